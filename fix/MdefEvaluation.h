@@ -0,0 +1,116 @@
+#ifndef MDEFEVALUATION_H
+#define MDEFEVALUATION_H 1
+
+#include <xsTypes.h>
+#include <string>
+#include <vector>
+
+class MdefExpression;
+
+// MdefEvaluation collects the evaluation entry points added to mdefine by
+// the STOKES tables distribution.  The functions are implemented in the
+// updated MdefExpression.cxx, so this header only has to be copied next to
+// it (Xspec/src/XSFunctions/Utilities) and nothing else needs rebuilding.
+
+class MdefEvaluation
+{
+   public:
+      // While an ActiveBins object exists, MdefExpression::evaluate() in the
+      // calling thread computes only the bins firstBin to endBin-1, or those
+      // with isActive[i] true, and sets all other bins to zero.  Use it when
+      // the response or the noticed channels need only part of the energy
+      // array.  Expressions with convolution models are always evaluated on
+      // all bins.  Objects may be nested, the innermost one applies.
+      class ActiveBins
+      {
+         public:
+            ActiveBins (size_t firstBin, size_t endBin);
+            explicit ActiveBins (const std::vector<bool>& isActive);
+            ~ActiveBins ();
+
+         private:
+            ActiveBins (const ActiveBins& right);
+            ActiveBins& operator= (const ActiveBins& right);
+
+            // the active bins being replaced, restored on destruction
+            bool m_isSet;
+            size_t m_firstBin;
+            size_t m_endBin;
+            std::vector<bool> m_isActive;
+      };
+
+      // Evaluate expression for each of spectrumNumbers (e.g. the i, q and
+      // u datasets of a fit) concurrently on a pool of worker threads.
+      // fluxes[i] receives the result for spectrumNumbers[i].  nThreads = 0
+      // uses one worker per hardware thread.  Calls into XSPEC table and
+      // built-in model code are serialised, everything else runs in parallel,
+      // including the tables interpolated with 'xset MDEF_TABLES stokes'.
+      // The active bins of the calling thread apply to all spectra.
+      static void evaluateSpectra (const MdefExpression& expression, const RealArray& energies,
+                                   const RealArray& parameters,
+                                   const std::vector<int>& spectrumNumbers,
+                                   std::vector<RealArray>& fluxes,
+                                   const std::string& initString, size_t nThreads = 0);
+
+      // Latencies of a number of calls [s].
+      struct Latencies
+      {
+         size_t nCalls;
+         double total;
+         double median;
+         double percentile90;
+         double percentile99;
+         double maximum;
+      };
+
+      // Re-execute a trace recorded with 'xset MDEF_RECORD file' in order,
+      // through the mdefine'd models of the recorded names (which must be
+      // defined as when recording), starting with empty caches.  recorded
+      // and replayed receive the latencies of the replayed calls in the
+      // recording session and now.  With isStubTables the table
+      // interpolations return zeros, leaving the cost of the evaluator
+      // itself.  Calls of convolution models and of models not defined now
+      // are skipped.
+      static void replay (const std::string& traceFile, bool isStubTables, Latencies& recorded,
+                          Latencies& replayed);
+
+      // Table and model calls are shared between expressions until the next
+      // pass over the model starts, which is detected when an expression is
+      // evaluated again for the same spectrum.  Programs evaluating the
+      // expressions in other patterns mark the start of each pass by this.
+      static void advanceEpoch ();
+
+      // The largest deviation found while 'xset MDEF_OPTIMISE check' is set
+      // between an expression rewritten by the optimiser and the same
+      // expression as written, relative to the largest absolute value of
+      // the result, since the start or the last reset.
+      static double optimiserDeviation (bool isReset = false);
+
+      // The last adaptive evaluation of the calling thread, made while 'xset
+      // MDEF_ADAPTIVE tol' is set: the number of bins requested, of bins
+      // evaluated in all, of bins in the final subgrid and of calls of the
+      // expression, and the estimated largest relative error of the
+      // interpolated bins.
+      struct AdaptiveSampling
+      {
+         size_t nRequested;
+         size_t nEvaluated;
+         size_t nFinal;
+         size_t nCalls;
+         double errorBound;
+      };
+      static AdaptiveSampling adaptiveSampling ();
+
+      // Numbers of spectrum-valued operands left unevaluated because their
+      // scalar factor was exactly zero (e.g. stvrp and st45d in the stokes
+      // model for PolFrac = 0), and of the model and table calls in them,
+      // since the start or the last reset.
+      struct ZeroSkips
+      {
+         unsigned long long nOperands;
+         unsigned long long nCalls;
+      };
+      static ZeroSkips zeroSkips (bool isReset = false);
+};
+
+#endif
@@ -2,22 +2,3264 @@
 #include <XSUtil/Utils/IosHolder.h>
 #include <XSUtil/Utils/XSstream.h>
 #include <XSUtil/Utils/XSutility.h>
+#include <fitsio.h>
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <stack>
+#include <thread>
 #include <utility>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 // MdefExpression
 #include <XSFunctions/Utilities/MdefExpression.h>
+#include <XSFunctions/Utilities/MdefEvaluation.h>
 #include <XSFunctions/Utilities/funcType.h>
 #include <XSFunctions/Utilities/FunctionUtility.h>
 #include <XSFunctions/Utilities/XSCall.h>
 #include <XSFunctions/Utilities/XSModelFunction.h>
 
+// With the table classes of tools/ (StokesTable, GridLocator and
+// TableInterpolator) copied to stokes/ next to this file, 'xset MDEF_TABLES
+// stokes' interpolates additive tables with them.  They are compiled as part
+// of this file, so the XSPEC build needs no change.
+#if defined(__has_include)
+#if __has_include("stokes/StokesTable.h")
+#define MDEF_HAS_STOKES_TABLES 1
+#endif
+#endif
+#if defined(MDEF_HAS_STOKES_TABLES)
+#include "stokes/StokesTable.cxx"
+#include "stokes/GridLocator.cxx"
+#include "stokes/TableInterpolator.cxx"
+#endif
+
 string MdefElementString[] = {"ENG", "ENGC", "NUM", "PARAM", "OPER", "UFUNC", "BFUNC", 
 			      "LPAREN", "RPAREN", "COMMA", "XSMODEL", "CONXSMODEL",
 			      "TABLEMODEL"};
 
+namespace {
+
+  // Calls into XSPEC's table code and into built-in (non-mdefine) model
+  // functions are not reentrant, so concurrent evaluations take turns there.
+  // Everything else in evaluate() works on local data only, and tables
+  // interpolated here with 'xset MDEF_TABLES stokes' need the lock only to
+  // read the Stokes component of the dataset.
+  std::mutex& tableMutex ()
+  {
+    static std::mutex s_tableMutex;
+    return s_tableMutex;
+  }
+
+  std::mutex& modelMutex ()
+  {
+    static std::mutex s_modelMutex;
+    return s_modelMutex;
+  }
+
+  // The operator tables are read by evaluate() without a lock, so they are
+  // only freed while no expression exists.  Both the tables and the count
+  // of expressions are guarded by operatorsMutex().
+  std::mutex& operatorsMutex ()
+  {
+    static std::mutex s_operatorsMutex;
+    return s_operatorsMutex;
+  }
+
+  size_t& nExpressions ()
+  {
+    static size_t s_nExpressions(0);
+    return s_nExpressions;
+  }
+
+  // Half-Phi tables written by tools/stokes_phisym tabulate the azimuthal
+  // angle over 0-180 deg only.  Their primary header gives the 1-based index
+  // of the Phi parameter (PHIMIRR), the reflection relation (PHISYMM) and,
+  // for the 45 deg table, the unpolarised half table it refers to (PHIREFT).
+  struct PhiMirrorInfo
+  {
+    PhiMirrorInfo() : phiIndex(-1), isReference(false), reference() {}
+    int phiIndex;
+    bool isReference;
+    string reference;
+  };
+
+  const PhiMirrorInfo& phiMirrorInfo (const string& filename)
+  {
+    static std::map<string,PhiMirrorInfo> s_mirrorInfo;
+    std::map<string,PhiMirrorInfo>::const_iterator itInfo = s_mirrorInfo.find(filename);
+    if (itInfo != s_mirrorInfo.end()) return itInfo->second;
+
+    PhiMirrorInfo info;
+    fitsfile* fptr(0);
+    int status(0);
+    if ( fits_open_file(&fptr, filename.c_str(), READONLY, &status) == 0 ) {
+      int phiPar(0);
+      char value[FLEN_VALUE];
+      if ( fits_read_key(fptr, TINT, "PHIMIRR", &phiPar, 0, &status) == 0 ) {
+	info.phiIndex = phiPar - 1;
+	if ( fits_read_key(fptr, TSTRING, "PHISYMM", value, 0, &status) == 0 )
+	  info.isReference = (string(value) == "REF");
+	status = 0;
+	if ( info.isReference && fits_read_key(fptr, TSTRING, "PHIREFT", value, 0, &status) == 0 ) {
+	  info.reference = value;
+	  // relative names are looked up next to the half table itself
+	  size_t slashPos = filename.find_last_of('/');
+	  if ( info.reference[0] != '/' && slashPos != string::npos )
+	    info.reference = filename.substr(0,slashPos+1) + info.reference;
+	}
+      }
+      status = 0;
+      fits_close_file(fptr, &status);
+    }
+    fits_clear_errmsg();
+    if ( info.isReference && info.reference.empty() ) {
+      string errMsg = "Half-Phi table " + filename + " has no PHIREFT keyword.";
+      throw MdefExpression::MdefExpressionError(errMsg);
+    }
+    return s_mirrorInfo.insert(std::make_pair(filename,info)).first->second;
+  }
+
+  int stokesComponent (int spectrumNumber)
+  {
+    // polarimetric datasets carry an XFLT keyword 'Stokes:n' with
+    // n = 0, 1, 2 for i, q, u
+    if ( FunctionUtility::inXFLT(spectrumNumber, "Stokes") )
+      return static_cast<int>(FunctionUtility::getXFLT(spectrumNumber, "Stokes"));
+    return 0;
+  }
+
+  // Replaced by zeros during MdefEvaluation::replay() with stubbed tables.
+  std::atomic<bool>& isTableStubbed ()
+  {
+    static std::atomic<bool> s_isTableStubbed(false);
+    return s_isTableStubbed;
+  }
+
+  void tableInterpolatePhiMirror (const RealArray& energies, RealArray& params,
+				  const string& filename, int spectrumNumber,
+				  RealArray& modFlux, RealArray& modFluxErr,
+				  const string& initString, const string& tableType)
+  {
+    // For Phi > 180 deg interpolate a half-Phi table at 360-Phi and apply the
+    // reflection: u changes sign, and the 45 deg table turns into -45 deg,
+    // S45(360-Phi) = M [2 S0(Phi) - S45(Phi)].
+    if ( isTableStubbed() ) {
+      modFlux.resize(energies.size()-1);
+      modFlux = 0.0;
+      return;
+    }
+    bool isMirrored(false), isReference(false), isU(false);
+    RealArray refFlux, refFluxErr;
+    {
+      std::lock_guard<std::mutex> tableLock(tableMutex());
+      const PhiMirrorInfo& mirror = phiMirrorInfo(filename);
+      isMirrored = ( mirror.phiIndex >= 0 && mirror.phiIndex < static_cast<int>(params.size())
+		     && params[mirror.phiIndex] > 180.0 );
+      if ( isMirrored ) params[mirror.phiIndex] = 360.0 - params[mirror.phiIndex];
+      FunctionUtility::tableInterpolate(energies, params, filename, spectrumNumber,
+					modFlux, modFluxErr, initString, tableType,
+					false);
+      if ( !isMirrored ) return;
+      isReference = mirror.isReference;
+      if ( isReference )
+	FunctionUtility::tableInterpolate(energies, params, mirror.reference, spectrumNumber,
+					  refFlux, refFluxErr, initString, tableType,
+					  false);
+      isU = ( stokesComponent(spectrumNumber) == 2 );
+    }
+    if ( isReference ) modFlux = 2.0*refFlux - modFlux;
+    if ( isU ) modFlux = -modFlux;
+  }
+
+  // The device, inode, size and modification and status change times of a
+  // file, the times with their nanoseconds so that a file rewritten within
+  // a second is told apart.
+  string fileSignature (const struct stat& status)
+  {
+#if defined(__APPLE__)
+    const struct timespec& modified = status.st_mtimespec;
+    const struct timespec& changed = status.st_ctimespec;
+#else
+    const struct timespec& modified = status.st_mtim;
+    const struct timespec& changed = status.st_ctim;
+#endif
+    const unsigned long long values[7] = {
+      static_cast<unsigned long long>(status.st_dev), static_cast<unsigned long long>(status.st_ino),
+      static_cast<unsigned long long>(status.st_size),
+      static_cast<unsigned long long>(modified.tv_sec), static_cast<unsigned long long>(modified.tv_nsec),
+      static_cast<unsigned long long>(changed.tv_sec), static_cast<unsigned long long>(changed.tv_nsec)};
+    return string(reinterpret_cast<const char*>(values), sizeof(values));
+  }
+
+  // Whether two spectra agree to tolerance of the largest value of the
+  // second.
+  bool isSpectrumAgreeing (const RealArray& first, const RealArray& second, double tolerance)
+  {
+    if ( first.size() != second.size() ) return false;
+    Real largest(0.0);
+    for (size_t i=0; i<second.size(); ++i) largest = std::max(largest, std::fabs(second[i]));
+    for (size_t i=0; i<second.size(); ++i) {
+      if ( !(std::fabs(first[i] - second[i]) <= tolerance*largest) ) return false;
+    }
+    return true;
+  }
+
+  // Interpolation of additive tables without an energy scale parameter by
+  // the table classes of tools/ while 'xset MDEF_TABLES stokes' is set.  A
+  // table is read once (again when its file changes) and shared by all
+  // threads, each of which interpolates it with its own TableInterpolator
+  // and without a lock, so concurrent evaluations do not take turns here as
+  // they do in XSPEC's table code.  The first call of each table and Stokes
+  // component is also interpolated by XSPEC, and the table is left to XSPEC
+  // from then on if the two differ by more than s_stokesTolerance of the
+  // largest value.
+  struct StokesTableEntry;
+
+#if defined(MDEF_HAS_STOKES_TABLES)
+
+  const double s_stokesTolerance = 1.0e-5;
+
+  enum StokesCheck {STOKES_UNCHECKED, STOKES_AGREED, STOKES_DISAGREED};
+
+  struct StokesTableEntry
+  {
+    StokesTableEntry () : table(), reference(), referenceName(), signature(), isFailing(false)
+    {
+      for (size_t iComp=0; iComp<3; ++iComp) checks[iComp] = STOKES_UNCHECKED;
+    }
+    StokesTable table;
+    // the unpolarised half table of a REF half-Phi table
+    std::unique_ptr<StokesTable> reference;
+    string referenceName;
+    // fileSignature() of the table, and of the reference table after it
+    string signature;
+    bool isFailing;
+    // StokesCheck per Stokes component
+    mutable std::atomic<int> checks[3];
+  };
+
+  std::mutex& stokesTablesMutex ()
+  {
+    static std::mutex s_stokesTablesMutex;
+    return s_stokesTablesMutex;
+  }
+
+  std::map<string, std::shared_ptr<const StokesTableEntry> >& stokesTables ()
+  {
+    static std::map<string, std::shared_ptr<const StokesTableEntry> > s_stokesTables;
+    return s_stokesTables;
+  }
+
+  // The unpolarised half table a REF half-Phi table refers to, relative
+  // names looked up next to the half table itself.
+  string stokesReferenceName (const string& filename, const StokesTable& table)
+  {
+    if ( table.phiSymmetry() != "REF" ) return string();
+    string reference = table.phiReference();
+    size_t slashPos = filename.find_last_of('/');
+    if ( !reference.empty() && reference[0] != '/' && slashPos != string::npos )
+      reference = filename.substr(0,slashPos+1) + reference;
+    return reference;
+  }
+
+  bool stokesSignature (const string& filename, const string& reference, string& signature)
+  {
+    struct stat status;
+    if ( stat(filename.c_str(), &status) != 0 ) return false;
+    signature = fileSignature(status);
+    if ( reference.empty() ) return true;
+    if ( stat(reference.c_str(), &status) != 0 ) return false;
+    signature += fileSignature(status);
+    return true;
+  }
+
+  // The table of an add-type atable{} call to interpolate here, with its
+  // number of parameters including the redshift, or none if MDEF_TABLES is
+  // not stokes or the table is not one of these.
+  std::shared_ptr<const StokesTableEntry> stokesTable (const string& filename, int& numberParams,
+						       bool& isRedshift)
+  {
+    if ( isTableStubbed() || FunctionUtility::getModelString("MDEF_TABLES") != "stokes" )
+      return std::shared_ptr<const StokesTableEntry>();
+    std::shared_ptr<const StokesTableEntry> entry;
+    {
+      std::lock_guard<std::mutex> lock(stokesTablesMutex());
+      entry = stokesTables()[filename];
+    }
+    string signature;
+    if ( !entry || !stokesSignature(filename, entry->referenceName, signature)
+	 || signature != entry->signature ) {
+      std::lock_guard<std::mutex> lock(stokesTablesMutex());
+      std::shared_ptr<const StokesTableEntry>& kept = stokesTables()[filename];
+      // another thread may have read it meanwhile
+      if ( kept == entry || kept->signature != signature ) {
+	std::shared_ptr<StokesTableEntry> loaded(new StokesTableEntry);
+	try {
+	  // cfitsio, which XSPEC's table code uses too, need not be reentrant
+	  std::lock_guard<std::mutex> tableLock(tableMutex());
+	  loaded->table.read(filename);
+	  loaded->referenceName = stokesReferenceName(filename, loaded->table);
+	  if ( !loaded->referenceName.empty() ) {
+	    loaded->reference.reset(new StokesTable);
+	    loaded->reference->read(loaded->referenceName);
+	  }
+	  if ( !stokesSignature(filename, loaded->referenceName, loaded->signature) )
+	    throw StokesTable::StokesTableError("Cannot stat " + filename);
+	} catch (StokesTable::StokesTableError& err) {
+	  // kept until the file changes
+	  loaded->isFailing = true;
+	  loaded->referenceName.clear();
+	  stokesSignature(filename, string(), loaded->signature);
+	  std::ostringstream oss;
+	  oss << "MDEF_TABLES: " << err.what() << ", leaving " << filename << " to XSPEC" << std::endl;
+	  FunctionUtility::xsWrite(oss.str(), 10);
+	}
+	kept = loaded;
+      }
+      entry = kept;
+    }
+    const StokesTable& table = entry->table;
+    if ( entry->isFailing || !table.isAdditive() || table.isEscale() )
+      return std::shared_ptr<const StokesTableEntry>();
+    numberParams = static_cast<int>(table.nParameters()) + (table.isRedshift() ? 1 : 0);
+    isRedshift = table.isRedshift();
+    return entry;
+  }
+
+  // Photons per bin of a table on the bins between energies, the table
+  // bins scaled by 1/scale, in proportion to the overlap (as in
+  // tools/MdefEngine.cxx).
+  void stokesRedistribute (const RealArray& low, const RealArray& high, const RealArray& flux,
+			   Real scale, const RealArray& energies, RealArray& result)
+  {
+    const size_t nBins = energies.size() - 1;
+    const size_t nTable = low.size();
+    result.resize(nBins);
+    bool isSameBins = ( scale == 1.0 && nBins == nTable );
+    for (size_t i=0; i<nTable && isSameBins; ++i)
+      isSameBins = ( low[i] == energies[i] && high[i] == energies[i+1] );
+    if ( isSameBins ) {
+      result = flux;
+      return;
+    }
+    result = 0.0;
+    size_t iFirst(0);
+    for (size_t i=0; i<nTable; ++i) {
+      const Real lo = low[i]/scale;
+      const Real hi = high[i]/scale;
+      const Real width = hi - lo;
+      if ( !(width > 0.0) ) continue;
+      while ( iFirst < nBins && energies[iFirst+1] <= lo ) ++iFirst;
+      for (size_t k=iFirst; k<nBins && energies[k] < hi; ++k) {
+	const Real overlap = std::min(hi, energies[k+1]) - std::max(lo, energies[k]);
+	if ( overlap > 0.0 ) result[k] += flux[i]*overlap/width;
+      }
+    }
+    if ( scale != 1.0 ) result /= scale;
+  }
+
+  // The interpolators of the calling thread for one table, made again when
+  // the table is read again.
+  struct StokesInterpolators
+  {
+    std::shared_ptr<const StokesTableEntry> entry;
+    std::unique_ptr<TableInterpolator> table;
+    std::unique_ptr<TableInterpolator> reference;
+  };
+
+  // Interpolates a table returned by stokesTable(), false if it is to be
+  // left to XSPEC for this spectrum.
+  bool stokesInterpolate (const std::shared_ptr<const StokesTableEntry>& entry,
+			  const RealArray& energies, const RealArray& params,
+			  const string& filename, int spectrumNumber,
+			  const string& initString, RealArray& modFlux)
+  {
+    int component(0);
+    {
+      std::lock_guard<std::mutex> tableLock(tableMutex());
+      component = stokesComponent(spectrumNumber);
+    }
+    const StokesTable& table = entry->table;
+    if ( component < 0 || component >= static_cast<int>(table.nComponents()) ) return false;
+    std::atomic<int>& check = entry->checks[component];
+    if ( check == STOKES_DISAGREED ) return false;
+
+    static thread_local std::map<string,StokesInterpolators> t_interpolators;
+    StokesInterpolators& interpolators = t_interpolators[filename];
+    if ( interpolators.entry != entry ) {
+      interpolators.reference.reset(entry->reference ? new TableInterpolator(*entry->reference) : 0);
+      interpolators.table.reset(new TableInterpolator(table));
+      interpolators.entry = entry;
+    }
+    // For Phi > 180 deg interpolate a half-Phi table at 360-Phi and apply
+    // the reflection as in tableInterpolatePhiMirror().
+    const size_t nPars = table.nParameters();
+    std::vector<Real> parValues(&params[0], &params[0] + nPars);
+    const int phiIndex = table.phiMirrorIndex();
+    const bool isMirrored = ( phiIndex >= 0 && phiIndex < static_cast<int>(nPars)
+			      && parValues[phiIndex] > 180.0 );
+    if ( isMirrored ) parValues[phiIndex] = 360.0 - parValues[phiIndex];
+    RealArray spectrum;
+    interpolators.table->interpolate(parValues, component, spectrum);
+    if ( isMirrored ) {
+      if ( interpolators.reference ) {
+	RealArray refSpectrum;
+	interpolators.reference->interpolate(parValues, component, refSpectrum);
+	spectrum = 2.0*refSpectrum - spectrum;
+      }
+      if ( component == StokesTable::U_COMP ) spectrum = -spectrum;
+    }
+    const Real redshift = table.isRedshift() ? params[nPars] : 0.0;
+    stokesRedistribute(table.energyLow(), table.energyHigh(), spectrum, 1.0 + redshift,
+		       energies, modFlux);
+    if ( check == STOKES_AGREED ) return true;
+
+    RealArray localParams(params);
+    RealArray localFlux, localFluxErr;
+    tableInterpolatePhiMirror(energies, localParams, filename, spectrumNumber,
+			      localFlux, localFluxErr, initString, "add");
+    const bool isAgreeing = isSpectrumAgreeing(modFlux, localFlux, s_stokesTolerance);
+    int unchecked(STOKES_UNCHECKED);
+    if ( check.compare_exchange_strong(unchecked, isAgreeing ? STOKES_AGREED : STOKES_DISAGREED)
+	 && !isAgreeing ) {
+      std::ostringstream oss;
+      oss << "MDEF_TABLES: " << filename << " differs from XSPEC's interpolation for Stokes component "
+	  << component << ", leaving it to XSPEC" << std::endl;
+      FunctionUtility::xsWrite(oss.str(), 10);
+    }
+    if ( isAgreeing ) return true;
+    modFlux.resize(localFlux.size());
+    modFlux = localFlux;
+    return true;
+  }
+
+#else
+
+  std::shared_ptr<const StokesTableEntry> stokesTable (const string&, int&, bool&)
+  {
+    return std::shared_ptr<const StokesTableEntry>();
+  }
+
+  bool stokesInterpolate (const std::shared_ptr<const StokesTableEntry>&, const RealArray&,
+			  const RealArray&, const string&, int, const string&, RealArray&)
+  {
+    return false;
+  }
+
+#endif
+
+  // A set of tasks shared by the calling thread and the pool workers, each
+  // of which claims task indices until none are left.
+  struct TaskBatch
+  {
+    TaskBatch (size_t n, const std::function<void(size_t)>& f)
+      : nTasks(n), next(0), nDone(0), task(f), error(), mutex(), finished() {}
+
+    void runTasks ()
+    {
+      size_t iTask;
+      while ( (iTask = next++) < nTasks ) {
+	std::exception_ptr taskError;
+	try {
+	  task(iTask);
+	} catch (...) {
+	  taskError = std::current_exception();
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	if ( taskError && !error ) error = taskError;
+	if ( ++nDone == nTasks ) finished.notify_all();
+      }
+    }
+
+    const size_t nTasks;
+    std::atomic<size_t> next;
+    size_t nDone;
+    const std::function<void(size_t)> task;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+
+  // Persistent worker threads, started on first use and grown on demand.
+  class EvaluationPool
+  {
+  public:
+    static EvaluationPool& instance ()
+    {
+      static EvaluationPool s_pool;
+      return s_pool;
+    }
+
+    ~EvaluationPool ()
+    {
+      {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_isStopping = true;
+      }
+      m_wakeUp.notify_all();
+      for (size_t i=0; i<m_workers.size(); ++i) m_workers[i].join();
+    }
+
+    // Run task(0) ... task(nTasks-1) on up to nThreads threads, including
+    // the calling one, and rethrow the first exception any task raised.
+    void run (size_t nTasks, size_t nThreads, const std::function<void(size_t)>& task)
+    {
+      if ( nTasks == 0 ) return;
+      std::shared_ptr<TaskBatch> batch(new TaskBatch(nTasks, task));
+      const size_t nHelpers = std::min(nThreads, nTasks) - 1;
+      if ( nHelpers > 0 ) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	while ( m_workers.size() < nHelpers )
+	  m_workers.push_back(std::thread(&EvaluationPool::work, this));
+	for (size_t i=0; i<nHelpers; ++i)
+	  m_queue.push_back([batch]() { batch->runTasks(); });
+      }
+      m_wakeUp.notify_all();
+      // The caller works too, so nested use cannot starve the pool.
+      batch->runTasks();
+      std::unique_lock<std::mutex> lock(batch->mutex);
+      batch->finished.wait(lock, [&batch]() { return batch->nDone == batch->nTasks; });
+      if ( batch->error ) std::rethrow_exception(batch->error);
+    }
+
+  private:
+    EvaluationPool () : m_mutex(), m_wakeUp(), m_queue(), m_workers(), m_isStopping(false) {}
+
+    void work ()
+    {
+      while ( true ) {
+	std::function<void()> job;
+	{
+	  std::unique_lock<std::mutex> lock(m_mutex);
+	  m_wakeUp.wait(lock, [this]() { return m_isStopping || !m_queue.empty(); });
+	  if ( m_queue.empty() ) return;
+	  job = m_queue.front();
+	  m_queue.pop_front();
+	}
+	job();
+      }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::deque<std::function<void()> > m_queue;
+    std::vector<std::thread> m_workers;
+    bool m_isStopping;
+  };
+
+  // Incremental evaluation.  Each element of the postfix program is a node
+  // whose value depends on a known set of model parameters.  The value of
+  // every node from the last call is kept per spectrum number (the i, q and
+  // u datasets interleave), and nodes none of whose parameters changed are
+  // reused together with their whole subtree.  Calls of other mdefine'd
+  // models are always repeated since they keep caches of their own, so a
+  // redefinition of such a model is picked up.  Expressions with
+  // convolution models are always evaluated in full.  'xset MDEF_INCREMENTAL
+  // on' switches this on.
+
+  typedef std::pair<RealArray, bool> MarkedArray;
+
+  struct SpectrumCache
+  {
+    SpectrumCache () : mutex(), isValid(false), energies(), parameters(), initString(),
+		       coarseLevel(0), values() {}
+    std::mutex mutex;
+    bool isValid;
+    RealArray energies;
+    RealArray parameters;
+    string initString;
+    int coarseLevel;
+    std::vector<MarkedArray> values;
+  };
+
+  // Linear factorisation.  Parameters that enter the expression only
+  // through scalar coefficients of sums of spectra, as PolFrac and PolAng in
+  // stokes and stpol, are found once per expression.  The spectra they
+  // multiply (the basis, e.g. the stunp, stvrp and st45d calls) are kept per
+  // spectrum number, and as long as none of the other parameters changes
+  // an evaluation only computes the coefficients and sums the basis
+  // spectra, without calling any model or table.  The basis is recomputed
+  // whenever an mdefine'd model is defined or deleted.  'xset MDEF_LINEAR
+  // on' switches this on.
+
+  struct BasisCache
+  {
+    BasisCache () : mutex(), isValid(false), generation(0), energies(), parameters(),
+		    initString(), coarseLevel(0), spectra(), isVaried() {}
+    std::mutex mutex;
+    bool isValid;
+    unsigned long generation;
+    RealArray energies;
+    RealArray parameters;
+    string initString;
+    int coarseLevel;
+    std::vector<RealArray> spectra;
+    // the parameters that have changed between evaluations
+    std::vector<bool> isVaried;
+  };
+
+  // A spectrum-valued operand of a product with a scalar: its last element,
+  // the first and last elements of the scalar factor and the number of model
+  // and table calls it makes.
+  struct ZeroFactor
+  {
+    size_t operandEnd;
+    size_t factorFirst;
+    size_t factorLast;
+    size_t nCalls;
+  };
+
+  struct IncrementalState
+  {
+    IncrementalState () : mutex(), exprString(), isAnalysed(false), isSupported(false),
+			  subtreeStart(), nodeParams(), isVolatile(), isCall(), operands(),
+			  numBefore(), parBefore(), opBefore(), spectra(), isLinear(false),
+			  basisNodes(), basisAt(), basisParams(), bases(),
+			  settingsGeneration(std::numeric_limits<unsigned long>::max()),
+			  dependsOnSettings(true), scalarEnd(), isScalar(), zeroFactors() {}
+    std::mutex mutex;
+    string exprString;
+    bool isAnalysed;
+    bool isSupported;
+    // first element of the subtree of each node, the parameters it depends
+    // on, whether it has to be recomputed always, whether it calls a model
+    // or table and its operands
+    std::vector<size_t> subtreeStart;
+    std::vector<std::vector<size_t> > nodeParams;
+    std::vector<bool> isVolatile;
+    std::vector<bool> isCall;
+    std::vector<std::vector<size_t> > operands;
+    // numbers of constants, parameters and operators before each element
+    std::vector<size_t> numBefore;
+    std::vector<size_t> parBefore;
+    std::vector<size_t> opBefore;
+    std::map<int, std::unique_ptr<SpectrumCache> > spectra;
+    // linear factorisation: the basis nodes, the basis node whose subtree
+    // starts at each element (or -1) and the parameters of the basis
+    bool isLinear;
+    std::vector<size_t> basisNodes;
+    std::vector<long> basisAt;
+    std::vector<size_t> basisParams;
+    std::map<int, std::unique_ptr<BasisCache> > bases;
+    // whether the models called depend on settings, which rules the
+    // factorisation out, checked again when mdefine'd models change
+    unsigned long settingsGeneration;
+    bool dependsOnSettings;
+    // scalar subtrees and nodes (see analyseScalars)
+    std::vector<long> scalarEnd;
+    std::vector<bool> isScalar;
+    // the operands starting at each element that need not be evaluated when
+    // their factor is zero, outermost first (see analyseZeroFactors)
+    std::vector<std::vector<ZeroFactor> > zeroFactors;
+  };
+
+  std::mutex& incrementalMutex ()
+  {
+    static std::mutex s_incrementalMutex;
+    return s_incrementalMutex;
+  }
+
+  std::map<const MdefExpression*, std::shared_ptr<IncrementalState> >& incrementalStates ()
+  {
+    static std::map<const MdefExpression*, std::shared_ptr<IncrementalState> > s_states;
+    return s_states;
+  }
+
+  // Incremented whenever an mdefine'd model is defined or deleted.
+  std::atomic<unsigned long>& mdefineGeneration ()
+  {
+    static std::atomic<unsigned long> s_generation(0);
+    return s_generation;
+  }
+
+  // Switches that are off until set to on (or any value other than off, no,
+  // false or 0).
+  bool isSwitchedOn (const string& key)
+  {
+    string value = FunctionUtility::getModelString(key);
+    if ( value == FunctionUtility::NOT_A_KEY() ) return false;
+    value = XSutility::lowerCase(value);
+    return !( value.empty() || value == "off" || value == "no" || value == "false" || value == "0" );
+  }
+
+  std::shared_ptr<IncrementalState> incrementalState (const MdefExpression* expression,
+						      const string& exprString)
+  {
+    std::lock_guard<std::mutex> lock(incrementalMutex());
+    std::shared_ptr<IncrementalState>& state = incrementalStates()[expression];
+    // a reused object (init, assignment) starts afresh
+    if ( !state || state->exprString != exprString ) {
+      state.reset(new IncrementalState);
+      state->exprString = exprString;
+    }
+    return state;
+  }
+
+  void forgetIncrementalState (const MdefExpression* expression)
+  {
+    std::lock_guard<std::mutex> lock(incrementalMutex());
+    incrementalStates().erase(expression);
+  }
+
+  void forgetAllIncrementalStates ()
+  {
+    std::lock_guard<std::mutex> lock(incrementalMutex());
+    incrementalStates().clear();
+  }
+
+  // Find the operands of each node by running the postfix program on
+  // element indices instead of arrays.  Returns false for programs that
+  // cannot be evaluated incrementally.
+  bool analyseIncremental (IncrementalState& state,
+			   const std::vector<MdefExpression::ElementType>& postfixElems,
+			   const std::vector<string>& operators,
+			   const std::vector<size_t>& paramsToGet,
+			   const MdefExpression::MathOpContainer& operatorsMap)
+  {
+    const size_t nElems = postfixElems.size();
+    state.subtreeStart.assign(nElems, 0);
+    state.nodeParams.assign(nElems, std::vector<size_t>());
+    state.isVolatile.assign(nElems, false);
+    state.isCall.assign(nElems, false);
+    state.operands.assign(nElems, std::vector<size_t>());
+    state.numBefore.assign(nElems+1, 0);
+    state.parBefore.assign(nElems+1, 0);
+    state.opBefore.assign(nElems+1, 0);
+
+    std::vector<size_t> operands;
+    size_t numPos(0), parPos(0), opPos(0);
+    for (size_t iElem=0; iElem<nElems; ++iElem) {
+      state.numBefore[iElem] = numPos;
+      state.parBefore[iElem] = parPos;
+      state.opBefore[iElem] = opPos;
+      state.subtreeStart[iElem] = iElem;
+      size_t nArgs(0);
+      switch (postfixElems[iElem]) {
+      case MdefExpression::ENG:
+      case MdefExpression::ENGC:
+	break;
+      case MdefExpression::NUM:
+	++numPos;
+	break;
+      case MdefExpression::PARAM:
+	state.nodeParams[iElem].push_back(paramsToGet[parPos++]);
+	break;
+      case MdefExpression::OPER:
+	{
+	  const string& opName = operators[opPos++];
+	  MdefExpression::MathOpContainer::const_iterator itFunc = operatorsMap.find(opName);
+	  if ( itFunc != operatorsMap.end() ) {
+	    nArgs = itFunc->second->nArgs();
+	  } else if ( opName == "#" ) {
+	    return false;
+	  } else if ( XSModelFunction::hasFunctionPointer(opName) ) {
+	    const ComponentInfo compInfo = XSModelFunction::compMatchName(opName);
+	    if ( compInfo.type() == string("con") ) return false;
+	    nArgs = XSModelFunction::numberParameters(opName);
+	    // mdefine'd models may be redefined, and built-in ones depend on
+	    // abund, xsect, cosmo and xset strings as well
+	    state.isVolatile[iElem] = true;
+	    state.isCall[iElem] = true;
+	  } else if ( opName.substr(0,6) == "atable" || opName.substr(0,6) == "mtable" ||
+		      opName.substr(0,6) == "etable" ) {
+	    int numberParams, numberSpectra, numberEnergies;
+	    bool isAdditive, isRedshift, isEscale;
+	    std::lock_guard<std::mutex> tableLock(tableMutex());
+	    if ( FunctionUtility::tableInfo(opName.substr(7,opName.length()-8), numberParams,
+					    numberSpectra, numberEnergies, isAdditive,
+					    isRedshift, isEscale) != 0 ) return false;
+	    nArgs = numberParams + (isRedshift ? 1 : 0) + (isEscale ? 1 : 0);
+	    state.isCall[iElem] = true;
+	  } else {
+	    state.isVolatile[iElem] = true;
+	  }
+	}
+	break;
+      default:
+	return false;
+      }
+      if ( operands.size() < nArgs ) return false;
+      std::vector<size_t>& params = state.nodeParams[iElem];
+      for (size_t iArg=0; iArg<nArgs; ++iArg) {
+	const size_t operand = operands.back();
+	operands.pop_back();
+	state.operands[iElem].insert(state.operands[iElem].begin(), operand);
+	state.subtreeStart[iElem] = state.subtreeStart[operand];
+	params.insert(params.end(), state.nodeParams[operand].begin(),
+		      state.nodeParams[operand].end());
+	if ( state.isVolatile[operand] ) state.isVolatile[iElem] = true;
+      }
+      std::sort(params.begin(), params.end());
+      params.erase(std::unique(params.begin(), params.end()), params.end());
+      operands.push_back(iElem);
+    }
+    state.numBefore[nElems] = numPos;
+    state.parBefore[nElems] = parPos;
+    state.opBefore[nElems] = opPos;
+    return operands.size() == 1;
+  }
+
+  bool isSameArray (const RealArray& first, const RealArray& second)
+  {
+    if ( first.size() != second.size() ) return false;
+    for (size_t i=0; i<first.size(); ++i)
+      if ( first[i] != second[i] ) return false;
+    return true;
+  }
+
+  // Reductions over the bins give spectrum-sized results even for scalar
+  // operands.
+  bool isReduction (const string& opName)
+  {
+    return opName == "mean" || opName == "dim" || opName == "smin" || opName == "smax";
+  }
+
+  // Find the parameters entering only linearly and the basis nodes, using
+  // the nodes found by analyseIncremental.  Returns false if the expression
+  // does not factorise.
+  bool analyseLinear (IncrementalState& state,
+		      const std::vector<MdefExpression::ElementType>& postfixElems,
+		      const std::vector<string>& operators,
+		      const std::vector<size_t>& paramsToGet,
+		      const MdefExpression::MathOpContainer& operatorsMap)
+  {
+    const size_t nElems = postfixElems.size();
+    if ( nElems == 0 || paramsToGet.empty() ) return false;
+
+    // Spectrum-valued nodes are the energies, model and table calls and
+    // everything computed from them, the others are scalars.
+    std::vector<bool> isVector(nElems, false);
+    for (size_t iElem=0; iElem<nElems; ++iElem) {
+      const MdefExpression::ElementType type = postfixElems[iElem];
+      if ( type == MdefExpression::ENG || type == MdefExpression::ENGC ) {
+	isVector[iElem] = true;
+      } else if ( type == MdefExpression::OPER ) {
+	const string& opName = operators[state.opBefore[iElem]];
+	if ( state.isCall[iElem] || isReduction(opName) ) {
+	  isVector[iElem] = true;
+	} else if ( operatorsMap.find(opName) == operatorsMap.end() ) {
+	  // unknown model
+	  return false;
+	}
+	for (size_t i=0; i<state.operands[iElem].size(); ++i)
+	  if ( isVector[state.operands[iElem][i]] ) isVector[iElem] = true;
+      }
+    }
+
+    // Parameters of model and table calls are not linear, neither are those
+    // of nodes that combine spectra other than by sums and scalar factors.
+    const size_t nPars = *std::max_element(paramsToGet.begin(), paramsToGet.end()) + 1;
+    std::vector<bool> isLinearPar(nPars, true);
+    for (size_t iElem=0; iElem<nElems; ++iElem) {
+      if ( !state.isCall[iElem] ) continue;
+      for (size_t i=0; i<state.nodeParams[iElem].size(); ++i)
+	isLinearPar[state.nodeParams[iElem][i]] = false;
+    }
+    std::vector<bool> hasLinearPar(nElems, false);
+    bool isChanged(true);
+    while ( isChanged ) {
+      isChanged = false;
+      for (size_t iElem=0; iElem<nElems; ++iElem) {
+	const std::vector<size_t>& nodeParams = state.nodeParams[iElem];
+	hasLinearPar[iElem] = false;
+	for (size_t i=0; i<nodeParams.size(); ++i)
+	  if ( isLinearPar[nodeParams[i]] ) hasLinearPar[iElem] = true;
+	if ( !isVector[iElem] || !hasLinearPar[iElem] ) continue;
+	bool isLinearOp(false);
+	if ( postfixElems[iElem] == MdefExpression::OPER && !state.isCall[iElem] ) {
+	  const string& opName = operators[state.opBefore[iElem]];
+	  const std::vector<size_t>& operands = state.operands[iElem];
+	  if ( opName == "+" || opName == "-" || opName == "@" )
+	    isLinearOp = true;
+	  else if ( opName == "*" )
+	    isLinearOp = !( isVector[operands[0]] && isVector[operands[1]] );
+	  else if ( opName == "/" )
+	    isLinearOp = !isVector[operands[1]];
+	}
+	if ( !isLinearOp ) {
+	  for (size_t i=0; i<nodeParams.size(); ++i) isLinearPar[nodeParams[i]] = false;
+	  isChanged = true;
+	}
+      }
+    }
+    if ( !isVector[nElems-1] || !hasLinearPar[nElems-1] ) return false;
+
+    // The basis are the spectrum-valued operands without linear parameters
+    // of the nodes with them.
+    state.basisNodes.clear();
+    state.basisAt.assign(nElems, -1);
+    state.basisParams.clear();
+    for (size_t iElem=0; iElem<nElems; ++iElem) {
+      if ( !hasLinearPar[iElem] ) continue;
+      const std::vector<size_t>& operands = state.operands[iElem];
+      for (size_t i=0; i<operands.size(); ++i) {
+	const size_t operand = operands[i];
+	if ( !isVector[operand] || hasLinearPar[operand] ) continue;
+	state.basisAt[state.subtreeStart[operand]] = operand;
+	state.basisNodes.push_back(operand);
+	state.basisParams.insert(state.basisParams.end(), state.nodeParams[operand].begin(),
+				 state.nodeParams[operand].end());
+      }
+    }
+    std::sort(state.basisNodes.begin(), state.basisNodes.end());
+    std::sort(state.basisParams.begin(), state.basisParams.end());
+    state.basisParams.erase(std::unique(state.basisParams.begin(), state.basisParams.end()),
+			    state.basisParams.end());
+    return true;
+  }
+
+  // A scalar, or the coefficients of the basis spectra with the constant
+  // term last.
+  struct LinearForm
+  {
+    explicit LinearForm (Real value) : isScalar(true), scalar(value), coefs() {}
+    LinearForm (size_t nBasis, size_t iBasis) : isScalar(false), scalar(0.0), coefs(0.0, nBasis+1)
+    {
+      coefs[iBasis] = 1.0;
+    }
+    bool isScalar;
+    Real scalar;
+    RealArray coefs;
+  };
+
+  // Run the program outside the basis subtrees on scalars and linear forms,
+  // and sum the basis spectra with the resulting coefficients.  Returns
+  // false if a basis spectrum left empty, as multiplied by zero when it was
+  // collected (see analyseZeroFactors), has a coefficient now.
+  bool combineLinear (const IncrementalState& state, const std::vector<RealArray>& basis,
+		      const RealArray& parameters,
+		      const std::vector<MdefExpression::ElementType>& postfixElems,
+		      const std::vector<Real>& numericalConsts,
+		      const std::vector<size_t>& paramsToGet,
+		      const std::vector<string>& operators,
+		      const MdefExpression::MathOpContainer& operatorsMap, RealArray& flux)
+  {
+    const size_t nBasis = state.basisNodes.size();
+    std::vector<LinearForm> formStack;
+    for (size_t iElem=0; iElem<postfixElems.size(); ++iElem) {
+      if ( state.basisAt[iElem] >= 0 ) {
+	const size_t iNode = state.basisAt[iElem];
+	const size_t iBasis = std::lower_bound(state.basisNodes.begin(), state.basisNodes.end(), iNode)
+	  - state.basisNodes.begin();
+	formStack.push_back(LinearForm(nBasis, iBasis));
+	iElem = iNode;
+	continue;
+      }
+      if ( postfixElems[iElem] == MdefExpression::NUM ) {
+	formStack.push_back(LinearForm(numericalConsts[state.numBefore[iElem]]));
+	continue;
+      }
+      if ( postfixElems[iElem] == MdefExpression::PARAM ) {
+	formStack.push_back(LinearForm(parameters[paramsToGet[state.parBefore[iElem]]]));
+	continue;
+      }
+      const string& opName = operators[state.opBefore[iElem]];
+      const Numerics::MathOperator& mathFunc = *(operatorsMap.find(opName)->second);
+      if ( mathFunc.nArgs() == 1 ) {
+	LinearForm& top = formStack.back();
+	if ( top.isScalar ) {
+	  RealArray value(top.scalar, 1);
+	  mathFunc(value);
+	  top.scalar = value[0];
+	} else {
+	  // unary minus
+	  top.coefs = -top.coefs;
+	}
+	continue;
+      }
+      LinearForm second = formStack.back();
+      formStack.pop_back();
+      LinearForm& first = formStack.back();
+      if ( first.isScalar && second.isScalar ) {
+	RealArray value(first.scalar, 1);
+	mathFunc(value, RealArray(second.scalar, 1));
+	first.scalar = value[0];
+      } else if ( opName == "+" || opName == "-" ) {
+	const Real sign = ( opName == "-" ) ? -1.0 : 1.0;
+	if ( first.isScalar ) {
+	  const Real constant = first.scalar;
+	  first = second;
+	  if ( sign < 0.0 ) first.coefs = -first.coefs;
+	  first.coefs[nBasis] += constant;
+	} else if ( second.isScalar ) {
+	  first.coefs[nBasis] += sign*second.scalar;
+	} else {
+	  first.coefs += sign*second.coefs;
+	}
+      } else if ( opName == "*" ) {
+	if ( first.isScalar ) std::swap(first, second);
+	first.coefs *= second.scalar;
+      } else {
+	// division by a scalar, with the semantics of the operator
+	RealArray factor(1.0, 1);
+	mathFunc(factor, RealArray(second.scalar, 1));
+	first.coefs *= factor[0];
+      }
+    }
+
+    const RealArray& coefs = formStack.back().coefs;
+    size_t nBins(0);
+    for (size_t iBasis=0; iBasis<nBasis; ++iBasis)
+      nBins = std::max(nBins, basis[iBasis].size());
+    for (size_t iBasis=0; iBasis<nBasis; ++iBasis)
+      if ( coefs[iBasis] != 0.0 && basis[iBasis].size() != nBins ) return false;
+    flux.resize(nBins);
+    flux = coefs[nBasis];
+    for (size_t iBasis=0; iBasis<nBasis; ++iBasis)
+      if ( coefs[iBasis] != 0.0 ) flux += coefs[iBasis]*basis[iBasis];
+    return true;
+  }
+
+  // Subtrees of numbers, parameters and element-wise operators have the same
+  // value in all bins and are computed once, as scalars: scalarEnd[i] is the
+  // last element of the largest such subtree starting at element i (with an
+  // operator), or -1, and isScalar[i] whether element i is the last of one.
+  void analyseScalars (IncrementalState& state,
+		       const std::vector<MdefExpression::ElementType>& postfixElems,
+		       const std::vector<string>& operators,
+		       const MdefExpression::MathOpContainer& operatorsMap)
+  {
+    const size_t nElems = postfixElems.size();
+    std::vector<bool>& isScalar = state.isScalar;
+    isScalar.assign(nElems, false);
+    state.scalarEnd.assign(nElems, -1);
+    for (size_t iElem=0; iElem<nElems; ++iElem) {
+      const MdefExpression::ElementType type = postfixElems[iElem];
+      if ( type == MdefExpression::NUM || type == MdefExpression::PARAM ) {
+	isScalar[iElem] = true;
+      } else if ( type == MdefExpression::OPER && !state.isCall[iElem] ) {
+	const string& opName = operators[state.opBefore[iElem]];
+	isScalar[iElem] = operatorsMap.find(opName) != operatorsMap.end() && !isReduction(opName);
+	for (size_t i=0; i<state.operands[iElem].size(); ++i)
+	  if ( !isScalar[state.operands[iElem][i]] ) isScalar[iElem] = false;
+	if ( isScalar[iElem] ) state.scalarEnd[state.subtreeStart[iElem]] = iElem;
+      }
+    }
+  }
+
+  // Short-circuit of products with zero.  A spectrum-valued operand calling
+  // models or tables whose scalar factor is exactly zero in an evaluation is
+  // not evaluated and enters the product as zeros, e.g. stvrp and st45d in
+  // the stokes model for PolFrac = 0.  The models and tables are taken to
+  // return finite values, as a product with zero would not be zero
+  // otherwise.  While a basis is collected its spectra are skipped only if
+  // the parameters of the factor have not varied since the first evaluation
+  // (a frozen PolFrac = 0), as a later change of them alone would need the
+  // skipped spectra and a full evaluation.  'xset MDEF_SKIPZERO on'
+  // switches this on, and MdefEvaluation::zeroSkips() counts the operands
+  // and calls skipped.
+  void analyseZeroFactors (IncrementalState& state,
+			   const std::vector<MdefExpression::ElementType>& postfixElems,
+			   const std::vector<string>& operators)
+  {
+    const size_t nElems = postfixElems.size();
+    state.zeroFactors.assign(nElems, std::vector<ZeroFactor>());
+    std::vector<size_t> nCalls(nElems+1, 0);
+    for (size_t iElem=0; iElem<nElems; ++iElem)
+      nCalls[iElem+1] = nCalls[iElem] + (state.isCall[iElem] ? 1 : 0);
+    // outer products come later in the program
+    for (size_t iElem=nElems; iElem-- > 0; ) {
+      if ( postfixElems[iElem] != MdefExpression::OPER || state.isCall[iElem]
+	   || operators[state.opBefore[iElem]] != "*" ) continue;
+      const std::vector<size_t>& operands = state.operands[iElem];
+      for (size_t i=0; i<2; ++i) {
+	const size_t operand = operands[i];
+	const size_t factor = operands[1-i];
+	const size_t operandStart = state.subtreeStart[operand];
+	const ZeroFactor zeroFactor = {operand, state.subtreeStart[factor], factor,
+				       nCalls[operand+1] - nCalls[operandStart]};
+	if ( state.isScalar[factor] && zeroFactor.nCalls > 0 )
+	  state.zeroFactors[operandStart].push_back(zeroFactor);
+      }
+    }
+  }
+
+  // Whether an operand holds basis spectra and the parameters of its factor
+  // have varied, or may vary as there was no evaluation before.
+  bool isBasisVaried (const IncrementalState& state, const BasisCache& basis,
+		      size_t operandStart, const ZeroFactor& zeroFactor)
+  {
+    bool hasBasis(false);
+    for (size_t iElem=operandStart; iElem<=zeroFactor.operandEnd && !hasBasis; ++iElem)
+      hasBasis = ( state.basisAt[iElem] >= 0 );
+    if ( !hasBasis ) return false;
+    if ( basis.parameters.size() != basis.isVaried.size() ) return true;
+    const std::vector<size_t>& factorParams = state.nodeParams[zeroFactor.factorLast];
+    for (size_t i=0; i<factorParams.size(); ++i)
+      if ( basis.isVaried[factorParams[i]] ) return true;
+    return false;
+  }
+
+  struct ZeroSkipCounters
+  {
+    static ZeroSkipCounters& instance ()
+    {
+      static ZeroSkipCounters s_counters;
+      return s_counters;
+    }
+    std::atomic<unsigned long long> nOperands;
+    std::atomic<unsigned long long> nCalls;
+
+  private:
+    ZeroSkipCounters () : nOperands(0), nCalls(0) {}
+  };
+
+  Real scalarValue (const IncrementalState& state, size_t iFirst, size_t iLast,
+		    const RealArray& parameters,
+		    const std::vector<MdefExpression::ElementType>& postfixElems,
+		    const std::vector<Real>& numericalConsts,
+		    const std::vector<size_t>& paramsToGet,
+		    const std::vector<string>& operators,
+		    const MdefExpression::MathOpContainer& operatorsMap)
+  {
+    std::vector<RealArray> valueStack;
+    for (size_t iElem=iFirst; iElem<=iLast; ++iElem) {
+      if ( postfixElems[iElem] == MdefExpression::NUM ) {
+	valueStack.push_back(RealArray(numericalConsts[state.numBefore[iElem]], 1));
+      } else if ( postfixElems[iElem] == MdefExpression::PARAM ) {
+	valueStack.push_back(RealArray(parameters[paramsToGet[state.parBefore[iElem]]], 1));
+      } else {
+	const Numerics::MathOperator& mathFunc
+	  = *(operatorsMap.find(operators[state.opBefore[iElem]])->second);
+	if ( mathFunc.nArgs() == 1 ) {
+	  mathFunc(valueStack.back());
+	} else {
+	  const RealArray second(valueStack.back());
+	  valueStack.pop_back();
+	  mathFunc(valueStack.back(), second);
+	}
+      }
+    }
+    return valueStack.back()[0];
+  }
+
+  // Masked evaluation.  The bins to be computed are set for the calling
+  // thread by MdefEvaluation::ActiveBins, or for all evaluations by 'xset
+  // MDEF_EBAND "Emin Emax"' (bins overlapping Emin-Emax keV).  evaluate()
+  // then runs on the energies covering the active bins only and zero-fills
+  // the others.
+
+  struct ActiveMask
+  {
+    ActiveMask () : isSet(false), firstBin(0), endBin(0), isActive() {}
+    bool isSet;
+    size_t firstBin;
+    size_t endBin;
+    // empty for a plain range
+    std::vector<bool> isActive;
+  };
+
+  ActiveMask& threadActiveMask ()
+  {
+    static thread_local ActiveMask t_activeMask;
+    return t_activeMask;
+  }
+
+  bool hasConvolution (const std::vector<string>& operators)
+  {
+    for (size_t i=0; i<operators.size(); ++i) {
+      if ( operators[i] == "#" ) return true;
+      if ( XSModelFunction::hasFunctionPointer(operators[i])
+	   && XSModelFunction::compMatchName(operators[i]).type() == string("con") ) return true;
+    }
+    return false;
+  }
+
+  // The active bins of this call, false if all bins are to be computed.
+  bool activeBins (const RealArray& energies, ActiveMask& active)
+  {
+    const size_t nBins = energies.size() - 1;
+    active = threadActiveMask();
+    if ( !active.isSet ) {
+      const string band = FunctionUtility::getModelString("MDEF_EBAND");
+      if ( band == FunctionUtility::NOT_A_KEY() ) return false;
+      std::istringstream iss(band);
+      Real eMin, eMax;
+      if ( !(iss >> eMin >> eMax) ) {
+	throw MdefExpression::MdefExpressionError("MDEF_EBAND should be set to \"Emin Emax\"");
+      }
+      active.isSet = true;
+      active.firstBin = 0;
+      while ( active.firstBin < nBins && energies[active.firstBin+1] <= eMin ) ++active.firstBin;
+      active.endBin = active.firstBin;
+      while ( active.endBin < nBins && energies[active.endBin] < eMax ) ++active.endBin;
+    }
+    if ( !active.isActive.empty() ) {
+      if ( active.isActive.size() != nBins ) {
+	throw MdefExpression::MdefExpressionError("Active bin mask does not match the energy array");
+      }
+      active.firstBin = nBins;
+      active.endBin = 0;
+      for (size_t i=0; i<nBins; ++i) {
+	if ( !active.isActive[i] ) continue;
+	if ( active.firstBin == nBins ) active.firstBin = i;
+	active.endBin = i + 1;
+      }
+      if ( active.firstBin == nBins ) active.firstBin = 0;
+    }
+    active.endBin = std::min(active.endBin, nBins);
+    active.firstBin = std::min(active.firstBin, active.endBin);
+    return active.firstBin > 0 || active.endBin < nBins || !active.isActive.empty();
+  }
+
+  // Recording of evaluation calls.  While 'xset MDEF_RECORD file' is set,
+  // every call of evaluate() that does not come from another mdefine'd model
+  // is appended to a binary trace, which MdefEvaluation::replay() or
+  // tools/stokes_replay re-execute.  The trace starts with "MDEFTRC1",
+  // followed by records in native byte order, each introduced by a tag:
+  //    'X' exprId, name, component type, expression   (once per expression)
+  //    'G' gridId, fingerprint, n, energies[n]          (once per energy grid)
+  //    'C' exprId, gridId, spectrumNumber, nPars, parameters[nPars],
+  //        initString, seconds                          (each call)
+  // Ids and counts are 32-bit unsigned, spectrumNumber 32-bit signed, the
+  // fingerprint 64-bit unsigned, values doubles and strings a 32-bit length
+  // followed by the characters.
+
+  const char s_traceMagic[] = "MDEFTRC1";
+
+  // FNV-1a of the energies
+  unsigned long long gridFingerprint (const RealArray& energies)
+  {
+    unsigned long long hash = 14695981039346656037ULL;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&energies[0]);
+    for (size_t i=0; i<energies.size()*sizeof(Real); ++i) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  class TraceRecorder
+  {
+  public:
+    static TraceRecorder& instance ()
+    {
+      static TraceRecorder s_recorder;
+      return s_recorder;
+    }
+
+    ~TraceRecorder ()
+    {
+      if ( m_file ) fclose(m_file);
+    }
+
+    void record (const MdefExpression& expression, const string& compType,
+		 const RealArray& energies, const RealArray& parameters, int spectrumNumber,
+		 const string& initString, double seconds)
+    {
+      string fileName = FunctionUtility::getModelString("MDEF_RECORD");
+      if ( fileName == FunctionUtility::NOT_A_KEY() ) fileName.clear();
+      if ( fileName.empty() && !m_isOpen ) return;
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if ( !open(fileName) ) return;
+      const string exprKey = expression.mdefName() + '\n' + expression.exprString();
+      std::map<string,unsigned>::const_iterator itExpr = m_exprIds.find(exprKey);
+      if ( itExpr == m_exprIds.end() ) {
+	itExpr = m_exprIds.insert(std::make_pair(exprKey, static_cast<unsigned>(m_exprIds.size()))).first;
+	writeTag('X');
+	writeValue<unsigned>(itExpr->second);
+	writeString(expression.mdefName());
+	writeString(compType);
+	writeString(expression.exprString());
+      }
+      const unsigned long long fingerprint = gridFingerprint(energies);
+      std::map<unsigned long long,unsigned>::const_iterator itGrid = m_gridIds.find(fingerprint);
+      if ( itGrid == m_gridIds.end() ) {
+	itGrid = m_gridIds.insert(std::make_pair(fingerprint, static_cast<unsigned>(m_gridIds.size()))).first;
+	writeTag('G');
+	writeValue<unsigned>(itGrid->second);
+	writeValue<unsigned long long>(fingerprint);
+	writeArray(energies);
+      }
+      writeTag('C');
+      writeValue<unsigned>(itExpr->second);
+      writeValue<unsigned>(itGrid->second);
+      writeValue<int>(spectrumNumber);
+      writeArray(parameters);
+      writeString(initString);
+      writeValue<double>(seconds);
+      fflush(m_file);
+    }
+
+  private:
+    TraceRecorder () : m_mutex(), m_isOpen(false), m_file(0), m_fileName(), m_exprIds(),
+		       m_gridIds() {}
+
+    // Follows MDEF_RECORD, false if not recording.
+    bool open (const string& fileName)
+    {
+      if ( fileName == m_fileName ) return m_file != 0;
+      if ( m_file ) fclose(m_file);
+      m_file = 0;
+      m_isOpen = false;
+      m_fileName = fileName;
+      m_exprIds.clear();
+      m_gridIds.clear();
+      if ( fileName.empty() ) return false;
+      // a new trace each time recording starts
+      m_file = fopen(fileName.c_str(), "wb");
+      if ( !m_file ) {
+	*IosHolder::errHolder() << "Cannot write the evaluation trace " << fileName << std::endl;
+	return false;
+      }
+      fwrite(s_traceMagic, 1, 8, m_file);
+      m_isOpen = true;
+      return true;
+    }
+
+    void writeTag (char tag)
+    {
+      fwrite(&tag, 1, 1, m_file);
+    }
+
+    template <typename T>
+    void writeValue (T value)
+    {
+      fwrite(&value, sizeof(T), 1, m_file);
+    }
+
+    void writeString (const string& value)
+    {
+      writeValue<unsigned>(value.size());
+      fwrite(value.data(), 1, value.size(), m_file);
+    }
+
+    void writeArray (const RealArray& values)
+    {
+      writeValue<unsigned>(values.size());
+      for (size_t i=0; i<values.size(); ++i) writeValue<double>(values[i]);
+    }
+
+    std::mutex m_mutex;
+    std::atomic<bool> m_isOpen;
+    FILE* m_file;
+    string m_fileName;
+    std::map<string,unsigned> m_exprIds;
+    std::map<unsigned long long,unsigned> m_gridIds;
+  };
+
+  class TraceReader
+  {
+  public:
+    explicit TraceReader (const string& fileName)
+      : m_file(fopen(fileName.c_str(), "rb"))
+    {
+      char magic[8];
+      if ( !m_file || fread(magic, 1, 8, m_file) != 8 || string(magic, 8) != string(s_traceMagic, 8) ) {
+	throw MdefExpression::MdefExpressionError(fileName + " is not an evaluation trace");
+      }
+    }
+
+    ~TraceReader ()
+    {
+      if ( m_file ) fclose(m_file);
+    }
+
+    // false at the end of the trace
+    bool readTag (char& tag)
+    {
+      return fread(&tag, 1, 1, m_file) == 1;
+    }
+
+    template <typename T>
+    T readValue ()
+    {
+      T value;
+      if ( fread(&value, sizeof(T), 1, m_file) != 1 ) truncated();
+      return value;
+    }
+
+    string readString ()
+    {
+      string value(readValue<unsigned>(), ' ');
+      if ( !value.empty() && fread(&value[0], 1, value.size(), m_file) != value.size() ) truncated();
+      return value;
+    }
+
+    void readArray (RealArray& values)
+    {
+      values.resize(readValue<unsigned>());
+      for (size_t i=0; i<values.size(); ++i) values[i] = readValue<double>();
+    }
+
+  private:
+    TraceReader (const TraceReader&);
+    TraceReader& operator= (const TraceReader&);
+
+    void truncated ()
+    {
+      throw MdefExpression::MdefExpressionError("Evaluation trace is truncated");
+    }
+
+    FILE* m_file;
+  };
+
+  void latencies (std::vector<double>& seconds, MdefEvaluation::Latencies& result)
+  {
+    result.nCalls = seconds.size();
+    result.total = result.median = result.percentile90 = result.percentile99 = result.maximum = 0.0;
+    if ( seconds.empty() ) return;
+    std::sort(seconds.begin(), seconds.end());
+    const size_t n = seconds.size();
+    for (size_t i=0; i<n; ++i) result.total += seconds[i];
+    result.median = seconds[n/2];
+    result.percentile90 = seconds[std::min(n-1, n*90/100)];
+    result.percentile99 = seconds[std::min(n-1, n*99/100)];
+    result.maximum = seconds[n-1];
+  }
+
+  // Depth of evaluate() calls in this thread, nested ones are not recorded.
+  int& threadEvaluationDepth ()
+  {
+    static thread_local int t_depth(0);
+    return t_depth;
+  }
+
+  // Exceptions being thrown in this thread, so that a destructor can tell a
+  // completed call from one being unwound (std::uncaught_exception() is
+  // deprecated in C++17 and gone in C++20).
+  int uncaughtExceptions ()
+  {
+#if defined(__cpp_lib_uncaught_exceptions)
+    return std::uncaught_exceptions();
+#else
+    return std::uncaught_exception() ? 1 : 0;
+#endif
+  }
+
+  // Times one call of evaluate() and records it when it is an outermost
+  // one and completes.
+  class CallRecord
+  {
+  public:
+    CallRecord (const MdefExpression& expression, const string& compType,
+		const RealArray& energies, const RealArray& parameters, int spectrumNumber,
+		const string& initString)
+      : m_expression(expression), m_compType(compType), m_energies(energies),
+	m_parameters(parameters), m_spectrumNumber(spectrumNumber), m_initString(initString),
+	m_isOutermost(threadEvaluationDepth()++ == 0), m_start(std::chrono::steady_clock::now()),
+	m_nUncaught(uncaughtExceptions()) {}
+
+    ~CallRecord ()
+    {
+      --threadEvaluationDepth();
+      if ( !m_isOutermost || uncaughtExceptions() > m_nUncaught ) return;
+      const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()
+							   - m_start).count();
+      TraceRecorder::instance().record(m_expression, m_compType, m_energies, m_parameters,
+				       m_spectrumNumber, m_initString, seconds);
+    }
+
+  private:
+    const MdefExpression& m_expression;
+    const string& m_compType;
+    const RealArray& m_energies;
+    const RealArray& m_parameters;
+    const int m_spectrumNumber;
+    const string& m_initString;
+    const bool m_isOutermost;
+    const std::chrono::steady_clock::time_point m_start;
+    const int m_nUncaught;
+  };
+
+  // Coarse-to-fine fits.  tools/stokes_levels writes coarser versions of a
+  // table next to it, name_L1.fits, name_L2.fits, ..., each with the energy
+  // bins of the level before grouped and every other node of its parameter
+  // grids.  While 'xset MDEF_COARSE n' is set, the outermost evaluations use
+  // level n of the tables (or the coarsest level there is), so a whole fit
+  // runs on one level and the fitter compares statistics of the same model.
+  // The coarsefit procedure of coarse_fit.xcm fits on each level in turn,
+  // from the coarsest, and always ends with MDEF_COARSE off and a fit on the
+  // full tables.
+  const int s_coarseMaxLevel = 9;
+
+  string coarseTableName (const string& filename, int level)
+  {
+    std::ostringstream suffix;
+    suffix << "_L" << level;
+    const size_t nName = filename.size();
+    if ( nName > 5 && XSutility::lowerCase(filename.substr(nName-5)) == ".fits" )
+      return filename.substr(0, nName-5) + suffix.str() + filename.substr(nName-5);
+    return filename + suffix.str();
+  }
+
+  // The level of the tables in this thread's outermost evaluation, 0 for
+  // full resolution.
+  int& threadCoarseLevel ()
+  {
+    static thread_local int t_level(0);
+    return t_level;
+  }
+
+  class CoarseToFine
+  {
+  public:
+    static CoarseToFine& instance ()
+    {
+      static CoarseToFine s_coarseToFine;
+      return s_coarseToFine;
+    }
+
+    // The level set by MDEF_COARSE, 0 when it is off.
+    int level ()
+    {
+      const string setting = FunctionUtility::getModelString("MDEF_COARSE");
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if ( setting != m_setting ) reset(setting);
+      return m_level;
+    }
+
+    // The coarsest level up to maxLevel there is of a table, 0 for none.
+    int tableLevel (const string& filename, int maxLevel)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      std::map<string,int>::iterator itLevels = m_nLevels.find(filename);
+      if ( itLevels == m_nLevels.end() ) {
+	int nLevels(0);
+	while ( nLevels < s_coarseMaxLevel
+		&& access(coarseTableName(filename, nLevels+1).c_str(), R_OK) == 0 ) ++nLevels;
+	itLevels = m_nLevels.insert(std::make_pair(filename, nLevels)).first;
+      }
+      return std::min(itLevels->second, maxLevel);
+    }
+
+  private:
+    CoarseToFine () : m_mutex(), m_setting(FunctionUtility::NOT_A_KEY()), m_level(0), m_nLevels() {}
+
+    // A new setting looks for the levels of the tables again.
+    void reset (const string& setting)
+    {
+      int level(0);
+      if ( setting != FunctionUtility::NOT_A_KEY() && isSwitchedOn("MDEF_COARSE") ) {
+	std::istringstream iss(setting);
+	if ( !(iss >> level) || level < 1 ) {
+	  throw MdefExpression::MdefExpressionError("MDEF_COARSE should be set to a table level, or off");
+	}
+      }
+      m_setting = setting;
+      m_level = std::min(level, s_coarseMaxLevel);
+      m_nLevels.clear();
+    }
+
+    std::mutex m_mutex;
+    string m_setting;
+    int m_level;
+    std::map<string,int> m_nLevels;
+  };
+
+  // Sets the level of the tables for an outermost evaluation.
+  class CoarseEvaluation
+  {
+  public:
+    CoarseEvaluation ()
+      : m_isOutermost(threadEvaluationDepth() == 1 && !isTableStubbed())
+    {
+      if ( m_isOutermost ) threadCoarseLevel() = CoarseToFine::instance().level();
+    }
+
+    ~CoarseEvaluation ()
+    {
+      if ( m_isOutermost ) threadCoarseLevel() = 0;
+    }
+
+  private:
+    const bool m_isOutermost;
+  };
+
+  // Adaptive energy sampling.  While 'xset MDEF_ADAPTIVE tol' is set ('on'
+  // for 1e-3, optionally followed by the initial stride, 8 by default), the
+  // outermost evaluations on at least four strides of bins run on a subgrid
+  // of the requested energies, every stride-th edge to start with.  The value
+  // of each subgrid bin (per unit energy for additive expressions) is
+  // compared with the linear interpolation between its neighbours at its
+  // centre, and the bins where they differ by more than tol times the largest
+  // of the three values are halved and the expression evaluated again, until
+  // no bin is to be halved or they are the requested ones.  The result is
+  // interpolated onto the requested bins linearly between the subgrid bin
+  // centres, keeping the flux of each subgrid bin for additive expressions.
+  // The largest difference left in a subgrid bin is the error bound, written
+  // at chatter 20 and returned by MdefEvaluation::adaptiveSampling().
+  // Expressions with convolutions are evaluated in full.
+  const Real s_adaptiveDefaultTolerance = 1.0e-3;
+  const size_t s_adaptiveDefaultStride = 8;
+
+  // False if adaptive sampling is off.
+  bool adaptiveSetting (Real& tolerance, size_t& stride)
+  {
+    const string setting = FunctionUtility::getModelString("MDEF_ADAPTIVE");
+    if ( setting == FunctionUtility::NOT_A_KEY() || !isSwitchedOn("MDEF_ADAPTIVE") ) return false;
+    tolerance = s_adaptiveDefaultTolerance;
+    stride = s_adaptiveDefaultStride;
+    std::istringstream iss(setting);
+    Real value;
+    if ( iss >> value ) {
+      tolerance = value;
+      int strideValue;
+      if ( iss >> strideValue ) stride = strideValue > 0 ? strideValue : 0;
+    }
+    if ( !(tolerance > 0.0) || stride < 2 ) {
+      throw MdefExpression::MdefExpressionError("MDEF_ADAPTIVE should be set to \"tol [stride]\"");
+    }
+    return true;
+  }
+
+  // The depth of evaluate() calls eligible for adaptive sampling in this
+  // thread: the outermost ones, or their masked evaluation.
+  int& threadAdaptiveDepth ()
+  {
+    static thread_local int t_depth(1);
+    return t_depth;
+  }
+
+  MdefEvaluation::AdaptiveSampling& threadAdaptiveSampling ()
+  {
+    static thread_local MdefEvaluation::AdaptiveSampling t_sampling = {0, 0, 0, 0, 0.0};
+    return t_sampling;
+  }
+
+  // The difference of each subgrid bin value from the linear interpolation
+  // between its neighbours, relative to the largest of the three.  The end
+  // bins take that of their inner neighbour, with fewer than three bins all
+  // are to be refined.
+  void adaptiveErrors (const RealArray& centres, const RealArray& values, std::vector<Real>& errors)
+  {
+    const size_t nSub = values.size();
+    errors.assign(nSub, std::numeric_limits<Real>::infinity());
+    if ( nSub < 3 ) return;
+    for (size_t j=1; j+1<nSub; ++j) {
+      const Real t = (centres[j] - centres[j-1])/(centres[j+1] - centres[j-1]);
+      const Real linear = values[j-1] + t*(values[j+1] - values[j-1]);
+      const Real scale = std::max(std::fabs(values[j]),
+				  std::max(std::fabs(values[j-1]), std::fabs(values[j+1])));
+      errors[j] = scale > 0.0 ? std::fabs(values[j] - linear)/scale : 0.0;
+    }
+    errors[0] = errors[1];
+    errors[nSub-1] = errors[nSub-2];
+  }
+
+  // The requested bins from the subgrid ones between energies[edges[j]] and
+  // energies[edges[j+1]], values per unit energy for additive expressions.
+  void adaptiveInterpolate (const RealArray& energies, const std::vector<size_t>& edges,
+			    const RealArray& values, bool isAdditive, RealArray& flux)
+  {
+    const size_t nSub = edges.size() - 1;
+    RealArray centres(nSub);
+    for (size_t j=0; j<nSub; ++j) centres[j] = 0.5*(energies[edges[j]] + energies[edges[j+1]]);
+    flux.resize(energies.size() - 1);
+    for (size_t j=0; j<nSub; ++j) {
+      Real subFlux(0.0);
+      for (size_t i=edges[j]; i<edges[j+1]; ++i) {
+	const Real centre = 0.5*(energies[i] + energies[i+1]);
+	// towards the nearer neighbour, extrapolated from the inner one at the ends
+	size_t k = (centre < centres[j]) ? j - 1 : j + 1;
+	if ( j == 0 && centre < centres[j] ) k = 1;
+	if ( j+1 == nSub && centre >= centres[j] ) k = j - 1;
+	Real value = values[j];
+	if ( nSub > 1 ) value += (values[k] - values[j])*(centre - centres[j])/(centres[k] - centres[j]);
+	flux[i] = isAdditive ? value*std::fabs(energies[i+1] - energies[i]) : value;
+	subFlux += flux[i];
+      }
+      if ( !isAdditive || edges[j+1] - edges[j] < 2 ) continue;
+      // the flux of the subgrid bin, the difference spread over its width
+      const Real width = std::fabs(energies[edges[j+1]] - energies[edges[j]]);
+      const Real correction = (values[j]*width - subFlux)/width;
+      for (size_t i=edges[j]; i<edges[j+1]; ++i)
+	flux[i] += correction*std::fabs(energies[i+1] - energies[i]);
+    }
+  }
+
+  // The values of the subgrid bins firstSub to endSub-1, per unit energy for
+  // additive expressions.
+  void adaptiveValues (const MdefExpression& expression, bool isAdditive, const RealArray& energies,
+		       const std::vector<size_t>& edges, size_t firstSub, size_t endSub,
+		       const RealArray& parameters, int spectrumNumber, RealArray& fluxErr,
+		       const string& initString, RealArray& values)
+  {
+    const size_t nSub = endSub - firstSub;
+    RealArray subEnergies(nSub + 1), subFlux;
+    for (size_t j=0; j<=nSub; ++j) subEnergies[j] = energies[edges[firstSub+j]];
+    expression.evaluate(subEnergies, parameters, spectrumNumber, subFlux, fluxErr, initString);
+    for (size_t j=0; j<nSub; ++j)
+      values[firstSub+j] = isAdditive ? subFlux[j]/std::fabs(subEnergies[j+1] - subEnergies[j]) : subFlux[j];
+  }
+
+  void adaptiveEvaluate (const MdefExpression& expression, bool isAdditive, const RealArray& energies,
+			 const RealArray& parameters, int spectrumNumber, RealArray& flux,
+			 RealArray& fluxErr, const string& initString, Real tolerance, size_t stride)
+  {
+    const size_t nBins = energies.size() - 1;
+    std::vector<size_t> edges;
+    for (size_t i=0; i<nBins; i+=stride) edges.push_back(i);
+    edges.push_back(nBins);
+    MdefEvaluation::AdaptiveSampling sampling = {nBins, edges.size() - 1, 0, 1, 0.0};
+    RealArray values(edges.size() - 1), centres;
+    std::vector<Real> errors;
+    // the subgrid evaluations are not masked
+    ActiveMask& threadMask = threadActiveMask();
+    const ActiveMask savedMask(threadMask);
+    ActiveMask allBins;
+    allBins.isSet = true;
+    allBins.endBin = std::numeric_limits<size_t>::max();
+    threadMask = allBins;
+    try {
+      adaptiveValues(expression, isAdditive, energies, edges, 0, edges.size() - 1, parameters,
+		     spectrumNumber, fluxErr, initString, values);
+      while ( true ) {
+	const size_t nSub = edges.size() - 1;
+	centres.resize(nSub);
+	for (size_t j=0; j<nSub; ++j) centres[j] = 0.5*(energies[edges[j]] + energies[edges[j+1]]);
+	adaptiveErrors(centres, values, errors);
+	// halved bins, of which only the runs are evaluated again
+	std::vector<size_t> refined;
+	std::vector<bool> isNew;
+	for (size_t j=0; j<nSub; ++j) {
+	  refined.push_back(edges[j]);
+	  const bool isHalved = ( edges[j+1] - edges[j] > 1 && !(errors[j] <= tolerance) );
+	  isNew.push_back(isHalved);
+	  if ( !isHalved ) continue;
+	  refined.push_back((edges[j] + edges[j+1])/2);
+	  isNew.push_back(true);
+	}
+	refined.push_back(nBins);
+	if ( refined.size() == edges.size() ) break;
+	RealArray refinedValues(refined.size() - 1);
+	for (size_t j=0, k=0; j<nSub; ++j, ++k) {
+	  refinedValues[k] = values[j];
+	  if ( isNew[k] ) ++k;
+	}
+	for (size_t k=0; k<isNew.size(); ) {
+	  if ( !isNew[k] ) {
+	    ++k;
+	    continue;
+	  }
+	  size_t endRun = k;
+	  while ( endRun < isNew.size() && isNew[endRun] ) ++endRun;
+	  adaptiveValues(expression, isAdditive, energies, refined, k, endRun, parameters,
+			 spectrumNumber, fluxErr, initString, refinedValues);
+	  sampling.nEvaluated += endRun - k;
+	  ++sampling.nCalls;
+	  k = endRun;
+	}
+	edges.swap(refined);
+	values.resize(refinedValues.size());
+	values = refinedValues;
+      }
+    } catch (...) {
+      threadMask = savedMask;
+      throw;
+    }
+    threadMask = savedMask;
+    sampling.nFinal = edges.size() - 1;
+    for (size_t j=0; j+1<edges.size(); ++j) {
+      if ( edges[j+1] - edges[j] > 1 ) sampling.errorBound = std::max(sampling.errorBound, errors[j]);
+    }
+    adaptiveInterpolate(energies, edges, values, isAdditive, flux);
+    threadAdaptiveSampling() = sampling;
+    std::ostringstream oss;
+    oss << "Model " << expression.mdefName() << ", spectrum " << spectrumNumber << ": "
+	<< sampling.nEvaluated << " bins evaluated in " << sampling.nCalls << " calls for "
+	<< nBins << ", estimated error " << sampling.errorBound << std::endl;
+    FunctionUtility::xsWrite(oss.str(), 20);
+  }
+
+  // Persistent evaluation cache.  While 'xset MDEF_CACHE file' is set, the
+  // results of outermost calls of evaluate() are kept in file, shared by all
+  // XSPEC sessions and processes using it, so that sessions repeating the
+  // same evaluations take them from there.  A result is keyed by everything
+  // it depends on: the expression and those of the mdefine'd models it
+  // calls (as last defined in this session), the device, inode, size and
+  // modification and status change times (in ns) of every table it reads,
+  // the energies, the active bins, the spectrum number and its Stokes
+  // component, the parameters and the init string.  Expressions calling
+  // built-in models or convolutions, which may depend on other settings,
+  // are not cached.
+  //
+  // The file (native byte order) has a header
+  //    "MDEFCCH2", slotBytes, nSlots, clock    (64-bit unsigned)
+  // and then nSlots slot headers
+  //    hash[2], keyBytes, nValues, lastUse     (64-bit unsigned)
+  // followed by nSlots slots of slotBytes each, holding the keyBytes bytes
+  // of the key and then nValues doubles.  The slots form sets of
+  // s_cacheWays, a key can only be in the set given by hash[0], and a slot
+  // matches only if its hash and the whole key are those looked up.  A new
+  // result replaces the least recently used slot of its set.  'xset
+  // MDEF_CACHE_SIZE n' sets the size of the file in MB (default 256) when it
+  // is created; a file of a different size or layout is started afresh.  All
+  // accesses hold an exclusive flock() on the file, and a slot is marked
+  // free while being written, so a killed process leaves no partial
+  // results.  Results whose key and values take more than slotBytes are not
+  // cached.
+
+  const char s_cacheMagic[] = "MDEFCCH2";
+  const size_t s_cacheWays = 16;
+  const size_t s_cacheSlotBytes = 131072;
+  const size_t s_cacheDefaultMB = 256;
+
+  struct CacheHeader
+  {
+    char magic[8];
+    unsigned long long slotBytes;
+    unsigned long long nSlots;
+    unsigned long long clock;
+  };
+
+  struct CacheSlot
+  {
+    unsigned long long hash[2];
+    unsigned long long keyBytes;
+    unsigned long long nValues;
+    unsigned long long lastUse;
+  };
+
+  // A 128-bit hash of the key, FNV-1a and an unrelated multiply-xorshift
+  // hash, and if isKept the bytes of the key themselves.
+  class CacheKey
+  {
+  public:
+    explicit CacheKey (bool isKept = false)
+      : m_first(14695981039346656037ULL), m_second(7809847782465536322ULL), m_isKept(isKept),
+	m_bytes() {}
+
+    void add (const void* data, size_t n)
+    {
+      const unsigned char* bytes = static_cast<const unsigned char*>(data);
+      for (size_t i=0; i<n; ++i) {
+	m_first = (m_first ^ bytes[i])*1099511628211ULL;
+	m_second = (m_second + bytes[i] + 1)*0x9E3779B97F4A7C15ULL;
+	m_second ^= m_second >> 29;
+      }
+      if ( m_isKept ) m_bytes.append(static_cast<const char*>(data), n);
+    }
+
+    template <typename T>
+    void addValue (T value)
+    {
+      add(&value, sizeof(T));
+    }
+
+    void addString (const string& value)
+    {
+      addValue<size_t>(value.size());
+      add(value.data(), value.size());
+    }
+
+    void addArray (const RealArray& values)
+    {
+      addValue<size_t>(values.size());
+      if ( values.size() ) add(&values[0], values.size()*sizeof(Real));
+    }
+
+    // never 0, which marks a free slot
+    unsigned long long first () const { return (m_first | m_second) ? m_first : 1; }
+    unsigned long long second () const { return m_second; }
+    const string& bytes () const { return m_bytes; }
+
+  private:
+    unsigned long long m_first;
+    unsigned long long m_second;
+    bool m_isKept;
+    string m_bytes;
+  };
+
+  // The definitions of the mdefine'd models by name, as last initialised.
+  struct MdefDefinition
+  {
+    string compType;
+    string exprString;
+    std::vector<string> operators;
+  };
+
+  std::mutex& definitionsMutex ()
+  {
+    static std::mutex s_definitionsMutex;
+    return s_definitionsMutex;
+  }
+
+  std::map<string,MdefDefinition>& mdefDefinitions ()
+  {
+    static std::map<string,MdefDefinition> s_definitions;
+    return s_definitions;
+  }
+
+  // The number of expressions of each mdefine'd model, so that deleting a
+  // model can be told from destroying one of its copies or temporaries.
+  // Guarded by definitionsMutex().
+  std::map<string,size_t>& mdefInstances ()
+  {
+    static std::map<string,size_t> s_instances;
+    return s_instances;
+  }
+
+  void addMdefInstance (const string& mdefName)
+  {
+    if ( mdefName.empty() ) return;
+    std::lock_guard<std::mutex> lock(definitionsMutex());
+    ++mdefInstances()[mdefName];
+  }
+
+  void removeMdefInstance (const string& mdefName)
+  {
+    if ( mdefName.empty() ) return;
+    std::lock_guard<std::mutex> lock(definitionsMutex());
+    std::map<string,size_t>::iterator itCount = mdefInstances().find(mdefName);
+    if ( itCount == mdefInstances().end() || --itCount->second > 0 ) return;
+    // the last one: the model is deleted
+    mdefInstances().erase(itCount);
+    mdefDefinitions().erase(mdefName);
+    ++mdefineGeneration();
+  }
+
+  bool addTableSignature (const string& filename, CacheKey& key)
+  {
+    struct stat status;
+    if ( stat(filename.c_str(), &status) != 0 ) return false;
+    key.addString(filename);
+    key.addString(fileSignature(status));
+    return true;
+  }
+
+  // Adds the definition of an expression and of everything it calls, false
+  // if its results are not to be cached.
+  bool addDefinition (const string& compType, const string& exprString,
+		      const std::vector<string>& operators, CacheKey& key, int depth = 0)
+  {
+    if ( depth > 16 || compType == "con" ) return false;
+    key.addString(compType);
+    key.addString(exprString);
+    for (size_t i=0; i<operators.size(); ++i) {
+      const string& opName = operators[i];
+      if ( opName == "#" ) return false;
+      if ( opName.substr(0,6) == "atable" || opName.substr(0,6) == "mtable" ||
+	   opName.substr(0,6) == "etable" ) {
+	const string filename = opName.substr(7, opName.length()-8);
+	if ( !addTableSignature(filename, key) ) return false;
+	string reference;
+	{
+	  std::lock_guard<std::mutex> tableLock(tableMutex());
+	  reference = phiMirrorInfo(filename).reference;
+	}
+	if ( !reference.empty() && !addTableSignature(reference, key) ) return false;
+      } else if ( XSModelFunction::hasFunctionPointer(opName) ) {
+	if ( !XSModelFunction::compMatchName(opName).isMdefineModel() ) return false;
+	MdefDefinition definition;
+	{
+	  std::lock_guard<std::mutex> lock(definitionsMutex());
+	  std::map<string,MdefDefinition>::const_iterator itDef = mdefDefinitions().find(opName);
+	  if ( itDef == mdefDefinitions().end() ) return false;
+	  definition = itDef->second;
+	}
+	if ( !addDefinition(definition.compType, definition.exprString, definition.operators,
+			    key, depth+1) ) return false;
+      }
+    }
+    return true;
+  }
+
+  // Whether the results of the models called may depend on more than their
+  // parameters, i.e. on abund, xsect, cosmo or xset strings: those of
+  // built-in models may, and so those of mdefine'd models calling them.
+  bool dependsOnSettings (const std::vector<string>& operators,
+			  const MdefExpression::MathOpContainer& operatorsMap, int depth = 0)
+  {
+    if ( depth > 16 ) return true;
+    for (size_t i=0; i<operators.size(); ++i) {
+      const string& opName = operators[i];
+      if ( operatorsMap.find(opName) != operatorsMap.end() ) continue;
+      if ( opName.substr(0,6) == "atable" || opName.substr(0,6) == "mtable" ||
+	   opName.substr(0,6) == "etable" ) continue;
+      if ( !XSModelFunction::hasFunctionPointer(opName) ) continue;
+      if ( !XSModelFunction::compMatchName(opName).isMdefineModel() ) return true;
+      std::vector<string> calledOperators;
+      {
+	std::lock_guard<std::mutex> lock(definitionsMutex());
+	std::map<string,MdefDefinition>::const_iterator itDef = mdefDefinitions().find(opName);
+	if ( itDef == mdefDefinitions().end() ) return true;
+	calledOperators = itDef->second.operators;
+      }
+      if ( dependsOnSettings(calledOperators, operatorsMap, depth+1) ) return true;
+    }
+    return false;
+  }
+
+  class PersistentCache
+  {
+  public:
+    static PersistentCache& instance ()
+    {
+      static PersistentCache s_cache;
+      return s_cache;
+    }
+
+    ~PersistentCache ()
+    {
+      close();
+    }
+
+    // Follows MDEF_CACHE, false if not caching.
+    bool isEnabled ()
+    {
+      string fileName = FunctionUtility::getModelString("MDEF_CACHE");
+      if ( fileName == FunctionUtility::NOT_A_KEY() ) fileName.clear();
+      if ( fileName.empty() && !m_isOpen ) return false;
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return open(fileName);
+    }
+
+    bool find (const CacheKey& key, size_t nValues, RealArray& values)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      FileLock fileLock(m_fd);
+      if ( !isMapped() ) return false;
+      CacheSlot* const slots = slotsOfSet(key);
+      const string& keyBytes = key.bytes();
+      for (size_t i=0; i<s_cacheWays; ++i) {
+	CacheSlot& slot = slots[i];
+	if ( slot.hash[0] != key.first() || slot.hash[1] != key.second()
+	     || slot.keyBytes != keyBytes.size()
+	     || memcmp(slotData(slot), keyBytes.data(), keyBytes.size()) != 0 ) continue;
+	if ( slot.nValues != nValues ) return false;
+	slot.lastUse = ++header().clock;
+	values.resize(nValues);
+	memcpy(&values[0], slotData(slot) + keyBytes.size(), nValues*sizeof(Real));
+	return true;
+      }
+      return false;
+    }
+
+    void store (const CacheKey& key, const RealArray& values)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      const string& keyBytes = key.bytes();
+      if ( values.size() == 0 || keyBytes.size() > s_cacheSlotBytes
+	   || values.size() > (s_cacheSlotBytes - keyBytes.size())/sizeof(Real) ) return;
+      FileLock fileLock(m_fd);
+      if ( !isMapped() ) return;
+      CacheSlot* const slots = slotsOfSet(key);
+      CacheSlot* target = slots;
+      for (size_t i=0; i<s_cacheWays; ++i) {
+	if ( slots[i].hash[0] == key.first() && slots[i].hash[1] == key.second()
+	     && slots[i].keyBytes == keyBytes.size()
+	     && memcmp(slotData(slots[i]), keyBytes.data(), keyBytes.size()) == 0 ) {
+	  target = slots + i;
+	  break;
+	}
+	if ( slots[i].lastUse < target->lastUse ) target = slots + i;
+      }
+      target->hash[0] = target->hash[1] = 0;
+      memcpy(slotData(*target), keyBytes.data(), keyBytes.size());
+      memcpy(slotData(*target) + keyBytes.size(), &values[0], values.size()*sizeof(Real));
+      target->keyBytes = keyBytes.size();
+      target->nValues = values.size();
+      target->lastUse = ++header().clock;
+      target->hash[0] = key.first();
+      target->hash[1] = key.second();
+    }
+
+  private:
+    // Exclusive lock on the cache file across processes.
+    class FileLock
+    {
+    public:
+      explicit FileLock (int fd) : m_fd(fd) { if ( m_fd >= 0 ) flock(m_fd, LOCK_EX); }
+      ~FileLock () { if ( m_fd >= 0 ) flock(m_fd, LOCK_UN); }
+    private:
+      int m_fd;
+    };
+
+    PersistentCache () : m_mutex(), m_isOpen(false), m_fileName(), m_fd(-1), m_map(0),
+			 m_mapSize(0) {}
+
+    bool open (const string& fileName)
+    {
+      if ( fileName == m_fileName ) return m_fd >= 0;
+      close();
+      m_fileName = fileName;
+      if ( fileName.empty() ) return false;
+      size_t sizeMB = s_cacheDefaultMB;
+      const string sizeString = FunctionUtility::getModelString("MDEF_CACHE_SIZE");
+      if ( sizeString != FunctionUtility::NOT_A_KEY() ) {
+	std::istringstream iss(sizeString);
+	if ( !(iss >> sizeMB) || sizeMB == 0 ) {
+	  throw MdefExpression::MdefExpressionError("MDEF_CACHE_SIZE should be a size in MB");
+	}
+      }
+      const size_t nSets = std::max(static_cast<size_t>(1), (sizeMB << 20)
+				    /(s_cacheWays*(s_cacheSlotBytes + sizeof(CacheSlot))));
+      m_fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+      if ( m_fd < 0 ) {
+	*IosHolder::errHolder() << "Cannot open the evaluation cache " << fileName << std::endl;
+	return false;
+      }
+      FileLock fileLock(m_fd);
+      CacheHeader fileHeader;
+      const bool isValid = pread(m_fd, &fileHeader, sizeof(CacheHeader), 0) == sizeof(CacheHeader)
+	&& string(fileHeader.magic, 8) == string(s_cacheMagic, 8)
+	&& fileHeader.slotBytes == s_cacheSlotBytes && fileHeader.nSlots == nSets*s_cacheWays;
+      if ( !isValid ) {
+	// a new file, or one of another size or layout, starts empty
+	memcpy(fileHeader.magic, s_cacheMagic, 8);
+	fileHeader.slotBytes = s_cacheSlotBytes;
+	fileHeader.nSlots = nSets*s_cacheWays;
+	fileHeader.clock = 0;
+	if ( ftruncate(m_fd, 0) != 0 || ftruncate(m_fd, fileSize(fileHeader.nSlots)) != 0
+	     || pwrite(m_fd, &fileHeader, sizeof(CacheHeader), 0) != sizeof(CacheHeader) ) {
+	  *IosHolder::errHolder() << "Cannot initialise the evaluation cache " << fileName << std::endl;
+	  close();
+	  return false;
+	}
+      }
+      m_isOpen = true;
+      return true;
+    }
+
+    void close ()
+    {
+      unmap();
+      if ( m_fd >= 0 ) ::close(m_fd);
+      m_fd = -1;
+      m_isOpen = false;
+    }
+
+    void unmap ()
+    {
+      if ( m_map ) munmap(m_map, m_mapSize);
+      m_map = 0;
+      m_mapSize = 0;
+    }
+
+    static size_t fileSize (size_t nSlots)
+    {
+      return sizeof(CacheHeader) + nSlots*(sizeof(CacheSlot) + s_cacheSlotBytes);
+    }
+
+    // Maps the file as it is now, which another process may have started
+    // afresh with another size.  Called with the file locked.
+    bool isMapped ()
+    {
+      if ( m_fd < 0 ) return false;
+      struct stat status;
+      if ( fstat(m_fd, &status) != 0 ) return false;
+      const size_t size = status.st_size;
+      if ( m_map && size == m_mapSize ) return true;
+      unmap();
+      CacheHeader fileHeader;
+      if ( pread(m_fd, &fileHeader, sizeof(CacheHeader), 0) != sizeof(CacheHeader)
+	   || string(fileHeader.magic, 8) != string(s_cacheMagic, 8)
+	   || fileHeader.slotBytes != s_cacheSlotBytes || fileHeader.nSlots % s_cacheWays != 0
+	   || fileHeader.nSlots == 0 || size != fileSize(fileHeader.nSlots) ) return false;
+      void* map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+      if ( map == MAP_FAILED ) return false;
+      m_map = static_cast<char*>(map);
+      m_mapSize = size;
+      return true;
+    }
+
+    CacheHeader& header ()
+    {
+      return *reinterpret_cast<CacheHeader*>(m_map);
+    }
+
+    CacheSlot* slotsOfSet (const CacheKey& key)
+    {
+      const size_t nSets = header().nSlots/s_cacheWays;
+      return reinterpret_cast<CacheSlot*>(m_map + sizeof(CacheHeader))
+	+ (key.first() % nSets)*s_cacheWays;
+    }
+
+    char* slotData (const CacheSlot& slot)
+    {
+      const CacheSlot* const slots = reinterpret_cast<const CacheSlot*>(m_map + sizeof(CacheHeader));
+      return m_map + sizeof(CacheHeader) + header().nSlots*sizeof(CacheSlot)
+	+ (&slot - slots)*s_cacheSlotBytes;
+    }
+
+    std::mutex m_mutex;
+    std::atomic<bool> m_isOpen;
+    string m_fileName;
+    int m_fd;
+    char* m_map;
+    size_t m_mapSize;
+  };
+
+  // Takes the result of an outermost call of evaluate() from the persistent
+  // cache, or stores it there when the call completes.
+  class CachedCall
+  {
+  public:
+    CachedCall (const MdefExpression& expression, const string& compType,
+		const std::vector<string>& operators, const RealArray& energies,
+		const RealArray& parameters, int spectrumNumber, const string& initString,
+		RealArray& flux)
+      : m_isActive(false), m_isFound(false), m_key(true), m_nBins(energies.size()-1), m_flux(flux),
+	m_nUncaught(uncaughtExceptions())
+    {
+      if ( threadEvaluationDepth() != 1 || isTableStubbed() ) return;
+      if ( !PersistentCache::instance().isEnabled() ) return;
+      m_key.addString(s_cacheMagic);
+      if ( !addDefinition(compType, expression.exprString(), operators, m_key) ) return;
+      m_key.addArray(energies);
+      ActiveMask active;
+      if ( activeBins(energies, active) ) {
+	m_key.addValue<size_t>(active.firstBin);
+	m_key.addValue<size_t>(active.endBin);
+	for (size_t i=0; i<active.isActive.size(); ++i) m_key.addValue<bool>(active.isActive[i]);
+      }
+      m_key.addValue<int>(spectrumNumber);
+      m_key.addValue<int>(stokesComponent(spectrumNumber));
+      m_key.addArray(parameters);
+      m_key.addString(initString);
+      if ( threadCoarseLevel() > 0 ) m_key.addValue<int>(threadCoarseLevel());
+      Real adaptiveTolerance;
+      size_t adaptiveStride;
+      if ( adaptiveSetting(adaptiveTolerance, adaptiveStride) ) {
+	m_key.addValue<Real>(adaptiveTolerance);
+	m_key.addValue<size_t>(adaptiveStride);
+      }
+      m_isActive = true;
+      m_isFound = PersistentCache::instance().find(m_key, m_nBins, flux);
+    }
+
+    ~CachedCall ()
+    {
+      if ( !m_isActive || m_isFound || uncaughtExceptions() > m_nUncaught
+	   || m_flux.size() != m_nBins ) return;
+      PersistentCache::instance().store(m_key, m_flux);
+    }
+
+    bool isFound () const { return m_isFound; }
+
+  private:
+    bool m_isActive;
+    bool m_isFound;
+    CacheKey m_key;
+    const size_t m_nBins;
+    RealArray& m_flux;
+    const int m_nUncaught;
+  };
+
+  // Table interpolations by a local server.  While 'xset MDEF_SERVER socket'
+  // is set, additive atable{} calls are sent to tools/stokes_served listening
+  // on that Unix-domain socket, which reads each table once for all sessions
+  // on the machine and keeps their results in a cache common to them.  The
+  // energies and the values pass through a file mapped by both sides (the
+  // protocol is described in tools/TableServer.h).  Each thread has its own
+  // connection.  A call the server does not answer is evaluated here, and
+  // the server is tried again s_serverRetrySeconds later.
+  const double s_serverRetrySeconds = 10.0;
+  const size_t s_serverMinBuffer = 1 << 20;
+  const unsigned long long s_serverAttachMessage = 1;
+  const unsigned long long s_serverTableMessage = 2;
+
+  class ServerConnection
+  {
+  public:
+    ServerConnection () : m_socket(-1), m_path(), m_buffer(0), m_capacity(0), m_retryTime(),
+			  m_isReported(false) {}
+
+    ~ServerConnection ()
+    {
+      disconnect();
+    }
+
+    // False if the call is to be evaluated here.
+    bool interpolate (const string& path, const string& filename, int component,
+		      const RealArray& energies, const RealArray& params, RealArray& modFlux)
+    {
+      if ( path != m_path ) {
+	disconnect();
+	m_path = path;
+	m_retryTime = std::chrono::steady_clock::time_point();
+	m_isReported = false;
+      }
+      if ( m_socket < 0 ) {
+	if ( std::chrono::steady_clock::now() < m_retryTime ) return false;
+	if ( !connectServer() ) return fail("cannot connect");
+      }
+      const size_t nEnergies = energies.size();
+      const size_t needed = (2*nEnergies - 1)*sizeof(Real);
+      if ( needed > m_capacity && !attach(std::max(needed, s_serverMinBuffer)) )
+	return fail("cannot share a buffer");
+      memcpy(m_buffer, &energies[0], nEnergies*sizeof(Real));
+
+      const unsigned long long header[6] = {s_serverTableMessage,
+					    4*sizeof(unsigned long long) + filename.size()
+					    + params.size()*sizeof(Real),
+					    static_cast<unsigned long long>(component), nEnergies,
+					    params.size(), filename.size()};
+      string bytes(reinterpret_cast<const char*>(header), sizeof(header));
+      bytes += filename;
+      for (size_t i=0; i<params.size(); ++i)
+	bytes.append(reinterpret_cast<const char*>(&params[i]), sizeof(Real));
+      unsigned long long nValues(0);
+      if ( !sendAll(bytes.data(), bytes.size()) || !receiveReply(nValues) ) return fail("no reply");
+      if ( nValues != nEnergies - 1 ) return fail("wrong number of values");
+      modFlux.resize(nEnergies - 1);
+      memcpy(&modFlux[0], m_buffer + nEnergies, (nEnergies - 1)*sizeof(Real));
+      m_isReported = false;
+      return true;
+    }
+
+  private:
+    bool connectServer ()
+    {
+      sockaddr_un address;
+      memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      if ( m_path.size() >= sizeof(address.sun_path) ) return false;
+      strcpy(address.sun_path, m_path.c_str());
+      m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+      if ( m_socket < 0 ) return false;
+      // the first call of a table waits for the server to read it
+      timeval timeout = {300, 0};
+      setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      if ( connect(m_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ) {
+	disconnect();
+	return false;
+      }
+      return true;
+    }
+
+    // A new buffer of capacity bytes in an unlinked file, passed to the
+    // server with the attach message.
+    bool attach (size_t capacity)
+    {
+      char shmName[] = "/dev/shm/mdefsrvXXXXXX";
+      char tmpName[] = "/tmp/mdefsrvXXXXXX";
+      int fd = mkstemp(shmName);
+      if ( fd >= 0 ) {
+	unlink(shmName);
+      } else {
+	fd = mkstemp(tmpName);
+	if ( fd < 0 ) return false;
+	unlink(tmpName);
+      }
+      void* mapped = MAP_FAILED;
+      if ( ftruncate(fd, capacity) == 0 )
+	mapped = mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if ( mapped == MAP_FAILED ) {
+	::close(fd);
+	return false;
+      }
+      unsigned long long message[3] = {s_serverAttachMessage, sizeof(unsigned long long), capacity};
+      char control[CMSG_SPACE(sizeof(int))];
+      memset(control, 0, sizeof(control));
+      iovec io = {message, sizeof(message)};
+      msghdr header;
+      memset(&header, 0, sizeof(header));
+      header.msg_iov = &io;
+      header.msg_iovlen = 1;
+      header.msg_control = control;
+      header.msg_controllen = sizeof(control);
+      cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+      ssize_t nSent;
+      do {
+	nSent = sendmsg(m_socket, &header, MSG_NOSIGNAL);
+      } while ( nSent < 0 && errno == EINTR );
+      ::close(fd);
+      unsigned long long nValues(0);
+      if ( nSent != static_cast<ssize_t>(sizeof(message)) || !receiveReply(nValues) ) {
+	munmap(mapped, capacity);
+	return false;
+      }
+      if ( m_buffer ) munmap(m_buffer, m_capacity);
+      m_buffer = static_cast<Real*>(mapped);
+      m_capacity = capacity;
+      return true;
+    }
+
+    // Status and value of a reply, false for an error.
+    bool receiveReply (unsigned long long& value)
+    {
+      unsigned long long reply[2];
+      if ( !receiveAll(reply, sizeof(reply)) ) return false;
+      value = reply[1];
+      if ( reply[0] == 0 ) return true;
+      if ( reply[1] < (1 << 16) ) {
+	string errMsg(reply[1], ' ');
+	if ( reply[1] > 0 && receiveAll(&errMsg[0], reply[1]) ) m_error = errMsg;
+      }
+      return false;
+    }
+
+    bool sendAll (const void* data, size_t size)
+    {
+      const char* bytes = static_cast<const char*>(data);
+      while ( size > 0 ) {
+	const ssize_t nSent = send(m_socket, bytes, size, MSG_NOSIGNAL);
+	if ( nSent < 0 && errno == EINTR ) continue;
+	if ( nSent <= 0 ) return false;
+	bytes += nSent;
+	size -= nSent;
+      }
+      return true;
+    }
+
+    bool receiveAll (void* data, size_t size)
+    {
+      char* bytes = static_cast<char*>(data);
+      while ( size > 0 ) {
+	const ssize_t nRead = recv(m_socket, bytes, size, 0);
+	if ( nRead < 0 && errno == EINTR ) continue;
+	if ( nRead <= 0 ) return false;
+	bytes += nRead;
+	size -= nRead;
+      }
+      return true;
+    }
+
+    // Drops the connection until the retry time, reporting the first
+    // failure after a success.
+    bool fail (const string& reason)
+    {
+      disconnect();
+      m_retryTime = std::chrono::steady_clock::now()
+	+ std::chrono::milliseconds(static_cast<long long>(s_serverRetrySeconds*1000.0));
+      if ( !m_isReported ) {
+	static std::mutex s_reportMutex;
+	std::lock_guard<std::mutex> lock(s_reportMutex);
+	std::ostringstream oss;
+	oss << "Table server " << m_path << ": " << (m_error.empty() ? reason : m_error)
+	    << ", interpolating the tables here" << std::endl;
+	FunctionUtility::xsWrite(oss.str(), 10);
+	m_isReported = true;
+      }
+      m_error.clear();
+      return false;
+    }
+
+    void disconnect ()
+    {
+      if ( m_buffer ) munmap(m_buffer, m_capacity);
+      m_buffer = 0;
+      m_capacity = 0;
+      if ( m_socket >= 0 ) ::close(m_socket);
+      m_socket = -1;
+    }
+
+    int m_socket;
+    string m_path;
+    Real* m_buffer;
+    size_t m_capacity;
+    std::chrono::steady_clock::time_point m_retryTime;
+    bool m_isReported;
+    string m_error;
+  };
+
+  // The first call the server answers for a table (or for a new version of
+  // the file) is also interpolated here.  The server's values are used while
+  // they agree with these to s_serverTolerance of the largest value, and the
+  // table is interpolated here from then on if they do not.
+  const double s_serverTolerance = 1.0e-5;
+
+  std::mutex& serverCheckMutex ()
+  {
+    static std::mutex s_serverCheckMutex;
+    return s_serverCheckMutex;
+  }
+
+  // Whether the server agreed, keyed by the resolved table name and its
+  // fileSignature().
+  std::map<string,bool>& serverChecks ()
+  {
+    static std::map<string,bool> s_serverChecks;
+    return s_serverChecks;
+  }
+
+  // Interpolates an additive table on the server given by MDEF_SERVER, false
+  // if it is not set, the server did not answer or it disagreed with this
+  // session on the table.
+  bool serverInterpolate (const RealArray& energies, const RealArray& params,
+			  const string& filename, int spectrumNumber,
+			  const string& initString, RealArray& modFlux)
+  {
+    if ( isTableStubbed() ) return false;
+    const string path = FunctionUtility::getModelString("MDEF_SERVER");
+    if ( path == FunctionUtility::NOT_A_KEY() || path.empty() ) return false;
+    int component(0);
+    {
+      std::lock_guard<std::mutex> tableLock(tableMutex());
+      component = stokesComponent(spectrumNumber);
+    }
+    if ( component < 0 || component > 2 ) return false;
+    // the server runs in its own directory
+    char* resolved = realpath(filename.c_str(), 0);
+    if ( !resolved ) return false;
+    const string tableName(resolved);
+    free(resolved);
+    struct stat status;
+    if ( stat(tableName.c_str(), &status) != 0 ) return false;
+    std::ostringstream signature;
+    signature << tableName << '\0' << fileSignature(status);
+    bool isChecked(false);
+    {
+      std::lock_guard<std::mutex> lock(serverCheckMutex());
+      std::map<string,bool>::const_iterator itCheck = serverChecks().find(signature.str());
+      if ( itCheck != serverChecks().end() ) {
+	if ( !itCheck->second ) return false;
+	isChecked = true;
+      }
+    }
+    static thread_local ServerConnection s_connection;
+    if ( !s_connection.interpolate(path, tableName, component, energies, params, modFlux) )
+      return false;
+    if ( isChecked ) return true;
+    RealArray localParams(params);
+    RealArray localFlux, localFluxErr;
+    tableInterpolatePhiMirror(energies, localParams, filename, spectrumNumber,
+			      localFlux, localFluxErr, initString, "add");
+    const bool isAgreeing = isSpectrumAgreeing(modFlux, localFlux, s_serverTolerance);
+    {
+      std::lock_guard<std::mutex> lock(serverCheckMutex());
+      bool& isAgreed = serverChecks().insert(std::make_pair(signature.str(), true)).first->second;
+      if ( !isAgreeing && isAgreed ) {
+	isAgreed = false;
+	std::ostringstream oss;
+	oss << "Table server " << path << " differs from this session on " << tableName
+	    << ", interpolating it here" << std::endl;
+	FunctionUtility::xsWrite(oss.str(), 10);
+      }
+    }
+    if ( isAgreeing ) return true;
+    modFlux.resize(localFlux.size());
+    modFlux = localFlux;
+    return true;
+  }
+
+  // Sharing of calls between components.  Within one pass over the model
+  // XSPEC evaluates each component once per spectrum, and components such
+  // as stokes and stpol, or the same component for several datagroups with
+  // tied parameters, often call the same table or model with the same
+  // arguments.  While sharing is on, the results of table calls and of
+  // mdefine'd models that use no built-in model are kept (built-in models
+  // may read abund, xsect, cosmo or xset strings, which are not in the key),
+  // keyed by the table or model name, the arguments, the energies, the
+  // spectrum number and the init string, and reused by any expression
+  // making the same call in the same epoch.  An epoch ends when a component
+  // is evaluated again for a spectrum it was already evaluated for in the
+  // epoch, i.e. when XSPEC starts the next pass, when an mdefine'd model is
+  // defined or deleted, or by MdefEvaluation::advanceEpoch().  'xset
+  // MDEF_SHARE on' switches this on.
+
+  const size_t s_maxSharedCalls = 1024;
+
+  class CallMemo
+  {
+  public:
+    static CallMemo& instance ()
+    {
+      static CallMemo s_memo;
+      return s_memo;
+    }
+
+    // An outermost evaluation of a component for spectrumNumber.
+    void beginEvaluation (const void* component, int spectrumNumber)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      checkGeneration();
+      if ( !m_evaluated.insert(std::make_pair(component, spectrumNumber)).second ) {
+	clear();
+	m_evaluated.insert(std::make_pair(component, spectrumNumber));
+      }
+    }
+
+    bool find (const CacheKey& key, RealArray& flux)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      checkGeneration();
+      std::map<KeyPair,RealArray>::const_iterator itResult
+	= m_results.find(KeyPair(key.first(), key.second()));
+      if ( itResult == m_results.end() ) return false;
+      flux.resize(itResult->second.size());
+      flux = itResult->second;
+      return true;
+    }
+
+    void store (const CacheKey& key, const RealArray& flux)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      checkGeneration();
+      if ( m_results.size() >= s_maxSharedCalls ) return;
+      RealArray& result = m_results[KeyPair(key.first(), key.second())];
+      result.resize(flux.size());
+      result = flux;
+    }
+
+    void advance ()
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      clear();
+    }
+
+  private:
+    typedef std::pair<unsigned long long, unsigned long long> KeyPair;
+
+    CallMemo () : m_mutex(), m_generation(mdefineGeneration()), m_evaluated(), m_results() {}
+
+    void checkGeneration ()
+    {
+      const unsigned long generation = mdefineGeneration();
+      if ( generation == m_generation ) return;
+      clear();
+      m_generation = generation;
+    }
+
+    void clear ()
+    {
+      m_evaluated.clear();
+      m_results.clear();
+    }
+
+    std::mutex m_mutex;
+    unsigned long m_generation;
+    std::set<std::pair<const void*, int> > m_evaluated;
+    std::map<KeyPair,RealArray> m_results;
+  };
+
+  // Key of a shared table or mdefine'd model call.
+  void sharedCallKey (const string& opName, const RealArray& params,
+		      unsigned long long gridKey, int spectrumNumber, const string& initString,
+		      CacheKey& key)
+  {
+    key.addString(opName);
+    key.addArray(params);
+    key.addValue<unsigned long long>(gridKey);
+    key.addValue<int>(spectrumNumber);
+    key.addString(initString);
+  }
+
+  // Algebraic optimisation of the postfix program, done when an expression
+  // is defined if 'xset MDEF_OPTIMISE on' (or check) was given before.  The
+  // program is read into a tree, numerical constants are folded, x^2 of
+  // the energies or a parameter becomes x*x, and the +/- and * chains with
+  // spectrum-valued operands are rebuilt with all their scalar operands
+  // combined first, so that each chain does one multiplication or addition
+  // per spectrum.  Scalar factors common to all the terms of a sum are taken
+  // out of it, or a scalar factor of a sum is distributed over its terms,
+  // whichever costs fewer spectrum operations.  The rewritten program
+  // replaces the original one only if it is cheaper.  Sums and products are
+  // reassociated, so results agree with those of the original program to
+  // rounding only.  Divisions and the operands of function calls are kept
+  // as they are, as is the order of the model and table calls.
+
+  struct ExprNode
+  {
+    ExprNode () : type(MdefExpression::NUM), opName(), value(0.0), param(0), args(),
+		  isScalar(true), isCall(false) {}
+    MdefExpression::ElementType type;
+    string opName;
+    Real value;
+    size_t param;
+    std::vector<size_t> args;
+    bool isScalar;
+    bool isCall;
+  };
+
+  class PostfixOptimiser
+  {
+  public:
+    explicit PostfixOptimiser (const MdefExpression::MathOpContainer& operatorsMap)
+      : m_operatorsMap(operatorsMap), m_nodes() {}
+
+    // Rewrite the program in place, returning true if it was changed.
+    bool optimise (std::vector<MdefExpression::ElementType>& postfixElems,
+		   std::vector<string>& operators, std::vector<Real>& numericalConsts,
+		   std::vector<size_t>& paramsToGet)
+    {
+      size_t root(0);
+      if ( !read(postfixElems, operators, numericalConsts, paramsToGet, root) ) return false;
+      const size_t oldCost = cost(root);
+      const size_t oldSize = size(root);
+      const size_t newRoot = optimiseNode(root);
+      const size_t newCost = cost(newRoot);
+      if ( newCost > oldCost || (newCost == oldCost && size(newRoot) >= oldSize) ) return false;
+      std::vector<MdefExpression::ElementType> newElems;
+      std::vector<string> newOperators;
+      std::vector<Real> newConsts;
+      std::vector<size_t> newParams;
+      emit(newRoot, newElems, newOperators, newConsts, newParams);
+      postfixElems.swap(newElems);
+      operators.swap(newOperators);
+      numericalConsts.swap(newConsts);
+      paramsToGet.swap(newParams);
+      return true;
+    }
+
+  private:
+    typedef std::pair<bool, size_t> Term;   // negated, node
+
+    bool read (const std::vector<MdefExpression::ElementType>& postfixElems,
+	       const std::vector<string>& operators, const std::vector<Real>& numericalConsts,
+	       const std::vector<size_t>& paramsToGet, size_t& root)
+    {
+      std::vector<size_t> operands;
+      size_t numPos(0), parPos(0), opPos(0);
+      for (size_t iElem=0; iElem<postfixElems.size(); ++iElem) {
+	ExprNode node;
+	node.type = postfixElems[iElem];
+	size_t nArgs(0);
+	switch (node.type) {
+	case MdefExpression::ENG:
+	case MdefExpression::ENGC:
+	  node.isScalar = false;
+	  break;
+	case MdefExpression::NUM:
+	  if ( numPos >= numericalConsts.size() ) return false;
+	  node.value = numericalConsts[numPos++];
+	  break;
+	case MdefExpression::PARAM:
+	  if ( parPos >= paramsToGet.size() ) return false;
+	  node.param = paramsToGet[parPos++];
+	  break;
+	case MdefExpression::OPER:
+	  {
+	    if ( opPos >= operators.size() ) return false;
+	    node.opName = operators[opPos++];
+	    MdefExpression::MathOpContainer::const_iterator itFunc = m_operatorsMap.find(node.opName);
+	    if ( itFunc != m_operatorsMap.end() ) {
+	      nArgs = itFunc->second->nArgs();
+	      node.isScalar = !isReduction(node.opName);
+	    } else if ( XSModelFunction::hasFunctionPointer(node.opName) ) {
+	      const ComponentInfo compInfo = XSModelFunction::compMatchName(node.opName);
+	      if ( compInfo.type() == string("con") ) return false;
+	      nArgs = XSModelFunction::numberParameters(node.opName);
+	      node.isScalar = false;
+	      node.isCall = true;
+	    } else if ( node.opName.substr(0,6) == "atable" || node.opName.substr(0,6) == "mtable" ||
+			node.opName.substr(0,6) == "etable" ) {
+	      int numberParams, numberSpectra, numberEnergies;
+	      bool isAdditive, isRedshift, isEscale;
+	      std::lock_guard<std::mutex> tableLock(tableMutex());
+	      if ( FunctionUtility::tableInfo(node.opName.substr(7,node.opName.length()-8),
+					      numberParams, numberSpectra, numberEnergies,
+					      isAdditive, isRedshift, isEscale) != 0 ) return false;
+	      nArgs = numberParams + (isRedshift ? 1 : 0) + (isEscale ? 1 : 0);
+	      node.isScalar = false;
+	      node.isCall = true;
+	    } else {
+	      // convolutions and unknown models
+	      return false;
+	    }
+	  }
+	  break;
+	default:
+	  return false;
+	}
+	if ( operands.size() < nArgs ) return false;
+	node.args.assign(operands.end()-nArgs, operands.end());
+	operands.resize(operands.size()-nArgs);
+	for (size_t i=0; i<node.args.size() && !node.isCall; ++i)
+	  if ( !m_nodes[node.args[i]].isScalar ) node.isScalar = false;
+	operands.push_back(add(node));
+      }
+      if ( operands.size() != 1 ) return false;
+      root = operands[0];
+      return true;
+    }
+
+    size_t add (const ExprNode& node)
+    {
+      m_nodes.push_back(node);
+      return m_nodes.size() - 1;
+    }
+
+    size_t number (Real value)
+    {
+      ExprNode node;
+      node.value = value;
+      return add(node);
+    }
+
+    size_t operation (const string& opName, size_t first, size_t second)
+    {
+      ExprNode node;
+      node.type = MdefExpression::OPER;
+      node.opName = opName;
+      node.args.push_back(first);
+      node.args.push_back(second);
+      node.isScalar = m_nodes[first].isScalar && m_nodes[second].isScalar;
+      return add(node);
+    }
+
+    size_t negation (size_t operand)
+    {
+      ExprNode node;
+      node.type = MdefExpression::OPER;
+      node.opName = "@";
+      node.args.push_back(operand);
+      node.isScalar = m_nodes[operand].isScalar;
+      return add(node);
+    }
+
+    bool isOperation (size_t iNode, const char* opName) const
+    {
+      const ExprNode& node = m_nodes[iNode];
+      return node.type == MdefExpression::OPER && node.opName == opName;
+    }
+
+    bool isSum (size_t iNode) const
+    {
+      return isOperation(iNode, "+") || isOperation(iNode, "-") || isOperation(iNode, "@");
+    }
+
+    // Operations on spectra, weighted by their rough cost relative to an
+    // addition, plus a copy for each energy or scalar operand pushed as a
+    // spectrum.  Scalar subtrees are evaluated once, as scalars.
+    size_t cost (size_t iNode) const
+    {
+      const ExprNode& node = m_nodes[iNode];
+      if ( node.isScalar ) return 0;
+      if ( node.type != MdefExpression::OPER ) return 1;
+      size_t total(0);
+      for (size_t i=0; i<node.args.size(); ++i)
+	total += m_nodes[node.args[i]].isScalar ? (node.isCall ? 0 : 1) : cost(node.args[i]);
+      if ( node.isCall ) return total;
+      const string& opName = node.opName;
+      const bool isArithmetic = opName == "+" || opName == "-" || opName == "*" || opName == "/"
+	|| opName == "@";
+      return total + (isArithmetic ? 1 : 8);
+    }
+
+    size_t size (size_t iNode) const
+    {
+      size_t total(1);
+      for (size_t i=0; i<m_nodes[iNode].args.size(); ++i) total += size(m_nodes[iNode].args[i]);
+      return total;
+    }
+
+    // Identifies equal subtrees.
+    string signature (size_t iNode) const
+    {
+      const ExprNode& node = m_nodes[iNode];
+      std::ostringstream oss;
+      oss.precision(17);
+      switch (node.type) {
+      case MdefExpression::NUM:
+	oss << "N" << node.value;
+	break;
+      case MdefExpression::PARAM:
+	oss << "P" << node.param;
+	break;
+      case MdefExpression::OPER:
+	oss << node.opName << "(";
+	for (size_t i=0; i<node.args.size(); ++i) oss << signature(node.args[i]) << ",";
+	oss << ")";
+	break;
+      default:
+	oss << "E";
+	break;
+      }
+      return oss.str();
+    }
+
+    size_t optimiseNode (size_t iNode)
+    {
+      if ( m_nodes[iNode].type != MdefExpression::OPER ) return iNode;
+      ExprNode node(m_nodes[iNode]);
+      bool isConstant(!node.isCall);
+      for (size_t i=0; i<node.args.size(); ++i) {
+	node.args[i] = optimiseNode(node.args[i]);
+	if ( m_nodes[node.args[i]].type != MdefExpression::NUM ) isConstant = false;
+      }
+      if ( node.isCall ) return add(node);
+
+      // constant folding, with the operator's own semantics
+      if ( isConstant && node.isScalar ) {
+	const Numerics::MathOperator& mathFunc = *(m_operatorsMap.find(node.opName)->second);
+	RealArray value(m_nodes[node.args[0]].value, 1);
+	if ( node.args.size() == 1 )
+	  mathFunc(value);
+	else
+	  mathFunc(value, RealArray(m_nodes[node.args[1]].value, 1));
+	return number(value[0]);
+      }
+      // x^2 as x*x for the energies and parameters, which can be pushed twice
+      if ( node.opName == "^" && m_nodes[node.args[1]].type == MdefExpression::NUM
+	   && m_nodes[node.args[1]].value == 2.0 ) {
+	const ExprNode& base = m_nodes[node.args[0]];
+	if ( base.type == MdefExpression::ENG || base.type == MdefExpression::ENGC
+	     || base.type == MdefExpression::PARAM )
+	  return operation("*", node.args[0], add(base));
+      }
+      const size_t iNew = add(node);
+      if ( m_nodes[iNew].isScalar ) return iNew;
+      if ( node.opName == "*" ) {
+	std::vector<size_t> scalars, spectra;
+	collectFactors(iNew, scalars, spectra);
+	return product(scalars, spectra, true);
+      }
+      if ( isSum(iNew) ) {
+	std::vector<Term> terms;
+	collectTerms(iNew, false, terms);
+	return sum(terms, true);
+      }
+      return iNew;
+    }
+
+    void collectFactors (size_t iNode, std::vector<size_t>& scalars, std::vector<size_t>& spectra) const
+    {
+      if ( isOperation(iNode, "*") ) {
+	collectFactors(m_nodes[iNode].args[0], scalars, spectra);
+	collectFactors(m_nodes[iNode].args[1], scalars, spectra);
+      } else if ( m_nodes[iNode].isScalar ) {
+	scalars.push_back(iNode);
+      } else {
+	spectra.push_back(iNode);
+      }
+    }
+
+    void collectTerms (size_t iNode, bool isNegated, std::vector<Term>& terms) const
+    {
+      const ExprNode& node = m_nodes[iNode];
+      if ( isOperation(iNode, "+") || isOperation(iNode, "-") ) {
+	collectTerms(node.args[0], isNegated, terms);
+	collectTerms(node.args[1], node.opName == "-" ? !isNegated : isNegated, terms);
+      } else if ( isOperation(iNode, "@") ) {
+	collectTerms(node.args[0], !isNegated, terms);
+      } else {
+	terms.push_back(Term(isNegated, iNode));
+      }
+    }
+
+    // Product of scalar factors with the numerical ones combined, or -1 if
+    // it is 1.
+    long scalarProduct (const std::vector<size_t>& scalars)
+    {
+      long result(-1);
+      Real constant(1.0);
+      bool hasConstant(false);
+      for (size_t i=0; i<scalars.size(); ++i) {
+	if ( m_nodes[scalars[i]].type == MdefExpression::NUM ) {
+	  constant *= m_nodes[scalars[i]].value;
+	  hasConstant = true;
+	} else {
+	  result = ( result < 0 ) ? static_cast<long>(scalars[i])
+	    : static_cast<long>(operation("*", result, scalars[i]));
+	}
+      }
+      if ( hasConstant && constant != 1.0 )
+	result = ( result < 0 ) ? static_cast<long>(number(constant))
+	  : static_cast<long>(operation("*", number(constant), result));
+      return result;
+    }
+
+    size_t product (const std::vector<size_t>& scalars, const std::vector<size_t>& spectra,
+		    bool isDistributable)
+    {
+      const long scalar = scalarProduct(scalars);
+      size_t result = spectra[0];
+      for (size_t i=1; i<spectra.size(); ++i) result = operation("*", result, spectra[i]);
+      if ( scalar >= 0 ) result = operation("*", scalar, result);
+      if ( !isDistributable || scalar < 0 ) return result;
+
+      // the scalar factor distributed over the terms of a sum
+      for (size_t iSum=0; iSum<spectra.size(); ++iSum) {
+	if ( !isSum(spectra[iSum]) ) continue;
+	std::vector<Term> terms;
+	collectTerms(spectra[iSum], false, terms);
+	for (size_t i=0; i<terms.size(); ++i) {
+	  std::vector<size_t> termScalars(scalars), termSpectra;
+	  collectFactors(terms[i].second, termScalars, termSpectra);
+	  if ( termSpectra.empty() ) {
+	    const long scalar = scalarProduct(termScalars);
+	    terms[i].second = ( scalar < 0 ) ? number(1.0) : static_cast<size_t>(scalar);
+	  } else {
+	    terms[i].second = product(termScalars, termSpectra, false);
+	  }
+	}
+	size_t candidate = sum(terms, false);
+	for (size_t i=0; i<spectra.size(); ++i)
+	  if ( i != iSum ) candidate = operation("*", candidate, spectra[i]);
+	if ( cost(candidate) < cost(result) ) result = candidate;
+      }
+      return result;
+    }
+
+    size_t sum (const std::vector<Term>& terms, bool isFactorable)
+    {
+      // the scalar terms first, with the numerical ones combined
+      long scalar(-1);
+      bool isScalarNegated(false);
+      Real constant(0.0);
+      bool hasConstant(false);
+      std::vector<Term> spectra;
+      for (size_t i=0; i<terms.size(); ++i) {
+	const size_t iTerm = terms[i].second;
+	if ( !m_nodes[iTerm].isScalar ) {
+	  spectra.push_back(terms[i]);
+	} else if ( m_nodes[iTerm].type == MdefExpression::NUM ) {
+	  constant += terms[i].first ? -m_nodes[iTerm].value : m_nodes[iTerm].value;
+	  hasConstant = true;
+	} else if ( scalar < 0 ) {
+	  scalar = iTerm;
+	  isScalarNegated = terms[i].first;
+	} else {
+	  scalar = operation(terms[i].first == isScalarNegated ? "+" : "-", scalar, iTerm);
+	}
+      }
+      if ( hasConstant && constant != 0.0 ) {
+	if ( scalar < 0 ) {
+	  scalar = number(constant);
+	  isScalarNegated = false;
+	} else {
+	  scalar = operation(isScalarNegated ? "-" : "+", scalar, number(constant));
+	}
+      }
+
+      // then the spectra, the positive ones first
+      std::stable_partition(spectra.begin(), spectra.end(), isPositive);
+      size_t result(0);
+      size_t iFirst(1);
+      if ( !spectra[0].first ) {
+	result = spectra[0].second;
+      } else if ( scalar >= 0 && !isScalarNegated ) {
+	result = scalar;
+	scalar = -1;
+	iFirst = 0;
+      } else {
+	result = negation(spectra[0].second);
+      }
+      for (size_t i=iFirst; i<spectra.size(); ++i)
+	result = operation(spectra[i].first ? "-" : "+", result, spectra[i].second);
+      if ( scalar >= 0 ) result = operation(isScalarNegated ? "-" : "+", result, scalar);
+      if ( !isFactorable || spectra.size() < 2 ) return result;
+
+      // scalar factors common to all the spectra taken out of the sum
+      std::vector<std::vector<size_t> > scalars(spectra.size()), factors(spectra.size());
+      for (size_t i=0; i<spectra.size(); ++i)
+	collectFactors(spectra[i].second, scalars[i], factors[i]);
+      std::vector<size_t> common;
+      for (size_t iFactor=0; iFactor<scalars[0].size(); ++iFactor) {
+	const string key = signature(scalars[0][iFactor]);
+	std::vector<size_t> found(spectra.size(), 0);
+	bool isCommon(true);
+	for (size_t i=1; i<spectra.size() && isCommon; ++i) {
+	  isCommon = false;
+	  for (size_t j=0; j<scalars[i].size() && !isCommon; ++j) {
+	    if ( signature(scalars[i][j]) == key ) {
+	      found[i] = j;
+	      isCommon = true;
+	    }
+	  }
+	}
+	if ( !isCommon ) continue;
+	common.push_back(scalars[0][iFactor]);
+	scalars[0].erase(scalars[0].begin()+iFactor);
+	--iFactor;
+	for (size_t i=1; i<spectra.size(); ++i) scalars[i].erase(scalars[i].begin()+found[i]);
+      }
+      if ( common.empty() ) return result;
+      std::vector<Term> reduced(spectra);
+      for (size_t i=0; i<spectra.size(); ++i)
+	reduced[i].second = product(scalars[i], factors[i], false);
+      size_t candidate = product(common, std::vector<size_t>(1, sum(reduced, false)), false);
+      if ( scalar >= 0 ) candidate = operation(isScalarNegated ? "-" : "+", candidate, scalar);
+      return ( cost(candidate) < cost(result) ) ? candidate : result;
+    }
+
+    static bool isPositive (const Term& term)
+    {
+      return !term.first;
+    }
+
+    void emit (size_t iNode, std::vector<MdefExpression::ElementType>& postfixElems,
+	       std::vector<string>& operators, std::vector<Real>& numericalConsts,
+	       std::vector<size_t>& paramsToGet) const
+    {
+      const ExprNode& node = m_nodes[iNode];
+      for (size_t i=0; i<node.args.size(); ++i)
+	emit(node.args[i], postfixElems, operators, numericalConsts, paramsToGet);
+      postfixElems.push_back(node.type);
+      if ( node.type == MdefExpression::NUM ) numericalConsts.push_back(node.value);
+      if ( node.type == MdefExpression::PARAM ) paramsToGet.push_back(node.param);
+      if ( node.type == MdefExpression::OPER ) operators.push_back(node.opName);
+    }
+
+    const MdefExpression::MathOpContainer& m_operatorsMap;
+    std::vector<ExprNode> m_nodes;
+  };
+
+  // Checking the optimiser.  Whenever the optimiser rewrites an expression
+  // the program as written is kept, by expression text, with the rewritten
+  // one.  While 'xset MDEF_OPTIMISE check' is set, an expression running a
+  // rewritten program is evaluated a second time as written (mdefine'd
+  // models it calls included), and the largest deviation between the two,
+  // relative to the largest absolute value of the result, is reported at
+  // chatter 10 for each expression when it grows and kept for
+  // MdefEvaluation::optimiserDeviation().  The rewritten result is returned.
+  struct PostfixProgram
+  {
+    std::vector<MdefExpression::ElementType> postfixElems;
+    std::vector<string> operators;
+    std::vector<Real> numericalConsts;
+    std::vector<size_t> paramsToGet;
+  };
+
+  struct RewrittenProgram
+  {
+    PostfixProgram rewritten;
+    PostfixProgram written;
+  };
+
+  std::mutex& rewrittenProgramsMutex ()
+  {
+    static std::mutex s_rewrittenProgramsMutex;
+    return s_rewrittenProgramsMutex;
+  }
+
+  std::map<string,RewrittenProgram>& rewrittenPrograms ()
+  {
+    static std::map<string,RewrittenProgram> s_programs;
+    return s_programs;
+  }
+
+  void keepWrittenProgram (const string& exprString, const PostfixProgram& written,
+			   const PostfixProgram& rewritten)
+  {
+    std::lock_guard<std::mutex> lock(rewrittenProgramsMutex());
+    RewrittenProgram& program = rewrittenPrograms()[exprString];
+    program.rewritten = rewritten;
+    program.written = written;
+  }
+
+  // The program as written if the given one is its rewritten form.
+  bool writtenProgram (const string& exprString,
+		       const std::vector<MdefExpression::ElementType>& postfixElems,
+		       const std::vector<string>& operators, PostfixProgram& written)
+  {
+    std::lock_guard<std::mutex> lock(rewrittenProgramsMutex());
+    std::map<string,RewrittenProgram>::const_iterator itProgram = rewrittenPrograms().find(exprString);
+    if ( itProgram == rewrittenPrograms().end()
+	 || itProgram->second.rewritten.postfixElems != postfixElems
+	 || itProgram->second.rewritten.operators != operators ) return false;
+    written = itProgram->second.written;
+    return true;
+  }
+
+  bool isOptimiserChecked ()
+  {
+    const string value = FunctionUtility::getModelString("MDEF_OPTIMISE");
+    return value != FunctionUtility::NOT_A_KEY() && XSutility::lowerCase(value) == "check";
+  }
+
+  // The pass of a check the calling thread is in.  In the written pass
+  // mdefine'd models are evaluated as written and their calls not shared.
+  enum OptimiserPass {NO_CHECK, REWRITTEN_PASS, WRITTEN_PASS};
+
+  OptimiserPass& threadOptimiserPass ()
+  {
+    static thread_local OptimiserPass t_pass(NO_CHECK);
+    return t_pass;
+  }
+
+  // Sets the pass of the calling thread, and lets the evaluations of the
+  // check be adaptive if the one checked would have been, until destroyed.
+  class OptimiserCheck
+  {
+  public:
+    OptimiserCheck ()
+      : m_savedPass(threadOptimiserPass()), m_savedDepth(threadAdaptiveDepth())
+    {
+      threadOptimiserPass() = REWRITTEN_PASS;
+      if ( threadEvaluationDepth() == m_savedDepth ) threadAdaptiveDepth() = m_savedDepth + 1;
+    }
+
+    ~OptimiserCheck ()
+    {
+      threadOptimiserPass() = m_savedPass;
+      threadAdaptiveDepth() = m_savedDepth;
+    }
+
+    void beginWrittenPass () { threadOptimiserPass() = WRITTEN_PASS; }
+
+  private:
+    OptimiserCheck (const OptimiserCheck&);
+    OptimiserCheck& operator= (const OptimiserCheck&);
+
+    const OptimiserPass m_savedPass;
+    const int m_savedDepth;
+  };
+
+  class OptimiserDeviations
+  {
+  public:
+    static OptimiserDeviations& instance ()
+    {
+      static OptimiserDeviations s_deviations;
+      return s_deviations;
+    }
+
+    void record (const string& exprString, const RealArray& rewritten, const RealArray& written)
+    {
+      Real scale(0.0);
+      Real deviation(0.0);
+      for (size_t i=0; i<written.size(); ++i) scale = std::max(scale, std::fabs(written[i]));
+      if ( rewritten.size() != written.size() ) {
+	deviation = std::numeric_limits<Real>::infinity();
+      } else {
+	for (size_t i=0; i<written.size(); ++i)
+	  deviation = std::max(deviation, std::fabs(rewritten[i] - written[i]));
+	if ( scale > 0.0 ) deviation /= scale;
+      }
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_largest = std::max(m_largest, deviation);
+      std::map<string,Real>::iterator itLargest = m_byExpression.find(exprString);
+      if ( itLargest != m_byExpression.end() && deviation <= itLargest->second ) return;
+      m_byExpression[exprString] = deviation;
+      std::ostringstream oss;
+      oss << "Optimised " << exprString << " deviates by " << deviation
+	  << " of the largest value from the expression as written" << std::endl;
+      FunctionUtility::xsWrite(oss.str(), 10);
+    }
+
+    Real largest (bool isReset)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      const Real largest = m_largest;
+      if ( isReset ) {
+	m_largest = 0.0;
+	m_byExpression.clear();
+      }
+      return largest;
+    }
+
+  private:
+    OptimiserDeviations () : m_mutex(), m_largest(0.0), m_byExpression() {}
+
+    std::mutex m_mutex;
+    Real m_largest;
+    std::map<string,Real> m_byExpression;
+  };
+
+
+}
+
 // Access to the list of models
 
 // Class MdefExpression::MdefExpressionError 
@@ -34,6 +3276,21 @@ const string MdefExpression::s_allValidChars = string("_#,.+-/*^(){}:abcdefghijk
 MdefExpression::MathOpContainer MdefExpression::s_operatorsMap;
 std::map<string,int> MdefExpression::s_precedenceMap;
 
+namespace {
+
+  // Builds the operator tables at startup, before any thread can create an
+  // expression.  Defined after the tables, so they are initialised first.
+  struct OperatorTables
+  {
+    OperatorTables ()
+    {
+      MdefExpression expression(std::make_pair(0.0,0.0), "add", "");
+    }
+  };
+  const OperatorTables s_operatorTables;
+
+}
+
 MdefExpression::MdefExpression(const MdefExpression &right)
    : AbstractExpression(right),
      m_distinctParNames(right.m_distinctParNames),
@@ -50,6 +3307,9 @@ MdefExpression::MdefExpression(const MdefExpression &right)
      m_mdefName(right.m_mdefName),
      m_callsSpecDependentFunctions(right.m_callsSpecDependentFunctions)
 {
+   addMdefInstance(m_mdefName);
+   std::lock_guard<std::mutex> lock(operatorsMutex());
+   ++nExpressions();
    if (s_operatorsMap.empty())
       buildOperatorsMap();
 }
@@ -70,6 +3330,12 @@ MdefExpression::MdefExpression (std::pair<Real,Real> eLimits, const string& comp
      m_mdefName(mdefName),
      m_callsSpecDependentFunctions(false)
 {
+   // The operator tables are built when the library is loaded (see below),
+   // and again only if clearOperatorsMap() freed them with no expression
+   // left.
+   addMdefInstance(m_mdefName);
+   std::lock_guard<std::mutex> lock(operatorsMutex());
+   ++nExpressions();
    if (s_operatorsMap.empty())
       buildOperatorsMap();
 }
@@ -77,6 +3343,14 @@ MdefExpression::MdefExpression (std::pair<Real,Real> eLimits, const string& comp
 
 MdefExpression::~MdefExpression()
 {
+   {
+      std::lock_guard<std::mutex> lock(operatorsMutex());
+      --nExpressions();
+   }
+   forgetIncrementalState(this);
+   // Copies and temporaries come and go, e.g. in operator= and clone(), so
+   // only deleting the model invalidates the kept results.
+   removeMdefInstance(m_mdefName);
 }
 
 
@@ -97,6 +3371,36 @@ void MdefExpression::init (const string& exprString, bool removeWhitespace)
    convertForTableModels();
    convertToInfix();
    convertToPostfix();
+   if (isSwitchedOn("MDEF_OPTIMISE"))
+   {
+      const PostfixProgram written = {m_postfixElems, m_operators, m_numericalConsts, m_paramsToGet};
+      PostfixOptimiser optimiser(s_operatorsMap);
+      if (optimiser.optimise(m_postfixElems, m_operators, m_numericalConsts, m_paramsToGet))
+      {
+         const PostfixProgram rewritten = {m_postfixElems, m_operators, m_numericalConsts,
+                                           m_paramsToGet};
+         keepWrittenProgram(this->exprString(), written, rewritten);
+         std::ostringstream oss;
+         oss << "Optimised postfix elements: ";
+         for (size_t i=0; i<m_postfixElems.size(); ++i)
+            oss << MdefElementString[m_postfixElems[i]] << " ";
+         oss << std::endl << "Optimised postfix operators: ";
+         for (size_t i=0; i<m_operators.size(); ++i)
+            oss << m_operators[i] << " ";
+         oss << std::endl;
+         FunctionUtility::xsWrite(oss.str(), 40);
+      }
+   }
+   forgetIncrementalState(this);
+   if (!m_mdefName.empty())
+   {
+      std::lock_guard<std::mutex> lock(definitionsMutex());
+      MdefDefinition& definition = mdefDefinitions()[m_mdefName];
+      definition.compType = m_compType;
+      definition.exprString = this->exprString();
+      definition.operators = m_operators;
+   }
+   ++mdefineGeneration();
 }
 
 void MdefExpression::Swap (MdefExpression& right)
@@ -130,7 +3434,7 @@ const string& MdefExpression::allValidChars () const
 void MdefExpression::buildOperatorsMap ()
 {
    using namespace Numerics;
-   clearOperatorsMap();
+   // Called with operatorsMutex() held and the tables empty.
    // s_operatorsMap will own the memory of these objects throughout
    // the program's lifetime.
    s_operatorsMap["+"] = new PlusOp();
@@ -192,6 +3496,10 @@ void MdefExpression::buildOperatorsMap ()
 
 void MdefExpression::clearOperatorsMap ()
 {
+   // Other threads may be evaluating expressions with these operators.
+   std::lock_guard<std::mutex> lock(operatorsMutex());
+   if (nExpressions() > 0)
+      return;
    MathOpContainer::iterator itOp = s_operatorsMap.begin();
    MathOpContainer::iterator itOpEnd = s_operatorsMap.end();
    while (itOp != itOpEnd)   
@@ -703,6 +4011,7 @@ void MdefExpression::verifyInfix () const
 	   int numberParams, numberSpectra, numberEnergies;
 	   bool isAdditive, isRedshift, isEscale;
 	   string filename = opName.substr(7,opName.length()-8);
+	   std::lock_guard<std::mutex> tableLock(tableMutex());
 	   int status = FunctionUtility::tableInfo(filename, numberParams, numberSpectra,
 						   numberEnergies, isAdditive, isRedshift,
 						   isEscale);
@@ -832,6 +4141,39 @@ void MdefExpression::evaluate (const RealArray& energies, const RealArray& param
 
   string initString = inInitString;
   if (energies.size() < 2) throw MdefExpressionError("Energy array must be at least size 2");
+  const CallRecord callRecord(*this, m_compType, energies, parameters, spectrumNumber, initString);
+  const CoarseEvaluation coarseEvaluation;
+  const CachedCall cachedCall(*this, m_compType, m_operators, energies, parameters, spectrumNumber,
+			      initString, flux);
+  if ( cachedCall.isFound() ) return;
+  const bool isShared = isSwitchedOn("MDEF_SHARE");
+  if ( isShared && threadEvaluationDepth() == 1 ) CallMemo::instance().beginEvaluation(this, spectrumNumber);
+
+  // 'xset MDEF_OPTIMISE check': a rewritten expression is evaluated as
+  // written too (see OptimiserCheck)
+  const OptimiserPass pass = threadOptimiserPass();
+  PostfixProgram written;
+  if ( pass != REWRITTEN_PASS && (pass == WRITTEN_PASS || isOptimiserChecked())
+       && writtenProgram(exprString(), m_postfixElems, m_operators, written) ) {
+    MdefExpression asWritten(*this);
+    asWritten.m_postfixElems.swap(written.postfixElems);
+    asWritten.m_operators.swap(written.operators);
+    asWritten.m_numericalConsts.swap(written.numericalConsts);
+    asWritten.m_paramsToGet.swap(written.paramsToGet);
+    if ( pass == WRITTEN_PASS ) {
+      asWritten.evaluate(energies, parameters, spectrumNumber, flux, fluxErr, initString);
+      return;
+    }
+    RealArray writtenFlux, writtenFluxErr;
+    {
+      OptimiserCheck check;
+      evaluate(energies, parameters, spectrumNumber, flux, fluxErr, initString);
+      check.beginWrittenPass();
+      asWritten.evaluate(energies, parameters, spectrumNumber, writtenFlux, writtenFluxErr, initString);
+    }
+    OptimiserDeviations::instance().record(exprString(), flux, writtenFlux);
+    return;
+  }
   if (m_compType == string("con")) {
      convolveEvaluate(energies, parameters, spectrumNumber, flux, fluxErr, initString);
      return;
@@ -839,6 +4181,55 @@ void MdefExpression::evaluate (const RealArray& energies, const RealArray& param
 
   const size_t nBins = energies.size() - 1;
 
+  // Masked evaluation: compute the bins covering the active ones (convolutions
+  // need all bins) and zero-fill the rest.
+  ActiveMask active;
+  if ( activeBins(energies, active) && !hasConvolution(m_operators) ) {
+    const size_t nActive = active.endBin - active.firstBin;
+    flux.resize(nBins);
+    flux = 0.0;
+    if ( nActive == 0 ) return;
+    RealArray activeEnergies(energies[std::slice(active.firstBin, nActive+1, 1)]);
+    RealArray activeFlux;
+    {
+      // nested evaluations get the active energies only
+      ActiveMask& threadMask = threadActiveMask();
+      const ActiveMask savedMask(threadMask);
+      ActiveMask band;
+      band.isSet = true;
+      band.endBin = nActive;
+      threadMask = band;
+      int& adaptiveDepth = threadAdaptiveDepth();
+      const int savedDepth = adaptiveDepth;
+      if ( threadEvaluationDepth() == adaptiveDepth ) adaptiveDepth = threadEvaluationDepth() + 1;
+      try {
+	evaluate(activeEnergies, parameters, spectrumNumber, activeFlux, fluxErr, initString);
+      } catch (...) {
+	threadMask = savedMask;
+	adaptiveDepth = savedDepth;
+	throw;
+      }
+      threadMask = savedMask;
+      adaptiveDepth = savedDepth;
+    }
+    flux[std::slice(active.firstBin, nActive, 1)] = activeFlux;
+    if ( !active.isActive.empty() ) {
+      for (size_t i=active.firstBin; i<active.endBin; ++i)
+	if ( !active.isActive[i] ) flux[i] = 0.0;
+    }
+    return;
+  }
+
+  Real adaptiveTolerance;
+  size_t adaptiveStride;
+  if ( threadEvaluationDepth() == threadAdaptiveDepth() && !isTableStubbed()
+       && adaptiveSetting(adaptiveTolerance, adaptiveStride) && nBins >= 4*adaptiveStride
+       && !hasConvolution(m_operators) ) {
+    adaptiveEvaluate(*this, m_compType == string("add"), energies, parameters, spectrumNumber, flux,
+		     fluxErr, initString, adaptiveTolerance, adaptiveStride);
+    return;
+  }
+
   RealArray avgEngs(nBins);
   RealArray binWidths(nBins);
   for (size_t i=0; i<nBins; ++i) {
@@ -848,8 +4239,7 @@ void MdefExpression::evaluate (const RealArray& energies, const RealArray& param
 
   // A boolean flag is coupled to the resultsStack arrays to mark whether
   // or not the array includes a factor of 1/binWidth, arising from XS add
-  // components.  The convolution operator needs to know about this.
-  typedef pair<RealArray, bool> MarkedArray;
+  // components (MarkedArray).  The convolution operator needs to know about this.
   stack<MarkedArray> resultsStack;
 
   stack<RealArray> xsConParVals;
@@ -858,10 +4248,188 @@ void MdefExpression::evaluate (const RealArray& energies, const RealArray& param
   int parPos = 0;
   int opPos = 0;
 
+  // Key of the energies for shared calls, computed at the first one.
+  unsigned long long gridKey(0);
+  bool hasGridKey(false);
+  auto sharedKey = [&](const string& opName, const RealArray& params, CacheKey& key) {
+    if ( !hasGridKey ) {
+      gridKey = gridFingerprint(energies);
+      hasGridKey = true;
+    }
+    const int level = threadCoarseLevel();
+    sharedCallKey(level > 0 ? coarseTableName(opName, level) : opName, params, gridKey,
+		  spectrumNumber, initString, key);
+  };
+
+  // For incremental evaluation reuseUpTo[i] is the last element of the
+  // largest unchanged subtree starting at element i, or -1.  The analysis
+  // also finds the scalar subtrees.
+  const size_t nElems = m_postfixElems.size();
+  std::shared_ptr<IncrementalState> incState;
+  SpectrumCache* cache(0);
+  std::unique_lock<std::mutex> cacheLock;
+  std::vector<long> reuseUpTo;
+  BasisCache* basis(0);
+  std::unique_lock<std::mutex> basisLock;
+  const std::vector<long>* scalarEnd(0);
+  const std::vector<std::vector<ZeroFactor> >* zeroFactors(0);
+  const bool isIncremental = isSwitchedOn("MDEF_INCREMENTAL");
+  const bool isFactorised = isSwitchedOn("MDEF_LINEAR");
+  {
+    incState = incrementalState(this, exprString());
+    std::lock_guard<std::mutex> stateLock(incState->mutex);
+    if ( !incState->isAnalysed ) {
+      incState->isSupported = analyseIncremental(*incState, m_postfixElems, m_operators,
+						 m_paramsToGet, s_operatorsMap);
+      incState->isLinear = incState->isSupported
+	&& analyseLinear(*incState, m_postfixElems, m_operators, m_paramsToGet, s_operatorsMap);
+      if ( incState->isSupported ) {
+	analyseScalars(*incState, m_postfixElems, m_operators, s_operatorsMap);
+	analyseZeroFactors(*incState, m_postfixElems, m_operators);
+      }
+      incState->isAnalysed = true;
+    }
+    if ( incState->isSupported ) scalarEnd = &incState->scalarEnd;
+    if ( incState->isSupported && isSwitchedOn("MDEF_SKIPZERO") ) zeroFactors = &incState->zeroFactors;
+    if ( isIncremental && incState->isSupported ) {
+      std::unique_ptr<SpectrumCache>& entry = incState->spectra[spectrumNumber];
+      if ( !entry ) entry.reset(new SpectrumCache);
+      cache = entry.get();
+    }
+    const unsigned long generation = mdefineGeneration();
+    if ( isFactorised && incState->isLinear && incState->settingsGeneration != generation ) {
+      incState->settingsGeneration = generation;
+      incState->dependsOnSettings = dependsOnSettings(m_operators, s_operatorsMap);
+    }
+    if ( isFactorised && incState->isLinear && !incState->dependsOnSettings ) {
+      std::unique_ptr<BasisCache>& entry = incState->bases[spectrumNumber];
+      if ( !entry ) entry.reset(new BasisCache);
+      basis = entry.get();
+    }
+  }
+  if ( basis ) {
+    // Only the linear parameters changed: recombine the basis spectra.
+    basisLock = std::unique_lock<std::mutex>(basis->mutex);
+    if ( basis->isVaried.size() != parameters.size()
+	 || basis->parameters.size() != parameters.size() ) {
+      basis->isVaried.assign(parameters.size(), false);
+    } else {
+      for (size_t i=0; i<parameters.size(); ++i)
+	if ( parameters[i] != basis->parameters[i] ) basis->isVaried[i] = true;
+    }
+    const unsigned long generation = mdefineGeneration();
+    bool isBasisValid = basis->isValid && basis->generation == generation
+      && basis->initString == initString && basis->coarseLevel == threadCoarseLevel()
+      && basis->parameters.size() == parameters.size()
+      && isSameArray(basis->energies, energies);
+    const std::vector<size_t>& basisParams = incState->basisParams;
+    for (size_t i=0; i<basisParams.size() && isBasisValid; ++i)
+      isBasisValid = ( parameters[basisParams[i]] == basis->parameters[basisParams[i]] );
+    if ( isBasisValid && combineLinear(*incState, basis->spectra, parameters, m_postfixElems,
+				       m_numericalConsts, m_paramsToGet, m_operators, s_operatorsMap,
+				       flux) ) {
+      if (m_compType == string("add")) flux *= binWidths;
+      return;
+    }
+    // the basis is collected by the evaluation below
+    basis->isValid = false;
+    basis->generation = generation;
+    basis->energies.resize(energies.size());
+    basis->energies = energies;
+    basis->initString = initString;
+    basis->coarseLevel = threadCoarseLevel();
+    basis->spectra.assign(incState->basisNodes.size(), RealArray());
+  }
+  if ( cache ) {
+    cacheLock = std::unique_lock<std::mutex>(cache->mutex);
+    reuseUpTo.assign(nElems, -1);
+    if ( cache->isValid && cache->initString == initString
+	 && cache->coarseLevel == threadCoarseLevel()
+	 && cache->parameters.size() == parameters.size()
+	 && isSameArray(cache->energies, energies) ) {
+      for (size_t iElem=0; iElem<nElems; ++iElem) {
+	if ( incState->isVolatile[iElem] ) continue;
+	const std::vector<size_t>& nodeParams = incState->nodeParams[iElem];
+	bool isUnchanged(true);
+	for (size_t i=0; i<nodeParams.size() && isUnchanged; ++i)
+	  isUnchanged = ( parameters[nodeParams[i]] == cache->parameters[nodeParams[i]] );
+	if ( isUnchanged ) reuseUpTo[incState->subtreeStart[iElem]] = iElem;
+      }
+    } else {
+      cache->energies.resize(energies.size());
+      cache->energies = energies;
+      cache->initString = initString;
+      cache->coarseLevel = threadCoarseLevel();
+      cache->values.assign(nElems, MarkedArray());
+    }
+    // only a completed evaluation leaves a valid cache
+    cache->isValid = false;
+  }
+
   // m_postfixElems will contain the following enum values:
   //    ENG, NUM, PARAM, OPER
-  for (auto& curType : m_postfixElems) {
+  for (size_t iElem=0; iElem<nElems; ++iElem) {
+
+    const long iScalarEnd = scalarEnd ? (*scalarEnd)[iElem] : -1;
+    if ( cache && reuseUpTo[iElem] >= 0 && reuseUpTo[iElem] >= iScalarEnd
+	 && cache->values[reuseUpTo[iElem]].first.size() == nBins ) {
+      const size_t iLast = reuseUpTo[iElem];
+      resultsStack.push(cache->values[iLast]);
+      if ( basis ) {
+	const std::vector<size_t>& basisNodes = incState->basisNodes;
+	for (size_t i=0; i<basisNodes.size(); ++i)
+	  if ( basisNodes[i] >= iElem && basisNodes[i] <= iLast )
+	    basis->spectra[i] = cache->values[basisNodes[i]].first;
+      }
+      numPos = incState->numBefore[iLast+1];
+      parPos = incState->parBefore[iLast+1];
+      opPos = incState->opBefore[iLast+1];
+      iElem = iLast;
+      continue;
+    }
+    if ( zeroFactors && !(*zeroFactors)[iElem].empty() ) {
+      // an operand multiplied by zero, pushed as zeros
+      const std::vector<ZeroFactor>& factors = (*zeroFactors)[iElem];
+      long iLast(-1);
+      for (size_t i=0; i<factors.size() && iLast < 0; ++i) {
+	const Real factor = scalarValue(*incState, factors[i].factorFirst, factors[i].factorLast,
+					parameters, m_postfixElems, m_numericalConsts, m_paramsToGet,
+					m_operators, s_operatorsMap);
+	if ( factor != 0.0 ) continue;
+	if ( basis && isBasisVaried(*incState, *basis, iElem, factors[i]) ) continue;
+	iLast = factors[i].operandEnd;
+	ZeroSkipCounters& counters = ZeroSkipCounters::instance();
+	++counters.nOperands;
+	counters.nCalls += factors[i].nCalls;
+      }
+      if ( iLast >= 0 ) {
+	resultsStack.push(MarkedArray(RealArray(0.0,nBins),false));
+	// the skipped nodes, and basis spectra among them, are left empty
+	if ( cache ) {
+	  for (long i=iElem; i<=iLast; ++i) cache->values[i] = MarkedArray();
+	}
+	numPos = incState->numBefore[iLast+1];
+	parPos = incState->parBefore[iLast+1];
+	opPos = incState->opBefore[iLast+1];
+	iElem = iLast;
+	continue;
+      }
+    }
+    if ( iScalarEnd >= 0 ) {
+      // a scalar subtree, evaluated once and pushed as a spectrum
+      const size_t iLast = iScalarEnd;
+      const Real value = scalarValue(*incState, iElem, iLast, parameters, m_postfixElems,
+				     m_numericalConsts, m_paramsToGet, m_operators, s_operatorsMap);
+      resultsStack.push(MarkedArray(RealArray(value,nBins),false));
+      numPos = incState->numBefore[iLast+1];
+      parPos = incState->parBefore[iLast+1];
+      opPos = incState->opBefore[iLast+1];
+      iElem = iLast;
+      if ( cache ) cache->values[iElem] = resultsStack.top();
+      continue;
+    }
 
+    const ElementType curType = m_postfixElems[iElem];
     switch (curType) {
 
     case ENG:
@@ -931,7 +4499,10 @@ void MdefExpression::evaluate (const RealArray& energies, const RealArray& param
 	  const XSCallBase& modFunc = *(xsConFunctions.top());
 	  xsConFunctions.pop();
 	  if (isDividedByBinWidth) modFlux *= binWidths;
-	  modFunc(energies, params, spectrumNumber, modFlux, modFluxErr, initString);
+	  {
+	    std::lock_guard<std::mutex> modelLock(modelMutex());
+	    modFunc(energies, params, spectrumNumber, modFlux, modFluxErr, initString);
+	  }
 	  if (isDividedByBinWidth) modFlux /= binWidths;
 	} else if ( XSModelFunction::hasFunctionPointer(opName) ) {
 	  // case that OPER is an xspec model
@@ -958,7 +4529,22 @@ void MdefExpression::evaluate (const RealArray& energies, const RealArray& param
 	    xsConFunctions.push(XSModelFunction::functionPointer(opName));
 	  } else {
 	    bool dividedByBinWidths=false;
-	    modFunc(energies, params, spectrumNumber, modFlux, modFluxErr, initString);
+	    // built-in models (and mdefine'd ones calling them) may depend on
+	    // abund, xsect, cosmo or xset strings, which the key does not hold
+	    const bool isCallShared = isShared && compInfo.isMdefineModel()
+	      && pass != WRITTEN_PASS
+	      && !dependsOnSettings(std::vector<string>(1, opName), s_operatorsMap);
+	    CacheKey callKey;
+	    if ( isCallShared ) sharedKey(opName, params, callKey);
+	    if ( !isCallShared || !CallMemo::instance().find(callKey, modFlux) ) {
+	      {
+		// mdefine'd models are evaluated by this class and need no lock
+		std::unique_lock<std::mutex> modelLock(modelMutex(), std::defer_lock);
+		if ( !compInfo.isMdefineModel() ) modelLock.lock();
+		modFunc(energies, params, spectrumNumber, modFlux, modFluxErr, initString);
+	      }
+	      if ( isCallShared ) CallMemo::instance().store(callKey, modFlux);
+	    }
 	    if ( !compInfo.isMdefineModel() ) {
 
 	      // if not an mdef model and the component type is add, con or mix then divide by the bin width
@@ -987,21 +4573,33 @@ void MdefExpression::evaluate (const RealArray& energies, const RealArray& param
 	  // special case to handle opName being a table model
 	  size_t lenString = opName.length();
 	  string filename = opName.substr(7,lenString-8);
+	  if ( threadCoarseLevel() > 0 ) {
+	    const int level = CoarseToFine::instance().tableLevel(filename, threadCoarseLevel());
+	    if ( level > 0 ) filename = coarseTableName(filename, level);
+	  }
 	  string tableType("add");
 	  if ( opName.substr(0,1) == "m" ) tableType = "mul";
 	  if ( opName.substr(0,1) == "e" ) tableType = "exp";
 	  // we need the number of parameters
 	  int numberParams, numberSpectra, numberEnergies;
-	  bool isAdditive, isRedshift, isEscale;
-	  int status = FunctionUtility::tableInfo(filename, numberParams, numberSpectra,
+	  bool isAdditive, isRedshift(false), isEscale(false);
+	  std::shared_ptr<const StokesTableEntry> stokesEntry;
+	  if ( tableType == "add" ) stokesEntry = stokesTable(filename, numberParams, isRedshift);
+	  if ( !stokesEntry ) {
+	    int status(0);
+	    {
+	      std::lock_guard<std::mutex> tableLock(tableMutex());
+	      status = FunctionUtility::tableInfo(filename, numberParams, numberSpectra,
 						  numberEnergies, isAdditive, isRedshift,
 						  isEscale);
-	  if ( status != 0 ) {
-	    string errMsg = "Filename " + filename + " cannot be found.";
-	    throw MdefExpressionError(errMsg);
+	    }
+	    if ( status != 0 ) {
+	      string errMsg = "Filename " + filename + " cannot be found.";
+	      throw MdefExpressionError(errMsg);
+	    }
+	    if ( isRedshift ) numberParams++;
+	    if ( isEscale ) numberParams++;
 	  }
-	  if ( isRedshift ) numberParams++;
-	  if ( isEscale ) numberParams++;
 	  // pop the parameters of the stack in reverse order
 	  RealArray params(numberParams);
 	  for (size_t iparam=0; iparam<numberParams; iparam++) {
@@ -1009,9 +4607,18 @@ void MdefExpression::evaluate (const RealArray& energies, const RealArray& param
 	    resultsStack.pop();
 	  }
 	  RealArray modFlux, modFluxErr;
-	  FunctionUtility::tableInterpolate(energies, params, filename, spectrumNumber,
-					    modFlux, modFluxErr, initString, tableType,
-					    false);
+	  CacheKey callKey;
+	  if ( isShared ) sharedKey(opName, params, callKey);
+	  if ( !isShared || !CallMemo::instance().find(callKey, modFlux) ) {
+	    if ( !(stokesEntry && stokesInterpolate(stokesEntry, energies, params, filename,
+						    spectrumNumber, initString, modFlux))
+		 && (tableType != "add" || isEscale
+		     || !serverInterpolate(energies, params, filename, spectrumNumber, initString,
+					   modFlux)) )
+	      tableInterpolatePhiMirror(energies, params, filename, spectrumNumber,
+					modFlux, modFluxErr, initString, tableType);
+	    if ( isShared ) CallMemo::instance().store(callKey, modFlux);
+	  }
 	  bool dividedByBinWidths(false);
 	  if ( tableType == "add" ) {
 	    modFlux /= binWidths;
@@ -1035,10 +4642,29 @@ void MdefExpression::evaluate (const RealArray& energies, const RealArray& param
       break;
 
     } // end of switch over token type
+
+    if ( cache ) cache->values[iElem] = resultsStack.top();
+    if ( basis ) {
+      const std::vector<size_t>& basisNodes = incState->basisNodes;
+      std::vector<size_t>::const_iterator itNode = std::lower_bound(basisNodes.begin(),
+								    basisNodes.end(), iElem);
+      if ( itNode != basisNodes.end() && *itNode == iElem )
+	basis->spectra[itNode - basisNodes.begin()] = resultsStack.top().first;
+    }
   } // end m_postfixElems loop
 
   if (resultsStack.size() != 1)
     throw RedAlert("Programmer error: MdefExpression::evaluate() stack should be of size 1 at end.");
+  if ( cache ) {
+    cache->parameters.resize(parameters.size());
+    cache->parameters = parameters;
+    cache->isValid = true;
+  }
+  if ( basis ) {
+    basis->parameters.resize(parameters.size());
+    basis->parameters = parameters;
+    basis->isValid = true;
+  }
   if (flux.size() != nBins)
     flux.resize(nBins);
   flux = resultsStack.top().first;
@@ -1177,7 +4803,11 @@ void MdefExpression::convolveEvaluate (const RealArray& energies, const RealArra
 	       }
 	     }
 
-	     modFunc(energies, params, spectrumNumber, modFlux, modFluxErr, initString);
+	     {
+	       std::unique_lock<std::mutex> modelLock(modelMutex(), std::defer_lock);
+	       if ( !compInfo.isMdefineModel() ) modelLock.lock();
+	       modFunc(energies, params, spectrumNumber, modFlux, modFluxErr, initString);
+	     }
 	     if ( !compInfo.isMdefineModel() ) {
 	     
 	       // if not an mdef model and the component type is add, con or mix then divide by the bin width
@@ -1365,6 +4995,8 @@ void MdefExpression::singleConvolveEvaluate (const RealArray& energies, const Re
      resultsStack.pop();
    }
 
+   std::unique_lock<std::mutex> modelLock(modelMutex(), std::defer_lock);
+   if ( !XSModelFunction::compMatchName(opName).isMdefineModel() ) modelLock.lock();
    modFunc(energies, params, spectrumNumber, flux, fluxErr, initString);
 
 }
@@ -1405,4 +5037,173 @@ bool MdefExpression::isSingleConvolve() const
 
 }
 
+// Class MdefEvaluation::ActiveBins
+
+MdefEvaluation::ActiveBins::ActiveBins (size_t firstBin, size_t endBin)
+  : m_isSet(threadActiveMask().isSet),
+    m_firstBin(threadActiveMask().firstBin),
+    m_endBin(threadActiveMask().endBin),
+    m_isActive(threadActiveMask().isActive)
+{
+  ActiveMask& active = threadActiveMask();
+  active.isSet = true;
+  active.firstBin = firstBin;
+  active.endBin = endBin;
+  active.isActive.clear();
+}
+
+MdefEvaluation::ActiveBins::ActiveBins (const std::vector<bool>& isActive)
+  : m_isSet(threadActiveMask().isSet),
+    m_firstBin(threadActiveMask().firstBin),
+    m_endBin(threadActiveMask().endBin),
+    m_isActive(threadActiveMask().isActive)
+{
+  ActiveMask& active = threadActiveMask();
+  active.isSet = true;
+  active.firstBin = 0;
+  active.endBin = isActive.size();
+  active.isActive = isActive;
+}
+
+MdefEvaluation::ActiveBins::~ActiveBins ()
+{
+  ActiveMask& active = threadActiveMask();
+  active.isSet = m_isSet;
+  active.firstBin = m_firstBin;
+  active.endBin = m_endBin;
+  active.isActive.swap(m_isActive);
+}
+
+// Class MdefEvaluation
+
+void MdefEvaluation::evaluateSpectra (const MdefExpression& expression, const RealArray& energies,
+				      const RealArray& parameters,
+				      const std::vector<int>& spectrumNumbers,
+				      std::vector<RealArray>& fluxes,
+				      const string& initString, size_t nThreads)
+{
+  // For convolution expressions fluxes[i] must hold the spectrum to be
+  // convolved on input.
+  const size_t nSpectra = spectrumNumbers.size();
+  fluxes.resize(nSpectra);
+  if ( nThreads == 0 ) nThreads = std::max(1u, std::thread::hardware_concurrency());
+  // the active bins of the caller apply in the worker threads too
+  const ActiveMask callerMask = threadActiveMask();
+  EvaluationPool::instance().run(nSpectra, nThreads, [&](size_t iSpec) {
+      ActiveMask& threadMask = threadActiveMask();
+      const ActiveMask savedMask(threadMask);
+      threadMask = callerMask;
+      RealArray fluxErr;
+      try {
+	expression.evaluate(energies, parameters, spectrumNumbers[iSpec], fluxes[iSpec],
+			    fluxErr, initString);
+      } catch (...) {
+	threadMask = savedMask;
+	throw;
+      }
+      threadMask = savedMask;
+    });
+}
+
+void MdefEvaluation::replay (const string& traceFile, bool isStubTables, Latencies& recorded,
+			     Latencies& replayed)
+{
+  struct TraceExpression
+  {
+    string name;
+    string compType;
+  };
+  std::vector<TraceExpression> expressions;
+  std::vector<RealArray> grids;
+  std::vector<double> recordedSeconds, replayedSeconds;
+
+  // Replayed calls count as nested ones, so they are not recorded again.
+  // Values cached from other evaluations, or with stubbed tables, must
+  // not be reused.
+  ++threadEvaluationDepth();
+  isTableStubbed() = isStubTables;
+  forgetAllIncrementalStates();
+  ++mdefineGeneration();
+  try {
+    TraceReader reader(traceFile);
+    char tag;
+    RealArray parameters, flux, fluxErr;
+    while ( reader.readTag(tag) ) {
+      if ( tag == 'X' ) {
+	const unsigned id = reader.readValue<unsigned>();
+	if ( id >= expressions.size() ) expressions.resize(id+1);
+	expressions[id].name = reader.readString();
+	expressions[id].compType = reader.readString();
+	reader.readString();
+      } else if ( tag == 'G' ) {
+	const unsigned id = reader.readValue<unsigned>();
+	if ( id >= grids.size() ) grids.resize(id+1);
+	reader.readValue<unsigned long long>();
+	reader.readArray(grids[id]);
+      } else if ( tag == 'C' ) {
+	const unsigned exprId = reader.readValue<unsigned>();
+	const unsigned gridId = reader.readValue<unsigned>();
+	const int spectrumNumber = reader.readValue<int>();
+	reader.readArray(parameters);
+	const string initString = reader.readString();
+	const double seconds = reader.readValue<double>();
+	if ( exprId >= expressions.size() || gridId >= grids.size() ) {
+	  throw MdefExpression::MdefExpressionError("Evaluation trace refers to undefined records");
+	}
+	const TraceExpression& expression = expressions[exprId];
+	if ( expression.compType == "con" || !XSModelFunction::hasFunctionPointer(expression.name) )
+	  continue;
+	const XSCallBase& modFunc = *(XSModelFunction::functionPointer(expression.name));
+	// as the call came from XSPEC, it may start a new epoch of shared calls
+	CallMemo::instance().beginEvaluation(&modFunc, spectrumNumber);
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	modFunc(grids[gridId], parameters, spectrumNumber, flux, fluxErr, initString);
+	replayedSeconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now()
+								- start).count());
+	recordedSeconds.push_back(seconds);
+      } else {
+	throw MdefExpression::MdefExpressionError("Evaluation trace is corrupt");
+      }
+    }
+  } catch (...) {
+    --threadEvaluationDepth();
+    isTableStubbed() = false;
+    forgetAllIncrementalStates();
+    ++mdefineGeneration();
+    throw;
+  }
+  --threadEvaluationDepth();
+  isTableStubbed() = false;
+  forgetAllIncrementalStates();
+  ++mdefineGeneration();
+  latencies(recordedSeconds, recorded);
+  latencies(replayedSeconds, replayed);
+}
+
+MdefEvaluation::AdaptiveSampling MdefEvaluation::adaptiveSampling ()
+{
+  return threadAdaptiveSampling();
+}
+
+MdefEvaluation::ZeroSkips MdefEvaluation::zeroSkips (bool isReset)
+{
+  ZeroSkipCounters& counters = ZeroSkipCounters::instance();
+  const ZeroSkips skips = {counters.nOperands, counters.nCalls};
+  if ( isReset ) {
+    counters.nOperands = 0;
+    counters.nCalls = 0;
+  }
+  return skips;
+}
+
 // Additional Declarations
+
+void MdefEvaluation::advanceEpoch ()
+{
+  CallMemo::instance().advance();
+}
+
+double MdefEvaluation::optimiserDeviation (bool isReset)
+{
+  return OptimiserDeviations::instance().largest(isReset);
+}
@@ -0,0 +1,281 @@
+// mdef_stress - concurrent evaluation stress test of the updated
+// MdefExpression.cxx.
+//
+// Several threads evaluate the same mdefine expressions for shared and
+// private spectrum numbers and parameter sets, while also copying, cloning,
+// creating and destroying expressions, calling clearOperatorsMap(),
+// advanceEpoch() and MdefEvaluation::evaluateSpectra().  Every result is
+// compared with one computed by a single thread beforehand.  The expressions
+// are defined with MDEF_OPTIMISE on, and the threaded phase is run with
+// MDEF_INCREMENTAL, MDEF_LINEAR, MDEF_SHARE and MDEF_SKIPZERO on and
+// MDEF_TABLES stokes, again with them off, and again with them on and
+// MDEF_OPTIMISE check, after which the rewritten expressions must agree with
+// them as written to 1e-12 of the largest value.
+//
+// Usage:
+//    mdef_stress [-t threads] [-i iterations] [-p "values"] [expression ...]
+//
+//    -t    number of threads, 8 by default
+//    -i    iterations per thread, 1000 by default
+//    -p    parameter values of the expressions (in the order their names
+//          first appear), varied by up to 0.4% between the parameter sets
+//
+// Without expressions three built-in ones are used, with sums of spectra
+// scaled by PolFrac and PolAng as in stokes.  Expressions may call tables,
+// e.g. 'atable{stokes_unpol-v2.fits}(PhoIndex, Xi, cosd(Thetai), Phi,
+// cosd(Thetae), z)*(1+PolFrac*cosd(2*PolAng))' with -p "2 1 30 90 60 0 0.3
+// 20".  It prints the number of evaluations and exits with 1 if any result
+// differs or the optimiser check fails.  See README.md for building it with
+// ThreadSanitizer.
+
+#include <XSFunctions/Utilities/MdefExpression.h>
+#include <XSFunctions/Utilities/MdefEvaluation.h>
+#include <XSFunctions/Utilities/FunctionUtility.h>
+#include <XSUtil/Error/Error.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+   void usage ()
+   {
+      std::cerr << "Usage: mdef_stress [-t threads] [-i iterations] [-p \"values\"] [expression ...]"
+                << std::endl;
+      exit(2);
+   }
+
+   const size_t N_SETS = 6;
+   const size_t N_SPECTRA = 3;
+   const double OPTIMISER_TOLERANCE = 1.0e-12;
+
+   // Parameter set iSet: the base values varied a little, or for the
+   // built-in expressions values covering their ranges, with the first
+   // parameter (PolFrac) zero in every third set.
+   RealArray parameterSet (const std::vector<Real>& base, size_t iSet)
+   {
+      if (!base.empty())
+      {
+         RealArray parameters(base.size());
+         for (size_t j=0; j<base.size(); ++j)
+            parameters[j] = base[j]*(1.0 + 0.001*((iSet + j) % 5));
+         return parameters;
+      }
+      RealArray parameters(4);
+      for (size_t j=0; j<parameters.size(); ++j)
+         parameters[j] = 0.5 + 0.25*((iSet + 2*j) % 7);
+      if (iSet % 3 == 0)
+         parameters[0] = 0.0;
+      return parameters;
+   }
+
+   bool isSame (const RealArray& result, const RealArray& reference)
+   {
+      if (result.size() != reference.size())
+         return false;
+      for (size_t i=0; i<result.size(); ++i)
+      {
+         if (std::fabs(result[i] - reference[i]) > 1.0e-12*std::fabs(reference[i]) + 1.0e-300)
+            return false;
+      }
+      return true;
+   }
+
+   struct Shared
+   {
+      Shared () : exprStrings(), expressions(), parameterSets(), references(), energies(),
+                  nIterations(1000), nEvaluations(0), nErrors(0) {}
+      std::vector<std::string> exprStrings;
+      std::vector<std::unique_ptr<MdefExpression> > expressions;
+      std::vector<RealArray> parameterSets;
+      // [expression][set]
+      std::vector<std::vector<RealArray> > references;
+      RealArray energies;
+      size_t nIterations;
+      std::atomic<unsigned long> nEvaluations;
+      std::atomic<unsigned long> nErrors;
+   };
+
+   void check (Shared& shared, const RealArray& result, const RealArray& reference,
+               const std::string& what)
+   {
+      ++shared.nEvaluations;
+      if (!isSame(result, reference))
+      {
+         if (shared.nErrors++ == 0)
+            std::cerr << "mdef_stress: " << what << " differs from the reference" << std::endl;
+      }
+   }
+
+   void stress (Shared& shared, size_t iThread)
+   {
+      const size_t nExprs = shared.expressions.size();
+      RealArray flux, fluxErr;
+      for (size_t i=0; i<shared.nIterations; ++i)
+      try
+      {
+         const size_t iExpr = (iThread + i) % nExprs;
+         const size_t iSet = (iThread*7 + i) % N_SETS;
+         const MdefExpression& expression = *shared.expressions[iExpr];
+         const RealArray& parameters = shared.parameterSets[iSet];
+         const RealArray& reference = shared.references[iExpr][iSet];
+
+         // shared spectrum numbers, so threads meet in the same caches
+         expression.evaluate(shared.energies, parameters, 1 + i % N_SPECTRA, flux, fluxErr, "");
+         check(shared, flux, reference, "evaluate");
+
+         if (i % 7 == 0)
+         {
+            MdefExpression copy(expression);
+            copy.evaluate(shared.energies, parameters, 100 + iThread, flux, fluxErr, "");
+            check(shared, flux, reference, "evaluate of a copy");
+            std::unique_ptr<MdefExpression> clone(expression.clone());
+            clone->evaluate(shared.energies, parameters, 1, flux, fluxErr, "");
+            check(shared, flux, reference, "evaluate of a clone");
+         }
+         if (i % 11 == 0)
+         {
+            MdefExpression::clearOperatorsMap();
+            MdefExpression created(std::make_pair(0.0, 1.0e10), "add", "");
+            created.init(shared.exprStrings[iExpr]);
+            created.evaluate(shared.energies, parameters, 200 + iThread, flux, fluxErr, "");
+            check(shared, flux, reference, "evaluate of a new expression");
+         }
+         if (i % 13 == 0)
+         {
+            std::vector<int> spectrumNumbers;
+            for (size_t iSpec=0; iSpec<N_SPECTRA; ++iSpec)
+               spectrumNumbers.push_back(static_cast<int>(1 + iSpec));
+            std::vector<RealArray> fluxes;
+            MdefEvaluation::evaluateSpectra(expression, shared.energies, parameters, spectrumNumbers,
+                                            fluxes, "", 2);
+            for (size_t iSpec=0; iSpec<fluxes.size(); ++iSpec)
+               check(shared, fluxes[iSpec], reference, "evaluateSpectra");
+         }
+         if (i % 17 == 0)
+            MdefEvaluation::advanceEpoch();
+      }
+      catch (YellowAlert&)
+      {
+         if (shared.nErrors++ == 0)
+            std::cerr << "mdef_stress: evaluation failed" << std::endl;
+      }
+   }
+
+   void runThreads (Shared& shared, size_t nThreads)
+   {
+      std::vector<std::thread> threads;
+      for (size_t iThread=0; iThread<nThreads; ++iThread)
+         threads.push_back(std::thread(stress, std::ref(shared), iThread));
+      for (size_t iThread=0; iThread<threads.size(); ++iThread)
+         threads[iThread].join();
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   int nThreads = 8;
+   int nIterations = 1000;
+   std::vector<Real> base;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-'; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (iArg+1 >= argc)
+         usage();
+      const std::string value(argv[++iArg]);
+      if (option == "-t")
+         nThreads = atoi(value.c_str());
+      else if (option == "-i")
+         nIterations = atoi(value.c_str());
+      else if (option == "-p")
+      {
+         std::istringstream values(value);
+         Real parameter = 0.0;
+         while (values >> parameter)
+            base.push_back(parameter);
+      }
+      else
+         usage();
+   }
+   if (nThreads < 1 || nIterations < 1)
+      usage();
+   Shared shared;
+   shared.nIterations = nIterations;
+   for (; iArg<argc; ++iArg)
+      shared.exprStrings.push_back(argv[iArg]);
+   if (shared.exprStrings.empty())
+   {
+      if (!base.empty())
+         usage();
+      shared.exprStrings.push_back("E^(-PhoIndex)*(1+PolFrac*cosd(2*PolAng))");
+      shared.exprStrings.push_back("PolFrac*(exp(-E/Ecut)*cosd(2*PolAng)+sqrt(E)*sind(2*PolAng))+E^(-PhoIndex)");
+      shared.exprStrings.push_back("max(E^(-PhoIndex)-0.1,0)*(1+PolFrac)/(1+(E/Ecut)^2)");
+   }
+
+   // 0.1-100 keV in 300 logarithmic bins, as the STOKES tables
+   const size_t nBins = 300;
+   shared.energies.resize(nBins+1);
+   for (size_t i=0; i<=nBins; ++i)
+      shared.energies[i] = 0.1*std::pow(1000.0, static_cast<Real>(i)/nBins);
+   for (size_t iSet=0; iSet<N_SETS; ++iSet)
+      shared.parameterSets.push_back(parameterSet(base, iSet));
+
+   double deviation = 0.0;
+   try
+   {
+      FunctionUtility::setModelString("MDEF_OPTIMISE", "on");
+      for (size_t iExpr=0; iExpr<shared.exprStrings.size(); ++iExpr)
+      {
+         shared.expressions.push_back(std::unique_ptr<MdefExpression>(
+            new MdefExpression(std::make_pair(0.0, 1.0e10), "add", "")));
+         shared.expressions[iExpr]->init(shared.exprStrings[iExpr]);
+      }
+
+      const char* keys[] = {"MDEF_INCREMENTAL", "MDEF_LINEAR", "MDEF_SHARE", "MDEF_SKIPZERO"};
+      for (int pass=0; pass<3; ++pass)
+      {
+         for (size_t iKey=0; iKey<sizeof(keys)/sizeof(keys[0]); ++iKey)
+            FunctionUtility::setModelString(keys[iKey], pass == 1 ? "off" : "on");
+         FunctionUtility::setModelString("MDEF_TABLES", pass == 1 ? "off" : "stokes");
+         FunctionUtility::setModelString("MDEF_OPTIMISE", pass == 2 ? "check" : "on");
+         MdefEvaluation::optimiserDeviation(true);
+         // the references, by a single thread with fresh expressions
+         shared.references.assign(shared.expressions.size(), std::vector<RealArray>());
+         for (size_t iExpr=0; iExpr<shared.expressions.size(); ++iExpr)
+         {
+            MdefExpression expression(std::make_pair(0.0, 1.0e10), "add", "");
+            expression.init(shared.exprStrings[iExpr]);
+            for (size_t iSet=0; iSet<N_SETS; ++iSet)
+            {
+               RealArray flux, fluxErr;
+               expression.evaluate(shared.energies, shared.parameterSets[iSet], 0, flux, fluxErr, "");
+               shared.references[iExpr].push_back(flux);
+            }
+         }
+         runThreads(shared, nThreads);
+         if (pass == 2)
+            deviation = MdefEvaluation::optimiserDeviation();
+      }
+   }
+   catch (YellowAlert&)
+   {
+      std::cerr << "mdef_stress: evaluation failed" << std::endl;
+      return 1;
+   }
+   std::cout << shared.nEvaluations << " evaluations in " << nThreads << " threads, "
+             << shared.nErrors << " differing, optimised expressions within " << deviation
+             << " of those as written" << std::endl;
+   if (deviation > OPTIMISER_TOLERANCE)
+      std::cerr << "mdef_stress: an optimised expression deviates by more than "
+                << OPTIMISER_TOLERANCE << std::endl;
+   return shared.nErrors || deviation > OPTIMISER_TOLERANCE ? 1 : 0;
+}
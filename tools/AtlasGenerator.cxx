@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+#include "AtlasGenerator.h"
+
+namespace {
+
+   const char s_magic[] = "STKATLAS";
+   const unsigned long long s_version = 1;
+
+   const char* const s_axisNames[] = {"Gamma", "Xi", "Thetai", "Phi", "Thetae", "PolFrac", "PolAng"};
+
+   // chunks kept in memory per thread, computed or being computed
+   const size_t s_pendingPerThread = 2;
+
+   void appendBytes (std::vector<char>& bytes, const void* value, size_t size)
+   {
+      const char* first = static_cast<const char*>(value);
+      bytes.insert(bytes.end(), first, first + size);
+   }
+
+   void appendInteger (std::vector<char>& bytes, unsigned long long value)
+   {
+      appendBytes(bytes, &value, sizeof(value));
+   }
+
+   void appendReal (std::vector<char>& bytes, double value)
+   {
+      appendBytes(bytes, &value, sizeof(value));
+   }
+
+   template <typename T>
+   char* writeValues (const RealArray& values, char* out)
+   {
+      for (size_t i=0; i<values.size(); ++i)
+      {
+         const T value = static_cast<T>(values[i]);
+         std::memcpy(out, &value, sizeof(T));
+         out += sizeof(T);
+      }
+      return out;
+   }
+
+   Real angleOf (Real cosine)
+   {
+      return std::acos(std::min(std::max(cosine, -1.0), 1.0))*180.0/M_PI;
+   }
+
+} // namespace
+
+// Class AtlasAxis
+
+AtlasAxis::AtlasAxis ()
+   : first(0.0), last(0.0), n(1)
+{
+}
+
+Real AtlasAxis::value (size_t i) const
+{
+   return (n == 1) ? first : first + (last - first)*i/(n - 1);
+}
+
+// Class AtlasGenerator
+
+struct AtlasGenerator::Queue
+{
+   Queue (size_t nFirst, size_t nTotal, size_t nPending)
+      : mutex(), canClaim(), chunkDone(), nextChunk(nFirst), nChunks(nTotal), nWritten(nFirst),
+        maxPending(nPending), done(), error(), isAborted(false) {}
+
+   std::mutex mutex;
+   std::condition_variable canClaim;
+   std::condition_variable chunkDone;
+   size_t nextChunk;
+   const size_t nChunks;
+   size_t nWritten;
+   const size_t maxPending;
+   std::map<size_t, std::vector<char> > done;
+   std::exception_ptr error;
+   bool isAborted;
+};
+
+AtlasGenerator::AtlasGenerator (const StokesTable& unpol, const StokesTable* vrpol,
+                                const StokesTable* pol45)
+   : m_unpol(&unpol),
+     m_vrpol(vrpol),
+     m_pol45(pol45),
+     m_chunkSize(256),
+     m_isSingleOutput(false)
+{
+   // checks the tables
+   StokesModel model(unpol, vrpol, pol45);
+   const char* const tableNames[] = {"Gamma", "Xi", "Mui", "Phi", "Mue"};
+   for (size_t iAxis=0; iAxis<POLFRAC_AXIS; ++iAxis)
+   {
+      const Real initial = unpol.parameter(unpol.parameterIndex(tableNames[iAxis])).initial;
+      const bool isAngle = (iAxis == THETAI_AXIS || iAxis == THETAE_AXIS);
+      m_axes[iAxis].first = m_axes[iAxis].last = isAngle ? angleOf(initial) : initial;
+   }
+}
+
+int AtlasGenerator::axisIndex (const std::string& name)
+{
+   for (size_t iAxis=0; iAxis<N_AXES; ++iAxis)
+   {
+      if (name == s_axisNames[iAxis])
+         return static_cast<int>(iAxis);
+   }
+   return -1;
+}
+
+const char* AtlasGenerator::axisName (size_t iAxis)
+{
+   return s_axisNames[iAxis];
+}
+
+size_t AtlasGenerator::nRecords () const
+{
+   size_t n = 1;
+   for (size_t iAxis=0; iAxis<N_AXES; ++iAxis)
+      n *= m_axes[iAxis].n;
+   return n;
+}
+
+size_t AtlasGenerator::recordSize () const
+{
+   return N_AXES*sizeof(double) + 3*m_unpol->nEnergies()*(m_isSingleOutput ? sizeof(float) : sizeof(double));
+}
+
+size_t AtlasGenerator::generate (const std::string& fileName, size_t nThreads, bool isResume)
+{
+   if (m_chunkSize == 0)
+      throw StokesTable::StokesTableError("Atlas chunk size must be positive");
+   for (size_t iAxis=0; iAxis<N_AXES; ++iAxis)
+   {
+      if (m_axes[iAxis].n == 0)
+         throw StokesTable::StokesTableError(std::string("Empty atlas axis ") + s_axisNames[iAxis]);
+   }
+   nThreads = std::max(static_cast<size_t>(1), nThreads);
+   std::vector<char> headerBytes;
+   header(headerBytes);
+   const size_t chunkBytes = m_chunkSize*recordSize();
+   const size_t nChunks = (nRecords() + m_chunkSize - 1)/m_chunkSize;
+
+   // An existing file for the same grid is continued after its last complete
+   // chunk, anything after that is cut off.
+   size_t firstChunk = 0;
+   if (isResume)
+   {
+      std::ifstream in(fileName.c_str(), std::ios::binary);
+      if (in)
+      {
+         std::vector<char> existing(headerBytes.size());
+         in.read(&existing[0], existing.size());
+         if (!in || existing != headerBytes)
+            throw StokesTable::StokesTableError(fileName + " is not an atlas of the same grid");
+         in.seekg(0, std::ios::end);
+         const size_t dataBytes = static_cast<size_t>(in.tellg()) - headerBytes.size();
+         firstChunk = std::min(dataBytes/chunkBytes, nChunks);
+         in.close();
+         if (truncate(fileName.c_str(), headerBytes.size() + firstChunk*chunkBytes) != 0)
+            throw StokesTable::StokesTableError("Cannot truncate " + fileName);
+      }
+      else
+         isResume = false;
+   }
+   std::ofstream out(fileName.c_str(), isResume ? std::ios::binary | std::ios::app
+                                                : std::ios::binary | std::ios::trunc);
+   if (!out)
+      throw StokesTable::StokesTableError("Cannot write " + fileName);
+   if (!isResume)
+      out.write(&headerBytes[0], headerBytes.size());
+
+   Queue queue(firstChunk, nChunks, s_pendingPerThread*nThreads);
+   std::vector<std::thread> workers;
+   for (size_t iThread=0; iThread<nThreads; ++iThread)
+      workers.push_back(std::thread(&AtlasGenerator::computeChunks, this, std::ref(queue)));
+
+   // The calling thread writes the chunks in order.
+   std::vector<char> bytes;
+   for (size_t iChunk=firstChunk; iChunk<nChunks; ++iChunk)
+   {
+      {
+         std::unique_lock<std::mutex> lock(queue.mutex);
+         queue.chunkDone.wait(lock, [&queue, iChunk]() { return queue.isAborted || queue.done.count(iChunk); });
+         if (queue.isAborted)
+            break;
+         bytes.swap(queue.done[iChunk]);
+         queue.done.erase(iChunk);
+         ++queue.nWritten;
+      }
+      queue.canClaim.notify_all();
+      out.write(&bytes[0], bytes.size());
+      out.flush();
+      if (!out)
+      {
+         std::lock_guard<std::mutex> lock(queue.mutex);
+         queue.error = std::make_exception_ptr(StokesTable::StokesTableError("Cannot write " + fileName));
+         queue.isAborted = true;
+         break;
+      }
+   }
+   {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.error)
+         queue.isAborted = true;
+   }
+   queue.canClaim.notify_all();
+   for (size_t i=0; i<workers.size(); ++i)
+      workers[i].join();
+   if (queue.error)
+      std::rethrow_exception(queue.error);
+   return nRecords() - std::min(firstChunk*m_chunkSize, nRecords());
+}
+
+void AtlasGenerator::header (std::vector<char>& bytes) const
+{
+   bytes.clear();
+   appendBytes(bytes, s_magic, 8);
+   appendInteger(bytes, s_version);
+   appendInteger(bytes, m_unpol->nEnergies());
+   appendInteger(bytes, m_isSingleOutput ? sizeof(float) : sizeof(double));
+   appendInteger(bytes, m_chunkSize);
+   appendInteger(bytes, nRecords());
+   for (size_t iAxis=0; iAxis<N_AXES; ++iAxis)
+   {
+      appendReal(bytes, m_axes[iAxis].first);
+      appendReal(bytes, m_axes[iAxis].last);
+      appendInteger(bytes, m_axes[iAxis].n);
+   }
+   for (size_t ie=0; ie<m_unpol->nEnergies(); ++ie)
+      appendReal(bytes, m_unpol->energyLow()[ie]);
+   for (size_t ie=0; ie<m_unpol->nEnergies(); ++ie)
+      appendReal(bytes, m_unpol->energyHigh()[ie]);
+}
+
+void AtlasGenerator::computeChunks (Queue& queue) const
+{
+   StokesModel model(*m_unpol, m_vrpol, m_pol45);
+   std::vector<char> bytes;
+   while (true)
+   {
+      size_t iChunk = 0;
+      {
+         std::unique_lock<std::mutex> lock(queue.mutex);
+         queue.canClaim.wait(lock, [&queue]() {
+            return queue.isAborted || queue.nextChunk >= queue.nChunks
+                   || queue.nextChunk < queue.nWritten + queue.maxPending; });
+         if (queue.isAborted || queue.nextChunk >= queue.nChunks)
+            return;
+         iChunk = queue.nextChunk++;
+      }
+      try
+      {
+         computeChunk(model, iChunk, bytes);
+      }
+      catch (...)
+      {
+         {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.error)
+               queue.error = std::current_exception();
+            queue.isAborted = true;
+         }
+         queue.chunkDone.notify_all();
+         queue.canClaim.notify_all();
+         return;
+      }
+      {
+         std::lock_guard<std::mutex> lock(queue.mutex);
+         queue.done[iChunk].swap(bytes);
+      }
+      queue.chunkDone.notify_all();
+   }
+}
+
+void AtlasGenerator::computeChunk (StokesModel& model, size_t iChunk, std::vector<char>& bytes) const
+{
+   const size_t first = iChunk*m_chunkSize;
+   const size_t last = std::min(first + m_chunkSize, nRecords());
+   bytes.resize((last - first)*recordSize());
+   char* out = &bytes[0];
+   StokesParameters params;
+   RealArray iFlux, qFlux, uFlux;
+   double values[N_AXES];
+   for (size_t iRecord=first; iRecord<last; ++iRecord)
+   {
+      size_t rest = iRecord;
+      for (size_t iAxis=N_AXES; iAxis-- > 0; )
+      {
+         values[iAxis] = m_axes[iAxis].value(rest % m_axes[iAxis].n);
+         rest /= m_axes[iAxis].n;
+      }
+      params.gamma = values[GAMMA_AXIS];
+      params.xi = values[XI_AXIS];
+      params.thetai = values[THETAI_AXIS];
+      params.phi = values[PHI_AXIS];
+      params.thetae = values[THETAE_AXIS];
+      params.polFrac = values[POLFRAC_AXIS];
+      params.polAng = values[POLANG_AXIS];
+      model.evaluate(params, iFlux, qFlux, uFlux);
+      std::memcpy(out, values, sizeof(values));
+      out += sizeof(values);
+      const RealArray* const spectra[] = {&iFlux, &qFlux, &uFlux};
+      for (size_t iComp=0; iComp<3; ++iComp)
+      {
+         out = m_isSingleOutput ? writeValues<float>(*spectra[iComp], out)
+                                : writeValues<double>(*spectra[iComp], out);
+      }
+   }
+}
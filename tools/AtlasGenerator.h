@@ -0,0 +1,117 @@
+#ifndef ATLASGENERATOR_H
+#define ATLASGENERATOR_H 1
+
+#include <string>
+#include <vector>
+
+#include "StokesModel.h"
+
+// AtlasGenerator evaluates the stokes model (StokesModel) over a
+// rectangular grid of Gamma, Xi, Thetai, Phi, Thetae, PolFrac and PolAng
+// and streams i, q and u of every grid point to a binary atlas file.
+//
+// The grid points are numbered with PolAng running fastest and Gamma
+// slowest, so consecutive points share the table interpolations and most
+// cost only the recombination of the tables.  They are computed in chunks
+// of consecutive points, which the threads claim in turn; the chunks are
+// written in order, and at most a few per thread are kept in memory.  A
+// file left by an interrupted run holds a number of complete chunks and is
+// continued from there.
+//
+// File layout (native byte order, all integers 64-bit unsigned):
+//    "STKATLAS", version, nEnergies, valueSize (4 or 8), chunkSize,
+//    nRecords, then first, last (doubles) and n of each of the 7 axes,
+//    E_low[nEnergies], E_high[nEnergies] (doubles),
+// followed by nRecords records of
+//    the 7 parameter values (doubles), i, q, u [nEnergies each]
+// with the spectra as floats or doubles (valueSize).
+
+struct AtlasAxis
+{
+   AtlasAxis();
+   Real value (size_t i) const;
+
+   Real first;
+   Real last;
+   size_t n;
+};
+
+class AtlasGenerator
+{
+   public:
+      enum {GAMMA_AXIS, XI_AXIS, THETAI_AXIS, PHI_AXIS, THETAE_AXIS, POLFRAC_AXIS, POLANG_AXIS,
+            N_AXES};
+
+      // vrpol and pol45 may be 0 for unpolarised illumination.  All axes
+      // start as the single value of the initial table parameter (0 for
+      // PolFrac and PolAng).  The tables must outlive the generator.
+      AtlasGenerator (const StokesTable& unpol, const StokesTable* vrpol, const StokesTable* pol45);
+
+      // Writes the grid to fileName and returns the number of grid points
+      // computed.  With isResume an existing file for the same grid is
+      // continued after its last complete chunk.
+      size_t generate (const std::string& fileName, size_t nThreads, bool isResume);
+
+      // Axis by name (Gamma, Xi, Thetai, Phi, Thetae, PolFrac, PolAng),
+      // -1 if unknown.
+      static int axisIndex (const std::string& name);
+      static const char* axisName (size_t iAxis);
+
+      const AtlasAxis& axis (size_t iAxis) const;
+      void axis (size_t iAxis, const AtlasAxis& value);
+      size_t nRecords () const;
+      size_t recordSize () const;
+
+      size_t chunkSize () const;
+      void chunkSize (size_t value);
+      bool isSingleOutput () const;
+      void isSingleOutput (bool value);
+
+   private:
+      struct Queue;
+
+      void header (std::vector<char>& bytes) const;
+      void computeChunks (Queue& queue) const;
+      void computeChunk (StokesModel& model, size_t iChunk, std::vector<char>& bytes) const;
+
+      const StokesTable* m_unpol;
+      const StokesTable* m_vrpol;
+      const StokesTable* m_pol45;
+      AtlasAxis m_axes[N_AXES];
+      size_t m_chunkSize;
+      bool m_isSingleOutput;
+};
+
+// Class AtlasGenerator
+
+inline const AtlasAxis& AtlasGenerator::axis (size_t iAxis) const
+{
+   return m_axes[iAxis];
+}
+
+inline void AtlasGenerator::axis (size_t iAxis, const AtlasAxis& value)
+{
+   m_axes[iAxis] = value;
+}
+
+inline size_t AtlasGenerator::chunkSize () const
+{
+   return m_chunkSize;
+}
+
+inline void AtlasGenerator::chunkSize (size_t value)
+{
+   m_chunkSize = value;
+}
+
+inline bool AtlasGenerator::isSingleOutput () const
+{
+   return m_isSingleOutput;
+}
+
+inline void AtlasGenerator::isSingleOutput (bool value)
+{
+   m_isSingleOutput = value;
+}
+
+#endif
@@ -0,0 +1,107 @@
+#include <fstream>
+
+#include "EvaluationTrace.h"
+
+namespace {
+
+   const char s_magic[] = "MDEFTRC1";
+
+   class TraceStream
+   {
+      public:
+         TraceStream (const std::string& fileName)
+            : m_in(fileName.c_str(), std::ios::binary)
+         {
+            char magic[8];
+            if (!m_in.read(magic, 8) || std::string(magic, 8) != std::string(s_magic, 8))
+               throw StokesTable::StokesTableError(fileName + " is not an evaluation trace");
+         }
+
+         bool readTag (char& tag)
+         {
+            return static_cast<bool>(m_in.read(&tag, 1));
+         }
+
+         template <typename T>
+         T readValue ()
+         {
+            T value;
+            if (!m_in.read(reinterpret_cast<char*>(&value), sizeof(T)))
+               throw StokesTable::StokesTableError("Evaluation trace is truncated");
+            return value;
+         }
+
+         std::string readString ()
+         {
+            std::string value(readValue<unsigned>(), ' ');
+            if (!value.empty() && !m_in.read(&value[0], value.size()))
+               throw StokesTable::StokesTableError("Evaluation trace is truncated");
+            return value;
+         }
+
+         template <typename Array>
+         void readArray (Array& values)
+         {
+            values.resize(readValue<unsigned>());
+            for (size_t i=0; i<values.size(); ++i)
+               values[i] = readValue<double>();
+         }
+
+      private:
+         std::ifstream m_in;
+   };
+
+} // namespace
+
+// Class EvaluationTrace
+
+EvaluationTrace::EvaluationTrace ()
+   : m_expressions(),
+     m_grids(),
+     m_calls()
+{
+}
+
+void EvaluationTrace::read (const std::string& fileName)
+{
+   m_expressions.clear();
+   m_grids.clear();
+   m_calls.clear();
+   TraceStream in(fileName);
+   char tag;
+   while (in.readTag(tag))
+   {
+      if (tag == 'X')
+      {
+         const unsigned id = in.readValue<unsigned>();
+         if (id >= m_expressions.size())
+            m_expressions.resize(id+1);
+         m_expressions[id].name = in.readString();
+         m_expressions[id].compType = in.readString();
+         m_expressions[id].expression = in.readString();
+      }
+      else if (tag == 'G')
+      {
+         const unsigned id = in.readValue<unsigned>();
+         if (id >= m_grids.size())
+            m_grids.resize(id+1);
+         m_grids[id].fingerprint = in.readValue<unsigned long long>();
+         in.readArray(m_grids[id].energies);
+      }
+      else if (tag == 'C')
+      {
+         Call call;
+         call.expression = in.readValue<unsigned>();
+         call.grid = in.readValue<unsigned>();
+         call.spectrumNumber = in.readValue<int>();
+         in.readArray(call.parameters);
+         call.initString = in.readString();
+         call.seconds = in.readValue<double>();
+         if (call.expression >= m_expressions.size() || call.grid >= m_grids.size())
+            throw StokesTable::StokesTableError("Evaluation trace refers to undefined records");
+         m_calls.push_back(call);
+      }
+      else
+         throw StokesTable::StokesTableError("Evaluation trace is corrupt");
+   }
+}
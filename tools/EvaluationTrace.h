@@ -0,0 +1,71 @@
+#ifndef EVALUATIONTRACE_H
+#define EVALUATIONTRACE_H 1
+
+#include <string>
+#include <vector>
+
+#include "StokesTable.h"
+
+// EvaluationTrace reads a trace of mdefine evaluations recorded in XSPEC
+// with 'xset MDEF_RECORD file' by the updated MdefExpression.cxx (the
+// format is described there): the expressions, the energy grids and, in
+// order, the calls with their parameters, spectrum number and latency.
+
+class EvaluationTrace
+{
+   public:
+      struct Expression
+      {
+         std::string name;
+         std::string compType;
+         std::string expression;
+      };
+
+      struct Grid
+      {
+         unsigned long long fingerprint;
+         RealArray energies;
+      };
+
+      struct Call
+      {
+         size_t expression;
+         size_t grid;
+         int spectrumNumber;
+         std::vector<Real> parameters;
+         std::string initString;
+         double seconds;
+      };
+
+      EvaluationTrace();
+
+      void read (const std::string& fileName);
+
+      const std::vector<Expression>& expressions () const;
+      const std::vector<Grid>& grids () const;
+      const std::vector<Call>& calls () const;
+
+   private:
+      std::vector<Expression> m_expressions;
+      std::vector<Grid> m_grids;
+      std::vector<Call> m_calls;
+};
+
+// Class EvaluationTrace
+
+inline const std::vector<EvaluationTrace::Expression>& EvaluationTrace::expressions () const
+{
+   return m_expressions;
+}
+
+inline const std::vector<EvaluationTrace::Grid>& EvaluationTrace::grids () const
+{
+   return m_grids;
+}
+
+inline const std::vector<EvaluationTrace::Call>& EvaluationTrace::calls () const
+{
+   return m_calls;
+}
+
+#endif
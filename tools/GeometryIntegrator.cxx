@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <thread>
+
+#include "GeometryIntegrator.h"
+#include "TableInterpolator.h"
+
+namespace {
+
+   const Real s_degToRad = M_PI/180.0;
+
+   size_t requiredIndex (const StokesTable& table, const char* parName)
+   {
+      const int iPar = table.parameterIndex(parName);
+      if (iPar < 0)
+         throw StokesTable::StokesTableError(std::string("Table has no parameter ") + parName);
+      return static_cast<size_t>(iPar);
+   }
+
+   StokesTable sliceGammaXi (const StokesTable& table, Real gamma, Real xi)
+   {
+      std::vector<size_t> parIndices(2);
+      parIndices[0] = requiredIndex(table, "Gamma");
+      parIndices[1] = requiredIndex(table, "Xi");
+      std::vector<Real> parValues(2);
+      parValues[0] = gamma;
+      parValues[1] = xi;
+      return TableInterpolator(table).slice(parIndices, parValues);
+   }
+
+   bool isSameGrid (const StokesTable& first, const StokesTable& second)
+   {
+      if (first.nParameters() != second.nParameters() || first.nEnergies() != second.nEnergies()
+          || first.nComponents() != second.nComponents())
+         return false;
+      for (size_t iPar=0; iPar<first.nParameters(); ++iPar)
+      {
+         if (first.parameter(iPar).values != second.parameter(iPar).values)
+            return false;
+      }
+      return true;
+   }
+
+} // namespace
+
+// Class GeometryIntegrator
+
+GeometryIntegrator::GeometryIntegrator (const StokesTable& unpol, const StokesTable* vrpol,
+                                        const StokesTable* pol45)
+   : m_unpol(&unpol),
+     m_vrpol(vrpol),
+     m_pol45(pol45),
+     m_combined()
+{
+   m_angleIndex[0] = m_angleIndex[1] = m_angleIndex[2] = 0;
+   if (m_unpol->nComponents() != 3)
+      throw StokesTable::StokesTableError("Geometry integration needs tables with i, q and u spectra");
+}
+
+void GeometryIntegrator::setup (Real gamma, Real xi, Real polFrac, Real polAng)
+{
+   const Real polCos = polFrac*std::cos(2.0*polAng*s_degToRad);
+   const Real polSin = polFrac*std::sin(2.0*polAng*s_degToRad);
+   if ((polCos != 0.0 && !m_vrpol) || (polSin != 0.0 && !m_pol45))
+      throw StokesTable::StokesTableError("Polarised illumination needs the vrpol and 45deg tables");
+
+   // Slice first, then unfold half-Phi tables: the slices are small.
+   const StokesTable unpolHalf = sliceGammaXi(*m_unpol, gamma, xi);
+   StokesTable unpol = unpolHalf.unfoldPhi(0);
+   StokesTable vrpol, pol45;
+   if (polCos != 0.0)
+      vrpol = sliceGammaXi(*m_vrpol, gamma, xi).unfoldPhi(0);
+   if (polSin != 0.0)
+      pol45 = sliceGammaXi(*m_pol45, gamma, xi).unfoldPhi(&unpolHalf);
+   if ((polCos != 0.0 && !isSameGrid(unpol, vrpol)) || (polSin != 0.0 && !isSameGrid(unpol, pol45)))
+      throw StokesTable::StokesTableError("The STOKES tables are not on the same grid");
+
+   const size_t nValues = unpol.nGridPoints()*unpol.nEnergies();
+   for (size_t iComp=0; iComp<3; ++iComp)
+   {
+      Real* out = unpol.spectrum(iComp, 0);
+      const Real* s90 = (polCos != 0.0) ? vrpol.spectrum(iComp, 0) : 0;
+      const Real* s45 = (polSin != 0.0) ? pol45.spectrum(iComp, 0) : 0;
+      for (size_t i=0; i<nValues; ++i)
+      {
+         Real s0 = out[i];
+         if (s90)
+            out[i] += polCos*(s90[i] - s0);
+         if (s45)
+            out[i] += polSin*(s45[i] - s0);
+      }
+   }
+   if (unpol.nParameters() != 3)
+      throw StokesTable::StokesTableError("Expected Gamma, Xi, Mui, Phi and Mue table parameters");
+   m_angleIndex[0] = requiredIndex(unpol, "Mui");
+   m_angleIndex[1] = requiredIndex(unpol, "Phi");
+   m_angleIndex[2] = requiredIndex(unpol, "Mue");
+   m_combined = unpol;
+}
+
+void GeometryIntegrator::integrate (const std::vector<GeometrySample>& samples, size_t nThreads,
+                                    RealArray& iFlux, RealArray& qFlux, RealArray& uFlux) const
+{
+   if (m_combined.nGridPoints() == 0)
+      throw StokesTable::StokesTableError("GeometryIntegrator::setup() has not been called");
+   const size_t nEngs = m_combined.nEnergies();
+   const size_t nSamples = samples.size();
+   nThreads = std::max(static_cast<size_t>(1), std::min(nThreads, nSamples));
+
+   std::vector<std::vector<Real> > accums(nThreads, std::vector<Real>(3*nEngs, 0.0));
+   std::vector<std::thread> workers;
+   const size_t chunk = nSamples/nThreads;
+   for (size_t iThread=0; iThread<nThreads; ++iThread)
+   {
+      const GeometrySample* first = nSamples ? &samples[0] + iThread*chunk : 0;
+      const GeometrySample* last = (iThread == nThreads-1) ? first + (nSamples - iThread*chunk)
+                                                           : first + chunk;
+      if (iThread == nThreads-1)
+         integrateRange(first, last, accums[iThread]);
+      else
+         workers.push_back(std::thread(&GeometryIntegrator::integrateRange, this, first, last,
+                                       std::ref(accums[iThread])));
+   }
+   for (size_t i=0; i<workers.size(); ++i)
+      workers[i].join();
+
+   RealArray* outputs[] = {&iFlux, &qFlux, &uFlux};
+   for (size_t iComp=0; iComp<3; ++iComp)
+   {
+      RealArray& out = *outputs[iComp];
+      out.resize(nEngs);
+      out = 0.0;
+      for (size_t iThread=0; iThread<nThreads; ++iThread)
+      {
+         const Real* accum = &accums[iThread][iComp*nEngs];
+         for (size_t ie=0; ie<nEngs; ++ie)
+            out[ie] += accum[ie];
+      }
+   }
+}
+
+void GeometryIntegrator::integrateRange (const GeometrySample* first, const GeometrySample* last,
+                                         std::vector<Real>& accum) const
+{
+   const size_t nEngs = m_combined.nEnergies();
+   Real* accI = &accum[0];
+   Real* accQ = &accum[nEngs];
+   Real* accU = &accum[2*nEngs];
+   std::vector<size_t> lower(3), nodes(3);
+   std::vector<Real> weight(3);
+   // one set of locators per range, so that the threads do not share them
+   const GridLocator locators[] = {GridLocator(m_combined.parameter(m_angleIndex[0])),
+                                   GridLocator(m_combined.parameter(m_angleIndex[1])),
+                                   GridLocator(m_combined.parameter(m_angleIndex[2]))};
+   for (const GeometrySample* sample=first; sample!=last; ++sample)
+   {
+      const Real angles[] = {std::cos(sample->thetai*s_degToRad), sample->phi,
+                             std::cos(sample->thetae*s_degToRad)};
+      for (size_t i=0; i<3; ++i)
+      {
+         const size_t iPar = m_angleIndex[i];
+         locators[i].locate(angles[i], lower[iPar], weight[iPar]);
+      }
+      const Real cos2psi = std::cos(2.0*sample->rotation*s_degToRad);
+      const Real sin2psi = std::sin(2.0*sample->rotation*s_degToRad);
+      for (size_t iCorner=0; iCorner<8; ++iCorner)
+      {
+         Real cornerWeight = sample->weight;
+         for (size_t iPar=0; iPar<3; ++iPar)
+         {
+            const bool isUpper = (iCorner >> iPar) & 1;
+            nodes[iPar] = lower[iPar] + (isUpper ? 1 : 0);
+            cornerWeight *= isUpper ? weight[iPar] : 1.0 - weight[iPar];
+         }
+         if (cornerWeight == 0.0)
+            continue;
+         const size_t iGrid = m_combined.gridIndex(nodes);
+         const Real* cornerI = m_combined.spectrum(StokesTable::I_COMP, iGrid);
+         const Real* cornerQ = m_combined.spectrum(StokesTable::Q_COMP, iGrid);
+         const Real* cornerU = m_combined.spectrum(StokesTable::U_COMP, iGrid);
+         const Real wc = cornerWeight*cos2psi;
+         const Real ws = cornerWeight*sin2psi;
+         for (size_t ie=0; ie<nEngs; ++ie)
+         {
+            accI[ie] += cornerWeight*cornerI[ie];
+            accQ[ie] += wc*cornerQ[ie] - ws*cornerU[ie];
+            accU[ie] += ws*cornerQ[ie] + wc*cornerU[ie];
+         }
+      }
+   }
+}
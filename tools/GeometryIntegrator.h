@@ -0,0 +1,62 @@
+#ifndef GEOMETRYINTEGRATOR_H
+#define GEOMETRYINTEGRATOR_H 1
+
+#include <vector>
+
+#include "StokesTable.h"
+
+// GeometryIntegrator sums STOKES spectra over many local scattering
+// geometries with Gamma and Xi fixed, as needed for disc-reflection models.
+// setup() interpolates the tables in (Gamma, Xi) once and combines the
+// unpolarised, vertically polarised and 45 deg tables for the illumination
+// polarisation exactly as the stokes model does,
+//    S(P, chi) = S0 + P [(S90 - S0) cos 2chi + (S45 - S0) sin 2chi],
+// leaving a single (Mui, Phi, Mue) table.  integrate() then needs one
+// trilinear interpolation per sample, rotates (q, u) by the sample's angle
+// and accumulates the weighted spectra directly, split over threads.
+
+struct GeometrySample
+{
+   Real thetai;    // incident angle [deg]
+   Real phi;       // azimuthal angle [deg]
+   Real thetae;    // emission angle [deg]
+   Real weight;    // quadrature weight
+   Real rotation;  // rotation of the polarisation plane [deg], as in polrot
+};
+
+class GeometryIntegrator
+{
+   public:
+      // vrpol and pol45 may be 0 for unpolarised illumination.  The tables
+      // must outlive the integrator.
+      GeometryIntegrator (const StokesTable& unpol, const StokesTable* vrpol,
+                          const StokesTable* pol45);
+
+      void setup (Real gamma, Real xi, Real polFrac, Real polAng);
+      // Weighted sums of i, q and u over the samples, on the table energy bins.
+      void integrate (const std::vector<GeometrySample>& samples, size_t nThreads,
+                      RealArray& iFlux, RealArray& qFlux, RealArray& uFlux) const;
+
+      const StokesTable& combined () const;
+
+   private:
+      void integrateRange (const GeometrySample* first, const GeometrySample* last,
+                           std::vector<Real>& accum) const;
+
+      const StokesTable* m_unpol;
+      const StokesTable* m_vrpol;
+      const StokesTable* m_pol45;
+      // combined (Mui, Phi, Mue) table built by setup(), and the positions
+      // of Mui, Phi and Mue among its parameters
+      StokesTable m_combined;
+      size_t m_angleIndex[3];
+};
+
+// Class GeometryIntegrator
+
+inline const StokesTable& GeometryIntegrator::combined () const
+{
+   return m_combined;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <cmath>
+
+#include "GridLocator.h"
+
+namespace {
+
+   // Nodes off an even spacing by more than this fraction of a step make the
+   // grid irregular.  Smaller deviations only cost a step of the correction
+   // in findCell.
+   const Real s_spacingTolerance = 1.0e-3;
+
+   bool isEvenlySpaced (const std::vector<Real>& coords)
+   {
+      const size_t n = coords.size();
+      const Real step = (coords[n-1] - coords[0])/(n - 1);
+      if (!(step > 0.0))
+         return false;
+      for (size_t i=1; i<n-1; ++i)
+      {
+         if (std::fabs(coords[i] - (coords[0] + i*step)) > s_spacingTolerance*step)
+            return false;
+      }
+      return true;
+   }
+
+} // namespace
+
+// Class GridLocator
+
+GridLocator::GridLocator (const StokesTable::Parameter& par)
+   : m_par(&par),
+     m_spacing(IRREGULAR),
+     m_origin(0.0),
+     m_scale(0.0),
+     m_lastLower(0)
+{
+   const std::vector<Real>& values = par.values;
+   const size_t nValues = values.size();
+   if (nValues < 3)
+      return;
+   if (isEvenlySpaced(values))
+   {
+      m_spacing = UNIFORM;
+      m_origin = values[0];
+      m_scale = (nValues - 1)/(values[nValues-1] - values[0]);
+      return;
+   }
+   if (values[0] <= 0.0)
+      return;
+   std::vector<Real> logValues(nValues);
+   for (size_t i=0; i<nValues; ++i)
+      logValues[i] = std::log(values[i]);
+   if (isEvenlySpaced(logValues))
+   {
+      m_spacing = LOG_UNIFORM;
+      m_origin = logValues[0];
+      m_scale = (nValues - 1)/(logValues[nValues-1] - logValues[0]);
+   }
+}
+
+void GridLocator::locate (Real value, size_t& lower, Real& weight) const
+{
+   const std::vector<Real>& values = m_par->values;
+   const size_t nValues = values.size();
+   if (nValues < 2 || value <= values[0])
+   {
+      lower = 0;
+      weight = 0.0;
+      return;
+   }
+   if (value >= values[nValues-1])
+   {
+      lower = nValues - 2;
+      weight = 1.0;
+      return;
+   }
+   if (values[m_lastLower] <= value && value < values[m_lastLower+1])
+      lower = m_lastLower;
+   else
+      lower = m_lastLower = findCell(value);
+   const Real low = values[lower];
+   if (value == low)
+   {
+      weight = 0.0;
+      return;
+   }
+   const Real high = values[lower+1];
+   if (m_par->method == 1 && low > 0.0)
+      weight = std::log(value/low)/std::log(high/low);
+   else
+      weight = (value - low)/(high - low);
+}
+
+size_t GridLocator::findCell (Real value) const
+{
+   // value is strictly inside the grid here
+   const std::vector<Real>& values = m_par->values;
+   const size_t nValues = values.size();
+   if (m_spacing == IRREGULAR)
+      return static_cast<size_t>(std::upper_bound(values.begin(), values.end(), value)
+                                 - values.begin()) - 1;
+   const Real coord = (m_spacing == UNIFORM) ? value : std::log(value);
+   const Real position = (coord - m_origin)*m_scale;
+   size_t lower = (position > 0.0) ? std::min(static_cast<size_t>(position), nValues - 2) : 0;
+   // rounding and small irregularities of the nodes
+   while (lower > 0 && value < values[lower])
+      --lower;
+   while (lower < nValues - 2 && value >= values[lower+1])
+      ++lower;
+   return lower;
+}
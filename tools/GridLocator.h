@@ -0,0 +1,48 @@
+#ifndef GRIDLOCATOR_H
+#define GRIDLOCATOR_H 1
+
+#include <cstddef>
+
+#include "StokesTable.h"
+
+// GridLocator finds the nodes of a table parameter bracketing a value, with
+// the same result as TableInterpolator::locate.  Grids uniform in the
+// parameter (Gamma, Mui, Phi, Mue of the STOKES tables) or in its logarithm
+// (Xi) are detected on construction and located by computing the cell
+// index, other grids by a binary search.  The cell found last is tried
+// first, as successive fit steps mostly stay within it, and a value on a
+// node needs no weight computation.  An instance keeps the last cell, so it
+// must not be shared between threads.
+
+class GridLocator
+{
+   public:
+      enum Spacing {IRREGULAR, UNIFORM, LOG_UNIFORM};
+
+      // The parameter must outlive the locator.
+      explicit GridLocator (const StokesTable::Parameter& par);
+
+      // Lower bracketing node and the weight of the upper one.
+      void locate (Real value, size_t& lower, Real& weight) const;
+
+      Spacing spacing () const;
+
+   private:
+      size_t findCell (Real value) const;
+
+      const StokesTable::Parameter* m_par;
+      Spacing m_spacing;
+      // first node and nodes per unit of the parameter or its logarithm
+      Real m_origin;
+      Real m_scale;
+      mutable size_t m_lastLower;
+};
+
+// Class GridLocator
+
+inline GridLocator::Spacing GridLocator::spacing () const
+{
+   return m_spacing;
+}
+
+#endif
@@ -0,0 +1,1013 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "MdefEngine.h"
+
+namespace {
+
+   const Real s_degToRad = M_PI/180.0;
+
+   // The operators and functions of mdefine, with the precedence of the
+   // operators (-1 for functions called by name).  The unary minus is @.
+   enum FunctionCode {PLUS, MINUS, TIMES, DIVIDE, POWER, NEGATE, MAX, MIN, ATAN2, EXP, SIN, SIND,
+                      COS, COSD, TAN, TAND, SINH, SINHD, COSH, COSHD, TANH, TANHD, LOG, LN, SQRT,
+                      ABS, INT, SIGN, HEAVISIDE, BOXCAR, ASIN, ACOS, ATAN, ASINH, ACOSH, ATANH, MEAN,
+                      DIM, SMIN, SMAX, ERF, ERFC, GAMMA, LEGENDRE2, LEGENDRE3, LEGENDRE4, LEGENDRE5,
+                      N_FUNCTIONS};
+
+   struct FunctionInfo
+   {
+      const char* name;
+      size_t nArgs;
+      int precedence;
+   };
+
+   const FunctionInfo s_functions[N_FUNCTIONS] = {
+      {"+", 2, 0}, {"-", 2, 0}, {"*", 2, 1}, {"/", 2, 1}, {"^", 2, 2}, {"@", 1, 0},
+      {"max", 2, -1}, {"min", 2, -1}, {"atan2", 2, -1}, {"exp", 1, -1}, {"sin", 1, -1},
+      {"sind", 1, -1}, {"cos", 1, -1}, {"cosd", 1, -1}, {"tan", 1, -1}, {"tand", 1, -1},
+      {"sinh", 1, -1}, {"sinhd", 1, -1}, {"cosh", 1, -1}, {"coshd", 1, -1}, {"tanh", 1, -1},
+      {"tanhd", 1, -1}, {"log", 1, -1}, {"ln", 1, -1}, {"sqrt", 1, -1}, {"abs", 1, -1},
+      {"int", 1, -1}, {"sign", 1, -1}, {"heaviside", 1, -1}, {"boxcar", 1, -1}, {"asin", 1, -1},
+      {"acos", 1, -1}, {"atan", 1, -1}, {"asinh", 1, -1}, {"acosh", 1, -1}, {"atanh", 1, -1},
+      {"mean", 1, -1}, {"dim", 1, -1}, {"smin", 1, -1}, {"smax", 1, -1}, {"erf", 1, -1},
+      {"erfc", 1, -1}, {"gamma", 1, -1}, {"legendre2", 1, -1}, {"legendre3", 1, -1},
+      {"legendre4", 1, -1}, {"legendre5", 1, -1}};
+
+   int functionCode (const std::string& name)
+   {
+      for (size_t i=MAX; i<N_FUNCTIONS; ++i)
+      {
+         if (name == s_functions[i].name)
+            return static_cast<int>(i);
+      }
+      return -1;
+   }
+
+   Real unaryValue (size_t code, Real x)
+   {
+      switch (code)
+      {
+         case NEGATE:    return -x;
+         case EXP:       return std::exp(x);
+         case SIN:       return std::sin(x);
+         case SIND:      return std::sin(x*s_degToRad);
+         case COS:       return std::cos(x);
+         case COSD:      return std::cos(x*s_degToRad);
+         case TAN:       return std::tan(x);
+         case TAND:      return std::tan(x*s_degToRad);
+         case SINH:      return std::sinh(x);
+         case SINHD:     return std::sinh(x*s_degToRad);
+         case COSH:      return std::cosh(x);
+         case COSHD:     return std::cosh(x*s_degToRad);
+         case TANH:      return std::tanh(x);
+         case TANHD:     return std::tanh(x*s_degToRad);
+         case LOG:       return std::log10(x);
+         case LN:        return std::log(x);
+         case SQRT:      return std::sqrt(x);
+         case ABS:       return std::fabs(x);
+         case INT:       return std::trunc(x);
+         case SIGN:      return (x < 0.0) ? -1.0 : 1.0;
+         case HEAVISIDE: return (x < 0.0) ? 0.0 : 1.0;
+         case BOXCAR:    return (x < 0.0 || x > 1.0) ? 0.0 : 1.0;
+         case ASIN:      return std::asin(x);
+         case ACOS:      return std::acos(x);
+         case ATAN:      return std::atan(x);
+         case ASINH:     return std::asinh(x);
+         case ACOSH:     return std::acosh(x);
+         case ATANH:     return std::atanh(x);
+         case ERF:       return std::erf(x);
+         case ERFC:      return std::erfc(x);
+         case GAMMA:     return std::tgamma(x);
+         case LEGENDRE2: return 0.5*(3.0*x*x - 1.0);
+         case LEGENDRE3: return 0.5*(5.0*x*x*x - 3.0*x);
+         case LEGENDRE4: return (35.0*x*x*x*x - 30.0*x*x + 3.0)/8.0;
+         case LEGENDRE5: return (63.0*x*x*x*x*x - 70.0*x*x*x + 15.0*x)/8.0;
+         default:        return x;
+      }
+   }
+
+   Real binaryValue (size_t code, Real x, Real y)
+   {
+      switch (code)
+      {
+         case PLUS:   return x + y;
+         case MINUS:  return x - y;
+         case TIMES:  return x*y;
+         case DIVIDE: return x/y;
+         case POWER:  return std::pow(x, y);
+         case MAX:    return std::max(x, y);
+         case MIN:    return std::min(x, y);
+         case ATAN2:  return std::atan2(x, y);
+         default:     return x;
+      }
+   }
+
+   bool sameBands (const std::vector<StokesTable::Band>& x, const std::vector<StokesTable::Band>& y)
+   {
+      if (x.size() != y.size())
+         return false;
+      for (size_t i=0; i<x.size(); ++i)
+      {
+         if (x[i].eMin != y[i].eMin || x[i].eMax != y[i].eMax || x[i].weightIndex != y[i].weightIndex)
+            return false;
+      }
+      return true;
+   }
+
+   bool isReduction (size_t code)
+   {
+      return code == MEAN || code == DIM || code == SMIN || code == SMAX;
+   }
+
+   std::string lowerCase (const std::string& value)
+   {
+      std::string result(value);
+      for (size_t i=0; i<result.size(); ++i)
+         result[i] = static_cast<char>(tolower(result[i]));
+      return result;
+   }
+
+   std::string trimmed (const std::string& value)
+   {
+      const size_t first = value.find_first_not_of(" \t\r\n");
+      if (first == std::string::npos)
+         return std::string();
+      const size_t last = value.find_last_not_of(" \t\r\n");
+      return value.substr(first, last - first + 1);
+   }
+
+   bool isWordChar (char c)
+   {
+      return isalnum(static_cast<unsigned char>(c)) || c == '_';
+   }
+
+   // Photons per bin of a table on the bins between energies, the table
+   // bins scaled by 1/scale, in proportion to the overlap.
+   void redistribute (const RealArray& low, const RealArray& high, const RealArray& flux, Real scale,
+                      const RealArray& energies, RealArray& result)
+   {
+      const size_t nBins = energies.size() - 1;
+      const size_t nTable = low.size();
+      result.resize(nBins);
+      bool isSameBins = (scale == 1.0 && nBins == nTable);
+      for (size_t i=0; i<nTable && isSameBins; ++i)
+         isSameBins = (low[i] == energies[i] && high[i] == energies[i+1]);
+      if (isSameBins)
+      {
+         result = flux;
+         return;
+      }
+      result = 0.0;
+      size_t iFirst = 0;
+      for (size_t i=0; i<nTable; ++i)
+      {
+         const Real lo = low[i]/scale;
+         const Real hi = high[i]/scale;
+         const Real width = hi - lo;
+         if (!(width > 0.0))
+            continue;
+         while (iFirst < nBins && energies[iFirst+1] <= lo)
+            ++iFirst;
+         for (size_t k=iFirst; k<nBins && energies[k] < hi; ++k)
+         {
+            const Real overlap = std::min(hi, energies[k+1]) - std::max(lo, energies[k]);
+            if (overlap > 0.0)
+               result[k] += flux[i]*overlap/width;
+         }
+      }
+      if (scale != 1.0)
+         result /= scale;
+   }
+
+} // namespace
+
+// A scalar, or i, q and u on the energy bins.
+struct MdefEngine::Value
+{
+   Value () : isVector(false), scalar(0.0) {}
+
+   Real first () const
+   {
+      return isVector ? comps[0][0] : scalar;
+   }
+
+   void broadcast (size_t nBins)
+   {
+      if (isVector)
+         return;
+      for (size_t iComp=0; iComp<3; ++iComp)
+         comps[iComp].resize(nBins, scalar);
+      isVector = true;
+   }
+
+   bool isVector;
+   Real scalar;
+   RealArray comps[3];
+};
+
+// State of the evaluations of one thread.  In band mode the values are
+// those of the bands of the first table called.
+struct MdefEngine::Workspace
+{
+   explicit Workspace (bool isBandMode = false) : isBands(isBandMode), bands(0) {}
+
+   TableInterpolator& interpolator (const StokesTable& table, size_t iTable)
+   {
+      if (interpolators.size() <= iTable)
+         interpolators.resize(iTable+1);
+      if (!interpolators[iTable])
+         interpolators[iTable].reset(new TableInterpolator(table));
+      return *interpolators[iTable];
+   }
+
+   bool isBands;
+   const std::vector<StokesTable::Band>* bands;
+   std::vector<std::unique_ptr<TableInterpolator> > interpolators;
+   std::vector<RealArray> tableSpectra;
+   std::vector<RealArray> refSpectra;
+};
+
+// Class MdefEngine
+
+MdefEngine::MdefEngine ()
+   : m_variables(),
+     m_definitions(),
+     m_definitionIndex(),
+     m_tables(),
+     m_isSingleStorage(false)
+{
+}
+
+MdefEngine::~MdefEngine ()
+{
+}
+
+void MdefEngine::readScript (const std::string& fileName)
+{
+   std::ifstream in(fileName.c_str());
+   if (!in)
+      throw StokesTable::StokesTableError("Cannot read " + fileName);
+   std::string line;
+   while (std::getline(in, line))
+   {
+      line = trimmed(line);
+      if (line.empty() || line[0] == '#')
+         continue;
+      // variables
+      std::string expanded;
+      for (size_t i=0; i<line.size(); ++i)
+      {
+         if (line[i] != '$')
+         {
+            expanded += line[i];
+            continue;
+         }
+         std::string name;
+         if (i+1 < line.size() && line[i+1] == '{')
+         {
+            const size_t close = line.find('}', i+2);
+            if (close == std::string::npos)
+               throw StokesTable::StokesTableError("Unterminated ${ in " + fileName);
+            name = line.substr(i+2, close-i-2);
+            i = close;
+         }
+         else
+         {
+            size_t last = i+1;
+            while (last < line.size() && isWordChar(line[last]))
+               ++last;
+            name = line.substr(i+1, last-i-1);
+            i = last-1;
+         }
+         std::map<std::string, std::string>::const_iterator itVar = m_variables.find(name);
+         if (itVar == m_variables.end())
+            throw StokesTable::StokesTableError("Variable " + name + " is not set in " + fileName);
+         expanded += itVar->second;
+      }
+      std::istringstream words(expanded);
+      std::string command, name;
+      words >> command >> name;
+      std::string rest;
+      std::getline(words, rest);
+      rest = trimmed(rest);
+      command = lowerCase(command);
+      if (command == "set")
+      {
+         if (rest.size() >= 2 && ((rest[0] == '"' && rest[rest.size()-1] == '"')
+                                  || (rest[0] == '{' && rest[rest.size()-1] == '}')))
+            rest = rest.substr(1, rest.size()-2);
+         variable(name, rest);
+      }
+      else if (command == "mdefine" || command == "mdef")
+      {
+         const size_t colon = rest.find_last_of(':');
+         if (colon == std::string::npos)
+            define(name, rest);
+         else
+            define(name, rest.substr(0, colon), trimmed(rest.substr(colon+1)));
+      }
+   }
+}
+
+void MdefEngine::variable (const std::string& name, const std::string& value)
+{
+   m_variables[name] = value;
+}
+
+void MdefEngine::define (const std::string& name, const std::string& expression,
+                         const std::string& compType)
+{
+   const std::string type = lowerCase(compType);
+   if (type != "add" && type != "mul")
+      throw StokesTable::StokesTableError("Model " + name + ": only add and mul models are supported");
+   std::unique_ptr<Definition> def(new Definition);
+   def->name = lowerCase(name);
+   def->isAdditive = (type == "add");
+   def->firstTable = -1;
+   compile(expression, *def);
+   install(def);
+}
+
+void MdefEngine::defineTable (const std::string& name, const std::string& fileName)
+{
+   std::unique_ptr<Definition> def(new Definition);
+   def->name = lowerCase(name);
+   def->isAdditive = true;
+   const size_t iTable = tableIndex(fileName);
+   def->firstTable = static_cast<int>(iTable);
+   const StokesTable& table = m_tables[iTable]->table;
+   const size_t nArgs = table.nParameters() + (table.isRedshift() ? 1 : 0);
+   for (size_t i=0; i<nArgs; ++i)
+   {
+      def->parNames.push_back(i < table.nParameters() ? table.parameter(i).name : "z");
+      const Element argument = {PARAM, i, 0.0};
+      def->program.push_back(argument);
+   }
+   const Element call = {TABLE, iTable, 0.0};
+   def->program.push_back(call);
+   install(def);
+}
+
+void MdefEngine::rereadTable (const std::string& fileName)
+{
+   for (size_t i=0; i<m_tables.size(); ++i)
+   {
+      if (m_tables[i]->fileName != fileName)
+         continue;
+      std::unique_ptr<Table> entry(new Table);
+      std::string reference;
+      readTable(fileName, *entry, reference);
+      if (!reference.empty())
+      {
+         // it may have been replaced as well
+         rereadTable(reference);
+         entry->reference = static_cast<int>(tableIndex(reference));
+      }
+      m_tables[i].swap(entry);
+      return;
+   }
+}
+
+void MdefEngine::install (std::unique_ptr<Definition>& def)
+{
+   std::map<std::string, size_t>::const_iterator itDef = m_definitionIndex.find(def->name);
+   if (itDef != m_definitionIndex.end())
+   {
+      // models calling the old definition call the new one
+      m_definitions[itDef->second].swap(def);
+      return;
+   }
+   m_definitionIndex[def->name] = m_definitions.size();
+   m_definitions.push_back(std::unique_ptr<Definition>());
+   m_definitions.back().swap(def);
+}
+
+bool MdefEngine::hasModel (const std::string& name) const
+{
+   return m_definitionIndex.count(lowerCase(name)) != 0;
+}
+
+const std::vector<std::string>& MdefEngine::parameterNames (const std::string& name) const
+{
+   return definition(name).parNames;
+}
+
+void MdefEngine::tableEnergies (const std::string& name, RealArray& energies) const
+{
+   defaultEnergies(definition(name), RealArray(), energies);
+}
+
+void MdefEngine::tableFiles (const std::string& name, std::vector<std::string>& fileNames) const
+{
+   const Definition& def = definition(name);
+   fileNames.clear();
+   if (def.firstTable < 0)
+      return;
+   const Table& table = *m_tables[def.firstTable];
+   fileNames.push_back(table.fileName);
+   if (table.reference >= 0)
+      fileNames.push_back(m_tables[table.reference]->fileName);
+}
+
+void MdefEngine::evaluate (const std::string& name, const std::vector<Real>& parameters,
+                           const RealArray& energies, std::vector<RealArray>& spectra) const
+{
+   const Definition& def = definition(name);
+   RealArray edges;
+   defaultEnergies(def, energies, edges);
+   Workspace work;
+   run(def, parameters, edges, work, spectra);
+}
+
+void MdefEngine::evaluateBatch (const std::string& name,
+                                const std::vector<std::vector<Real> >& parameterSets,
+                                const RealArray& energies,
+                                std::vector<std::vector<RealArray> >& spectra, size_t nThreads) const
+{
+   const Definition& def = definition(name);
+   RealArray edges;
+   defaultEnergies(def, energies, edges);
+   runBatch(def, parameterSets, edges, false, spectra, nThreads);
+}
+
+const std::vector<StokesTable::Band>& MdefEngine::bands (const std::string& name) const
+{
+   const Definition& def = definition(name);
+   static const std::vector<StokesTable::Band> s_noBands;
+   return def.firstTable < 0 ? s_noBands : m_tables[def.firstTable]->table.bands();
+}
+
+void MdefEngine::evaluateBands (const std::string& name,
+                                const std::vector<std::vector<Real> >& parameterSets,
+                                std::vector<std::vector<RealArray> >& values, size_t nThreads) const
+{
+   const Definition& def = definition(name);
+   if (bands(name).empty())
+      throw StokesTable::StokesTableError("Model " + def.name + " uses no table with band layers");
+   runBatch(def, parameterSets, RealArray(), true, values, nThreads);
+}
+
+void MdefEngine::runBatch (const Definition& def, const std::vector<std::vector<Real> >& parameterSets,
+                           const RealArray& energies, bool isBands,
+                           std::vector<std::vector<RealArray> >& spectra, size_t nThreads) const
+{
+   const size_t nSets = parameterSets.size();
+   spectra.resize(nSets);
+   if (nThreads == 0)
+      nThreads = std::max(1u, std::thread::hardware_concurrency());
+   nThreads = std::max(static_cast<size_t>(1), std::min(nThreads, nSets));
+
+   // Each thread claims parameter sets in turn, with interpolators of its own
+   // kept from one set to the next.
+   std::atomic<size_t> next(0);
+   std::mutex errorMutex;
+   std::exception_ptr error;
+   auto worker = [&]() {
+      Workspace work(isBands);
+      if (isBands)
+         work.bands = &m_tables[def.firstTable]->table.bands();
+      size_t iSet;
+      while ((iSet = next++) < nSets)
+      {
+         try
+         {
+            run(def, parameterSets[iSet], energies, work, spectra[iSet]);
+         }
+         catch (...)
+         {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error)
+               error = std::current_exception();
+            next = nSets;
+         }
+      }
+   };
+   std::vector<std::thread> workers;
+   for (size_t iThread=1; iThread<nThreads; ++iThread)
+      workers.push_back(std::thread(worker));
+   worker();
+   for (size_t i=0; i<workers.size(); ++i)
+      workers[i].join();
+   if (error)
+      std::rethrow_exception(error);
+}
+
+const MdefEngine::Definition& MdefEngine::definition (const std::string& name) const
+{
+   std::map<std::string, size_t>::const_iterator itDef = m_definitionIndex.find(lowerCase(name));
+   if (itDef == m_definitionIndex.end())
+      throw StokesTable::StokesTableError("No model " + name + " is defined");
+   return *m_definitions[itDef->second];
+}
+
+size_t MdefEngine::tableIndex (const std::string& fileName)
+{
+   for (size_t i=0; i<m_tables.size(); ++i)
+   {
+      if (m_tables[i]->fileName == fileName)
+         return i;
+   }
+   std::unique_ptr<Table> entry(new Table);
+   std::string reference;
+   readTable(fileName, *entry, reference);
+   const size_t iTable = m_tables.size();
+   m_tables.push_back(std::unique_ptr<Table>());
+   m_tables.back().swap(entry);
+   if (!reference.empty())
+      m_tables[iTable]->reference = static_cast<int>(tableIndex(reference));
+   return iTable;
+}
+
+void MdefEngine::readTable (const std::string& fileName, Table& entry, std::string& reference) const
+{
+   entry.fileName = fileName;
+   entry.reference = -1;
+   entry.table.read(fileName, m_isSingleStorage);
+   const StokesTable& table = entry.table;
+   if (!table.isAdditive())
+      throw StokesTable::StokesTableError(fileName + " is not an additive table");
+   if (table.isEscale())
+      throw StokesTable::StokesTableError(fileName + ": energy scale parameters are not supported");
+   reference.clear();
+   if (table.phiSymmetry() == "REF")
+   {
+      // relative names are looked up next to the half table itself
+      reference = table.phiReference();
+      const size_t slashPos = fileName.find_last_of('/');
+      if (!reference.empty() && reference[0] != '/' && slashPos != std::string::npos)
+         reference = fileName.substr(0, slashPos+1) + reference;
+   }
+   if (!table.bands().empty())
+      entry.bandTable = table.bandTable();
+}
+
+void MdefEngine::compile (const std::string& expression, Definition& def)
+{
+   // Shunting-yard conversion as in MdefExpression::convertToPostfix: an
+   // operator pops those of higher or equal precedence except ^, which
+   // binds to the right, and function and model calls act as a left
+   // parenthesis carrying the call.  The unary minus pops nothing.
+   struct Pending
+   {
+      int precedence;
+      bool isCall;
+      Element element;
+      size_t nArgs;
+      size_t nCommas;
+   };
+   std::string expr;
+   for (size_t i=0; i<expression.size(); ++i)
+   {
+      if (!isspace(static_cast<unsigned char>(expression[i])))
+         expr += expression[i];
+   }
+   const std::string context = "Model " + def.name + ": ";
+   if (expr.empty())
+      throw StokesTable::StokesTableError(context + "empty expression");
+
+   std::vector<Pending> pending;
+   std::vector<Element> program;
+   bool isOperandExpected = true;
+   size_t pos = 0;
+   while (pos < expr.size())
+   {
+      const char c = expr[pos];
+      if (isOperandExpected && (isdigit(static_cast<unsigned char>(c)) || c == '.'))
+      {
+         const char* start = expr.c_str() + pos;
+         char* end = 0;
+         Element element = {NUM, 0, strtod(start, &end)};
+         if (end == start)
+            throw StokesTable::StokesTableError(context + "bad number in " + expr);
+         program.push_back(element);
+         pos += end - start;
+         isOperandExpected = false;
+      }
+      else if (isOperandExpected && (isalpha(static_cast<unsigned char>(c)) || c == '_'))
+      {
+         size_t last = pos;
+         while (last < expr.size() && isWordChar(expr[last]))
+            ++last;
+         std::string word = expr.substr(pos, last-pos);
+         const std::string lcWord = lowerCase(word);
+         bool isCall = true;
+         if ((lcWord == "atable" || lcWord == "mtable" || lcWord == "etable") && last < expr.size()
+             && expr[last] == '{')
+         {
+            const size_t close = expr.find('}', last);
+            if (close == std::string::npos)
+               throw StokesTable::StokesTableError(context + "unterminated table name in " + expr);
+            if (lcWord != "atable")
+               throw StokesTable::StokesTableError(context + "only atable is supported");
+            word = expr.substr(last+1, close-last-1);
+            last = close+1;
+            const size_t iTable = tableIndex(word);
+            const StokesTable& table = m_tables[iTable]->table;
+            Pending call = {-1, true, {TABLE, iTable, 0.0},
+                            table.nParameters() + (table.isRedshift() ? 1 : 0), 0};
+            pending.push_back(call);
+            if (def.firstTable < 0)
+               def.firstTable = static_cast<int>(iTable);
+         }
+         else if (last < expr.size() && expr[last] == '(')
+         {
+            const int code = functionCode(lcWord);
+            Pending call = {-1, true, {FUNC, 0, 0.0}, 0, 0};
+            if (code >= 0)
+            {
+               call.element.index = static_cast<size_t>(code);
+               call.nArgs = s_functions[code].nArgs;
+            }
+            else
+            {
+               std::map<std::string, size_t>::const_iterator itDef = m_definitionIndex.find(lcWord);
+               if (itDef == m_definitionIndex.end() || lcWord == def.name)
+                  throw StokesTable::StokesTableError(context + "unknown function or model " + word);
+               const Definition& called = *m_definitions[itDef->second];
+               call.element.type = MODEL;
+               call.element.index = itDef->second;
+               call.nArgs = called.parNames.size();
+               if (def.firstTable < 0)
+                  def.firstTable = called.firstTable;
+            }
+            pending.push_back(call);
+         }
+         else if (word == "e" || word == "E")
+         {
+            Element element = {ENG, 0, 0.0};
+            program.push_back(element);
+            isOperandExpected = false;
+            isCall = false;
+         }
+         else
+         {
+            const size_t iPar = std::find(def.parNames.begin(), def.parNames.end(), word)
+                                - def.parNames.begin();
+            if (iPar == def.parNames.size())
+               def.parNames.push_back(word);
+            Element element = {PARAM, iPar, 0.0};
+            program.push_back(element);
+            isOperandExpected = false;
+            isCall = false;
+         }
+         if (isCall)
+         {
+            if (last >= expr.size() || expr[last] != '(')
+               throw StokesTable::StokesTableError(context + "missing arguments of " + word);
+            ++last;
+         }
+         pos = last;
+      }
+      else if (isOperandExpected && c == '(')
+      {
+         Pending paren = {-1, false, {FUNC, 0, 0.0}, 0, 0};
+         pending.push_back(paren);
+         ++pos;
+      }
+      else if (isOperandExpected && c == '-')
+      {
+         Pending negate = {s_functions[NEGATE].precedence, false, {FUNC, NEGATE, 0.0}, 1, 0};
+         pending.push_back(negate);
+         ++pos;
+      }
+      else if (!isOperandExpected && (c == '+' || c == '-' || c == '*' || c == '/' || c == '^'))
+      {
+         const size_t code = std::string("+-*/^").find(c);
+         const int precedence = s_functions[code].precedence;
+         if (code != POWER)
+         {
+            while (!pending.empty() && pending.back().precedence >= precedence)
+            {
+               program.push_back(pending.back().element);
+               pending.pop_back();
+            }
+         }
+         Pending op = {precedence, false, {FUNC, code, 0.0}, 2, 0};
+         pending.push_back(op);
+         isOperandExpected = true;
+         ++pos;
+      }
+      else if (!isOperandExpected && (c == ')' || c == ','))
+      {
+         while (!pending.empty() && pending.back().precedence != -1)
+         {
+            program.push_back(pending.back().element);
+            pending.pop_back();
+         }
+         if (pending.empty())
+            throw StokesTable::StokesTableError(context + "unbalanced parentheses or misplaced comma in " + expr);
+         Pending& paren = pending.back();
+         if (c == ',')
+         {
+            if (!paren.isCall)
+               throw StokesTable::StokesTableError(context + "misplaced comma in " + expr);
+            ++paren.nCommas;
+            isOperandExpected = true;
+         }
+         else
+         {
+            if (paren.isCall)
+            {
+               if (paren.nCommas + 1 != paren.nArgs)
+               {
+                  std::ostringstream oss;
+                  oss << context << "call with " << paren.nCommas+1 << " arguments instead of "
+                      << paren.nArgs << " in " << expr;
+                  throw StokesTable::StokesTableError(oss.str());
+               }
+               program.push_back(paren.element);
+            }
+            pending.pop_back();
+         }
+         ++pos;
+      }
+      else
+         throw StokesTable::StokesTableError(context + "syntax error at " + expr.substr(pos));
+   }
+   if (isOperandExpected)
+      throw StokesTable::StokesTableError(context + "incomplete expression " + expr);
+   while (!pending.empty())
+   {
+      if (pending.back().precedence == -1)
+         throw StokesTable::StokesTableError(context + "unbalanced parentheses in " + expr);
+      program.push_back(pending.back().element);
+      pending.pop_back();
+   }
+   def.program.swap(program);
+}
+
+void MdefEngine::run (const Definition& def, const std::vector<Real>& parameters,
+                      const RealArray& energies, Workspace& work, std::vector<RealArray>& spectra) const
+{
+   if (parameters.size() != def.parNames.size())
+   {
+      std::ostringstream oss;
+      oss << "Model " << def.name << " takes " << def.parNames.size() << " parameters, not "
+          << parameters.size();
+      throw StokesTable::StokesTableError(oss.str());
+   }
+   // Band values are photons in the band, so they enter the expression as
+   // they are.
+   const size_t nBins = work.isBands ? work.bands->size() : energies.size() - 1;
+   RealArray widths(1.0, nBins);
+   for (size_t i=0; i<nBins && !work.isBands; ++i)
+      widths[i] = std::fabs(energies[i+1] - energies[i]);
+   const std::string bandError = "Model " + def.name + " is not linear in its tables: ";
+
+   std::vector<Value> stack;
+   stack.reserve(def.program.size());
+   std::vector<Real> args;
+   std::vector<RealArray> subSpectra;
+   for (size_t iElem=0; iElem<def.program.size(); ++iElem)
+   {
+      const Element& element = def.program[iElem];
+      switch (element.type)
+      {
+         case NUM:
+         case PARAM:
+         {
+            stack.push_back(Value());
+            stack.back().scalar = (element.type == NUM) ? element.value : parameters[element.index];
+            break;
+         }
+         case ENG:
+         {
+            if (work.isBands)
+               throw StokesTable::StokesTableError(bandError + "it depends on the energy");
+            stack.push_back(Value());
+            Value& value = stack.back();
+            value.isVector = true;
+            for (size_t iComp=0; iComp<3; ++iComp)
+            {
+               value.comps[iComp].resize(nBins);
+               for (size_t i=0; i<nBins; ++i)
+                  value.comps[iComp][i] = 0.5*(energies[i] + energies[i+1]);
+            }
+            break;
+         }
+         case FUNC:
+         {
+            const size_t code = element.index;
+            if (work.isBands && stack.back().isVector && code != NEGATE && code != PLUS
+                && code != MINUS && code != TIMES && code != DIVIDE)
+               throw StokesTable::StokesTableError(bandError + s_functions[code].name + " of a spectrum");
+            if (s_functions[code].nArgs == 1)
+            {
+               Value& top = stack.back();
+               if (isReduction(code))
+               {
+                  for (size_t iComp=0; iComp<(top.isVector ? 3 : 1); ++iComp)
+                  {
+                     Real& scalar = top.scalar;
+                     RealArray& comp = top.comps[iComp];
+                     Real value = nBins;
+                     if (code == MEAN)
+                        value = top.isVector ? comp.sum()/nBins : scalar;
+                     else if (code == SMIN)
+                        value = top.isVector ? comp.min() : scalar;
+                     else if (code == SMAX)
+                        value = top.isVector ? comp.max() : scalar;
+                     if (top.isVector)
+                        comp = value;
+                     else
+                        scalar = value;
+                  }
+               }
+               else if (!top.isVector)
+                  top.scalar = unaryValue(code, top.scalar);
+               else
+               {
+                  for (size_t iComp=0; iComp<3; ++iComp)
+                  {
+                     RealArray& comp = top.comps[iComp];
+                     for (size_t i=0; i<nBins; ++i)
+                        comp[i] = unaryValue(code, comp[i]);
+                  }
+               }
+               break;
+            }
+            Value second;
+            std::swap(second, stack.back());
+            stack.pop_back();
+            Value& first = stack.back();
+            if (!first.isVector && !second.isVector)
+            {
+               first.scalar = binaryValue(code, first.scalar, second.scalar);
+               break;
+            }
+            // only sums of spectra and spectra scaled by scalars in band mode
+            if (work.isBands && ((first.isVector && second.isVector) ? (code != PLUS && code != MINUS)
+                                 : (code != TIMES && (code != DIVIDE || second.isVector))))
+               throw StokesTable::StokesTableError(bandError + "spectra combined by "
+                                                   + s_functions[code].name);
+            first.broadcast(nBins);
+            for (size_t iComp=0; iComp<3; ++iComp)
+            {
+               RealArray& x = first.comps[iComp];
+               if (!second.isVector)
+               {
+                  const Real y = second.scalar;
+                  switch (code)
+                  {
+                     case PLUS:   x += y; break;
+                     case MINUS:  x -= y; break;
+                     case TIMES:  x *= y; break;
+                     case DIVIDE: x /= y; break;
+                     default:
+                        for (size_t i=0; i<nBins; ++i)
+                           x[i] = binaryValue(code, x[i], y);
+                  }
+                  continue;
+               }
+               const RealArray& y = second.comps[iComp];
+               switch (code)
+               {
+                  case PLUS:   x += y; break;
+                  case MINUS:  x -= y; break;
+                  case TIMES:  x *= y; break;
+                  case DIVIDE: x /= y; break;
+                  default:
+                     for (size_t i=0; i<nBins; ++i)
+                        x[i] = binaryValue(code, x[i], y[i]);
+               }
+            }
+            break;
+         }
+         case MODEL:
+         case TABLE:
+         {
+            // arguments are the first values of their arrays, as in XSPEC
+            const Definition* called = (element.type == MODEL) ? m_definitions[element.index].get() : 0;
+            const StokesTable* table = called ? 0 : &m_tables[element.index]->table;
+            const size_t nArgs = called ? called->parNames.size()
+                                        : table->nParameters() + (table->isRedshift() ? 1 : 0);
+            if (stack.size() < nArgs)
+               throw StokesTable::StokesTableError("Model " + def.name + ": too few arguments");
+            args.resize(nArgs);
+            for (size_t i=0; i<nArgs; ++i)
+               args[i] = stack[stack.size()-nArgs+i].first();
+            stack.resize(stack.size()-nArgs);
+            stack.push_back(Value());
+            Value& result = stack.back();
+            if (called)
+            {
+               run(*called, args, energies, work, subSpectra);
+               result.isVector = true;
+               for (size_t iComp=0; iComp<3; ++iComp)
+                  result.comps[iComp].swap(subSpectra[iComp]);
+            }
+            else
+               callTable(element.index, args, energies, work, result);
+            // additive results enter the expression per unit energy
+            if (!called || called->isAdditive)
+            {
+               for (size_t iComp=0; iComp<3; ++iComp)
+                  result.comps[iComp] /= widths;
+            }
+            break;
+         }
+      }
+   }
+   if (stack.size() != 1)
+      throw StokesTable::StokesTableError("Model " + def.name + ": malformed program");
+   Value& result = stack.back();
+   if (work.isBands && !result.isVector)
+      throw StokesTable::StokesTableError("Model " + def.name + " calls no table");
+   result.broadcast(nBins);
+   spectra.resize(3);
+   for (size_t iComp=0; iComp<3; ++iComp)
+   {
+      spectra[iComp].resize(nBins);
+      spectra[iComp] = result.comps[iComp];
+      if (def.isAdditive)
+         spectra[iComp] *= widths;
+   }
+}
+
+void MdefEngine::callTable (size_t iTable, const std::vector<Real>& args, const RealArray& energies,
+                            Workspace& work, Value& result) const
+{
+   const Table& entry = *m_tables[iTable];
+   const StokesTable& table = work.isBands ? entry.bandTable : entry.table;
+   const size_t nPars = table.nParameters();
+   std::vector<Real> parValues(args.begin(), args.begin() + nPars);
+   const Real redshift = entry.table.isRedshift() ? args[nPars] : 0.0;
+   if (work.isBands)
+   {
+      if (!sameBands(entry.table.bands(), *work.bands))
+         throw StokesTable::StokesTableError(entry.fileName + " has other bands than the first table");
+      if (redshift != 0.0)
+         throw StokesTable::StokesTableError("Band values need z = 0");
+   }
+
+   // For Phi > 180 deg interpolate a half-Phi table at 360-Phi and apply the
+   // reflection: u changes sign, and the 45 deg table turns into -45 deg,
+   // S45(360-Phi) = M [2 S0(Phi) - S45(Phi)].
+   const int phiIndex = table.phiMirrorIndex();
+   const bool isMirrored = (phiIndex >= 0 && parValues[phiIndex] > 180.0);
+   if (isMirrored)
+      parValues[phiIndex] = 360.0 - parValues[phiIndex];
+   std::vector<RealArray>& spectra = work.tableSpectra;
+   work.interpolator(table, iTable).interpolate(parValues, spectra);
+   const size_t nComps = std::min(table.nComponents(), static_cast<size_t>(3));
+   if (isMirrored)
+   {
+      if (entry.reference >= 0)
+      {
+         const Table& refEntry = *m_tables[entry.reference];
+         const StokesTable& refTable = work.isBands ? refEntry.bandTable : refEntry.table;
+         if (work.isBands && !sameBands(refEntry.table.bands(), *work.bands))
+            throw StokesTable::StokesTableError(refEntry.fileName + " has other bands than the first table");
+         work.interpolator(refTable, entry.reference).interpolate(parValues, work.refSpectra);
+         for (size_t iComp=0; iComp<nComps; ++iComp)
+            spectra[iComp] = 2.0*work.refSpectra[iComp] - spectra[iComp];
+      }
+      if (nComps > StokesTable::U_COMP)
+         spectra[StokesTable::U_COMP] *= -1.0;
+   }
+
+   result.isVector = true;
+   for (size_t iComp=0; iComp<3; ++iComp)
+   {
+      if (work.isBands)
+      {
+         if (iComp < nComps)
+            result.comps[iComp].swap(spectra[iComp]);
+         else
+            result.comps[iComp].resize(table.nEnergies(), 0.0);
+      }
+      else if (iComp < nComps)
+         redistribute(table.energyLow(), table.energyHigh(), spectra[iComp], 1.0 + redshift,
+                      energies, result.comps[iComp]);
+      else
+         result.comps[iComp].resize(energies.size() - 1, 0.0);
+   }
+}
+
+void MdefEngine::defaultEnergies (const Definition& def, const RealArray& energies,
+                                  RealArray& edges) const
+{
+   if (energies.size() >= 2)
+   {
+      edges.resize(energies.size());
+      edges = energies;
+      return;
+   }
+   if (energies.size() != 0 || def.firstTable < 0)
+      throw StokesTable::StokesTableError("Model " + def.name + " needs at least two energies");
+   const StokesTable& table = m_tables[def.firstTable]->table;
+   const size_t nEngs = table.nEnergies();
+   edges.resize(nEngs + 1);
+   for (size_t i=0; i<nEngs; ++i)
+      edges[i] = table.energyLow()[i];
+   edges[nEngs] = table.energyHigh()[nEngs-1];
+}
@@ -0,0 +1,170 @@
+#ifndef MDEFENGINE_H
+#define MDEFENGINE_H 1
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "StokesTable.h"
+#include "TableInterpolator.h"
+
+// MdefEngine evaluates mdefine'd models outside XSPEC: the definitions of
+// STOKES_model_definitions.xcm (stunp, stvrp, st45d, stiso, stpol, stokes)
+// and other expressions of the same kind.  Expressions are compiled to
+// postfix programs as by MdefExpression, with the same operators,
+// precedence and functions, parameters named in order of first appearance,
+// calls of models defined before and atable{file}(...) calls of additive
+// tables, which are read when the definition is made.  Evaluation follows
+// MdefExpression::evaluate: table and additive model results enter the
+// expression per unit energy, and the result of an additive model is
+// multiplied by the bin widths.
+//
+// Tables are interpolated by TableInterpolator on their energy bins and
+// redistributed onto the requested ones in proportion to the overlap, with
+// the energies of tables with a redshift parameter scaled by 1+z and the
+// spectrum divided by 1+z.  Half-Phi tables written by stokes_phisym are
+// reflected for Phi > 180 deg as in MdefExpression.  i, q and u are
+// evaluated together; tables without Q_SPEC and U_SPEC give zero q and u.
+//
+// Tables with band layers (see StokesTable::bands()) can also be evaluated
+// in those bands alone by evaluateBands(), which interpolates the layers
+// instead of the spectra.  This is exact for models that are linear in the
+// tables, as all of STOKES_model_definitions.xcm: the tables may be added,
+// subtracted and multiplied or divided by scalars, and models or functions
+// of the energies, reductions and other operations on the spectra are
+// rejected, as is a redshift other than 0.  All tables must have the same
+// bands.
+//
+// Once the definitions are made, evaluate() and evaluateBatch() are const
+// and keep all their working state local, so any number of threads may
+// evaluate concurrently.  Definitions must not be changed meanwhile.
+
+class MdefEngine
+{
+   public:
+      MdefEngine ();
+      ~MdefEngine ();
+
+      // Read the 'set' and 'mdefine' commands of an XSPEC script such as
+      // STOKES_model_definitions.xcm, ignoring all others.  $NAME and
+      // ${NAME} are replaced by the variables set so far.
+      void readScript (const std::string& fileName);
+      void variable (const std::string& name, const std::string& value);
+      // compType is add or mul.
+      void define (const std::string& name, const std::string& expression,
+                   const std::string& compType = "add");
+      // Additive model name calling the table fileName alone, with the
+      // parameters of the table (and z for a redshift parameter).
+      void defineTable (const std::string& name, const std::string& fileName);
+      // Read table fileName (and the unpolarised half table it reflects
+      // with) again, e.g. after the file was replaced.  The models calling
+      // it use the new table; those made by defineTable() should be defined
+      // again, as its parameters may have changed.
+      void rereadTable (const std::string& fileName);
+
+      bool hasModel (const std::string& name) const;
+      const std::vector<std::string>& parameterNames (const std::string& name) const;
+      // Energy bin edges of the first table used by the model.
+      void tableEnergies (const std::string& name, RealArray& energies) const;
+      // Files of the first table used by the model and of its unpolarised
+      // half table, if any.
+      void tableFiles (const std::string& name, std::vector<std::string>& fileNames) const;
+
+      // i, q and u of model name for one parameter set on the bins between
+      // consecutive energies (as in XSPEC), or on the table bins if energies
+      // is empty.
+      void evaluate (const std::string& name, const std::vector<Real>& parameters,
+                     const RealArray& energies, std::vector<RealArray>& spectra) const;
+      // The same for each of parameterSets, on nThreads threads (0 for one
+      // per hardware thread).
+      void evaluateBatch (const std::string& name,
+                          const std::vector<std::vector<Real> >& parameterSets,
+                          const RealArray& energies,
+                          std::vector<std::vector<RealArray> >& spectra, size_t nThreads) const;
+
+      // Band layers of the first table used by model name, empty if it has
+      // none.
+      const std::vector<StokesTable::Band>& bands (const std::string& name) const;
+      // i, q and u of model name in each of these bands for each of
+      // parameterSets, on nThreads threads.
+      void evaluateBands (const std::string& name,
+                          const std::vector<std::vector<Real> >& parameterSets,
+                          std::vector<std::vector<RealArray> >& values, size_t nThreads) const;
+
+      // Tables read from now on are kept in single precision.
+      bool isSingleStorage () const;
+      void isSingleStorage (bool value);
+
+   private:
+      MdefEngine (const MdefEngine& right);
+      MdefEngine& operator= (const MdefEngine& right);
+
+      enum ElementType {NUM, PARAM, ENG, FUNC, MODEL, TABLE};
+
+      struct Element
+      {
+         ElementType type;
+         // parameter, function, model or table index
+         size_t index;
+         Real value;
+      };
+
+      struct Definition
+      {
+         std::string name;
+         bool isAdditive;
+         std::vector<std::string> parNames;
+         std::vector<Element> program;
+         // first table called, directly or not, -1 for none
+         int firstTable;
+      };
+
+      struct Table
+      {
+         std::string fileName;
+         StokesTable table;
+         // unpolarised half table of a 45 deg half-Phi table, -1 for none
+         int reference;
+         // the band layers as a table, empty for none
+         StokesTable bandTable;
+      };
+
+      struct Value;
+      struct Workspace;
+
+      const Definition& definition (const std::string& name) const;
+      void install (std::unique_ptr<Definition>& def);
+      void runBatch (const Definition& def, const std::vector<std::vector<Real> >& parameterSets,
+                     const RealArray& energies, bool isBands,
+                     std::vector<std::vector<RealArray> >& spectra, size_t nThreads) const;
+      size_t tableIndex (const std::string& fileName);
+      void readTable (const std::string& fileName, Table& entry, std::string& reference) const;
+      void compile (const std::string& expression, Definition& def);
+      void run (const Definition& def, const std::vector<Real>& parameters, const RealArray& energies,
+                Workspace& work, std::vector<RealArray>& spectra) const;
+      void callTable (size_t iTable, const std::vector<Real>& args, const RealArray& energies,
+                      Workspace& work, Value& result) const;
+      void defaultEnergies (const Definition& def, const RealArray& energies,
+                            RealArray& edges) const;
+
+      std::map<std::string, std::string> m_variables;
+      std::vector<std::unique_ptr<Definition> > m_definitions;
+      std::map<std::string, size_t> m_definitionIndex;
+      std::vector<std::unique_ptr<Table> > m_tables;
+      bool m_isSingleStorage;
+};
+
+// Class MdefEngine
+
+inline bool MdefEngine::isSingleStorage () const
+{
+   return m_isSingleStorage;
+}
+
+inline void MdefEngine::isSingleStorage (bool value)
+{
+   m_isSingleStorage = value;
+}
+
+#endif
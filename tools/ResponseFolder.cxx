@@ -0,0 +1,356 @@
+#include <fitsio.h>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "ResponseFolder.h"
+
+namespace {
+
+   void checkStatus (int status, const std::string& context)
+   {
+      if (status)
+      {
+         char statusText[FLEN_STATUS];
+         fits_get_errstatus(status, statusText);
+         std::ostringstream oss;
+         oss << context << ": " << statusText << " (CFITSIO status " << status << ")";
+         throw StokesTable::StokesTableError(oss.str());
+      }
+   }
+
+   int columnNumber (fitsfile* fptr, const char* colName)
+   {
+      int status = 0;
+      int colNum = 0;
+      fits_get_colnum(fptr, CASEINSEN, const_cast<char*>(colName), &colNum, &status);
+      checkStatus(status, std::string("Locating column ") + colName);
+      return colNum;
+   }
+
+   // Moves to the first of the extensions named, which need not all exist.
+   void moveToExtension (fitsfile* fptr, const char* const* extNames, size_t nNames)
+   {
+      int status = 0;
+      for (size_t i=0; i<nNames; ++i)
+      {
+         status = 0;
+         fits_movnam_hdu(fptr, BINARY_TBL, const_cast<char*>(extNames[i]), 0, &status);
+         if (status == 0)
+            return;
+      }
+      fits_clear_errmsg();
+      checkStatus(status, std::string("Moving to extension ") + extNames[0]);
+   }
+
+   long numberOfRows (fitsfile* fptr)
+   {
+      int status = 0;
+      long nRows = 0;
+      fits_get_num_rows(fptr, &nRows, &status);
+      checkStatus(status, "Reading the number of rows");
+      return nRows;
+   }
+
+   // SPECRESP of an ARF or MRF, which must be on the energy bins of the RMF.
+   void readResponse (const std::string& fileName, const RealArray& energyLow, RealArray& response)
+   {
+      fitsfile* fptr = 0;
+      int status = 0;
+      fits_open_file(&fptr, fileName.c_str(), READONLY, &status);
+      checkStatus(status, "Opening " + fileName);
+      try
+      {
+         const char* extNames[] = {"SPECRESP"};
+         moveToExtension(fptr, extNames, 1);
+         const long nRows = numberOfRows(fptr);
+         if (static_cast<size_t>(nRows) != energyLow.size())
+            throw StokesTable::StokesTableError(fileName + " is not on the energy bins of the RMF");
+         RealArray fileLow(nRows);
+         response.resize(nRows);
+         fits_read_col(fptr, TDOUBLE, columnNumber(fptr, "ENERG_LO"), 1, 1, nRows, 0, &fileLow[0], 0,
+                       &status);
+         fits_read_col(fptr, TDOUBLE, columnNumber(fptr, "SPECRESP"), 1, 1, nRows, 0, &response[0], 0,
+                       &status);
+         checkStatus(status, "Reading " + fileName);
+         for (long i=0; i<nRows; ++i)
+         {
+            if (std::abs(fileLow[i] - energyLow[i]) > 1.0e-5*energyLow[i])
+               throw StokesTable::StokesTableError(fileName + " is not on the energy bins of the RMF");
+         }
+      }
+      catch (...)
+      {
+         int closeStatus = 0;
+         fits_close_file(fptr, &closeStatus);
+         throw;
+      }
+      fits_close_file(fptr, &status);
+      checkStatus(status, "Closing " + fileName);
+   }
+
+} // namespace
+
+// Class ResponseFolder
+
+ResponseFolder::ResponseFolder ()
+   : m_energyLow(),
+     m_energyHigh(),
+     m_channelLow(),
+     m_channelHigh(),
+     m_firstChannel(1),
+     m_rowStart(1, 0),
+     m_groupChannel(),
+     m_groupLength(),
+     m_groupOffset(),
+     m_values(),
+     m_effectiveArea(),
+     m_modulationResponse(),
+     m_nModelBins(0),
+     m_modelStart(),
+     m_modelIndex(),
+     m_modelWeight()
+{
+}
+
+void ResponseFolder::read (const std::string& rmfName, const std::string& arfName,
+                           const std::string& mrfName)
+{
+   fitsfile* fptr = 0;
+   int status = 0;
+   fits_open_file(&fptr, rmfName.c_str(), READONLY, &status);
+   checkStatus(status, "Opening response " + rmfName);
+   try
+   {
+      // EBOUNDS
+      const char* boundsNames[] = {"EBOUNDS"};
+      moveToExtension(fptr, boundsNames, 1);
+      const long nChans = numberOfRows(fptr);
+      RealArray channelLow(nChans), channelHigh(nChans);
+      fits_read_col(fptr, TDOUBLE, columnNumber(fptr, "E_MIN"), 1, 1, nChans, 0, &channelLow[0], 0,
+                    &status);
+      fits_read_col(fptr, TDOUBLE, columnNumber(fptr, "E_MAX"), 1, 1, nChans, 0, &channelHigh[0], 0,
+                    &status);
+      checkStatus(status, "Reading EBOUNDS");
+
+      // MATRIX
+      const char* matrixNames[] = {"MATRIX", "SPECRESP MATRIX"};
+      moveToExtension(fptr, matrixNames, 2);
+      const long nEngs = numberOfRows(fptr);
+      RealArray energyLow(nEngs), energyHigh(nEngs);
+      fits_read_col(fptr, TDOUBLE, columnNumber(fptr, "ENERG_LO"), 1, 1, nEngs, 0, &energyLow[0], 0,
+                    &status);
+      fits_read_col(fptr, TDOUBLE, columnNumber(fptr, "ENERG_HI"), 1, 1, nEngs, 0, &energyHigh[0], 0,
+                    &status);
+      checkStatus(status, "Reading the energies of the RMF");
+      reset(energyLow, energyHigh, channelLow, channelHigh);
+      const int nGroupCol = columnNumber(fptr, "N_GRP");
+      const int firstChanCol = columnNumber(fptr, "F_CHAN");
+      const int nChanCol = columnNumber(fptr, "N_CHAN");
+      const int matrixCol = columnNumber(fptr, "MATRIX");
+      // channel numbers start at TLMIN of F_CHAN, 1 if not given
+      long firstChannel = 1;
+      std::ostringstream tlmin;
+      tlmin << "TLMIN" << firstChanCol;
+      fits_read_key(fptr, TLONG, tlmin.str().c_str(), &firstChannel, 0, &status);
+      if (status == KEY_NO_EXIST)
+      {
+         status = 0;
+         fits_clear_errmsg();
+         firstChannel = 1;
+      }
+      checkStatus(status, "Reading " + tlmin.str());
+      m_firstChannel = firstChannel;
+      std::vector<long> groupFirst, groupLength;
+      std::vector<Real> values;
+      for (long row=1; row<=nEngs; ++row)
+      {
+         int nGroups = 0;
+         fits_read_col(fptr, TINT, nGroupCol, row, 1, 1, 0, &nGroups, 0, &status);
+         checkStatus(status, "Reading N_GRP");
+         if (nGroups <= 0)
+            continue;
+         groupFirst.resize(nGroups);
+         groupLength.resize(nGroups);
+         fits_read_col(fptr, TLONG, firstChanCol, row, 1, nGroups, 0, &groupFirst[0], 0, &status);
+         fits_read_col(fptr, TLONG, nChanCol, row, 1, nGroups, 0, &groupLength[0], 0, &status);
+         checkStatus(status, "Reading F_CHAN and N_CHAN");
+         long nValues = 0;
+         for (int g=0; g<nGroups; ++g)
+            nValues += groupLength[g];
+         values.resize(std::max(nValues, 1L));
+         fits_read_col(fptr, TDOUBLE, matrixCol, row, 1, nValues, 0, &values[0], 0, &status);
+         checkStatus(status, "Reading MATRIX");
+         size_t offset = 0;
+         for (int g=0; g<nGroups; ++g)
+         {
+            const long first = groupFirst[g] - firstChannel;
+            if (first < 0 || first + groupLength[g] > nChans)
+               throw StokesTable::StokesTableError("RMF group outside the channels of " + rmfName);
+            addGroup(row-1, first, &values[offset], groupLength[g]);
+            offset += groupLength[g];
+         }
+      }
+   }
+   catch (...)
+   {
+      int closeStatus = 0;
+      fits_close_file(fptr, &closeStatus);
+      throw;
+   }
+   fits_close_file(fptr, &status);
+   checkStatus(status, "Closing response " + rmfName);
+
+   if (!arfName.empty())
+      readResponse(arfName, m_energyLow, m_effectiveArea);
+   if (!mrfName.empty())
+      readResponse(mrfName, m_energyLow, m_modulationResponse);
+}
+
+void ResponseFolder::reset (const RealArray& energyLow, const RealArray& energyHigh,
+                            const RealArray& channelLow, const RealArray& channelHigh)
+{
+   if (energyLow.size() != energyHigh.size() || channelLow.size() != channelHigh.size())
+      throw StokesTable::StokesTableError("Energy bin edge arrays differ in size");
+   m_energyLow.resize(energyLow.size());
+   m_energyLow = energyLow;
+   m_energyHigh.resize(energyHigh.size());
+   m_energyHigh = energyHigh;
+   m_channelLow.resize(channelLow.size());
+   m_channelLow = channelLow;
+   m_channelHigh.resize(channelHigh.size());
+   m_channelHigh = channelHigh;
+   m_rowStart.assign(energyLow.size()+1, 0);
+   m_groupChannel.clear();
+   m_groupLength.clear();
+   m_groupOffset.clear();
+   m_values.clear();
+   m_effectiveArea.resize(energyLow.size());
+   m_effectiveArea = 1.0;
+   m_modulationResponse.resize(energyLow.size());
+   m_modulationResponse = 1.0;
+   m_nModelBins = energyLow.size();
+   m_modelStart.clear();
+   m_modelIndex.clear();
+   m_modelWeight.clear();
+}
+
+void ResponseFolder::addGroup (size_t iEnergy, size_t firstChannel, const Real* values,
+                               size_t nValues)
+{
+   const size_t nEngs = nEnergies();
+   if (iEnergy >= nEngs || firstChannel + nValues > nChannels())
+      throw StokesTable::StokesTableError("Response group outside the matrix");
+   if (m_rowStart[iEnergy+1] != m_groupChannel.size())
+      throw StokesTable::StokesTableError("Response rows must be filled in order");
+   m_groupChannel.push_back(firstChannel);
+   m_groupLength.push_back(nValues);
+   m_groupOffset.push_back(m_values.size());
+   m_values.insert(m_values.end(), values, values + nValues);
+   for (size_t i=iEnergy+1; i<=nEngs; ++i)
+      m_rowStart[i] = m_groupChannel.size();
+}
+
+void ResponseFolder::effectiveArea (const RealArray& value)
+{
+   if (value.size() != nEnergies())
+      throw StokesTable::StokesTableError("The effective area is not on the energy bins of the response");
+   m_effectiveArea = value;
+}
+
+void ResponseFolder::modulationResponse (const RealArray& value)
+{
+   if (value.size() != nEnergies())
+      throw StokesTable::StokesTableError("The modulation response is not on the energy bins of the response");
+   m_modulationResponse = value;
+}
+
+void ResponseFolder::modelBins (const RealArray& energyLow, const RealArray& energyHigh)
+{
+   if (energyLow.size() != energyHigh.size())
+      throw StokesTable::StokesTableError("Energy bin edge arrays differ in size");
+   // Fraction of each model bin within each response bin, both in
+   // increasing energy.
+   const size_t nEngs = nEnergies();
+   const size_t nModel = energyLow.size();
+   m_nModelBins = nModel;
+   m_modelStart.assign(nEngs+1, 0);
+   m_modelIndex.clear();
+   m_modelWeight.clear();
+   size_t iFirst = 0;
+   for (size_t iEng=0; iEng<nEngs; ++iEng)
+   {
+      const Real low = m_energyLow[iEng];
+      const Real high = m_energyHigh[iEng];
+      while (iFirst < nModel && energyHigh[iFirst] <= low)
+         ++iFirst;
+      for (size_t iModel=iFirst; iModel<nModel && energyLow[iModel] < high; ++iModel)
+      {
+         const Real width = energyHigh[iModel] - energyLow[iModel];
+         const Real overlap = std::min(high, energyHigh[iModel]) - std::max(low, energyLow[iModel]);
+         if (width <= 0.0 || overlap <= 0.0)
+            continue;
+         m_modelIndex.push_back(iModel);
+         m_modelWeight.push_back(overlap/width);
+      }
+      m_modelStart[iEng+1] = m_modelIndex.size();
+   }
+}
+
+void ResponseFolder::fold (const Real* iFlux, const Real* qFlux, const Real* uFlux,
+                           RealArray& iCounts, RealArray& qCounts, RealArray& uCounts) const
+{
+   const size_t nChans = nChannels();
+   iCounts.resize(nChans);
+   qCounts.resize(nChans);
+   uCounts.resize(nChans);
+   iCounts = 0.0;
+   qCounts = 0.0;
+   uCounts = 0.0;
+   Real* iOut = &iCounts[0];
+   Real* qOut = &qCounts[0];
+   Real* uOut = &uCounts[0];
+   const size_t nEngs = nEnergies();
+   for (size_t iEng=0; iEng<nEngs; ++iEng)
+   {
+      Real i = 0.0, q = 0.0, u = 0.0;
+      rowFlux(iEng, iFlux, i);
+      if (qFlux)
+         rowFlux(iEng, qFlux, q);
+      if (uFlux)
+         rowFlux(iEng, uFlux, u);
+      const Real iScale = i*m_effectiveArea[iEng];
+      const Real qScale = q*m_modulationResponse[iEng];
+      const Real uScale = u*m_modulationResponse[iEng];
+      if (iScale == 0.0 && qScale == 0.0 && uScale == 0.0)
+         continue;
+      for (size_t iGroup=m_rowStart[iEng]; iGroup<m_rowStart[iEng+1]; ++iGroup)
+      {
+         const float* values = &m_values[m_groupOffset[iGroup]];
+         const size_t first = m_groupChannel[iGroup];
+         Real* iGroupOut = iOut + first;
+         Real* qGroupOut = qOut + first;
+         Real* uGroupOut = uOut + first;
+         const size_t nValues = m_groupLength[iGroup];
+         for (size_t k=0; k<nValues; ++k)
+         {
+            const Real value = values[k];
+            iGroupOut[k] += iScale*value;
+            qGroupOut[k] += qScale*value;
+            uGroupOut[k] += uScale*value;
+         }
+      }
+   }
+}
+
+void ResponseFolder::rowFlux (size_t iEnergy, const Real* flux, Real& value) const
+{
+   if (m_modelStart.empty())
+   {
+      value = flux[iEnergy];
+      return;
+   }
+   value = 0.0;
+   for (size_t k=m_modelStart[iEnergy]; k<m_modelStart[iEnergy+1]; ++k)
+      value += m_modelWeight[k]*flux[m_modelIndex[k]];
+}
@@ -0,0 +1,128 @@
+#ifndef RESPONSEFOLDER_H
+#define RESPONSEFOLDER_H 1
+
+#include <string>
+#include <vector>
+
+#include "StokesTable.h"
+
+// ResponseFolder folds model spectra of the Stokes i, q and u into counts
+// per channel through an OGIP response, i through the redistribution
+// matrix (RMF) and the effective area (ARF), q and u through the RMF and
+// the modulation response (MRF), as XSPEC does for the three datasets of
+// load_null_data.xcm.  All three are folded in a single pass over the
+// matrix.
+//
+// The matrix is kept as in the RMF, row by row of the energy bins, each row
+// a list of groups of consecutive channels, the values of a group stored
+// contiguously in single precision (the precision of the files).  Folding
+// a row thus adds three scaled copies of each group to the counts, which
+// the compiler vectorises.  Model spectra may be given on other energy bins
+// (e.g. those of the tables): they are then redistributed onto the bins of
+// the response in proportion to the overlap within the same pass, reading
+// the model arrays where they are without intermediate copies.
+
+class ResponseFolder
+{
+   public:
+      ResponseFolder();
+
+      // mrfName may be empty for i only, arfName too for a response already
+      // including the effective area.
+      void read (const std::string& rmfName, const std::string& arfName,
+                 const std::string& mrfName);
+      // Replace the response by an empty matrix, unit effective area and
+      // modulation response and no model bins.
+      void reset (const RealArray& energyLow, const RealArray& energyHigh,
+                  const RealArray& channelLow, const RealArray& channelHigh);
+      // Append a group of values of energy row iEnergy from channel
+      // firstChannel (0-based) on.  Rows are filled in order.
+      void addGroup (size_t iEnergy, size_t firstChannel, const Real* values, size_t nValues);
+      void effectiveArea (const RealArray& value);
+      void modulationResponse (const RealArray& value);
+      // Energy bins of the model spectra, if not those of the response.
+      void modelBins (const RealArray& energyLow, const RealArray& energyHigh);
+
+      // Counts per channel of the i, q and u model spectra (photons per bin
+      // as for additive models), on the model bins.  qFlux and uFlux may be
+      // 0, giving zero counts.
+      void fold (const Real* iFlux, const Real* qFlux, const Real* uFlux, RealArray& iCounts,
+                 RealArray& qCounts, RealArray& uCounts) const;
+
+      size_t nEnergies () const;
+      size_t nChannels () const;
+      size_t nModelBins () const;
+      const RealArray& energyLow () const;
+      const RealArray& energyHigh () const;
+      const RealArray& channelLow () const;
+      const RealArray& channelHigh () const;
+      // Number of the first channel in the files (TLMIN of F_CHAN).
+      long firstChannel () const;
+
+   private:
+      void rowFlux (size_t iEnergy, const Real* flux, Real& value) const;
+
+      RealArray m_energyLow;
+      RealArray m_energyHigh;
+      RealArray m_channelLow;
+      RealArray m_channelHigh;
+      long m_firstChannel;
+      // groups of each row, and channel, length and first value of each group
+      std::vector<size_t> m_rowStart;
+      std::vector<size_t> m_groupChannel;
+      std::vector<size_t> m_groupLength;
+      std::vector<size_t> m_groupOffset;
+      std::vector<float> m_values;
+      RealArray m_effectiveArea;
+      RealArray m_modulationResponse;
+      // model bins contributing to each energy bin of the response, empty
+      // for the bins of the response
+      size_t m_nModelBins;
+      std::vector<size_t> m_modelStart;
+      std::vector<size_t> m_modelIndex;
+      std::vector<Real> m_modelWeight;
+};
+
+// Class ResponseFolder
+
+inline size_t ResponseFolder::nEnergies () const
+{
+   return m_energyLow.size();
+}
+
+inline size_t ResponseFolder::nChannels () const
+{
+   return m_channelLow.size();
+}
+
+inline size_t ResponseFolder::nModelBins () const
+{
+   return m_nModelBins;
+}
+
+inline const RealArray& ResponseFolder::energyLow () const
+{
+   return m_energyLow;
+}
+
+inline const RealArray& ResponseFolder::energyHigh () const
+{
+   return m_energyHigh;
+}
+
+inline const RealArray& ResponseFolder::channelLow () const
+{
+   return m_channelLow;
+}
+
+inline const RealArray& ResponseFolder::channelHigh () const
+{
+   return m_channelHigh;
+}
+
+inline long ResponseFolder::firstChannel () const
+{
+   return m_firstChannel;
+}
+
+#endif
@@ -0,0 +1,280 @@
+#include <fitsio.h>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "SpectrumSimulator.h"
+
+namespace {
+
+   // Philox4x32-10 (Salmon et al. 2011): four 32-bit random numbers per
+   // counter value and key.
+   void philoxBlock (const unsigned int key[2], const unsigned int counter[4], unsigned int out[4])
+   {
+      const unsigned long long m0 = 0xD2511F53ULL;
+      const unsigned long long m1 = 0xCD9E8D57ULL;
+      unsigned int k0 = key[0], k1 = key[1];
+      unsigned int c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+      for (int round=0; round<10; ++round)
+      {
+         const unsigned long long p0 = m0*c0;
+         const unsigned long long p1 = m1*c2;
+         const unsigned int hi0 = static_cast<unsigned int>(p0 >> 32);
+         const unsigned int hi1 = static_cast<unsigned int>(p1 >> 32);
+         c0 = hi1 ^ c1 ^ k0;
+         c1 = static_cast<unsigned int>(p1);
+         c2 = hi0 ^ c3 ^ k1;
+         c3 = static_cast<unsigned int>(p0);
+         k0 += 0x9E3779B9U;
+         k1 += 0xBB67AE85U;
+      }
+      out[0] = c0;
+      out[1] = c1;
+      out[2] = c2;
+      out[3] = c3;
+   }
+
+   // The random numbers of one channel of one dataset of one simulation.
+   class ChannelRandom
+   {
+      public:
+         ChannelRandom (unsigned long long seed, unsigned long long simulation, size_t dataset,
+                        size_t channel)
+            : m_nextBlock(0), m_nUsed(4)
+         {
+            m_key[0] = static_cast<unsigned int>(seed);
+            m_key[1] = static_cast<unsigned int>(seed >> 32);
+            m_counter[0] = static_cast<unsigned int>(simulation);
+            m_counter[1] = static_cast<unsigned int>(simulation >> 32);
+            m_counter[2] = static_cast<unsigned int>(dataset << 28 | channel);
+         }
+
+         // uniform in (0, 1)
+         Real uniform ()
+         {
+            if (m_nUsed == 4)
+            {
+               m_counter[3] = m_nextBlock++;
+               philoxBlock(m_key, m_counter, m_block);
+               m_nUsed = 0;
+            }
+            return (m_block[m_nUsed++] + 0.5)*(1.0/4294967296.0);
+         }
+
+         Real normal ()
+         {
+            const Real radius = std::sqrt(-2.0*std::log(uniform()));
+            return radius*std::cos(2.0*M_PI*uniform());
+         }
+
+         // Inversion for small means, else the transformed rejection of
+         // Hormann (1993).
+         Real poisson (Real mean)
+         {
+            if (!(mean > 0.0))
+               return 0.0;
+            if (mean < 10.0)
+            {
+               Real probability = std::exp(-mean);
+               Real cumulative = probability;
+               const Real u = uniform();
+               Real k = 0.0;
+               while (u > cumulative && k < 1000.0)
+               {
+                  k += 1.0;
+                  probability *= mean/k;
+                  cumulative += probability;
+               }
+               return k;
+            }
+            const Real sqrtMean = std::sqrt(mean);
+            const Real logMean = std::log(mean);
+            const Real b = 0.931 + 2.53*sqrtMean;
+            const Real a = -0.059 + 0.02483*b;
+            const Real invAlpha = 1.1239 + 1.1328/(b - 3.4);
+            const Real vr = 0.9277 - 3.6224/(b - 2.0);
+            while (true)
+            {
+               const Real u = uniform() - 0.5;
+               const Real v = uniform();
+               const Real us = 0.5 - std::fabs(u);
+               const Real k = std::floor((2.0*a/us + b)*u + mean + 0.43);
+               if (us >= 0.07 && v <= vr)
+                  return k;
+               if (k < 0.0 || (us < 0.013 && v > us))
+                  continue;
+               if (std::log(v) + std::log(invAlpha) - std::log(a/(us*us) + b)
+                   <= -mean + k*logMean - std::lgamma(k + 1.0))
+                  return k;
+            }
+         }
+
+      private:
+         unsigned int m_key[2];
+         unsigned int m_counter[4];
+         unsigned int m_block[4];
+         unsigned int m_nextBlock;
+         size_t m_nUsed;
+   };
+
+   void checkStatus (int status, const std::string& context)
+   {
+      if (status)
+      {
+         char statusText[FLEN_STATUS];
+         fits_get_errstatus(status, statusText);
+         std::ostringstream oss;
+         oss << context << ": " << statusText << " (CFITSIO status " << status << ")";
+         throw StokesTable::StokesTableError(oss.str());
+      }
+   }
+
+   void writeStringKey (fitsfile* fptr, const char* keyName, const std::string& value,
+                        const char* comment)
+   {
+      int status = 0;
+      fits_write_key(fptr, TSTRING, keyName, const_cast<char*>(value.c_str()),
+                     comment, &status);
+      checkStatus(status, std::string("Writing keyword ") + keyName);
+   }
+
+   void writeLogicalKey (fitsfile* fptr, const char* keyName, bool value, const char* comment)
+   {
+      int status = 0;
+      int logical = value ? 1 : 0;
+      fits_write_key(fptr, TLOGICAL, keyName, &logical, comment, &status);
+      checkStatus(status, std::string("Writing keyword ") + keyName);
+   }
+
+   void writeRealKey (fitsfile* fptr, const char* keyName, Real value, const char* comment)
+   {
+      int status = 0;
+      fits_write_key(fptr, TDOUBLE, keyName, &value, comment, &status);
+      checkStatus(status, std::string("Writing keyword ") + keyName);
+   }
+
+} // namespace
+
+// Class SpectrumSimulator
+
+SpectrumSimulator::SpectrumSimulator (const MdefEngine& engine, const std::string& modelName,
+                                      const ResponseFolder& response)
+   : m_engine(engine),
+     m_modelName(modelName),
+     m_response(response),
+     m_energies(),
+     m_exposure(1.0),
+     m_seed(0)
+{
+   const size_t nEngs = response.nEnergies();
+   if (nEngs == 0 || response.nModelBins() != nEngs)
+      throw StokesTable::StokesTableError("The simulation needs a response on its own energy bins");
+   m_energies.resize(nEngs + 1);
+   for (size_t i=0; i<nEngs; ++i)
+      m_energies[i] = response.energyLow()[i];
+   m_energies[nEngs] = response.energyHigh()[nEngs-1];
+   if (!engine.hasModel(modelName))
+      throw StokesTable::StokesTableError("No model " + modelName + " is defined");
+}
+
+void SpectrumSimulator::simulate (unsigned long long index, const std::vector<Real>& parameters,
+                                  Real norm, Spectra& result) const
+{
+   std::vector<RealArray> flux;
+   m_engine.evaluate(m_modelName, parameters, m_energies, flux);
+   RealArray expected[3];
+   m_response.fold(&flux[0][0], &flux[1][0], &flux[2][0], expected[0], expected[1], expected[2]);
+   const Real scale = norm*m_exposure;
+   const size_t nChans = m_response.nChannels();
+   for (size_t iComp=0; iComp<3; ++iComp)
+   {
+      result.counts[iComp].resize(nChans);
+      result.errors[iComp].resize(nChans);
+   }
+   for (size_t ic=0; ic<nChans; ++ic)
+   {
+      const Real iExpected = scale*expected[0][ic];
+      ChannelRandom iRandom(m_seed, index, 0, ic);
+      const Real nEvents = iRandom.poisson(iExpected);
+      result.counts[0][ic] = nEvents;
+      result.errors[0][ic] = std::sqrt(nEvents);
+      for (size_t iComp=1; iComp<3; ++iComp)
+      {
+         // mean weight per event of the expected spectra
+         const Real weight = (iExpected > 0.0) ? scale*expected[iComp][ic]/iExpected : 0.0;
+         const Real variance = nEvents*std::max(2.0 - weight*weight, 0.0);
+         ChannelRandom random(m_seed, index, iComp, ic);
+         result.counts[iComp][ic] = nEvents*weight + std::sqrt(variance)*random.normal();
+         result.errors[iComp][ic] = std::sqrt(2.0*nEvents);
+      }
+   }
+}
+
+void SpectrumSimulator::writePha (const std::string& fileName, const Spectra& spectra,
+                                  size_t stokes, const std::string& respFile,
+                                  const std::string& ancrFile) const
+{
+   fitsfile* fptr = 0;
+   int status = 0;
+   const std::string clobberName = "!" + fileName;
+   fits_create_file(&fptr, clobberName.c_str(), &status);
+   checkStatus(status, "Creating spectrum " + fileName);
+   try
+   {
+      const bool isPoisson = (stokes == 0);
+      const long nChans = static_cast<long>(m_response.nChannels());
+      fits_create_img(fptr, 8, 0, 0, &status);
+      checkStatus(status, "Creating primary HDU");
+      const char* colTypes[] = {"CHANNEL", "COUNTS", "STAT_ERR"};
+      const char* colForms[] = {"J", isPoisson ? "J" : "E", "E"};
+      const char* colUnits[] = {"", "counts", "counts"};
+      fits_create_tbl(fptr, BINARY_TBL, nChans, isPoisson ? 2 : 3, const_cast<char**>(colTypes),
+                      const_cast<char**>(colForms), const_cast<char**>(colUnits), "SPECTRUM",
+                      &status);
+      checkStatus(status, "Creating SPECTRUM extension");
+      writeStringKey(fptr, "HDUCLASS", "OGIP", "format conforms to OGIP standard");
+      writeStringKey(fptr, "HDUCLAS1", "SPECTRUM", "PHA dataset");
+      writeStringKey(fptr, "HDUCLAS2", "TOTAL", "gross PHA spectrum");
+      writeStringKey(fptr, "HDUCLAS3", "COUNT", "PHA data stored as counts");
+      writeStringKey(fptr, "HDUVERS", "1.2.1", "version of format");
+      writeStringKey(fptr, "TELESCOP", "NONE", "");
+      writeStringKey(fptr, "INSTRUME", "NONE", "");
+      writeStringKey(fptr, "FILTER", "NONE", "");
+      writeStringKey(fptr, "CHANTYPE", "PI", "channel type");
+      long detChans = nChans;
+      fits_write_key(fptr, TLONG, "DETCHANS", &detChans, "total number of channels", &status);
+      checkStatus(status, "Writing keyword DETCHANS");
+      writeRealKey(fptr, "EXPOSURE", m_exposure, "exposure time [s]");
+      writeRealKey(fptr, "AREASCAL", 1.0, "area scaling factor");
+      writeRealKey(fptr, "BACKSCAL", 1.0, "background scaling factor");
+      writeRealKey(fptr, "CORRSCAL", 0.0, "correction scaling factor");
+      writeStringKey(fptr, "BACKFILE", "none", "background file");
+      writeStringKey(fptr, "CORRFILE", "none", "correction file");
+      writeStringKey(fptr, "RESPFILE", respFile.empty() ? "none" : respFile, "redistribution matrix");
+      writeStringKey(fptr, "ANCRFILE", ancrFile.empty() ? "none" : ancrFile,
+                     isPoisson ? "ancillary response" : "modulation response");
+      writeLogicalKey(fptr, "POISSERR", isPoisson, "Poisson errors apply");
+      std::ostringstream xflt;
+      xflt << "Stokes:" << stokes;
+      writeStringKey(fptr, "XFLT0001", xflt.str(), "Stokes parameter of the dataset");
+
+      std::vector<long> channels(nChans);
+      for (long ic=0; ic<nChans; ++ic)
+         channels[ic] = m_response.firstChannel() + ic;
+      RealArray counts(spectra.counts[stokes]);
+      RealArray errors(spectra.errors[stokes]);
+      fits_write_col(fptr, TLONG, 1, 1, 1, nChans, &channels[0], &status);
+      fits_write_col(fptr, TDOUBLE, 2, 1, 1, nChans, &counts[0], &status);
+      if (!isPoisson)
+         fits_write_col(fptr, TDOUBLE, 3, 1, 1, nChans, &errors[0], &status);
+      checkStatus(status, "Writing spectrum " + fileName);
+   }
+   catch (...)
+   {
+      int closeStatus = 0;
+      fits_close_file(fptr, &closeStatus);
+      throw;
+   }
+   fits_close_file(fptr, &status);
+   checkStatus(status, "Closing spectrum " + fileName);
+}
@@ -0,0 +1,88 @@
+#ifndef SPECTRUMSIMULATOR_H
+#define SPECTRUMSIMULATOR_H 1
+
+#include <string>
+#include <vector>
+
+#include "MdefEngine.h"
+#include "ResponseFolder.h"
+
+// SpectrumSimulator simulates the i, q and u datasets of a polarimetric
+// observation, as fakeit does for the spectra of load_null_data.xcm: a
+// model of an MdefEngine is evaluated on the energy bins of the response,
+// folded by a ResponseFolder and multiplied by the exposure, and counts are
+// drawn around the expected ones.  i counts are Poisson distributed.  q and
+// u are sums of the weights 2 cos 2phi and 2 sin 2phi of the N detected
+// events, drawn from their normal distribution given N, of mean N q/i and
+// variance N (2 - (q/i)^2) per channel, with the errors sqrt(2 N) written
+// to polarimetric spectra.
+//
+// The random numbers come from a counter-based generator (Philox4x32-10)
+// keyed by the seed, with the simulation index, the dataset and the channel
+// as counter, so every value depends only on those and not on the order in
+// which simulations are run or on the number of threads.  simulate() is
+// const and may be called from any number of threads.
+
+class SpectrumSimulator
+{
+   public:
+      struct Spectra
+      {
+         // counts of i, q and u per channel, and errors of q and u
+         RealArray counts[3];
+         RealArray errors[3];
+      };
+
+      // The engine, which must hold the model, and the response must outlive
+      // the simulator.
+      SpectrumSimulator (const MdefEngine& engine, const std::string& modelName,
+                         const ResponseFolder& response);
+
+      // Simulation number index of the model at parameters with
+      // normalisation norm.
+      void simulate (unsigned long long index, const std::vector<Real>& parameters, Real norm,
+                     Spectra& result) const;
+
+      // OGIP spectrum file of one dataset (0, 1, 2 for i, q, u) with the
+      // XFLT0001 'Stokes:n' keyword XSPEC uses to tell them apart.
+      void writePha (const std::string& fileName, const Spectra& spectra, size_t stokes,
+                     const std::string& respFile, const std::string& ancrFile) const;
+
+      Real exposure () const;
+      void exposure (Real value);
+      unsigned long long seed () const;
+      void seed (unsigned long long value);
+
+   private:
+      const MdefEngine& m_engine;
+      std::string m_modelName;
+      const ResponseFolder& m_response;
+      // energy bin edges of the response
+      RealArray m_energies;
+      Real m_exposure;
+      unsigned long long m_seed;
+};
+
+// Class SpectrumSimulator
+
+inline Real SpectrumSimulator::exposure () const
+{
+   return m_exposure;
+}
+
+inline void SpectrumSimulator::exposure (Real value)
+{
+   m_exposure = value;
+}
+
+inline unsigned long long SpectrumSimulator::seed () const
+{
+   return m_seed;
+}
+
+inline void SpectrumSimulator::seed (unsigned long long value)
+{
+   m_seed = value;
+}
+
+#endif
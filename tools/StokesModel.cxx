@@ -0,0 +1,202 @@
+#include <cmath>
+
+#include "StokesModel.h"
+
+namespace {
+
+   const Real s_degToRad = M_PI/180.0;
+
+   const char* const s_parNames[] = {"Gamma", "Xi", "Mui", "Phi", "Mue"};
+   const size_t s_nParNames = 5;
+   const size_t s_phiPar = 3;
+
+} // namespace
+
+// Class StokesParameters
+
+StokesParameters::StokesParameters ()
+   : gamma(0.0), xi(0.0), thetai(0.0), phi(0.0), thetae(0.0), polFrac(0.0), polAng(0.0),
+     rotation(0.0)
+{
+}
+
+bool StokesParameters::operator== (const StokesParameters& right) const
+{
+   return gamma == right.gamma && xi == right.xi && thetai == right.thetai && phi == right.phi
+          && thetae == right.thetae && polFrac == right.polFrac && polAng == right.polAng
+          && rotation == right.rotation;
+}
+
+// Class StokesModel
+
+StokesModel::StokesModel (const StokesTable& unpol, const StokesTable* vrpol,
+                          const StokesTable* pol45)
+   : m_lastParams(),
+     m_hasSpectra(false),
+     m_hasCombination(false),
+     m_nInterpolations(0),
+     m_nCombinations(0)
+{
+   m_tables[UNPOL_TABLE] = &unpol;
+   m_tables[VRPOL_TABLE] = vrpol;
+   m_tables[POL45_TABLE] = pol45;
+   for (size_t iTab=0; iTab<N_TABLES; ++iTab)
+   {
+      const StokesTable* table = m_tables[iTab];
+      if (!table)
+         continue;
+      if (table->nComponents() != 3 || table->nEnergies() != unpol.nEnergies())
+         throw StokesTable::StokesTableError("The STOKES tables need i, q and u spectra on the same energy bins");
+      if (table->nParameters() != s_nParNames)
+         throw StokesTable::StokesTableError("Expected Gamma, Xi, Mui, Phi and Mue table parameters");
+      for (size_t i=0; i<s_nParNames; ++i)
+      {
+         const int iPar = table->parameterIndex(s_parNames[i]);
+         if (iPar < 0)
+            throw StokesTable::StokesTableError(std::string("Table has no parameter ") + s_parNames[i]);
+         m_parIndex[iTab].push_back(static_cast<size_t>(iPar));
+      }
+      if (table->phiMirrorIndex() >= 0
+          && static_cast<size_t>(table->phiMirrorIndex()) != m_parIndex[iTab][s_phiPar])
+         throw StokesTable::StokesTableError("Half-Phi table is not halved in Phi");
+      m_interpolators[iTab].reset(new TableInterpolator(*table));
+   }
+   if (pol45 && pol45->phiSymmetry() == "REF" && unpol.phiMirrorIndex() < 0)
+      throw StokesTable::StokesTableError("A 45 deg half-Phi table needs the unpolarised half-Phi table");
+}
+
+void StokesModel::evaluate (const StokesParameters& params, RealArray& iFlux, RealArray& qFlux,
+                            RealArray& uFlux)
+{
+   const StokesParameters& last = m_lastParams;
+   const bool isSameTables = m_hasSpectra && params.gamma == last.gamma && params.xi == last.xi
+                             && params.thetai == last.thetai && params.phi == last.phi
+                             && params.thetae == last.thetae;
+   if (!isSameTables)
+   {
+      interpolateTables(params);
+      m_hasCombination = false;
+   }
+   if (!m_hasCombination || params.polFrac != last.polFrac || params.polAng != last.polAng)
+      combine(params, iFlux, qFlux, uFlux);
+   else
+      rotate(params.rotation, iFlux, qFlux, uFlux);
+   m_lastParams = params;
+}
+
+void StokesModel::clearCache ()
+{
+   m_hasSpectra = false;
+   m_hasCombination = false;
+}
+
+void StokesModel::interpolateTables (const StokesParameters& params)
+{
+   const Real angles[] = {params.gamma, params.xi, std::cos(params.thetai*s_degToRad), params.phi,
+                          std::cos(params.thetae*s_degToRad)};
+   std::vector<bool> isMirrored(N_TABLES, false);
+   for (size_t iTab=0; iTab<N_TABLES; ++iTab)
+   {
+      const StokesTable* table = m_tables[iTab];
+      if (!table)
+         continue;
+      std::vector<Real> parValues(s_nParNames);
+      for (size_t i=0; i<s_nParNames; ++i)
+         parValues[m_parIndex[iTab][i]] = angles[i];
+      // half-Phi tables are evaluated at 360-Phi and reflected below
+      isMirrored[iTab] = (table->phiMirrorIndex() >= 0 && params.phi > 180.0);
+      if (isMirrored[iTab])
+         parValues[m_parIndex[iTab][s_phiPar]] = 360.0 - params.phi;
+      m_interpolators[iTab]->interpolate(parValues, m_tableSpectra[iTab]);
+   }
+   for (size_t iTab=0; iTab<N_TABLES; ++iTab)
+   {
+      if (!isMirrored[iTab])
+         continue;
+      std::vector<RealArray>& spectra = m_tableSpectra[iTab];
+      if (m_tables[iTab]->phiSymmetry() == "REF")
+      {
+         // S45(360-Phi) = M [2 S0(Phi) - S45(Phi)], S0 not yet reflected
+         const std::vector<RealArray>& unpol = m_tableSpectra[UNPOL_TABLE];
+         for (size_t iComp=0; iComp<3; ++iComp)
+            spectra[iComp] = 2.0*unpol[iComp] - spectra[iComp];
+      }
+   }
+   for (size_t iTab=0; iTab<N_TABLES; ++iTab)
+   {
+      if (isMirrored[iTab])
+         m_tableSpectra[iTab][StokesTable::U_COMP] *= -1.0;
+   }
+   m_hasSpectra = true;
+   ++m_nInterpolations;
+}
+
+void StokesModel::combine (const StokesParameters& params, RealArray& iFlux, RealArray& qFlux,
+                           RealArray& uFlux)
+{
+   const Real polCos = params.polFrac*std::cos(2.0*params.polAng*s_degToRad);
+   const Real polSin = params.polFrac*std::sin(2.0*params.polAng*s_degToRad);
+   if ((polCos != 0.0 && !m_tables[VRPOL_TABLE]) || (polSin != 0.0 && !m_tables[POL45_TABLE]))
+      throw StokesTable::StokesTableError("Polarised illumination needs the vrpol and 45deg tables");
+   const Real cos2psi = std::cos(2.0*params.rotation*s_degToRad);
+   const Real sin2psi = std::sin(2.0*params.rotation*s_degToRad);
+   const size_t nEngs = m_tables[UNPOL_TABLE]->nEnergies();
+   const Real unpolWeight = 1.0 - polCos - polSin;
+
+   const Real* s0[3];
+   const Real* s90[3];
+   const Real* s45[3];
+   Real* combined[3];
+   for (size_t iComp=0; iComp<3; ++iComp)
+   {
+      m_combined[iComp].resize(nEngs);
+      combined[iComp] = &m_combined[iComp][0];
+      s0[iComp] = &m_tableSpectra[UNPOL_TABLE][iComp][0];
+      s90[iComp] = (polCos != 0.0) ? &m_tableSpectra[VRPOL_TABLE][iComp][0] : 0;
+      s45[iComp] = (polSin != 0.0) ? &m_tableSpectra[POL45_TABLE][iComp][0] : 0;
+   }
+   iFlux.resize(nEngs);
+   qFlux.resize(nEngs);
+   uFlux.resize(nEngs);
+
+   // One pass: combine the tables, keep the result for later rotations and
+   // write the rotated q and u.
+   for (size_t ie=0; ie<nEngs; ++ie)
+   {
+      Real value[3];
+      for (size_t iComp=0; iComp<3; ++iComp)
+      {
+         value[iComp] = unpolWeight*s0[iComp][ie];
+         if (s90[iComp])
+            value[iComp] += polCos*s90[iComp][ie];
+         if (s45[iComp])
+            value[iComp] += polSin*s45[iComp][ie];
+         combined[iComp][ie] = value[iComp];
+      }
+      iFlux[ie] = value[StokesTable::I_COMP];
+      qFlux[ie] = cos2psi*value[StokesTable::Q_COMP] - sin2psi*value[StokesTable::U_COMP];
+      uFlux[ie] = sin2psi*value[StokesTable::Q_COMP] + cos2psi*value[StokesTable::U_COMP];
+   }
+   m_hasCombination = true;
+   ++m_nCombinations;
+}
+
+void StokesModel::rotate (Real rotation, RealArray& iFlux, RealArray& qFlux, RealArray& uFlux) const
+{
+   const size_t nEngs = m_combined[0].size();
+   const Real cos2psi = std::cos(2.0*rotation*s_degToRad);
+   const Real sin2psi = std::sin(2.0*rotation*s_degToRad);
+   iFlux.resize(nEngs);
+   qFlux.resize(nEngs);
+   uFlux.resize(nEngs);
+   iFlux = m_combined[StokesTable::I_COMP];
+   const Real* q = &m_combined[StokesTable::Q_COMP][0];
+   const Real* u = &m_combined[StokesTable::U_COMP][0];
+   Real* qOut = &qFlux[0];
+   Real* uOut = &uFlux[0];
+   for (size_t ie=0; ie<nEngs; ++ie)
+   {
+      qOut[ie] = cos2psi*q[ie] - sin2psi*u[ie];
+      uOut[ie] = sin2psi*q[ie] + cos2psi*u[ie];
+   }
+}
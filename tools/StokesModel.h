@@ -0,0 +1,103 @@
+#ifndef STOKESMODEL_H
+#define STOKESMODEL_H 1
+
+#include <memory>
+#include <vector>
+
+#include "StokesTable.h"
+#include "TableInterpolator.h"
+
+// StokesModel evaluates polrot*stokes on the energy bins of the tables,
+//    S(P, chi) = S0 + P [(S90 - S0) cos 2chi + (S45 - S0) sin 2chi],
+// followed by the rotation of (q, u) by the orientation angle psi,
+//    q' = q cos 2psi - u sin 2psi,   u' = q sin 2psi + u cos 2psi,
+// which is applied in the same pass that combines the three tables instead
+// of in a separate one as in XSPEC.
+//
+// The last results are cached at each stage: the three table interpolations
+// are redone only when Gamma, Xi or the angles of the geometry change, the
+// combination only when P or chi change as well, and a change of psi alone
+// just rotates the cached i, q and u, i.e. costs four multiplications per
+// energy bin.  An instance must not be shared between threads.
+
+struct StokesParameters
+{
+   StokesParameters();
+   bool operator== (const StokesParameters& right) const;
+
+   Real gamma;
+   Real xi;
+   Real thetai;    // incident angle [deg]
+   Real phi;       // azimuthal angle [deg]
+   Real thetae;    // emission angle [deg]
+   Real polFrac;
+   Real polAng;    // chi [deg]
+   Real rotation;  // psi [deg], as in polrot
+};
+
+class StokesModel
+{
+   public:
+      // vrpol and pol45 may be 0 for unpolarised illumination.  Half-Phi
+      // tables are accepted, a 45 deg half table needs the unpolarised half
+      // table as unpol.  The tables must outlive the model.
+      StokesModel (const StokesTable& unpol, const StokesTable* vrpol, const StokesTable* pol45);
+
+      void evaluate (const StokesParameters& params, RealArray& iFlux, RealArray& qFlux,
+                     RealArray& uFlux);
+      void clearCache ();
+
+      const RealArray& energyLow () const;
+      const RealArray& energyHigh () const;
+      // Number of evaluations that needed the table interpolations, and of
+      // those that needed the combination of the tables.
+      size_t nInterpolations () const;
+      size_t nCombinations () const;
+
+   private:
+      void interpolateTables (const StokesParameters& params);
+      void combine (const StokesParameters& params, RealArray& iFlux, RealArray& qFlux,
+                    RealArray& uFlux);
+      void rotate (Real rotation, RealArray& iFlux, RealArray& qFlux, RealArray& uFlux) const;
+
+      enum {UNPOL_TABLE, VRPOL_TABLE, POL45_TABLE, N_TABLES};
+
+      const StokesTable* m_tables[N_TABLES];
+      // kept between evaluations, which start from the last grid cells
+      std::unique_ptr<TableInterpolator> m_interpolators[N_TABLES];
+      // position of Gamma, Xi, Mui, Phi and Mue among the table parameters
+      std::vector<size_t> m_parIndex[N_TABLES];
+      // interpolated i, q and u of each table, and their combination before
+      // the rotation
+      std::vector<RealArray> m_tableSpectra[N_TABLES];
+      RealArray m_combined[3];
+      StokesParameters m_lastParams;
+      bool m_hasSpectra;
+      bool m_hasCombination;
+      size_t m_nInterpolations;
+      size_t m_nCombinations;
+};
+
+// Class StokesModel
+
+inline const RealArray& StokesModel::energyLow () const
+{
+   return m_tables[UNPOL_TABLE]->energyLow();
+}
+
+inline const RealArray& StokesModel::energyHigh () const
+{
+   return m_tables[UNPOL_TABLE]->energyHigh();
+}
+
+inline size_t StokesModel::nInterpolations () const
+{
+   return m_nInterpolations;
+}
+
+inline size_t StokesModel::nCombinations () const
+{
+   return m_nCombinations;
+}
+
+#endif
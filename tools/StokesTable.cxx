@@ -0,0 +1,799 @@
+#include <fitsio.h>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <sstream>
+#include <utility>
+
+#include "StokesTable.h"
+
+namespace {
+
+   // Names of the SPECTRA columns holding the i, q and u spectra.
+   const char* const s_spectrumColumns[] = {"INTPSPEC", "Q_SPEC", "U_SPEC"};
+   // and of the BANDS columns holding their band layers
+   const char* const s_bandColumns[] = {"I_BAND", "Q_BAND", "U_BAND"};
+
+   void checkStatus (int status, const std::string& context)
+   {
+      if (status)
+      {
+         char statusText[FLEN_STATUS];
+         fits_get_errstatus(status, statusText);
+         std::ostringstream oss;
+         oss << context << ": " << statusText << " (CFITSIO status " << status << ")";
+         throw StokesTable::StokesTableError(oss.str());
+      }
+   }
+
+   std::string upperCase (const std::string& inString)
+   {
+      std::string outString(inString);
+      for (size_t i=0; i<outString.size(); ++i)
+         outString[i] = static_cast<char>(toupper(outString[i]));
+      return outString;
+   }
+
+   bool readLogicalKey (fitsfile* fptr, const char* keyName, bool defaultValue)
+   {
+      int status = 0;
+      int value = 0;
+      fits_read_key(fptr, TLOGICAL, keyName, &value, 0, &status);
+      if (status == KEY_NO_EXIST)
+         return defaultValue;
+      checkStatus(status, std::string("Reading keyword ") + keyName);
+      return value != 0;
+   }
+
+   std::string readStringKey (fitsfile* fptr, const char* keyName)
+   {
+      int status = 0;
+      char value[FLEN_VALUE];
+      value[0] = 0;
+      fits_read_key(fptr, TSTRING, keyName, value, 0, &status);
+      if (status == KEY_NO_EXIST)
+         return std::string();
+      checkStatus(status, std::string("Reading keyword ") + keyName);
+      return std::string(value);
+   }
+
+   void writeStringKey (fitsfile* fptr, const char* keyName, const std::string& value,
+                        const char* comment)
+   {
+      int status = 0;
+      fits_write_key(fptr, TSTRING, keyName, const_cast<char*>(value.c_str()),
+                     comment, &status);
+      checkStatus(status, std::string("Writing keyword ") + keyName);
+   }
+
+   void writeLogicalKey (fitsfile* fptr, const char* keyName, bool value, const char* comment)
+   {
+      int status = 0;
+      int logical = value ? 1 : 0;
+      fits_write_key(fptr, TLOGICAL, keyName, &logical, comment, &status);
+      checkStatus(status, std::string("Writing keyword ") + keyName);
+   }
+
+   void writeOgipKeys (fitsfile* fptr, const char* extName, const char* hduClass2)
+   {
+      writeStringKey(fptr, "EXTNAME", extName, "name of this binary table extension");
+      writeStringKey(fptr, "HDUCLASS", "OGIP", "format conforms to OGIP standard");
+      writeStringKey(fptr, "HDUCLAS1", "XSPEC TABLE MODEL", "model spectra for XSPEC");
+      writeStringKey(fptr, "HDUCLAS2", hduClass2, "");
+      writeStringKey(fptr, "HDUVERS", "1.1.0", "version of format");
+   }
+
+   int columnNumber (fitsfile* fptr, const char* colName, bool isRequired)
+   {
+      int status = 0;
+      int colNum = 0;
+      fits_get_colnum(fptr, CASEINSEN, const_cast<char*>(colName), &colNum, &status);
+      if (status == COL_NOT_FOUND && !isRequired)
+      {
+         fits_clear_errmsg();
+         return 0;
+      }
+      checkStatus(status, std::string("Locating column ") + colName);
+      return colNum;
+   }
+
+   void moveToExtension (fitsfile* fptr, const char* extName)
+   {
+      int status = 0;
+      fits_movnam_hdu(fptr, BINARY_TBL, const_cast<char*>(extName), 0, &status);
+      checkStatus(status, std::string("Moving to extension ") + extName);
+   }
+
+   size_t findNode (const std::vector<Real>& values, Real value)
+   {
+      // Grid values are read from single precision columns in general, so
+      // match to within a relative tolerance rather than exactly.
+      size_t iBest = 0;
+      Real bestDiff = std::fabs(values[0] - value);
+      for (size_t i=1; i<values.size(); ++i)
+      {
+         Real diff = std::fabs(values[i] - value);
+         if (diff < bestDiff)
+         {
+            bestDiff = diff;
+            iBest = i;
+         }
+      }
+      if (bestDiff > 1.0e-5*std::max(std::fabs(value), 1.0))
+      {
+         std::ostringstream oss;
+         oss << "PARAMVAL " << value << " is not on the parameter grid";
+         throw StokesTable::StokesTableError(oss.str());
+      }
+      return iBest;
+   }
+
+} // namespace
+
+// Class StokesTable::StokesTableError
+
+StokesTable::StokesTableError::StokesTableError (const std::string& errMsg)
+   : std::runtime_error(errMsg)
+{
+}
+
+// Class StokesTable::Parameter
+
+StokesTable::Parameter::Parameter()
+   : name(),
+     method(0),
+     initial(0.0),
+     delta(0.0),
+     minimum(0.0),
+     bottom(0.0),
+     top(0.0),
+     maximum(0.0),
+     values()
+{
+}
+
+// Class StokesTable::Band
+
+StokesTable::Band::Band()
+   : eMin(0.0),
+     eMax(0.0),
+     weightIndex(0.0)
+{
+}
+
+// Class StokesTable
+
+StokesTable::StokesTable()
+   : m_parameters(),
+     m_energyLow(),
+     m_energyHigh(),
+     m_nComponents(0),
+     m_spectra(),
+     m_spectraSingle(),
+     m_isSingleStorage(false),
+     m_modelName(),
+     m_modelUnits(),
+     m_isAdditive(true),
+     m_isRedshift(false),
+     m_isEscale(false),
+     m_isDoublePrecision(false),
+     m_phiMirrorIndex(-1),
+     m_phiSymmetry(),
+     m_phiReference(),
+     m_bands(),
+     m_bandValues()
+{
+}
+
+void StokesTable::read (const std::string& fileName, bool isSingleStorage)
+{
+   fitsfile* fptr = 0;
+   int status = 0;
+   fits_open_file(&fptr, fileName.c_str(), READONLY, &status);
+   checkStatus(status, "Opening table " + fileName);
+
+   try
+   {
+      // primary header
+      m_modelName = readStringKey(fptr, "MODLNAME");
+      m_modelUnits = readStringKey(fptr, "MODLUNIT");
+      m_isAdditive = readLogicalKey(fptr, "ADDMODEL", true);
+      m_isRedshift = readLogicalKey(fptr, "REDSHIFT", false);
+      m_isEscale = readLogicalKey(fptr, "ESCALE", false);
+      m_phiMirrorIndex = -1;
+      m_phiSymmetry.clear();
+      m_phiReference.clear();
+      int phiIndex = 0;
+      fits_read_key(fptr, TINT, "PHIMIRR", &phiIndex, 0, &status);
+      if (status == KEY_NO_EXIST)
+      {
+         status = 0;
+         fits_clear_errmsg();
+      }
+      else
+      {
+         checkStatus(status, "Reading keyword PHIMIRR");
+         m_phiMirrorIndex = phiIndex - 1;
+         m_phiSymmetry = readStringKey(fptr, "PHISYMM");
+         m_phiReference = readStringKey(fptr, "PHIREFT");
+      }
+
+      // PARAMETERS
+      moveToExtension(fptr, "PARAMETERS");
+      int nIntParams = 0;
+      fits_read_key(fptr, TINT, "NINTPARM", &nIntParams, 0, &status);
+      checkStatus(status, "Reading keyword NINTPARM");
+      m_parameters.assign(nIntParams, Parameter());
+      const char* realCols[] = {"INITIAL", "DELTA", "MINIMUM", "BOTTOM", "TOP", "MAXIMUM"};
+      int nameCol = columnNumber(fptr, "NAME", true);
+      int methodCol = columnNumber(fptr, "METHOD", true);
+      int numbCol = columnNumber(fptr, "NUMBVALS", true);
+      int valueCol = columnNumber(fptr, "VALUE", true);
+      for (int iPar=0; iPar<nIntParams; ++iPar)
+      {
+         Parameter& par = m_parameters[iPar];
+         const long row = iPar + 1;
+         char nameBuf[FLEN_VALUE];
+         char* namePtr = nameBuf;
+         fits_read_col(fptr, TSTRING, nameCol, row, 1, 1, 0, &namePtr, 0, &status);
+         par.name = nameBuf;
+         par.name.erase(par.name.find_last_not_of(' ')+1);
+         fits_read_col(fptr, TINT, methodCol, row, 1, 1, 0, &par.method, 0, &status);
+         Real* realVals[] = {&par.initial, &par.delta, &par.minimum, &par.bottom,
+                             &par.top, &par.maximum};
+         for (size_t iCol=0; iCol<6; ++iCol)
+         {
+            int colNum = columnNumber(fptr, realCols[iCol], true);
+            fits_read_col(fptr, TDOUBLE, colNum, row, 1, 1, 0, realVals[iCol], 0, &status);
+         }
+         int nValues = 0;
+         fits_read_col(fptr, TINT, numbCol, row, 1, 1, 0, &nValues, 0, &status);
+         checkStatus(status, "Reading parameter " + par.name);
+         par.values.resize(nValues);
+         fits_read_col(fptr, TDOUBLE, valueCol, row, 1, nValues, 0, &par.values[0], 0, &status);
+         checkStatus(status, "Reading grid values of parameter " + par.name);
+      }
+
+      // ENERGIES
+      moveToExtension(fptr, "ENERGIES");
+      long nEngs = 0;
+      fits_get_num_rows(fptr, &nEngs, &status);
+      checkStatus(status, "Reading ENERGIES extension");
+      m_energyLow.resize(nEngs);
+      m_energyHigh.resize(nEngs);
+      fits_read_col(fptr, TDOUBLE, columnNumber(fptr, "ENERG_LO", true), 1, 1, nEngs, 0,
+                    &m_energyLow[0], 0, &status);
+      fits_read_col(fptr, TDOUBLE, columnNumber(fptr, "ENERG_HI", true), 1, 1, nEngs, 0,
+                    &m_energyHigh[0], 0, &status);
+      checkStatus(status, "Reading ENERGIES extension");
+
+      // SPECTRA
+      moveToExtension(fptr, "SPECTRA");
+      int specCols[3] = {0, 0, 0};
+      specCols[I_COMP] = columnNumber(fptr, s_spectrumColumns[I_COMP], true);
+      specCols[Q_COMP] = columnNumber(fptr, s_spectrumColumns[Q_COMP], false);
+      specCols[U_COMP] = columnNumber(fptr, s_spectrumColumns[U_COMP], false);
+      m_nComponents = (specCols[Q_COMP] && specCols[U_COMP]) ? 3 : 1;
+      int typeCode = 0;
+      long repeat = 0, width = 0;
+      fits_get_coltype(fptr, specCols[I_COMP], &typeCode, &repeat, &width, &status);
+      checkStatus(status, "Reading INTPSPEC column type");
+      m_isDoublePrecision = (std::abs(typeCode) == TDOUBLE);
+
+      const size_t nGrid = nGridPoints();
+      long nRows = 0;
+      fits_get_num_rows(fptr, &nRows, &status);
+      checkStatus(status, "Reading SPECTRA extension");
+      if (static_cast<size_t>(nRows) != nGrid)
+      {
+         std::ostringstream oss;
+         oss << "SPECTRA extension has " << nRows << " rows but the parameter grid has "
+             << nGrid << " points";
+         throw StokesTableError(oss.str());
+      }
+      // read straight into the storage asked for, so that a single precision
+      // table never needs the memory of a double one
+      m_isSingleStorage = isSingleStorage;
+      m_spectra.clear();
+      m_spectraSingle.clear();
+      if (m_isSingleStorage)
+         m_spectraSingle.assign(m_nComponents, std::vector<float>(nGrid*nEngs, 0.0f));
+      else
+         m_spectra.assign(m_nComponents, std::vector<Real>(nGrid*nEngs, 0.0));
+      int parValCol = columnNumber(fptr, "PARAMVAL", true);
+      std::vector<Real> parVals(nIntParams);
+      std::vector<size_t> nodes(nIntParams);
+      for (long row=1; row<=nRows; ++row)
+      {
+         fits_read_col(fptr, TDOUBLE, parValCol, row, 1, nIntParams, 0, &parVals[0], 0, &status);
+         checkStatus(status, "Reading PARAMVAL");
+         for (int iPar=0; iPar<nIntParams; ++iPar)
+            nodes[iPar] = findNode(m_parameters[iPar].values, parVals[iPar]);
+         const size_t iGrid = gridIndex(nodes);
+         for (size_t iComp=0; iComp<m_nComponents; ++iComp)
+         {
+            if (m_isSingleStorage)
+               fits_read_col(fptr, TFLOAT, specCols[iComp], row, 1, nEngs, 0,
+                             &m_spectraSingle[iComp][iGrid*nEngs], 0, &status);
+            else
+               fits_read_col(fptr, TDOUBLE, specCols[iComp], row, 1, nEngs, 0,
+                             spectrum(iComp, iGrid), 0, &status);
+            checkStatus(status, std::string("Reading ") + s_spectrumColumns[iComp]);
+         }
+      }
+
+      // BANDS, if any, rows in the order of the grid points
+      m_bands.clear();
+      m_bandValues.clear();
+      fits_movnam_hdu(fptr, BINARY_TBL, const_cast<char*>("BANDS"), 0, &status);
+      if (status == BAD_HDU_NUM)
+      {
+         status = 0;
+         fits_clear_errmsg();
+      }
+      else
+      {
+         checkStatus(status, "Moving to extension BANDS");
+         int nBands = 0;
+         fits_read_key(fptr, TINT, "NBANDS", &nBands, 0, &status);
+         checkStatus(status, "Reading keyword NBANDS");
+         m_bands.resize(nBands);
+         for (int iBand=0; iBand<nBands; ++iBand)
+         {
+            std::ostringstream suffix;
+            suffix << iBand + 1;
+            const std::string keys[] = {"E_MIN" + suffix.str(), "E_MAX" + suffix.str(),
+                                        "WINDEX" + suffix.str()};
+            Real* values[] = {&m_bands[iBand].eMin, &m_bands[iBand].eMax, &m_bands[iBand].weightIndex};
+            for (size_t iKey=0; iKey<3; ++iKey)
+            {
+               fits_read_key(fptr, TDOUBLE, keys[iKey].c_str(), values[iKey], 0, &status);
+               checkStatus(status, "Reading keyword " + keys[iKey]);
+            }
+         }
+         fits_get_num_rows(fptr, &nRows, &status);
+         checkStatus(status, "Reading BANDS extension");
+         if (static_cast<size_t>(nRows) != nGrid)
+            throw StokesTableError("BANDS extension does not match the parameter grid");
+         m_bandValues.assign(m_nComponents, std::vector<Real>(nGrid*nBands, 0.0));
+         for (size_t iComp=0; iComp<m_nComponents && nBands > 0; ++iComp)
+         {
+            fits_read_col(fptr, TDOUBLE, columnNumber(fptr, s_bandColumns[iComp], true), 1, 1,
+                          nGrid*nBands, 0, &m_bandValues[iComp][0], 0, &status);
+            checkStatus(status, std::string("Reading ") + s_bandColumns[iComp]);
+         }
+      }
+   }
+   catch (...)
+   {
+      int closeStatus = 0;
+      fits_close_file(fptr, &closeStatus);
+      throw;
+   }
+   fits_close_file(fptr, &status);
+   checkStatus(status, "Closing table " + fileName);
+}
+
+void StokesTable::write (const std::string& fileName) const
+{
+   fitsfile* fptr = 0;
+   int status = 0;
+   const std::string clobberName = "!" + fileName;
+   fits_create_file(&fptr, clobberName.c_str(), &status);
+   checkStatus(status, "Creating table " + fileName);
+
+   try
+   {
+      const size_t nPars = nParameters();
+      const size_t nEngs = nEnergies();
+      const char* realForm = m_isDoublePrecision ? "D" : "E";
+
+      // primary header
+      fits_create_img(fptr, 8, 0, 0, &status);
+      checkStatus(status, "Creating primary HDU");
+      writeStringKey(fptr, "HDUCLASS", "OGIP", "format conforms to OGIP standard");
+      writeStringKey(fptr, "HDUCLAS1", "XSPEC TABLE MODEL", "model spectra for XSPEC");
+      writeStringKey(fptr, "HDUVERS", "1.1.0", "version of format");
+      writeStringKey(fptr, "MODLNAME", m_modelName, "model name");
+      writeStringKey(fptr, "MODLUNIT", m_modelUnits, "model units");
+      writeLogicalKey(fptr, "REDSHIFT", m_isRedshift, "if true then redshift will be included as a par");
+      writeLogicalKey(fptr, "ADDMODEL", m_isAdditive, "if true then this is an additive table model");
+      writeLogicalKey(fptr, "ESCALE", m_isEscale, "if true then escale will be included as a par");
+      if (m_phiMirrorIndex >= 0)
+      {
+         int phiIndex = m_phiMirrorIndex + 1;
+         fits_write_key(fptr, TINT, "PHIMIRR", &phiIndex, "Phi parameter tabulated over 0-180 deg only",
+                        &status);
+         checkStatus(status, "Writing keyword PHIMIRR");
+         writeStringKey(fptr, "PHISYMM", m_phiSymmetry, "reflection relation about Phi=180 deg");
+         if (!m_phiReference.empty())
+            writeStringKey(fptr, "PHIREFT", m_phiReference, "unpolarised table used by the reflection");
+      }
+
+      // PARAMETERS
+      size_t maxValues = 0;
+      for (size_t iPar=0; iPar<nPars; ++iPar)
+         maxValues = std::max(maxValues, m_parameters[iPar].values.size());
+      std::ostringstream valueForm;
+      valueForm << maxValues << realForm;
+      const std::string valueFormStr = valueForm.str();
+      const char* parTypes[] = {"NAME", "METHOD", "INITIAL", "DELTA", "MINIMUM", "BOTTOM",
+                                "TOP", "MAXIMUM", "NUMBVALS", "VALUE"};
+      const char* parForms[] = {"12A", "J", realForm, realForm, realForm, realForm,
+                                realForm, realForm, "J", valueFormStr.c_str()};
+      fits_create_tbl(fptr, BINARY_TBL, nPars, 10, const_cast<char**>(parTypes),
+                      const_cast<char**>(parForms), 0, "PARAMETERS", &status);
+      checkStatus(status, "Creating PARAMETERS extension");
+      writeOgipKeys(fptr, "PARAMETERS", "PARAMETERS");
+      int nIntParams = static_cast<int>(nPars);
+      int nAddParams = 0;
+      fits_write_key(fptr, TINT, "NINTPARM", &nIntParams, "Number of interpolation parameters", &status);
+      fits_write_key(fptr, TINT, "NADDPARM", &nAddParams, "Number of additional parameters", &status);
+      checkStatus(status, "Writing PARAMETERS keywords");
+      for (size_t iPar=0; iPar<nPars; ++iPar)
+      {
+         const Parameter& par = m_parameters[iPar];
+         const long row = iPar + 1;
+         char* namePtr = const_cast<char*>(par.name.c_str());
+         fits_write_col(fptr, TSTRING, 1, row, 1, 1, &namePtr, &status);
+         int method = par.method;
+         fits_write_col(fptr, TINT, 2, row, 1, 1, &method, &status);
+         Real realVals[] = {par.initial, par.delta, par.minimum, par.bottom, par.top, par.maximum};
+         for (int iCol=0; iCol<6; ++iCol)
+            fits_write_col(fptr, TDOUBLE, iCol+3, row, 1, 1, &realVals[iCol], &status);
+         int nValues = static_cast<int>(par.values.size());
+         fits_write_col(fptr, TINT, 9, row, 1, 1, &nValues, &status);
+         std::vector<Real> paddedValues(par.values);
+         paddedValues.resize(maxValues, 0.0);
+         fits_write_col(fptr, TDOUBLE, 10, row, 1, maxValues, &paddedValues[0], &status);
+         checkStatus(status, "Writing parameter " + par.name);
+      }
+
+      // ENERGIES
+      const char* engTypes[] = {"ENERG_LO", "ENERG_HI"};
+      const char* engForms[] = {realForm, realForm};
+      const char* engUnits[] = {"keV", "keV"};
+      fits_create_tbl(fptr, BINARY_TBL, nEngs, 2, const_cast<char**>(engTypes),
+                      const_cast<char**>(engForms), const_cast<char**>(engUnits),
+                      "ENERGIES", &status);
+      checkStatus(status, "Creating ENERGIES extension");
+      writeOgipKeys(fptr, "ENERGIES", "ENERGIES");
+      RealArray eLow(m_energyLow);
+      RealArray eHigh(m_energyHigh);
+      fits_write_col(fptr, TDOUBLE, 1, 1, 1, nEngs, &eLow[0], &status);
+      fits_write_col(fptr, TDOUBLE, 2, 1, 1, nEngs, &eHigh[0], &status);
+      checkStatus(status, "Writing ENERGIES extension");
+
+      // SPECTRA
+      std::ostringstream parValForm, specForm;
+      parValForm << nPars << realForm;
+      specForm << nEngs << realForm;
+      const std::string parValFormStr = parValForm.str();
+      const std::string specFormStr = specForm.str();
+      std::vector<const char*> specTypes(1, "PARAMVAL");
+      std::vector<const char*> specForms(1, parValFormStr.c_str());
+      for (size_t iComp=0; iComp<m_nComponents; ++iComp)
+      {
+         specTypes.push_back(s_spectrumColumns[iComp]);
+         specForms.push_back(specFormStr.c_str());
+      }
+      const size_t nGrid = nGridPoints();
+      fits_create_tbl(fptr, BINARY_TBL, nGrid, static_cast<int>(specTypes.size()),
+                      const_cast<char**>(&specTypes[0]), const_cast<char**>(&specForms[0]),
+                      0, "SPECTRA", &status);
+      checkStatus(status, "Creating SPECTRA extension");
+      writeOgipKeys(fptr, "SPECTRA", "MODEL SPECTRA");
+      std::vector<size_t> nodes(nPars);
+      std::vector<Real> parVals(nPars);
+      for (size_t iGrid=0; iGrid<nGrid; ++iGrid)
+      {
+         const long row = iGrid + 1;
+         gridNodes(iGrid, nodes);
+         for (size_t iPar=0; iPar<nPars; ++iPar)
+            parVals[iPar] = m_parameters[iPar].values[nodes[iPar]];
+         fits_write_col(fptr, TDOUBLE, 1, row, 1, nPars, &parVals[0], &status);
+         for (size_t iComp=0; iComp<m_nComponents; ++iComp)
+         {
+            if (m_isSingleStorage)
+               fits_write_col(fptr, TFLOAT, static_cast<int>(iComp)+2, row, 1, nEngs,
+                              const_cast<float*>(spectrumSingle(iComp, iGrid)), &status);
+            else
+               fits_write_col(fptr, TDOUBLE, static_cast<int>(iComp)+2, row, 1, nEngs,
+                              const_cast<Real*>(spectrum(iComp, iGrid)), &status);
+         }
+         checkStatus(status, "Writing SPECTRA extension");
+      }
+
+      // BANDS
+      if (!m_bands.empty())
+      {
+         const size_t nBands = m_bands.size();
+         std::ostringstream bandForm;
+         bandForm << nBands << "D";
+         const std::string bandFormStr = bandForm.str();
+         std::vector<const char*> bandTypes, bandForms;
+         for (size_t iComp=0; iComp<m_nComponents; ++iComp)
+         {
+            bandTypes.push_back(s_bandColumns[iComp]);
+            bandForms.push_back(bandFormStr.c_str());
+         }
+         fits_create_tbl(fptr, BINARY_TBL, nGrid, static_cast<int>(bandTypes.size()),
+                         const_cast<char**>(&bandTypes[0]), const_cast<char**>(&bandForms[0]),
+                         0, "BANDS", &status);
+         checkStatus(status, "Creating BANDS extension");
+         int nBandsKey = static_cast<int>(nBands);
+         fits_write_key(fptr, TINT, "NBANDS", &nBandsKey, "number of band-integrated layers", &status);
+         for (size_t iBand=0; iBand<nBands; ++iBand)
+         {
+            std::ostringstream suffix;
+            suffix << iBand + 1;
+            Band band = m_bands[iBand];
+            fits_write_key(fptr, TDOUBLE, ("E_MIN" + suffix.str()).c_str(), &band.eMin,
+                           "lower band edge [keV]", &status);
+            fits_write_key(fptr, TDOUBLE, ("E_MAX" + suffix.str()).c_str(), &band.eMax,
+                           "upper band edge [keV]", &status);
+            fits_write_key(fptr, TDOUBLE, ("WINDEX" + suffix.str()).c_str(), &band.weightIndex,
+                           "spectra weighted by E^WINDEX", &status);
+         }
+         checkStatus(status, "Writing BANDS keywords");
+         for (size_t iComp=0; iComp<m_nComponents; ++iComp)
+            fits_write_col(fptr, TDOUBLE, static_cast<int>(iComp)+1, 1, 1, nGrid*nBands,
+                           const_cast<Real*>(&m_bandValues[iComp][0]), &status);
+         checkStatus(status, "Writing BANDS extension");
+      }
+   }
+   catch (...)
+   {
+      int closeStatus = 0;
+      fits_close_file(fptr, &closeStatus);
+      throw;
+   }
+   fits_close_file(fptr, &status);
+   checkStatus(status, "Closing table " + fileName);
+}
+
+void StokesTable::reset (const std::vector<Parameter>& params, const RealArray& energyLow,
+                         const RealArray& energyHigh, size_t nComponents)
+{
+   if (energyLow.size() != energyHigh.size())
+      throw StokesTableError("Energy bin edge arrays differ in size");
+   if (nComponents != 1 && nComponents != 3)
+      throw StokesTableError("A table holds either 1 (i) or 3 (i, q, u) spectra per grid point");
+   m_parameters = params;
+   m_energyLow.resize(energyLow.size());
+   m_energyLow = energyLow;
+   m_energyHigh.resize(energyHigh.size());
+   m_energyHigh = energyHigh;
+   m_nComponents = nComponents;
+   m_spectra.assign(m_nComponents, std::vector<Real>(nGridPoints()*nEnergies(), 0.0));
+   m_spectraSingle.clear();
+   m_isSingleStorage = false;
+   m_bands.clear();
+   m_bandValues.clear();
+}
+
+void StokesTable::singleStorage (bool value)
+{
+   if (value == m_isSingleStorage)
+      return;
+   if (value)
+   {
+      m_spectraSingle.resize(m_nComponents);
+      for (size_t iComp=0; iComp<m_nComponents; ++iComp)
+      {
+         m_spectraSingle[iComp].assign(m_spectra[iComp].begin(), m_spectra[iComp].end());
+         std::vector<Real>().swap(m_spectra[iComp]);
+      }
+      m_spectra.clear();
+   }
+   else
+   {
+      m_spectra.resize(m_nComponents);
+      for (size_t iComp=0; iComp<m_nComponents; ++iComp)
+      {
+         m_spectra[iComp].assign(m_spectraSingle[iComp].begin(), m_spectraSingle[iComp].end());
+         std::vector<float>().swap(m_spectraSingle[iComp]);
+      }
+      m_spectraSingle.clear();
+   }
+   m_isSingleStorage = value;
+}
+
+int StokesTable::parameterIndex (const std::string& name) const
+{
+   const std::string ucName = upperCase(name);
+   for (size_t iPar=0; iPar<m_parameters.size(); ++iPar)
+   {
+      if (upperCase(m_parameters[iPar].name) == ucName)
+         return static_cast<int>(iPar);
+   }
+   return -1;
+}
+
+size_t StokesTable::nGridPoints () const
+{
+   if (m_parameters.empty())
+      return 0;
+   size_t nGrid = 1;
+   for (size_t iPar=0; iPar<m_parameters.size(); ++iPar)
+      nGrid *= m_parameters[iPar].values.size();
+   return nGrid;
+}
+
+size_t StokesTable::gridIndex (const std::vector<size_t>& nodes) const
+{
+   size_t iGrid = 0;
+   for (size_t iPar=0; iPar<m_parameters.size(); ++iPar)
+      iGrid = iGrid*m_parameters[iPar].values.size() + nodes[iPar];
+   return iGrid;
+}
+
+void StokesTable::gridNodes (size_t gridIndex, std::vector<size_t>& nodes) const
+{
+   const size_t nPars = m_parameters.size();
+   nodes.resize(nPars);
+   for (size_t iPar=nPars; iPar>0; --iPar)
+   {
+      const size_t nValues = m_parameters[iPar-1].values.size();
+      nodes[iPar-1] = gridIndex % nValues;
+      gridIndex /= nValues;
+   }
+}
+
+void StokesTable::phiMirror (int phiIndex, const std::string& symmetry, const std::string& reference)
+{
+   m_phiMirrorIndex = phiIndex;
+   m_phiSymmetry = symmetry;
+   m_phiReference = reference;
+}
+
+StokesTable StokesTable::unfoldPhi (const StokesTable* refHalf) const
+{
+   if (m_phiMirrorIndex < 0)
+      return *this;
+   if (m_isSingleStorage || (refHalf && refHalf->isSingleStorage()))
+      throw StokesTableError("Unfolding a half-Phi table needs double precision storage");
+   const size_t phiIndex = m_phiMirrorIndex;
+   const bool isReference = (m_phiSymmetry == "REF");
+   if (isReference && (!refHalf || refHalf->nGridPoints() != nGridPoints()
+                       || refHalf->nEnergies() != nEnergies()
+                       || refHalf->nComponents() != nComponents()))
+      throw StokesTableError("Unfolding a REF half-Phi table needs the unpolarised half table on the same grid");
+
+   // Full Phi nodes: the half nodes followed by the mirrors of those below
+   // 180 deg, each tagged with the half node it comes from.
+   std::vector<Parameter> params(m_parameters);
+   const std::vector<Real>& halfValues = m_parameters[phiIndex].values;
+   Parameter& phiPar = params[phiIndex];
+   std::vector<size_t> sourceNode;
+   std::vector<bool> isMirrored;
+   for (size_t i=0; i<halfValues.size(); ++i)
+   {
+      sourceNode.push_back(i);
+      isMirrored.push_back(false);
+   }
+   for (size_t i=halfValues.size(); i>0; --i)
+   {
+      if (halfValues[i-1] < 180.0 - 1.0e-4)
+      {
+         phiPar.values.push_back(360.0 - halfValues[i-1]);
+         sourceNode.push_back(i-1);
+         isMirrored.push_back(true);
+      }
+   }
+   phiPar.top = 360.0 - phiPar.bottom;
+   phiPar.maximum = 360.0 - phiPar.minimum;
+
+   StokesTable full;
+   full.reset(params, m_energyLow, m_energyHigh, m_nComponents);
+   full.modelName(m_modelName);
+   full.modelUnits(m_modelUnits);
+   full.isAdditive(m_isAdditive);
+   full.isRedshift(m_isRedshift);
+   full.isEscale(m_isEscale);
+   full.isDoublePrecision(m_isDoublePrecision);
+
+   const size_t nEngs = nEnergies();
+   std::vector<size_t> nodes;
+   for (size_t iFull=0; iFull<full.nGridPoints(); ++iFull)
+   {
+      full.gridNodes(iFull, nodes);
+      const size_t iPhi = nodes[phiIndex];
+      nodes[phiIndex] = sourceNode[iPhi];
+      const size_t iHalf = gridIndex(nodes);
+      for (size_t iComp=0; iComp<m_nComponents; ++iComp)
+      {
+         const Real* in = spectrum(iComp, iHalf);
+         Real* out = full.spectrum(iComp, iFull);
+         if (!isMirrored[iPhi])
+         {
+            std::copy(in, in+nEngs, out);
+            continue;
+         }
+         const Real sign = (iComp == U_COMP) ? -1.0 : 1.0;
+         if (isReference)
+         {
+            const Real* ref = refHalf->spectrum(iComp, iHalf);
+            for (size_t ie=0; ie<nEngs; ++ie)
+               out[ie] = sign*(2.0*ref[ie] - in[ie]);
+         }
+         else
+         {
+            for (size_t ie=0; ie<nEngs; ++ie)
+               out[ie] = sign*in[ie];
+         }
+      }
+   }
+   return full;
+}
+
+void StokesTable::bands (const std::vector<Band>& value)
+{
+   const size_t nBands = value.size();
+   const size_t nEngs = nEnergies();
+   const size_t nGrid = nGridPoints();
+   // weight of each energy bin in each band
+   std::vector<std::vector<std::pair<size_t, Real> > > weights(nBands);
+   for (size_t iBand=0; iBand<nBands; ++iBand)
+   {
+      const Band& band = value[iBand];
+      if (!(band.eMax > band.eMin))
+         throw StokesTableError("Empty energy band");
+      for (size_t ie=0; ie<nEngs; ++ie)
+      {
+         const Real width = m_energyHigh[ie] - m_energyLow[ie];
+         const Real overlap = std::min(m_energyHigh[ie], band.eMax) - std::max(m_energyLow[ie], band.eMin);
+         if (overlap > 0.0 && width > 0.0)
+         {
+            const Real centre = 0.5*(m_energyLow[ie] + m_energyHigh[ie]);
+            weights[iBand].push_back(std::make_pair(ie, overlap/width*std::pow(centre, band.weightIndex)));
+         }
+      }
+   }
+   std::vector<std::vector<Real> > bandValues(m_nComponents, std::vector<Real>(nGrid*nBands, 0.0));
+   for (size_t iComp=0; iComp<m_nComponents; ++iComp)
+   {
+      for (size_t iGrid=0; iGrid<nGrid; ++iGrid)
+      {
+         const Real* spec = m_isSingleStorage ? 0 : spectrum(iComp, iGrid);
+         const float* specSingle = m_isSingleStorage ? spectrumSingle(iComp, iGrid) : 0;
+         for (size_t iBand=0; iBand<nBands; ++iBand)
+         {
+            Real sum = 0.0;
+            for (size_t i=0; i<weights[iBand].size(); ++i)
+            {
+               const size_t ie = weights[iBand][i].first;
+               sum += weights[iBand][i].second*(spec ? spec[ie] : specSingle[ie]);
+            }
+            bandValues[iComp][iGrid*nBands + iBand] = sum;
+         }
+      }
+   }
+   m_bands = value;
+   m_bandValues.swap(bandValues);
+}
+
+StokesTable StokesTable::bandTable () const
+{
+   const size_t nBands = m_bands.size();
+   if (nBands == 0)
+      throw StokesTableError("Table has no band layers");
+   RealArray eLow(nBands), eHigh(nBands);
+   for (size_t iBand=0; iBand<nBands; ++iBand)
+   {
+      eLow[iBand] = m_bands[iBand].eMin;
+      eHigh[iBand] = m_bands[iBand].eMax;
+   }
+   StokesTable bandTable;
+   bandTable.reset(m_parameters, eLow, eHigh, m_nComponents);
+   bandTable.m_spectra = m_bandValues;
+   bandTable.m_modelName = m_modelName;
+   bandTable.m_modelUnits = m_modelUnits;
+   bandTable.m_isAdditive = m_isAdditive;
+   bandTable.m_isRedshift = m_isRedshift;
+   bandTable.m_isEscale = m_isEscale;
+   bandTable.m_isDoublePrecision = true;
+   if (m_phiMirrorIndex >= 0)
+      bandTable.phiMirror(m_phiMirrorIndex, m_phiSymmetry, m_phiReference);
+   return bandTable;
+}
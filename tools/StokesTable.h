@@ -0,0 +1,285 @@
+#ifndef STOKESTABLE_H
+#define STOKESTABLE_H 1
+
+#include <stdexcept>
+#include <string>
+#include <valarray>
+#include <vector>
+
+typedef double Real;
+typedef std::valarray<Real> RealArray;
+
+// StokesTable holds an OGIP (XSPEC) table model in memory: the PARAMETERS,
+// ENERGIES and SPECTRA extensions, including the optional Q_SPEC and U_SPEC
+// columns of the polarimetric tables.  Spectra are stored grid point by grid
+// point with the last parameter varying fastest, which is also the row order
+// used when writing.  They are held in double precision, or optionally in
+// single precision (the precision of the Monte-Carlo spectra is far lower),
+// which halves the memory and the bandwidth needed for interpolation.
+
+class StokesTable
+{
+   public:
+      class StokesTableError : public std::runtime_error
+      {
+         public:
+            StokesTableError (const std::string& errMsg);
+      };
+
+      enum StokesComponent {I_COMP, Q_COMP, U_COMP};
+
+      struct Parameter
+      {
+         Parameter();
+         std::string name;
+         // 0 for linear, 1 for logarithmic interpolation
+         int method;
+         Real initial;
+         Real delta;
+         Real minimum;
+         Real bottom;
+         Real top;
+         Real maximum;
+         std::vector<Real> values;
+      };
+
+      // A band-integrated layer: the spectra summed over the bins of
+      // eMin-eMax [keV] with the weight E^weightIndex (E at the bin centre),
+      // bins straddling a band edge in proportion to the overlap.
+      struct Band
+      {
+         Band();
+         Real eMin;
+         Real eMax;
+         Real weightIndex;
+      };
+
+      StokesTable();
+
+      void read (const std::string& fileName, bool isSingleStorage = false);
+      void write (const std::string& fileName) const;
+      // Replace the grid definition and allocate zeroed spectra.
+      void reset (const std::vector<Parameter>& params, const RealArray& energyLow,
+                  const RealArray& energyHigh, size_t nComponents);
+      // Convert the spectra between double and single precision storage.
+      void singleStorage (bool value);
+      bool isSingleStorage () const;
+
+      size_t nParameters () const;
+      const Parameter& parameter (size_t iPar) const;
+      const std::vector<Parameter>& parameters () const;
+      // Case-insensitive lookup, returns -1 if there is no such parameter.
+      int parameterIndex (const std::string& name) const;
+      size_t nEnergies () const;
+      const RealArray& energyLow () const;
+      const RealArray& energyHigh () const;
+      size_t nComponents () const;
+      size_t nGridPoints () const;
+      size_t gridIndex (const std::vector<size_t>& nodes) const;
+      void gridNodes (size_t gridIndex, std::vector<size_t>& nodes) const;
+      // Spectra in double precision storage only.
+      const Real* spectrum (size_t iComp, size_t gridIndex) const;
+      Real* spectrum (size_t iComp, size_t gridIndex);
+      // Spectra in single precision storage only.
+      const float* spectrumSingle (size_t iComp, size_t gridIndex) const;
+
+      const std::string& modelName () const;
+      void modelName (const std::string& value);
+      const std::string& modelUnits () const;
+      void modelUnits (const std::string& value);
+      bool isAdditive () const;
+      void isAdditive (bool value);
+      bool isRedshift () const;
+      void isRedshift (bool value);
+      bool isEscale () const;
+      void isEscale (bool value);
+      bool isDoublePrecision () const;
+      void isDoublePrecision (bool value);
+
+      // Half-Phi tables (see stokes_phisym.cxx).  phiMirrorIndex is
+      // 0-based and -1 for an ordinary table.
+      int phiMirrorIndex () const;
+      const std::string& phiSymmetry () const;
+      const std::string& phiReference () const;
+      void phiMirror (int phiIndex, const std::string& symmetry, const std::string& reference);
+      // Full-Phi table reconstructed from a half-Phi one.  REF tables need the
+      // unpolarised half table on the same grid, refHalf is ignored otherwise.
+      StokesTable unfoldPhi (const StokesTable* refHalf) const;
+
+      // Band layers (see stokes_bands.cxx), kept in the optional BANDS
+      // extension, which XSPEC ignores.  Setting them computes the layers
+      // from the spectra; reset() removes them.
+      const std::vector<Band>& bands () const;
+      void bands (const std::vector<Band>& value);
+      // nBands values per grid point and Stokes component.
+      const Real* bandValues (size_t iComp, size_t gridIndex) const;
+      // A table on the same grid with the band values as spectra, the bands
+      // as its energy bins, for interpolation by TableInterpolator.
+      StokesTable bandTable () const;
+
+   private:
+      std::vector<Parameter> m_parameters;
+      RealArray m_energyLow;
+      RealArray m_energyHigh;
+      size_t m_nComponents;
+      // one block of nGridPoints*nEnergies values per Stokes component
+      std::vector<std::vector<Real> > m_spectra;
+      std::vector<std::vector<float> > m_spectraSingle;
+      bool m_isSingleStorage;
+      std::string m_modelName;
+      std::string m_modelUnits;
+      bool m_isAdditive;
+      bool m_isRedshift;
+      bool m_isEscale;
+      bool m_isDoublePrecision;
+      int m_phiMirrorIndex;
+      std::string m_phiSymmetry;
+      std::string m_phiReference;
+      std::vector<Band> m_bands;
+      // one block of nGridPoints*nBands values per Stokes component
+      std::vector<std::vector<Real> > m_bandValues;
+};
+
+// Class StokesTable
+
+inline size_t StokesTable::nParameters () const
+{
+   return m_parameters.size();
+}
+
+inline const StokesTable::Parameter& StokesTable::parameter (size_t iPar) const
+{
+   return m_parameters[iPar];
+}
+
+inline const std::vector<StokesTable::Parameter>& StokesTable::parameters () const
+{
+   return m_parameters;
+}
+
+inline size_t StokesTable::nEnergies () const
+{
+   return m_energyLow.size();
+}
+
+inline const RealArray& StokesTable::energyLow () const
+{
+   return m_energyLow;
+}
+
+inline const RealArray& StokesTable::energyHigh () const
+{
+   return m_energyHigh;
+}
+
+inline size_t StokesTable::nComponents () const
+{
+   return m_nComponents;
+}
+
+inline const Real* StokesTable::spectrum (size_t iComp, size_t gridIndex) const
+{
+   return &m_spectra[iComp][gridIndex*nEnergies()];
+}
+
+inline Real* StokesTable::spectrum (size_t iComp, size_t gridIndex)
+{
+   return &m_spectra[iComp][gridIndex*nEnergies()];
+}
+
+inline const std::vector<StokesTable::Band>& StokesTable::bands () const
+{
+   return m_bands;
+}
+
+inline const Real* StokesTable::bandValues (size_t iComp, size_t gridIndex) const
+{
+   return &m_bandValues[iComp][gridIndex*m_bands.size()];
+}
+
+inline bool StokesTable::isSingleStorage () const
+{
+   return m_isSingleStorage;
+}
+
+inline const float* StokesTable::spectrumSingle (size_t iComp, size_t gridIndex) const
+{
+   return &m_spectraSingle[iComp][gridIndex*nEnergies()];
+}
+
+inline const std::string& StokesTable::modelName () const
+{
+   return m_modelName;
+}
+
+inline void StokesTable::modelName (const std::string& value)
+{
+   m_modelName = value;
+}
+
+inline const std::string& StokesTable::modelUnits () const
+{
+   return m_modelUnits;
+}
+
+inline void StokesTable::modelUnits (const std::string& value)
+{
+   m_modelUnits = value;
+}
+
+inline bool StokesTable::isAdditive () const
+{
+   return m_isAdditive;
+}
+
+inline void StokesTable::isAdditive (bool value)
+{
+   m_isAdditive = value;
+}
+
+inline bool StokesTable::isRedshift () const
+{
+   return m_isRedshift;
+}
+
+inline void StokesTable::isRedshift (bool value)
+{
+   m_isRedshift = value;
+}
+
+inline bool StokesTable::isEscale () const
+{
+   return m_isEscale;
+}
+
+inline void StokesTable::isEscale (bool value)
+{
+   m_isEscale = value;
+}
+
+inline bool StokesTable::isDoublePrecision () const
+{
+   return m_isDoublePrecision;
+}
+
+inline void StokesTable::isDoublePrecision (bool value)
+{
+   m_isDoublePrecision = value;
+}
+
+inline int StokesTable::phiMirrorIndex () const
+{
+   return m_phiMirrorIndex;
+}
+
+inline const std::string& StokesTable::phiSymmetry () const
+{
+   return m_phiSymmetry;
+}
+
+inline const std::string& StokesTable::phiReference () const
+{
+   return m_phiReference;
+}
+
+#endif
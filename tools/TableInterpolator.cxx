@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <cmath>
+
+#include "TableInterpolator.h"
+
+namespace {
+
+   // Weights and sums are kept in double precision for either storage.
+   template <typename T>
+   void addWeighted (const T* corner, Real weight, Real* out, size_t nEngs)
+   {
+      for (size_t ie=0; ie<nEngs; ++ie)
+         out[ie] += weight*corner[ie];
+   }
+
+   void addCorner (const StokesTable& table, size_t iComp, size_t iGrid, Real weight, Real* out)
+   {
+      if (table.isSingleStorage())
+         addWeighted(table.spectrumSingle(iComp, iGrid), weight, out, table.nEnergies());
+      else
+         addWeighted(table.spectrum(iComp, iGrid), weight, out, table.nEnergies());
+   }
+
+   // Blend of the 2^N corners of a cell.  Corners are added four at a time,
+   // which cuts the passes over the output by four while keeping few enough
+   // input streams for the hardware prefetchers.  Corner count and group
+   // size are compile-time constants and the energy loops have no branches,
+   // so the compiler unrolls the groups and vectorises over the energies.
+   template <size_t N, typename T>
+   void blendCorners (const T* first, const size_t* offsets, const Real* weights, Real* out,
+                      size_t nEngs)
+   {
+      const size_t nCorners = static_cast<size_t>(1) << N;
+      const size_t nGroup = (nCorners < 4) ? nCorners : 4;
+      for (size_t iFirst=0; iFirst<nCorners; iFirst+=nGroup)
+      {
+         const T* corners[nGroup];
+         Real groupWeights[nGroup];
+         for (size_t j=0; j<nGroup; ++j)
+         {
+            corners[j] = first + offsets[iFirst+j]*nEngs;
+            groupWeights[j] = weights[iFirst+j];
+         }
+         if (iFirst == 0)
+         {
+            for (size_t ie=0; ie<nEngs; ++ie)
+            {
+               Real sum = 0.0;
+               for (size_t j=0; j<nGroup; ++j)
+                  sum += groupWeights[j]*corners[j][ie];
+               out[ie] = sum;
+            }
+         }
+         else
+         {
+            for (size_t ie=0; ie<nEngs; ++ie)
+            {
+               Real sum = out[ie];
+               for (size_t j=0; j<nGroup; ++j)
+                  sum += groupWeights[j]*corners[j][ie];
+               out[ie] = sum;
+            }
+         }
+      }
+   }
+
+   template <size_t N>
+   void interpolateFixed (const StokesTable& table, size_t iFirst, const size_t* offsets,
+                          const Real* weights, size_t firstComp, size_t nComps, RealArray* spectra)
+   {
+      const size_t nEngs = table.nEnergies();
+      for (size_t iComp=firstComp; iComp<firstComp+nComps; ++iComp)
+      {
+         Real* out = &spectra[iComp-firstComp][0];
+         if (table.isSingleStorage())
+            blendCorners<N>(table.spectrumSingle(iComp, 0) + iFirst*nEngs, offsets, weights, out, nEngs);
+         else
+            blendCorners<N>(table.spectrum(iComp, 0) + iFirst*nEngs, offsets, weights, out, nEngs);
+      }
+   }
+
+} // namespace
+
+// Class TableInterpolator
+
+TableInterpolator::TableInterpolator (const StokesTable& table)
+   : m_table(table),
+     m_useFixedKernels(true),
+     m_locators(),
+     m_strides(),
+     m_cornerOffsets()
+{
+   const size_t nPars = m_table.nParameters();
+   for (size_t iPar=0; iPar<nPars; ++iPar)
+      m_locators.push_back(GridLocator(m_table.parameter(iPar)));
+   // A parameter with a single node never moves.
+   m_strides.assign(nPars, 0);
+   size_t stride = 1;
+   for (size_t iPar=nPars; iPar>0; --iPar)
+   {
+      const size_t nValues = m_table.parameter(iPar-1).values.size();
+      m_strides[iPar-1] = (nValues > 1) ? stride : 0;
+      stride *= nValues;
+   }
+   if (nPars > s_maxFixedParameters)
+      return;
+   // Grid index offset of each corner from the lower corner of a cell, bit
+   // (nPars-1-iPar) of the corner number selecting the upper node of
+   // parameter iPar.
+   const size_t nCorners = static_cast<size_t>(1) << nPars;
+   m_cornerOffsets.assign(nCorners, 0);
+   for (size_t iCorner=0; iCorner<nCorners; ++iCorner)
+   {
+      for (size_t iPar=0; iPar<nPars; ++iPar)
+      {
+         if ((iCorner >> (nPars-1-iPar)) & 1)
+            m_cornerOffsets[iCorner] += m_strides[iPar];
+      }
+   }
+}
+
+void TableInterpolator::interpolate (const std::vector<Real>& parValues,
+                                     std::vector<RealArray>& spectra) const
+{
+   spectra.resize(m_table.nComponents());
+   interpolateComponents(parValues, 0, spectra.size(), &spectra[0]);
+}
+
+void TableInterpolator::interpolate (const std::vector<Real>& parValues, size_t iComp,
+                                     RealArray& spectrum) const
+{
+   if (iComp >= m_table.nComponents())
+      throw StokesTable::StokesTableError("No such Stokes component in the table");
+   interpolateComponents(parValues, iComp, 1, &spectrum);
+}
+
+void TableInterpolator::interpolateComponents (const std::vector<Real>& parValues, size_t firstComp,
+                                               size_t nComps, RealArray* spectra) const
+{
+   const size_t nPars = m_table.nParameters();
+   const size_t nEngs = m_table.nEnergies();
+   if (parValues.size() != nPars)
+      throw StokesTable::StokesTableError("Wrong number of parameter values for table interpolation");
+
+   std::vector<size_t> lower(nPars);
+   std::vector<Real> weight(nPars);
+   for (size_t iPar=0; iPar<nPars; ++iPar)
+      m_locators[iPar].locate(parValues[iPar], lower[iPar], weight[iPar]);
+
+   for (size_t iComp=0; iComp<nComps; ++iComp)
+      spectra[iComp].resize(nEngs);
+   if (m_useFixedKernels && nPars <= s_maxFixedParameters)
+   {
+      interpolateFixed(lower, weight, firstComp, nComps, spectra);
+      return;
+   }
+   for (size_t iComp=0; iComp<nComps; ++iComp)
+      spectra[iComp] = 0.0;
+
+   // Loop over the 2^nPars corners of the bracketing cell, bit iPar of
+   // iCorner selecting the upper node of parameter iPar.
+   std::vector<size_t> nodes(nPars);
+   const size_t nCorners = static_cast<size_t>(1) << nPars;
+   for (size_t iCorner=0; iCorner<nCorners; ++iCorner)
+   {
+      Real cornerWeight = 1.0;
+      for (size_t iPar=0; iPar<nPars && cornerWeight != 0.0; ++iPar)
+      {
+         const bool isUpper = (iCorner >> (nPars-1-iPar)) & 1;
+         nodes[iPar] = lower[iPar] + (isUpper ? 1 : 0);
+         cornerWeight *= isUpper ? weight[iPar] : 1.0 - weight[iPar];
+      }
+      if (cornerWeight == 0.0)
+         continue;
+      const size_t iGrid = m_table.gridIndex(nodes);
+      for (size_t iComp=0; iComp<nComps; ++iComp)
+         addCorner(m_table, firstComp + iComp, iGrid, cornerWeight, &spectra[iComp][0]);
+   }
+}
+
+void TableInterpolator::interpolateFixed (const std::vector<size_t>& lower,
+                                          const std::vector<Real>& weight, size_t firstComp,
+                                          size_t nComps, RealArray* spectra) const
+{
+   // Parameters on a node (weight 0 or 1) are fixed there, the others span
+   // the cell.
+   const size_t nPars = lower.size();
+   std::vector<size_t> nodes(lower);
+   size_t moving[s_maxFixedParameters];
+   size_t nMoving = 0;
+   for (size_t iPar=0; iPar<nPars; ++iPar)
+   {
+      if (weight[iPar] == 1.0)
+         ++nodes[iPar];
+      else if (weight[iPar] != 0.0 && m_strides[iPar] != 0)
+         moving[nMoving++] = iPar;
+   }
+
+   // tensor-product weights, built up one parameter at a time in the corner
+   // order of the offsets
+   Real weights[static_cast<size_t>(1) << s_maxFixedParameters];
+   weights[0] = 1.0;
+   for (size_t i=0; i<nMoving; ++i)
+   {
+      const Real upperWeight = weight[moving[i]];
+      const size_t nDone = static_cast<size_t>(1) << i;
+      for (size_t k=nDone; k>0; --k)
+      {
+         weights[2*k-1] = weights[k-1]*upperWeight;
+         weights[2*k-2] = weights[k-1]*(1.0 - upperWeight);
+      }
+   }
+   size_t cellOffsets[static_cast<size_t>(1) << s_maxFixedParameters];
+   const size_t* offsets = &m_cornerOffsets[0];
+   if (nMoving < nPars)
+   {
+      const size_t nCorners = static_cast<size_t>(1) << nMoving;
+      for (size_t iCorner=0; iCorner<nCorners; ++iCorner)
+      {
+         cellOffsets[iCorner] = 0;
+         for (size_t i=0; i<nMoving; ++i)
+         {
+            if ((iCorner >> (nMoving-1-i)) & 1)
+               cellOffsets[iCorner] += m_strides[moving[i]];
+         }
+      }
+      offsets = cellOffsets;
+   }
+   const size_t iFirst = m_table.gridIndex(nodes);
+   switch (nMoving)
+   {
+      case 0: ::interpolateFixed<0>(m_table, iFirst, offsets, weights, firstComp, nComps, spectra); break;
+      case 1: ::interpolateFixed<1>(m_table, iFirst, offsets, weights, firstComp, nComps, spectra); break;
+      case 2: ::interpolateFixed<2>(m_table, iFirst, offsets, weights, firstComp, nComps, spectra); break;
+      case 3: ::interpolateFixed<3>(m_table, iFirst, offsets, weights, firstComp, nComps, spectra); break;
+      case 4: ::interpolateFixed<4>(m_table, iFirst, offsets, weights, firstComp, nComps, spectra); break;
+      case 5: ::interpolateFixed<5>(m_table, iFirst, offsets, weights, firstComp, nComps, spectra); break;
+      case 6: ::interpolateFixed<6>(m_table, iFirst, offsets, weights, firstComp, nComps, spectra); break;
+   }
+}
+
+StokesTable TableInterpolator::slice (const std::vector<size_t>& parIndices,
+                                      const std::vector<Real>& parValues) const
+{
+   const size_t nPars = m_table.nParameters();
+   const size_t nComps = m_table.nComponents();
+   if (parIndices.size() != parValues.size())
+      throw StokesTable::StokesTableError("Slice needs one value per fixed parameter");
+
+   std::vector<bool> isFixed(nPars, false);
+   std::vector<size_t> fixedLower(nPars, 0);
+   std::vector<Real> fixedWeight(nPars, 0.0);
+   for (size_t i=0; i<parIndices.size(); ++i)
+   {
+      const size_t iPar = parIndices[i];
+      if (iPar >= nPars)
+         throw StokesTable::StokesTableError("Slice parameter index out of range");
+      isFixed[iPar] = true;
+      locate(m_table.parameter(iPar), parValues[i], fixedLower[iPar], fixedWeight[iPar]);
+   }
+
+   std::vector<StokesTable::Parameter> keptPars;
+   std::vector<size_t> keptIndex;
+   int phiIndex = -1;
+   for (size_t iPar=0; iPar<nPars; ++iPar)
+   {
+      if (isFixed[iPar])
+         continue;
+      if (static_cast<int>(iPar) == m_table.phiMirrorIndex())
+         phiIndex = static_cast<int>(keptPars.size());
+      keptPars.push_back(m_table.parameter(iPar));
+      keptIndex.push_back(iPar);
+   }
+   StokesTable sliced;
+   sliced.reset(keptPars, m_table.energyLow(), m_table.energyHigh(), nComps);
+   sliced.modelName(m_table.modelName());
+   sliced.modelUnits(m_table.modelUnits());
+   sliced.isAdditive(m_table.isAdditive());
+   sliced.isRedshift(m_table.isRedshift());
+   sliced.isEscale(m_table.isEscale());
+   sliced.isDoublePrecision(m_table.isDoublePrecision());
+   if (phiIndex >= 0)
+      sliced.phiMirror(phiIndex, m_table.phiSymmetry(), m_table.phiReference());
+
+   const size_t nFixed = parIndices.size();
+   const size_t nCorners = static_cast<size_t>(1) << nFixed;
+   std::vector<size_t> slicedNodes, nodes(nPars);
+   for (size_t iSliced=0; iSliced<sliced.nGridPoints(); ++iSliced)
+   {
+      sliced.gridNodes(iSliced, slicedNodes);
+      for (size_t k=0; k<keptIndex.size(); ++k)
+         nodes[keptIndex[k]] = slicedNodes[k];
+      for (size_t iCorner=0; iCorner<nCorners; ++iCorner)
+      {
+         Real cornerWeight = 1.0;
+         for (size_t i=0; i<nFixed; ++i)
+         {
+            const size_t iPar = parIndices[i];
+            const bool isUpper = (iCorner >> i) & 1;
+            nodes[iPar] = fixedLower[iPar] + (isUpper ? 1 : 0);
+            cornerWeight *= isUpper ? fixedWeight[iPar] : 1.0 - fixedWeight[iPar];
+         }
+         if (cornerWeight == 0.0)
+            continue;
+         const size_t iGrid = m_table.gridIndex(nodes);
+         for (size_t iComp=0; iComp<nComps; ++iComp)
+            addCorner(m_table, iComp, iGrid, cornerWeight, sliced.spectrum(iComp, iSliced));
+      }
+   }
+   return sliced;
+}
+
+void TableInterpolator::locate (const StokesTable::Parameter& par, Real value,
+                                size_t& lower, Real& weight)
+{
+   const std::vector<Real>& values = par.values;
+   const size_t nValues = values.size();
+   if (nValues < 2 || value <= values[0])
+   {
+      lower = 0;
+      weight = 0.0;
+      return;
+   }
+   if (value >= values[nValues-1])
+   {
+      lower = nValues - 2;
+      weight = 1.0;
+      return;
+   }
+   lower = static_cast<size_t>(std::upper_bound(values.begin(), values.end(), value)
+                               - values.begin()) - 1;
+   const Real low = values[lower];
+   const Real high = values[lower+1];
+   if (par.method == 1 && low > 0.0)
+      weight = std::log(value/low)/std::log(high/low);
+   else
+      weight = (value - low)/(high - low);
+}
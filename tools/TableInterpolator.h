@@ -0,0 +1,75 @@
+#ifndef TABLEINTERPOLATOR_H
+#define TABLEINTERPOLATOR_H 1
+
+#include <vector>
+
+#include "GridLocator.h"
+#include "StokesTable.h"
+
+// TableInterpolator does multilinear interpolation on the parameter grid of
+// a StokesTable the way XSPEC does for atable: linearly in the parameter, or
+// in its logarithm for parameters with METHOD 1, with values outside the grid
+// clamped to the end nodes.  The spectra themselves are not rebinned, results
+// are on the energy bins of the table.  Tables in single precision storage
+// are interpolated with double precision weights and sums.
+//
+// Tables with up to six parameters (the STOKES tables have five, the
+// isotropic one three) are interpolated by kernels compiled for their
+// number of parameters, using corner offsets precomputed in the constructor
+// and a single vectorisable pass over the energies.  fixedKernels(false)
+// selects the generic corner loop instead.  The cells are found by a
+// GridLocator per parameter, and parameters sitting on a node are left out
+// of the cell, halving the corners to blend for each of them.  As the
+// locators keep the last cell, an interpolator must not be shared between
+// threads.
+
+class TableInterpolator
+{
+   public:
+      TableInterpolator (const StokesTable& table);
+
+      // Spectra of all Stokes components at parValues, one value per table
+      // parameter.
+      void interpolate (const std::vector<Real>& parValues, std::vector<RealArray>& spectra) const;
+      // Spectrum of Stokes component iComp only.
+      void interpolate (const std::vector<Real>& parValues, size_t iComp, RealArray& spectrum) const;
+      // Table with the parameters in parIndices fixed at parValues and removed
+      // from the grid.
+      StokesTable slice (const std::vector<size_t>& parIndices, const std::vector<Real>& parValues) const;
+
+      // Lower bracketing node and the weight of the upper one.
+      static void locate (const StokesTable::Parameter& par, Real value, size_t& lower, Real& weight);
+
+      bool fixedKernels () const;
+      void fixedKernels (bool value);
+
+      static const size_t s_maxFixedParameters = 6;
+
+   private:
+      // nComps spectra from component firstComp on
+      void interpolateComponents (const std::vector<Real>& parValues, size_t firstComp,
+                                  size_t nComps, RealArray* spectra) const;
+      void interpolateFixed (const std::vector<size_t>& lower, const std::vector<Real>& weight,
+                             size_t firstComp, size_t nComps, RealArray* spectra) const;
+
+      const StokesTable& m_table;
+      bool m_useFixedKernels;
+      std::vector<GridLocator> m_locators;
+      // grid index stride of each parameter, 0 for a single node
+      std::vector<size_t> m_strides;
+      std::vector<size_t> m_cornerOffsets;
+};
+
+// Class TableInterpolator
+
+inline bool TableInterpolator::fixedKernels () const
+{
+   return m_useFixedKernels;
+}
+
+inline void TableInterpolator::fixedKernels (bool value)
+{
+   m_useFixedKernels = value;
+}
+
+#endif
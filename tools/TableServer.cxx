@@ -0,0 +1,571 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "TableServer.h"
+
+namespace {
+
+   const unsigned long long s_attachMessage = 1;
+   const unsigned long long s_tableMessage = 2;
+   const unsigned long long s_maxPayload = 1 << 20;
+
+   volatile sig_atomic_t s_isStopping = 0;
+
+   // FNV-1a of the energies
+   unsigned long long gridFingerprint (const Real* energies, size_t nEnergies)
+   {
+      unsigned long long hash = 14695981039346656037ULL;
+      const unsigned char* bytes = reinterpret_cast<const unsigned char*>(energies);
+      for (size_t i=0; i<nEnergies*sizeof(Real); ++i)
+      {
+         hash ^= bytes[i];
+         hash *= 1099511628211ULL;
+      }
+      return hash;
+   }
+
+   // Whether the peer runs as the server's user (always true where the
+   // peer cannot be asked, the socket's permissions then being the guard).
+   bool isSameUser (int socket)
+   {
+#if defined(SO_PEERCRED)
+      ucred credentials;
+      socklen_t size = sizeof(credentials);
+      if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0)
+         return false;
+      return credentials.uid == geteuid();
+#else
+      (void)socket;
+      return true;
+#endif
+   }
+
+   template <typename T>
+   void appendBytes (std::string& key, const T& value)
+   {
+      key.append(reinterpret_cast<const char*>(&value), sizeof(T));
+   }
+
+   // Device, inode, size and modification and status change times (with
+   // their nanoseconds) of each file.
+   std::string fileSignature (const std::vector<std::string>& fileNames)
+   {
+      std::string signature;
+      for (size_t i=0; i<fileNames.size(); ++i)
+      {
+         struct stat status;
+         if (stat(fileNames[i].c_str(), &status) != 0)
+            throw StokesTable::StokesTableError("Cannot find " + fileNames[i]);
+#if defined(__APPLE__)
+         const timespec& modified = status.st_mtimespec;
+         const timespec& changed = status.st_ctimespec;
+#else
+         const timespec& modified = status.st_mtim;
+         const timespec& changed = status.st_ctim;
+#endif
+         appendBytes(signature, static_cast<unsigned long long>(status.st_dev));
+         appendBytes(signature, static_cast<unsigned long long>(status.st_ino));
+         appendBytes(signature, static_cast<unsigned long long>(status.st_size));
+         appendBytes(signature, static_cast<unsigned long long>(modified.tv_sec));
+         appendBytes(signature, static_cast<unsigned long long>(modified.tv_nsec));
+         appendBytes(signature, static_cast<unsigned long long>(changed.tv_sec));
+         appendBytes(signature, static_cast<unsigned long long>(changed.tv_nsec));
+      }
+      return signature;
+   }
+
+   bool receiveAll (int socket, void* data, size_t size)
+   {
+      char* bytes = static_cast<char*>(data);
+      while (size > 0)
+      {
+         const ssize_t nRead = recv(socket, bytes, size, 0);
+         if (nRead < 0 && errno == EINTR)
+            continue;
+         if (nRead <= 0)
+            return false;
+         bytes += nRead;
+         size -= nRead;
+      }
+      return true;
+   }
+
+   bool sendAll (int socket, const void* data, size_t size)
+   {
+      const char* bytes = static_cast<const char*>(data);
+      while (size > 0)
+      {
+         const ssize_t nSent = send(socket, bytes, size, MSG_NOSIGNAL);
+         if (nSent < 0 && errno == EINTR)
+            continue;
+         if (nSent <= 0)
+            return false;
+         bytes += nSent;
+         size -= nSent;
+      }
+      return true;
+   }
+
+} // namespace
+
+// Class TableServer::Statistics
+
+TableServer::Statistics::Statistics ()
+   : nRequests(0),
+     nCacheHits(0),
+     nEvaluations(0),
+     nBatches(0),
+     nErrors(0)
+{
+}
+
+// Class TableServer
+
+TableServer::TableServer (MdefEngine& engine)
+   : m_engine(engine),
+     m_listener(-1),
+     m_clients(),
+     m_tableModels(),
+     m_cache(),
+     m_cacheIndex(),
+     m_cacheBytes(0),
+     m_cacheSize(256 << 20),
+     m_batchWindow(0.0005),
+     m_nThreads(0),
+     m_statistics()
+{
+}
+
+TableServer::~TableServer ()
+{
+   while (!m_clients.empty())
+      dropClient(m_clients.size() - 1);
+   if (m_listener >= 0)
+      close(m_listener);
+}
+
+void TableServer::stop ()
+{
+   s_isStopping = 1;
+}
+
+void TableServer::run (const std::string& socketPath)
+{
+   sockaddr_un address;
+   std::memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   if (socketPath.size() >= sizeof(address.sun_path))
+      throw StokesTable::StokesTableError("Socket path too long: " + socketPath);
+   std::strcpy(address.sun_path, socketPath.c_str());
+   m_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (m_listener < 0)
+      throw StokesTable::StokesTableError("Cannot create a socket");
+   // a socket left by a server that died is replaced, a live one is not
+   if (connect(m_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0)
+      throw StokesTable::StokesTableError("A server is already listening on " + socketPath);
+   close(m_listener);
+   unlink(socketPath.c_str());
+   m_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   // the socket is created readable and writable by its owner only
+   const mode_t oldMask = umask(0177);
+   const bool isBound = m_listener >= 0
+      && bind(m_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+   umask(oldMask);
+   if (!isBound || listen(m_listener, 64) != 0)
+      throw StokesTable::StokesTableError("Cannot listen on " + socketPath + ": " + std::strerror(errno));
+
+   s_isStopping = 0;
+   std::vector<pollfd> polled;
+   std::vector<Request> batch;
+   while (!s_isStopping)
+   {
+      // Wait for requests, then give other clients the batch window to
+      // send theirs.
+      std::chrono::steady_clock::time_point batchEnd;
+      bool isCollecting = false;
+      while (!s_isStopping)
+      {
+         polled.resize(m_clients.size() + 1);
+         polled[0].fd = m_listener;
+         polled[0].events = POLLIN;
+         for (size_t i=0; i<m_clients.size(); ++i)
+         {
+            polled[i+1].fd = m_clients[i].socket;
+            polled[i+1].events = POLLIN;
+         }
+         int timeout = 200;
+         if (isCollecting)
+         {
+            const double remaining = std::chrono::duration<double>(batchEnd
+                                        - std::chrono::steady_clock::now()).count();
+            if (remaining <= 0.0)
+               break;
+            timeout = static_cast<int>(std::ceil(remaining*1000.0));
+         }
+         const int nReady = poll(&polled[0], polled.size(), timeout);
+         if (nReady < 0 && errno != EINTR)
+            throw StokesTable::StokesTableError(std::string("poll: ") + std::strerror(errno));
+         if (nReady <= 0)
+         {
+            if (isCollecting)
+               break;
+            continue;
+         }
+         const size_t nBefore = batch.size();
+         // from the last, so that dropping a client leaves the others in place
+         for (size_t i=m_clients.size(); i>0; --i)
+         {
+            if (polled[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+               if (!receive(i-1, batch))
+               {
+                  // with the requests it has left in the batch
+                  dropClient(i-1);
+                  size_t nKept = 0;
+                  for (size_t iRequest=0; iRequest<batch.size(); ++iRequest)
+                  {
+                     if (batch[iRequest].client == i-1)
+                        continue;
+                     if (batch[iRequest].client > i-1)
+                        --batch[iRequest].client;
+                     batch[nKept++] = batch[iRequest];
+                  }
+                  batch.resize(nKept);
+               }
+            }
+         }
+         if (polled[0].revents & POLLIN)
+         {
+            const int clientSocket = accept(m_listener, 0, 0);
+            if (clientSocket >= 0 && !isSameUser(clientSocket))
+               close(clientSocket);
+            else if (clientSocket >= 0)
+            {
+               // a client stuck in the middle of a message is dropped
+               timeval timeout = {5, 0};
+               setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+               const Client client = {clientSocket, 0, 0};
+               m_clients.push_back(client);
+            }
+         }
+         if (batch.size() > nBefore && !isCollecting)
+         {
+            isCollecting = true;
+            batchEnd = std::chrono::steady_clock::now()
+               + std::chrono::microseconds(static_cast<long long>(m_batchWindow*1.0e6));
+         }
+      }
+      if (!batch.empty())
+         serve(batch);
+   }
+   close(m_listener);
+   m_listener = -1;
+   unlink(socketPath.c_str());
+}
+
+bool TableServer::receive (size_t iClient, std::vector<Request>& batch)
+{
+   Client& client = m_clients[iClient];
+   unsigned long long header[2];
+   char control[CMSG_SPACE(sizeof(int))];
+   iovec io = {header, sizeof(header)};
+   msghdr message;
+   std::memset(&message, 0, sizeof(message));
+   message.msg_iov = &io;
+   message.msg_iovlen = 1;
+   message.msg_control = control;
+   message.msg_controllen = sizeof(control);
+   ssize_t nRead;
+   do
+      nRead = recvmsg(client.socket, &message, MSG_WAITALL);
+   while (nRead < 0 && errno == EINTR);
+   int fileDescriptor = -1;
+   for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+   {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+         std::memcpy(&fileDescriptor, CMSG_DATA(cmsg), sizeof(int));
+   }
+   if (nRead != static_cast<ssize_t>(sizeof(header)) || header[1] > s_maxPayload)
+   {
+      if (fileDescriptor >= 0)
+         close(fileDescriptor);
+      return false;
+   }
+   std::vector<unsigned long long> payload((header[1] + 7)/8);
+   if (header[1] > 0 && !receiveAll(client.socket, &payload[0], header[1]))
+   {
+      if (fileDescriptor >= 0)
+         close(fileDescriptor);
+      return false;
+   }
+
+   if (header[0] == s_attachMessage)
+   {
+      const size_t capacity = payload.empty() ? 0 : payload[0];
+      struct stat fileStatus;
+      if (fileDescriptor < 0 || fstat(fileDescriptor, &fileStatus) != 0
+          || static_cast<size_t>(fileStatus.st_size) < capacity || capacity < 2*sizeof(Real))
+      {
+         if (fileDescriptor >= 0)
+            close(fileDescriptor);
+         reply(iClient, 1, 0, "Invalid shared buffer");
+         return true;
+      }
+      void* mapped = mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0);
+      close(fileDescriptor);
+      if (mapped == MAP_FAILED)
+      {
+         reply(iClient, 1, 0, "Cannot map the shared buffer");
+         return true;
+      }
+      if (client.buffer)
+         munmap(client.buffer, client.capacity);
+      client.buffer = static_cast<Real*>(mapped);
+      client.capacity = capacity;
+      reply(iClient, 0, 0);
+      return true;
+   }
+   if (fileDescriptor >= 0)
+      close(fileDescriptor);
+   if (header[0] != s_tableMessage || payload.size() < 4)
+      return false;
+
+   Request request;
+   request.client = iClient;
+   request.component = payload[0];
+   request.nEnergies = payload[1];
+   // the counts are bounded by the payload size before they are combined,
+   // so that the size computed from them cannot wrap around
+   const unsigned long long nFixed = 4*sizeof(unsigned long long);
+   if (header[1] < nFixed || payload[2] > (header[1] - nFixed)/sizeof(Real)
+       || payload[3] > header[1] - nFixed
+       || header[1] != nFixed + payload[2]*sizeof(Real) + payload[3])
+      return false;
+   const size_t nParams = payload[2];
+   const size_t nameLength = payload[3];
+   const char* name = reinterpret_cast<const char*>(&payload[4]);
+   request.fileName.assign(name, nameLength);
+   request.parameters.resize(nParams);
+   if (nParams > 0)
+      std::memcpy(&request.parameters[0], name + nameLength, nParams*sizeof(Real));
+   ++m_statistics.nRequests;
+   if (request.component > 2 || request.nEnergies < 2
+       || request.nEnergies > (client.capacity/sizeof(Real) + 1)/2)
+   {
+      ++m_statistics.nErrors;
+      reply(iClient, 1, 0, "Invalid request");
+      return true;
+   }
+   batch.push_back(request);
+   return true;
+}
+
+void TableServer::serve (std::vector<Request>& batch)
+{
+   ++m_statistics.nBatches;
+   // Requests not in the cache, grouped by table and energies, the
+   // distinct parameter sets of each group evaluated together.
+   struct Group
+   {
+      std::string modelName;
+      const Real* energies;
+      size_t nEnergies;
+      std::vector<std::vector<Real> > sets;
+      std::vector<std::string> keys;
+      std::vector<std::vector<size_t> > requests;
+   };
+   std::map<std::string, Group> groups;
+   std::map<std::string, std::vector<RealArray> > results;
+   std::vector<std::string> keys(batch.size());
+   for (size_t iRequest=0; iRequest<batch.size(); ++iRequest)
+   {
+      const Request& request = batch[iRequest];
+      const Client& client = m_clients[request.client];
+      const TableModel* model = 0;
+      try
+      {
+         model = &tableModel(request.fileName);
+         if (m_engine.parameterNames(model->name).size() != request.parameters.size())
+            throw StokesTable::StokesTableError(request.fileName + ": wrong number of parameters");
+      }
+      catch (StokesTable::StokesTableError& err)
+      {
+         ++m_statistics.nErrors;
+         reply(request.client, 1, 0, err.what());
+         keys[iRequest].clear();
+         continue;
+      }
+      std::string groupKey(request.fileName);
+      groupKey.push_back('\0');
+      groupKey += model->signature;
+      appendBytes(groupKey, request.nEnergies);
+      appendBytes(groupKey, gridFingerprint(client.buffer, request.nEnergies));
+      std::string& key = keys[iRequest];
+      key = groupKey;
+      for (size_t i=0; i<request.parameters.size(); ++i)
+         appendBytes(key, request.parameters[i]);
+      if (results.count(key))
+      {
+         ++m_statistics.nCacheHits;
+         continue;
+      }
+      if (const std::vector<RealArray>* cached = findCached(key))
+      {
+         // copied, since storing the new results may evict it
+         ++m_statistics.nCacheHits;
+         results[key] = *cached;
+         continue;
+      }
+      std::map<std::string, Group>::iterator itGroup = groups.find(groupKey);
+      if (itGroup == groups.end())
+      {
+         Group group;
+         group.modelName = model->name;
+         group.energies = client.buffer;
+         group.nEnergies = request.nEnergies;
+         itGroup = groups.insert(std::make_pair(groupKey, group)).first;
+      }
+      Group& group = itGroup->second;
+      const size_t iSet = std::find(group.keys.begin(), group.keys.end(), key) - group.keys.begin();
+      if (iSet == group.keys.size())
+      {
+         group.keys.push_back(key);
+         group.sets.push_back(request.parameters);
+         group.requests.push_back(std::vector<size_t>());
+      }
+      group.requests[iSet].push_back(iRequest);
+   }
+
+   for (std::map<std::string, Group>::iterator itGroup=groups.begin(); itGroup!=groups.end(); ++itGroup)
+   {
+      Group& group = itGroup->second;
+      RealArray energies(group.energies, group.nEnergies);
+      std::vector<std::vector<RealArray> > spectra;
+      try
+      {
+         m_engine.evaluateBatch(group.modelName, group.sets, energies, spectra, m_nThreads);
+      }
+      catch (StokesTable::StokesTableError& err)
+      {
+         for (size_t iSet=0; iSet<group.requests.size(); ++iSet)
+         {
+            for (size_t i=0; i<group.requests[iSet].size(); ++i)
+            {
+               const size_t iRequest = group.requests[iSet][i];
+               ++m_statistics.nErrors;
+               reply(batch[iRequest].client, 1, 0, err.what());
+               keys[iRequest].clear();
+            }
+         }
+         continue;
+      }
+      m_statistics.nEvaluations += group.sets.size();
+      for (size_t iSet=0; iSet<group.sets.size(); ++iSet)
+      {
+         storeCached(group.keys[iSet], spectra[iSet]);
+         results[group.keys[iSet]].swap(spectra[iSet]);
+      }
+   }
+
+   // Replies in order of arrival.
+   for (size_t iRequest=0; iRequest<batch.size(); ++iRequest)
+   {
+      if (keys[iRequest].empty())
+         continue;
+      const Request& request = batch[iRequest];
+      const RealArray& values = results[keys[iRequest]][request.component];
+      const size_t nBins = request.nEnergies - 1;
+      std::copy(&values[0], &values[0] + nBins, m_clients[request.client].buffer + request.nEnergies);
+      reply(request.client, 0, nBins);
+   }
+   batch.clear();
+}
+
+void TableServer::reply (size_t iClient, unsigned long long status, unsigned long long value,
+                         const std::string& message)
+{
+   unsigned long long header[2] = {status, status == 0 ? value : message.size()};
+   const int clientSocket = m_clients[iClient].socket;
+   if (sendAll(clientSocket, header, sizeof(header)) && status != 0)
+      sendAll(clientSocket, message.data(), message.size());
+}
+
+void TableServer::dropClient (size_t iClient)
+{
+   Client& client = m_clients[iClient];
+   if (client.buffer)
+      munmap(client.buffer, client.capacity);
+   close(client.socket);
+   m_clients.erase(m_clients.begin() + iClient);
+}
+
+const TableServer::TableModel& TableServer::tableModel (const std::string& fileName)
+{
+   std::vector<std::string> fileNames;
+   std::map<std::string, TableModel>::iterator itModel = m_tableModels.find(fileName);
+   if (itModel != m_tableModels.end())
+   {
+      TableModel& model = itModel->second;
+      m_engine.tableFiles(model.name, fileNames);
+      const std::string signature = fileSignature(fileNames);
+      if (signature != model.signature)
+      {
+         // replaced since it was read
+         m_engine.rereadTable(fileName);
+         m_engine.defineTable(model.name, fileName);
+         m_engine.tableFiles(model.name, fileNames);
+         model.signature = fileSignature(fileNames);
+      }
+      return model;
+   }
+   std::ostringstream name;
+   name << "table" << m_tableModels.size();
+   m_engine.defineTable(name.str(), fileName);
+   TableModel model;
+   model.name = name.str();
+   m_engine.tableFiles(model.name, fileNames);
+   model.signature = fileSignature(fileNames);
+   return m_tableModels.insert(std::make_pair(fileName, model)).first->second;
+}
+
+const std::vector<RealArray>* TableServer::findCached (const std::string& key)
+{
+   std::map<std::string, std::list<CacheEntry>::iterator>::iterator itEntry = m_cacheIndex.find(key);
+   if (itEntry == m_cacheIndex.end())
+      return 0;
+   // most recently used first
+   m_cache.splice(m_cache.begin(), m_cache, itEntry->second);
+   return &itEntry->second->spectra;
+}
+
+void TableServer::storeCached (const std::string& key, const std::vector<RealArray>& spectra)
+{
+   const size_t nBytes = 3*spectra[0].size()*sizeof(Real) + key.size();
+   if (nBytes > m_cacheSize || m_cacheIndex.count(key))
+      return;
+   while (m_cacheBytes + nBytes > m_cacheSize && !m_cache.empty())
+   {
+      const CacheEntry& oldest = m_cache.back();
+      m_cacheBytes -= 3*oldest.spectra[0].size()*sizeof(Real) + oldest.key.size();
+      m_cacheIndex.erase(oldest.key);
+      m_cache.pop_back();
+   }
+   CacheEntry entry;
+   entry.key = key;
+   entry.spectra = spectra;
+   m_cache.push_front(entry);
+   m_cacheIndex[key] = m_cache.begin();
+   m_cacheBytes += nBytes;
+}
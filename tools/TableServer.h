@@ -0,0 +1,174 @@
+#ifndef TABLESERVER_H
+#define TABLESERVER_H 1
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "MdefEngine.h"
+
+// TableServer serves the atable{} interpolations of XSPEC sessions on one
+// machine over a Unix-domain socket, so that the tables are read and kept
+// once for all of them.  The updated MdefExpression.cxx sends its atable{}
+// calls here while 'xset MDEF_SERVER socket' is set, and evaluates them
+// itself when the server cannot be reached.  The tables are interpolated by
+// an MdefEngine, i, q and u together, and the results are kept in a cache
+// shared by all clients, so the q and u datasets of a fit (or another
+// session at the same parameters) take them from there.  Requests arriving
+// within a short window are served as one batch: identical calls are
+// computed once, the others on several threads.
+//
+// Protocol (native byte order, all integers 64-bit unsigned).  Each message
+// starts with its kind and the size of the rest:
+//    1 attach: size of the buffer in bytes, with the descriptor of a shared
+//      file passed as SCM_RIGHTS, which the server maps as the buffer of
+//      this client.  Sent before the first request and whenever the client
+//      needs a larger buffer.
+//    2 table: Stokes component (0, 1, 2 for i, q, u), number of energies n,
+//      number of parameters m, length of the file name, the file name (an
+//      absolute path, as the server runs in its own directory), the m
+//      parameter values (doubles, the redshift last).  The n energies are
+//      at the start of the buffer, and the n-1 values of the component on
+//      those bins (per bin, as from XSPEC's table code) are written after
+//      them.
+// and every message is answered by
+//    status (0 for success), then the number of values written or, for an
+//    error, the length of the message that follows.
+// A message whose sizes do not add up, or that is larger than 1 MB, drops
+// the client.  The socket is created with mode 0600 and, where the peer's
+// credentials are available, clients of other users are refused.
+// Requests are served in order for each client, one at a time.  Tables are
+// read again when the device, inode, size or modification or status change
+// time (in ns) of their files change, and the results are kept under these,
+// so a replaced table is never served from the cache.
+
+class TableServer
+{
+   public:
+      struct Statistics
+      {
+         Statistics();
+         unsigned long long nRequests;
+         unsigned long long nCacheHits;
+         unsigned long long nEvaluations;
+         unsigned long long nBatches;
+         unsigned long long nErrors;
+      };
+
+      // The engine must outlive the server; tables are defined in it as the
+      // clients ask for them.
+      explicit TableServer (MdefEngine& engine);
+      ~TableServer ();
+
+      // Create the socket (replacing a stale one) and serve until stop().
+      void run (const std::string& socketPath);
+      // May be called from a signal handler.
+      static void stop ();
+
+      // Cache size [bytes], 256 MB by default.
+      size_t cacheSize () const;
+      void cacheSize (size_t value);
+      // Time to wait for further requests before serving a batch [s].
+      double batchWindow () const;
+      void batchWindow (double value);
+      // Threads for the evaluations of a batch, 0 for one per hardware
+      // thread.
+      size_t nThreads () const;
+      void nThreads (size_t value);
+
+      const Statistics& statistics () const;
+
+   private:
+      TableServer (const TableServer& right);
+      TableServer& operator= (const TableServer& right);
+
+      struct Client
+      {
+         int socket;
+         Real* buffer;
+         size_t capacity;
+      };
+
+      struct Request
+      {
+         size_t client;
+         size_t component;
+         std::string fileName;
+         std::vector<Real> parameters;
+         size_t nEnergies;
+      };
+
+      struct TableModel
+      {
+         std::string name;
+         // device, inode, size and times of the table files when read
+         std::string signature;
+      };
+
+      struct CacheEntry
+      {
+         std::string key;
+         std::vector<RealArray> spectra;
+      };
+
+      bool receive (size_t iClient, std::vector<Request>& batch);
+      void serve (std::vector<Request>& batch);
+      void reply (size_t iClient, unsigned long long status, unsigned long long value,
+                  const std::string& message = std::string());
+      void dropClient (size_t iClient);
+      const TableModel& tableModel (const std::string& fileName);
+      const std::vector<RealArray>* findCached (const std::string& key);
+      void storeCached (const std::string& key, const std::vector<RealArray>& spectra);
+
+      MdefEngine& m_engine;
+      int m_listener;
+      std::vector<Client> m_clients;
+      std::map<std::string, TableModel> m_tableModels;
+      std::list<CacheEntry> m_cache;
+      std::map<std::string, std::list<CacheEntry>::iterator> m_cacheIndex;
+      size_t m_cacheBytes;
+      size_t m_cacheSize;
+      double m_batchWindow;
+      size_t m_nThreads;
+      Statistics m_statistics;
+};
+
+// Class TableServer
+
+inline size_t TableServer::cacheSize () const
+{
+   return m_cacheSize;
+}
+
+inline void TableServer::cacheSize (size_t value)
+{
+   m_cacheSize = value;
+}
+
+inline double TableServer::batchWindow () const
+{
+   return m_batchWindow;
+}
+
+inline void TableServer::batchWindow (double value)
+{
+   m_batchWindow = value;
+}
+
+inline size_t TableServer::nThreads () const
+{
+   return m_nThreads;
+}
+
+inline void TableServer::nThreads (size_t value)
+{
+   m_nThreads = value;
+}
+
+inline const TableServer::Statistics& TableServer::statistics () const
+{
+   return m_statistics;
+}
+
+#endif
@@ -0,0 +1,161 @@
+// stokes_atlas - i, q and u of the stokes model over a grid of all its
+// parameters, written to a binary atlas file (see AtlasGenerator.h for the
+// layout).
+//
+// Each axis is given as name=first:last:n or name=value, with the names
+// Gamma, Xi, Thetai, Phi, Thetae, PolFrac and PolAng (angles in degrees).
+// Axes not given hold the initial value of the table parameter (0 for
+// PolFrac and PolAng).  With -r an atlas left by an interrupted run is
+// continued.
+//
+// Usage:
+//    stokes_atlas -u stokes_unpol-v2.fits [-v stokes_vrpol-v2.fits]
+//                 [-4 stokes_45deg-v2.fits] [-a name=first:last:n ...]
+//                 [-n threads] [-c chunk] [-s] [-f] [-r] atlas.bin
+//
+//    -c    grid points per chunk (default 256)
+//    -s    write the spectra in single precision
+//    -f    keep the tables in single precision (see stokes_f32check)
+//    -r    resume
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AtlasGenerator.h"
+
+namespace {
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_atlas -u unpol.fits [-v vrpol.fits] [-4 45deg.fits]"
+                << " [-a name=first:last:n ...] [-n threads] [-c chunk] [-s] [-f] [-r] atlas.bin"
+                << std::endl;
+      exit(2);
+   }
+
+   void parseAxis (const std::string& value, AtlasGenerator& generator)
+   {
+      const size_t equalPos = value.find('=');
+      if (equalPos == std::string::npos)
+         usage();
+      const int iAxis = AtlasGenerator::axisIndex(value.substr(0, equalPos));
+      if (iAxis < 0)
+         throw StokesTable::StokesTableError("Unknown atlas axis " + value.substr(0, equalPos));
+      const std::string range(value.substr(equalPos+1));
+      AtlasAxis axis;
+      const size_t firstColon = range.find(':');
+      if (firstColon == std::string::npos)
+      {
+         axis.first = axis.last = atof(range.c_str());
+      }
+      else
+      {
+         const size_t secondColon = range.find(':', firstColon+1);
+         if (secondColon == std::string::npos)
+            usage();
+         axis.first = atof(range.substr(0, firstColon).c_str());
+         axis.last = atof(range.substr(firstColon+1, secondColon-firstColon-1).c_str());
+         const int n = atoi(range.substr(secondColon+1).c_str());
+         if (n < 1)
+            usage();
+         axis.n = n;
+      }
+      generator.axis(iAxis, axis);
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   std::string unpolName, vrpolName, pol45Name;
+   std::vector<std::string> axisValues;
+   size_t nThreads = std::thread::hardware_concurrency();
+   size_t chunkSize = 0;
+   bool isSingleOutput = false, isSingleStorage = false, isResume = false;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-'; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (option == "-s")
+      {
+         isSingleOutput = true;
+         continue;
+      }
+      if (option == "-f")
+      {
+         isSingleStorage = true;
+         continue;
+      }
+      if (option == "-r")
+      {
+         isResume = true;
+         continue;
+      }
+      if (iArg+1 >= argc)
+         usage();
+      const char* value = argv[++iArg];
+      if (option == "-u")
+         unpolName = value;
+      else if (option == "-v")
+         vrpolName = value;
+      else if (option == "-4")
+         pol45Name = value;
+      else if (option == "-a")
+         axisValues.push_back(value);
+      else if (option == "-n")
+         nThreads = atoi(value);
+      else if (option == "-c")
+         chunkSize = atoi(value);
+      else
+         usage();
+   }
+   if (argc - iArg != 1 || unpolName.empty())
+      usage();
+   const std::string atlasName(argv[iArg]);
+
+   try
+   {
+      StokesTable unpol, vrpol, pol45;
+      unpol.read(unpolName, isSingleStorage);
+      if (!vrpolName.empty())
+         vrpol.read(vrpolName, isSingleStorage);
+      if (!pol45Name.empty())
+         pol45.read(pol45Name, isSingleStorage);
+      AtlasGenerator generator(unpol, vrpolName.empty() ? 0 : &vrpol, pol45Name.empty() ? 0 : &pol45);
+      for (size_t i=0; i<axisValues.size(); ++i)
+         parseAxis(axisValues[i], generator);
+      if (chunkSize)
+         generator.chunkSize(chunkSize);
+      generator.isSingleOutput(isSingleOutput);
+
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      const size_t nComputed = generator.generate(atlasName, nThreads, isResume);
+      const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      std::cout << "Wrote " << atlasName << ": " << generator.nRecords() << " grid points of "
+                << generator.recordSize() << " bytes";
+      if (nComputed < generator.nRecords())
+         std::cout << ", " << nComputed << " computed in this run";
+      std::cout << std::endl;
+      for (size_t iAxis=0; iAxis<AtlasGenerator::N_AXES; ++iAxis)
+      {
+         const AtlasAxis& axis = generator.axis(iAxis);
+         std::cout << "   " << AtlasGenerator::axisName(iAxis) << " : " << axis.n << " x "
+                   << axis.first << " - " << axis.last << std::endl;
+      }
+      if (nComputed && seconds > 0.0)
+      {
+         std::cout << seconds << " s, " << nComputed/seconds*3600.0 << " spectra per hour"
+                   << std::endl;
+      }
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_atlas: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
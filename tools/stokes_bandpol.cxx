@@ -0,0 +1,132 @@
+// stokes_bandpol - band-integrated polarisation of mdefine'd models.
+//
+// Evaluates a model of an XSPEC script such as STOKES_model_definitions.xcm
+// for the parameter sets listed in a text file (one set per line, in the
+// order of the model parameters) in the bands of the layers added to its
+// tables by stokes_bands, interpolating those layers alone, and prints i, q
+// and u in each band with the polarisation degree and angle.  The model must
+// be linear in its tables (see MdefEngine.h) and z must be 0.
+//
+// Usage:
+//    stokes_bandpol -d STOKES_model_definitions.xcm [-s NAME=value] [-f]
+//                   [-n threads] model params.txt
+//
+// -s sets a script variable before the script is read, -f keeps the tables
+// in single precision.  Each output line holds the set and band numbers
+// (from 0), the band edges [keV] and weighting index, i, q, u, the
+// polarisation degree and the polarisation angle [deg].
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "MdefEngine.h"
+
+namespace {
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_bandpol -d script.xcm [-s NAME=value] [-f] [-n threads] model params.txt"
+                << std::endl;
+      exit(2);
+   }
+
+   void readParameterSets (const std::string& fileName, size_t nParams,
+                           std::vector<std::vector<Real> >& sets)
+   {
+      std::ifstream in(fileName.c_str());
+      if (!in)
+         throw StokesTable::StokesTableError("Cannot read " + fileName);
+      std::string line;
+      while (std::getline(in, line))
+      {
+         const size_t first = line.find_first_not_of(" \t\r");
+         if (first == std::string::npos || line[first] == '#')
+            continue;
+         std::istringstream values(line);
+         std::vector<Real> set;
+         Real value = 0.0;
+         while (values >> value)
+            set.push_back(value);
+         if (set.size() != nParams)
+            throw StokesTable::StokesTableError("Wrong number of parameters in: " + line);
+         sets.push_back(set);
+      }
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   std::string scriptName;
+   std::vector<std::string> variables;
+   bool isSingleStorage = false;
+   size_t nThreads = 0;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-' && argv[iArg][1] != 0 && !isdigit(argv[iArg][1]); ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (option == "-f")
+      {
+         isSingleStorage = true;
+         continue;
+      }
+      if (iArg+1 >= argc)
+         usage();
+      const char* value = argv[++iArg];
+      if (option == "-d")
+         scriptName = value;
+      else if (option == "-s")
+         variables.push_back(value);
+      else if (option == "-n")
+         nThreads = atoi(value);
+      else
+         usage();
+   }
+   if (scriptName.empty() || argc - iArg != 2)
+      usage();
+   const std::string modelName(argv[iArg]);
+
+   try
+   {
+      MdefEngine engine;
+      engine.isSingleStorage(isSingleStorage);
+      for (size_t i=0; i<variables.size(); ++i)
+      {
+         const size_t equals = variables[i].find('=');
+         if (equals == std::string::npos)
+            usage();
+         engine.variable(variables[i].substr(0, equals), variables[i].substr(equals+1));
+      }
+      engine.readScript(scriptName);
+      std::vector<std::vector<Real> > sets;
+      readParameterSets(argv[iArg+1], engine.parameterNames(modelName).size(), sets);
+
+      std::vector<std::vector<RealArray> > values;
+      engine.evaluateBands(modelName, sets, values, nThreads);
+      const std::vector<StokesTable::Band>& bands = engine.bands(modelName);
+      for (size_t iSet=0; iSet<sets.size(); ++iSet)
+      {
+         for (size_t iBand=0; iBand<bands.size(); ++iBand)
+         {
+            const Real i = values[iSet][StokesTable::I_COMP][iBand];
+            const Real q = values[iSet][StokesTable::Q_COMP][iBand];
+            const Real u = values[iSet][StokesTable::U_COMP][iBand];
+            std::cout << iSet << " " << iBand << " " << bands[iBand].eMin << " " << bands[iBand].eMax
+                      << " " << bands[iBand].weightIndex << " " << i << " " << q << " " << u << " "
+                      << std::sqrt(q*q + u*u)/i << " " << 0.5*std::atan2(u, q)*180.0/M_PI << std::endl;
+         }
+      }
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_bandpol: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,115 @@
+// stokes_bands - adds band-integrated i, q and u layers to a STOKES table.
+//
+// For each grid point of the table and each band the spectra are summed
+// over the energy bins, in proportion to their overlap with the band and
+// weighted by E^index at the bin centre (index 0 by default: photons in the
+// band, 1: energy flux in keV).  The layers are written to a BANDS extension
+// of the table, which XSPEC ignores, and are used by stokes_bandpol.  The
+// written table is read back and its layers checked.
+//
+// Usage:
+//    stokes_bands -b Emin:Emax[:index] [-b ...] table.fits [out.fits]
+//
+//    -b    energy band [keV] and weighting index, may be repeated
+//
+// The table is rewritten in place unless out.fits is given.  The layers of
+// the tables of a model must be made with the same bands, including the
+// unpolarised half table referred to by a 45 deg half-Phi table.
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "StokesTable.h"
+
+namespace {
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_bands -b Emin:Emax[:index] [-b ...] table.fits [out.fits]" << std::endl;
+      exit(2);
+   }
+
+   StokesTable::Band parseBand (const std::string& value)
+   {
+      const size_t firstColon = value.find(':');
+      if (firstColon == std::string::npos)
+         usage();
+      const size_t secondColon = value.find(':', firstColon+1);
+      StokesTable::Band band;
+      band.eMin = atof(value.substr(0, firstColon).c_str());
+      band.eMax = atof(value.substr(firstColon+1, secondColon-firstColon-1).c_str());
+      if (secondColon != std::string::npos)
+         band.weightIndex = atof(value.substr(secondColon+1).c_str());
+      if (!(band.eMax > band.eMin))
+         usage();
+      return band;
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   std::vector<StokesTable::Band> bands;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-'; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (iArg+1 >= argc)
+         usage();
+      const std::string value(argv[++iArg]);
+      if (option == "-b")
+         bands.push_back(parseBand(value));
+      else
+         usage();
+   }
+   if (bands.empty() || argc - iArg < 1 || argc - iArg > 2)
+      usage();
+   const std::string tableName(argv[iArg]);
+   const std::string outName(argc - iArg == 2 ? argv[iArg+1] : argv[iArg]);
+
+   try
+   {
+      StokesTable table;
+      table.read(tableName);
+      const Real eMin = table.energyLow()[0];
+      const Real eMax = table.energyHigh()[table.nEnergies()-1];
+      for (size_t iBand=0; iBand<bands.size(); ++iBand)
+      {
+         if (bands[iBand].eMin < eMin || bands[iBand].eMax > eMax)
+            std::cout << "Warning: band " << bands[iBand].eMin << "-" << bands[iBand].eMax
+                      << " keV extends beyond the table energies " << eMin << "-" << eMax
+                      << " keV" << std::endl;
+      }
+      table.bands(bands);
+      table.write(outName);
+
+      StokesTable written;
+      written.read(outName);
+      if (written.bands().size() != bands.size() || written.nGridPoints() != table.nGridPoints())
+         throw StokesTable::StokesTableError("The written table has other bands");
+      for (size_t iComp=0; iComp<table.nComponents(); ++iComp)
+      {
+         for (size_t iGrid=0; iGrid<table.nGridPoints(); ++iGrid)
+         {
+            const Real* expected = table.bandValues(iComp, iGrid);
+            const Real* values = written.bandValues(iComp, iGrid);
+            for (size_t iBand=0; iBand<bands.size(); ++iBand)
+            {
+               if (values[iBand] != expected[iBand])
+                  throw StokesTable::StokesTableError("The written band values differ from the computed ones");
+            }
+         }
+      }
+      std::cout << "Wrote " << outName << ": " << bands.size() << " bands for "
+                << table.nGridPoints() << " grid points" << std::endl;
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_bands: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
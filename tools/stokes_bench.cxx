@@ -0,0 +1,238 @@
+// stokes_bench - times the interpolation of a STOKES table.
+//
+// Interpolates the table at random points of its parameter space with the
+// generic corner loop and with the kernels compiled for the number of
+// parameters (see TableInterpolator.h), in double and in single precision
+// storage, and reports the time per interpolation and the largest
+// difference from the generic double precision results (relative to i).
+// Build with -O3 (and e.g. -march=native) to let the compiler vectorise.
+//
+// Built with -DSTOKES_BENCH_XSPEC and linked with XSPEC and the updated
+// MdefExpression.cxx (see README.md), it also times atable{table.fits}
+// evaluated by MdefExpression on the energies of the table, with XSPEC's
+// table code and with 'xset MDEF_TABLES stokes', and then the same calls
+// made by MdefEvaluation::evaluateSpectra() for -t spectra at once, on one
+// thread and on -t threads (4 by default).
+//
+// Usage:
+//    stokes_bench [-c calls] [-t threads] table.fits
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "StokesTable.h"
+#include "TableInterpolator.h"
+
+#if defined(STOKES_BENCH_XSPEC)
+#include <sstream>
+
+#include <XSFunctions/Utilities/FunctionUtility.h>
+#include <XSFunctions/Utilities/MdefEvaluation.h>
+#include <XSFunctions/Utilities/MdefExpression.h>
+#endif
+
+namespace {
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_bench [-c calls] [-t threads] table.fits" << std::endl;
+      exit(2);
+   }
+
+   // Seconds per interpolation, the results of all calls in results.
+   double timeInterpolation (const TableInterpolator& interpolator,
+                             const std::vector<std::vector<Real> >& points,
+                             std::vector<std::vector<RealArray> >& results)
+   {
+      results.resize(points.size());
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (size_t iPoint=0; iPoint<points.size(); ++iPoint)
+         interpolator.interpolate(points[iPoint], results[iPoint]);
+      const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      return elapsed.count()/std::max(points.size(), static_cast<size_t>(1));
+   }
+
+   Real maxDeviation (const std::vector<std::vector<RealArray> >& expected,
+                      const std::vector<std::vector<RealArray> >& results)
+   {
+      Real maxDev = 0.0;
+      for (size_t iPoint=0; iPoint<expected.size(); ++iPoint)
+      {
+         const RealArray& i = expected[iPoint][StokesTable::I_COMP];
+         for (size_t iComp=0; iComp<expected[iPoint].size(); ++iComp)
+         {
+            for (size_t ie=0; ie<i.size(); ++ie)
+            {
+               if (i[ie] > 0.0)
+               {
+                  const Real diff = std::fabs(results[iPoint][iComp][ie] - expected[iPoint][iComp][ie]);
+                  maxDev = std::max(maxDev, diff/i[ie]);
+               }
+            }
+         }
+      }
+      return maxDev;
+   }
+
+#if defined(STOKES_BENCH_XSPEC)
+   // Seconds per call of atable{fileName} at points (with z = 0 appended for
+   // redshift tables) on the energies of the table, with MDEF_TABLES set to
+   // tables.  With nSpectra > 0 each call is made for spectra 1 to nSpectra
+   // by evaluateSpectra() on nThreads threads, and the time is per spectrum.
+   double timeAtable (const std::string& fileName, const StokesTable& table,
+                      const std::vector<std::vector<Real> >& points, const std::string& tables,
+                      size_t nSpectra, size_t nThreads, std::vector<RealArray>& results)
+   {
+      const size_t nPars = table.nParameters();
+      std::ostringstream exprString;
+      exprString << "atable{" << fileName << "}(";
+      for (size_t iPar=0; iPar<nPars; ++iPar)
+         exprString << (iPar ? ", " : "") << "p" << iPar;
+      if (table.isRedshift())
+         exprString << ", z";
+      exprString << ")";
+      MdefExpression expression(std::make_pair(0.0, 1.0e10), "add", "");
+      expression.init(exprString.str());
+      FunctionUtility::setModelString("MDEF_TABLES", tables);
+
+      RealArray energies(table.nEnergies() + 1);
+      for (size_t ie=0; ie<table.nEnergies(); ++ie)
+         energies[ie] = table.energyLow()[ie];
+      energies[table.nEnergies()] = table.energyHigh()[table.nEnergies()-1];
+      RealArray parameters(0.0, nPars + (table.isRedshift() ? 1 : 0));
+      std::vector<int> spectrumNumbers;
+      for (size_t iSpec=0; iSpec<nSpectra; ++iSpec)
+         spectrumNumbers.push_back(static_cast<int>(iSpec) + 1);
+      std::vector<RealArray> fluxes;
+      RealArray fluxErr;
+      results.resize(points.size());
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (size_t iPoint=0; iPoint<points.size(); ++iPoint)
+      {
+         for (size_t iPar=0; iPar<nPars; ++iPar)
+            parameters[iPar] = points[iPoint][iPar];
+         if (nSpectra == 0)
+            expression.evaluate(energies, parameters, 0, results[iPoint], fluxErr, "");
+         else
+         {
+            MdefEvaluation::evaluateSpectra(expression, energies, parameters, spectrumNumbers, fluxes,
+                                            "", nThreads);
+            results[iPoint].resize(fluxes[0].size());
+            results[iPoint] = fluxes[0];
+         }
+      }
+      const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      return elapsed.count()/std::max(points.size()*std::max(nSpectra, static_cast<size_t>(1)),
+                                      static_cast<size_t>(1));
+   }
+
+   Real maxAtableDeviation (const std::vector<RealArray>& expected, const std::vector<RealArray>& results)
+   {
+      Real maxDev = 0.0;
+      for (size_t iPoint=0; iPoint<expected.size(); ++iPoint)
+      {
+         const Real largest = std::abs(expected[iPoint]).max();
+         for (size_t ie=0; ie<expected[iPoint].size() && largest > 0.0; ++ie)
+            maxDev = std::max(maxDev, std::fabs(results[iPoint][ie] - expected[iPoint][ie])/largest);
+      }
+      return maxDev;
+   }
+#endif
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   size_t nCalls = 10000;
+#if defined(STOKES_BENCH_XSPEC)
+   size_t nThreads = 4;
+#endif
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-'; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (iArg+1 >= argc)
+         usage();
+      if (option == "-c")
+         nCalls = atoi(argv[++iArg]);
+#if defined(STOKES_BENCH_XSPEC)
+      else if (option == "-t")
+         nThreads = std::max(atoi(argv[++iArg]), 1);
+#endif
+      else
+         usage();
+   }
+   if (argc - iArg != 1)
+      usage();
+
+   try
+   {
+      StokesTable table;
+      table.read(argv[iArg]);
+      StokesTable single(table);
+      single.singleStorage(true);
+
+      std::mt19937 generator(1);
+      std::vector<std::vector<Real> > points(nCalls, std::vector<Real>(table.nParameters()));
+      for (size_t iPar=0; iPar<table.nParameters(); ++iPar)
+      {
+         const std::vector<Real>& values = table.parameter(iPar).values;
+         std::uniform_real_distribution<Real> uniform(values.front(), values.back());
+         for (size_t iCall=0; iCall<nCalls; ++iCall)
+            points[iCall][iPar] = uniform(generator);
+      }
+
+      std::cout << table.nParameters() << " parameters, " << table.nEnergies() << " energies, "
+                << table.nComponents() << " components, " << nCalls << " interpolations" << std::endl;
+      std::vector<std::vector<RealArray> > expected, results;
+      TableInterpolator generic(table);
+      generic.fixedKernels(false);
+      const double genericTime = timeInterpolation(generic, points, expected);
+      std::cout << std::setprecision(3);
+      std::cout << "   generic, double : " << genericTime*1.0e6 << " us" << std::endl;
+
+      const char* labels[] = {"fixed,   double : ", "generic, single : ", "fixed,   single : "};
+      for (size_t iCase=0; iCase<3; ++iCase)
+      {
+         TableInterpolator interpolator(iCase == 0 ? table : single);
+         interpolator.fixedKernels(iCase != 1);
+         const double caseTime = timeInterpolation(interpolator, points, results);
+         std::cout << "   " << labels[iCase] << caseTime*1.0e6 << " us  (x"
+                   << genericTime/caseTime << ", max. deviation " << maxDeviation(expected, results)
+                   << ")" << std::endl;
+      }
+
+#if defined(STOKES_BENCH_XSPEC)
+      std::vector<RealArray> xspecResults, stokesResults;
+      const double xspecTime = timeAtable(argv[iArg], table, points, "off", 0, 1, xspecResults);
+      std::cout << "   atable, XSPEC         : " << xspecTime*1.0e6 << " us" << std::endl;
+      const double stokesTime = timeAtable(argv[iArg], table, points, "stokes", 0, 1, stokesResults);
+      std::cout << "   atable, MDEF_TABLES   : " << stokesTime*1.0e6 << " us  (x" << xspecTime/stokesTime
+                << ", max. deviation " << maxAtableDeviation(xspecResults, stokesResults) << ")" << std::endl;
+      const char* tables[] = {"off", "stokes"};
+      for (size_t iCase=0; iCase<2; ++iCase)
+      {
+         const double serialTime = timeAtable(argv[iArg], table, points, tables[iCase], nThreads, 1,
+                                              stokesResults);
+         const double parallelTime = timeAtable(argv[iArg], table, points, tables[iCase], nThreads,
+                                                nThreads, stokesResults);
+         std::cout << "   " << nThreads << " spectra, " << (iCase ? "MDEF_TABLES" : "XSPEC      ")
+                   << " : " << serialTime*1.0e6 << " us on 1 thread, " << parallelTime*1.0e6
+                   << " us on " << nThreads << "  (x" << serialTime/parallelTime << ")" << std::endl;
+      }
+#endif
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_bench: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,267 @@
+// stokes_crop - writes a STOKES table reduced to an energy band and to
+// sub-ranges of its parameters.
+//
+// The energy bins overlapping the band are kept, optionally grouped by n
+// (the spectra of additive tables are summed over the group, those of
+// multiplicative tables averaged with the bin widths as weights).  For each
+// cropped parameter the nodes bracketing the sub-range are kept, so the
+// cropped table interpolates exactly as the full one inside the sub-range.
+// Spectra and parameter values of the kept nodes are copied unchanged, and
+// the written table is read back and checked against them.
+//
+// Usage:
+//    stokes_crop [-e Emin:Emax] [-g n] [-p name:min:max ...] [-n ref_name]
+//                full.fits cropped.fits
+//
+//    -e    energy band [keV]
+//    -g    number of energy bins grouped into one
+//    -p    parameter sub-range, may be repeated
+//    -n    PHIREFT of a cropped 45 deg half-Phi table, i.e. the name of the
+//          cropped unpolarised half table
+//
+// The cropped tables are used in STOKES_model_definitions.xcm in place of
+// the full ones, all of them must be cropped in the same way.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "StokesTable.h"
+
+namespace {
+
+   struct ParameterRange
+   {
+      std::string name;
+      Real minimum;
+      Real maximum;
+   };
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_crop [-e Emin:Emax] [-g n] [-p name:min:max ...] [-n ref_name]"
+                << " full.fits cropped.fits" << std::endl;
+      exit(2);
+   }
+
+   void parseRange (const std::string& value, Real& minimum, Real& maximum)
+   {
+      const size_t colonPos = value.find(':');
+      if (colonPos == std::string::npos)
+         usage();
+      minimum = atof(value.substr(0, colonPos).c_str());
+      maximum = atof(value.substr(colonPos+1).c_str());
+      if (minimum > maximum)
+         usage();
+   }
+
+   // Nodes [first, last] bracketing [minimum, maximum].
+   void bracketNodes (const std::vector<Real>& values, Real minimum, Real maximum, size_t& first,
+                      size_t& last)
+   {
+      first = 0;
+      while (first+1 < values.size() && values[first+1] <= minimum)
+         ++first;
+      last = values.size() - 1;
+      while (last > first+1 && values[last-1] >= maximum)
+         --last;
+   }
+
+   void cropParameter (StokesTable::Parameter& par, size_t first, size_t last)
+   {
+      par.values = std::vector<Real>(par.values.begin() + first, par.values.begin() + last + 1);
+      const Real low = par.values.front();
+      const Real high = par.values.back();
+      par.minimum = std::max(par.minimum, low);
+      par.bottom = std::max(par.bottom, low);
+      par.maximum = std::min(par.maximum, high);
+      par.top = std::min(par.top, high);
+      par.initial = std::min(std::max(par.initial, par.minimum), par.maximum);
+   }
+
+   Real deviation (const StokesTable& expected, const StokesTable& written)
+   {
+      if (expected.nGridPoints() != written.nGridPoints() || expected.nEnergies() != written.nEnergies()
+          || expected.nComponents() != written.nComponents())
+         throw StokesTable::StokesTableError("The written table has a different grid");
+      for (size_t iPar=0; iPar<expected.nParameters(); ++iPar)
+      {
+         if (expected.parameter(iPar).values != written.parameter(iPar).values)
+            throw StokesTable::StokesTableError("Parameter values of " + expected.parameter(iPar).name
+                                               + " changed on writing");
+      }
+      // single precision columns round the values once
+      const bool isSingle = !expected.isDoublePrecision();
+      Real maxDev = 0.0;
+      for (size_t iGrid=0; iGrid<expected.nGridPoints(); ++iGrid)
+      {
+         for (size_t iComp=0; iComp<expected.nComponents(); ++iComp)
+         {
+            const Real* in = expected.spectrum(iComp, iGrid);
+            const Real* out = written.spectrum(iComp, iGrid);
+            for (size_t ie=0; ie<expected.nEnergies(); ++ie)
+            {
+               const Real value = isSingle ? static_cast<float>(in[ie]) : in[ie];
+               if (value != out[ie])
+                  maxDev = std::max(maxDev, std::fabs(value - out[ie])/std::max(std::fabs(value), 1.0e-30));
+            }
+         }
+      }
+      return maxDev;
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   Real eMin = 0.0, eMax = HUGE_VAL;
+   size_t groupSize = 1;
+   std::vector<ParameterRange> ranges;
+   std::string refName;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-'; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (iArg+1 >= argc)
+         usage();
+      const std::string value(argv[++iArg]);
+      if (option == "-e")
+         parseRange(value, eMin, eMax);
+      else if (option == "-g")
+         groupSize = atoi(value.c_str());
+      else if (option == "-p")
+      {
+         const size_t colonPos = value.find(':');
+         if (colonPos == std::string::npos)
+            usage();
+         ParameterRange range;
+         range.name = value.substr(0, colonPos);
+         parseRange(value.substr(colonPos+1), range.minimum, range.maximum);
+         ranges.push_back(range);
+      }
+      else if (option == "-n")
+         refName = value;
+      else
+         usage();
+   }
+   if (argc - iArg != 2 || groupSize < 1)
+      usage();
+   const std::string fullName(argv[iArg]);
+   const std::string croppedName(argv[iArg+1]);
+
+   try
+   {
+      StokesTable full;
+      full.read(fullName);
+      const size_t nPars = full.nParameters();
+      const size_t nComps = full.nComponents();
+
+      // kept nodes
+      std::vector<StokesTable::Parameter> params(full.parameters());
+      std::vector<size_t> firstNode(nPars, 0);
+      for (size_t i=0; i<ranges.size(); ++i)
+      {
+         const int iPar = full.parameterIndex(ranges[i].name);
+         if (iPar < 0)
+            throw StokesTable::StokesTableError("Table has no parameter " + ranges[i].name);
+         if (iPar == full.phiMirrorIndex())
+            throw StokesTable::StokesTableError("Phi of a half-Phi table cannot be cropped");
+         size_t first = 0, last = 0;
+         bracketNodes(full.parameter(iPar).values, ranges[i].minimum, ranges[i].maximum, first, last);
+         firstNode[iPar] = first;
+         cropParameter(params[iPar], first, last);
+      }
+
+      // kept energy bins, grouped
+      const RealArray& fullLow = full.energyLow();
+      const RealArray& fullHigh = full.energyHigh();
+      size_t firstBin = 0;
+      while (firstBin < fullLow.size() && fullHigh[firstBin] <= eMin)
+         ++firstBin;
+      size_t endBin = firstBin;
+      while (endBin < fullLow.size() && fullLow[endBin] < eMax)
+         ++endBin;
+      if (endBin == firstBin)
+         throw StokesTable::StokesTableError("No energy bins of the table in the band");
+      const size_t nGroups = (endBin - firstBin + groupSize - 1)/groupSize;
+      RealArray eLow(nGroups), eHigh(nGroups);
+      std::vector<size_t> groupStart(nGroups+1);
+      for (size_t iGroup=0; iGroup<nGroups; ++iGroup)
+      {
+         groupStart[iGroup] = firstBin + iGroup*groupSize;
+         eLow[iGroup] = fullLow[groupStart[iGroup]];
+         eHigh[iGroup] = fullHigh[std::min(groupStart[iGroup] + groupSize, endBin) - 1];
+      }
+      groupStart[nGroups] = endBin;
+
+      StokesTable cropped;
+      cropped.reset(params, eLow, eHigh, nComps);
+      cropped.modelName(full.modelName());
+      cropped.modelUnits(full.modelUnits());
+      cropped.isAdditive(full.isAdditive());
+      cropped.isRedshift(full.isRedshift());
+      cropped.isEscale(full.isEscale());
+      cropped.isDoublePrecision(full.isDoublePrecision());
+      if (full.phiMirrorIndex() >= 0)
+      {
+         cropped.phiMirror(full.phiMirrorIndex(), full.phiSymmetry(),
+                           refName.empty() ? full.phiReference() : refName);
+      }
+
+      std::vector<size_t> nodes;
+      for (size_t iGrid=0; iGrid<cropped.nGridPoints(); ++iGrid)
+      {
+         cropped.gridNodes(iGrid, nodes);
+         for (size_t iPar=0; iPar<nPars; ++iPar)
+            nodes[iPar] += firstNode[iPar];
+         const size_t iFull = full.gridIndex(nodes);
+         for (size_t iComp=0; iComp<nComps; ++iComp)
+         {
+            const Real* in = full.spectrum(iComp, iFull);
+            Real* out = cropped.spectrum(iComp, iGrid);
+            for (size_t iGroup=0; iGroup<nGroups; ++iGroup)
+            {
+               Real sum = 0.0, width = 0.0;
+               for (size_t ie=groupStart[iGroup]; ie<groupStart[iGroup+1]; ++ie)
+               {
+                  const Real binWidth = fullHigh[ie] - fullLow[ie];
+                  sum += full.isAdditive() ? in[ie] : in[ie]*binWidth;
+                  width += binWidth;
+               }
+               out[iGroup] = full.isAdditive() ? sum : sum/width;
+            }
+         }
+      }
+      cropped.write(croppedName);
+
+      StokesTable written;
+      written.read(croppedName);
+      const Real maxDev = deviation(cropped, written);
+      std::cout << "Wrote " << croppedName << ": " << cropped.nGridPoints() << " of "
+                << full.nGridPoints() << " grid points, " << nGroups << " of " << full.nEnergies()
+                << " energy bins (" << eLow[0] << "-" << eHigh[nGroups-1] << " keV)" << std::endl;
+      for (size_t iPar=0; iPar<nPars; ++iPar)
+      {
+         const std::vector<Real>& values = params[iPar].values;
+         std::cout << "   " << params[iPar].name << " : " << values.size() << " nodes, "
+                   << values.front() << " - " << values.back() << std::endl;
+      }
+      std::cout << "Largest relative deviation of the written spectra: " << maxDev << std::endl;
+      if (cropped.phiSymmetry() == "REF" && refName.empty())
+      {
+         std::cout << "Note: PHIREFT still names " << cropped.phiReference()
+                   << ", use -n to name the cropped unpolarised half table" << std::endl;
+      }
+      if (maxDev > 0.0)
+         throw StokesTable::StokesTableError("The written spectra differ from the kept ones");
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_crop: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
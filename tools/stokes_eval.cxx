@@ -0,0 +1,258 @@
+// stokes_eval - mdefine'd models evaluated outside XSPEC.
+//
+// Reads the model definitions of an XSPEC script (set and mdefine commands,
+// e.g. STOKES_model_definitions.xcm), evaluates a model for the parameter
+// sets listed in a text file (one set per line, the values in the order of
+// the model parameters as listed by -p) on several threads and writes i, q
+// and u of every set to a binary file.
+//
+// Usage:
+//    stokes_eval -d STOKES_model_definitions.xcm [-s NAME=value] [-f]
+//                [-e energies.txt | -g first:last:n | -l first:last:n]
+//                [-n threads] [-c chunk] [-o] model params.txt out.bin
+//    stokes_eval -d STOKES_model_definitions.xcm -p model
+//
+// -s sets a script variable before the script is read (e.g. the table
+// directory STOKESDIR).  The energy bin edges are read from a file (one per
+// line), or spaced linearly (-g) or logarithmically (-l) in keV; by default
+// the model is evaluated on the energy bins of its tables.  -f keeps the
+// tables in single precision, -o writes the spectra in single precision.
+// The parameter sets are evaluated in chunks of -c sets (1024 by default),
+// so that the memory used does not grow with the number of sets.
+//
+// File layout (native byte order, all integers 64-bit unsigned):
+//    "STKSPECS", version, nEnergies, valueSize (4 or 8), nParameters,
+//    nRecords, energy bin edges [nEnergies+1] (doubles),
+// followed by nRecords records of
+//    the parameter values (doubles), i, q, u [nEnergies each]
+// with the spectra as floats or doubles (valueSize).  i, q and u are in
+// photons/cm^2/s per bin for unit normalisation, as from XSPEC.
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "MdefEngine.h"
+
+namespace {
+
+   const char s_magic[] = "STKSPECS";
+   const unsigned long long s_version = 1;
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_eval -d script.xcm [-s NAME=value] [-f]"
+                << " [-e energies.txt | -g first:last:n | -l first:last:n] [-n threads] [-c chunk] [-o]"
+                << " model params.txt out.bin" << std::endl
+                << "       stokes_eval -d script.xcm -p model" << std::endl;
+      exit(2);
+   }
+
+   void parseGrid (const std::string& value, bool isLog, RealArray& energies)
+   {
+      const size_t firstColon = value.find(':');
+      const size_t secondColon = value.find(':', firstColon+1);
+      if (firstColon == std::string::npos || secondColon == std::string::npos)
+         usage();
+      const Real first = atof(value.substr(0, firstColon).c_str());
+      const Real last = atof(value.substr(firstColon+1, secondColon-firstColon-1).c_str());
+      const int nBins = atoi(value.substr(secondColon+1).c_str());
+      if (nBins < 1 || !(last > first) || (isLog && !(first > 0.0)))
+         usage();
+      energies.resize(nBins+1);
+      for (int i=0; i<=nBins; ++i)
+         energies[i] = isLog ? first*std::pow(last/first, static_cast<Real>(i)/nBins)
+                             : first + (last - first)*i/nBins;
+   }
+
+   void readEnergies (const std::string& fileName, RealArray& energies)
+   {
+      std::ifstream in(fileName.c_str());
+      if (!in)
+         throw StokesTable::StokesTableError("Cannot read " + fileName);
+      std::vector<Real> values;
+      Real value = 0.0;
+      while (in >> value)
+         values.push_back(value);
+      if (values.size() < 2)
+         throw StokesTable::StokesTableError(fileName + " has fewer than two energies");
+      energies.resize(values.size());
+      for (size_t i=0; i<values.size(); ++i)
+         energies[i] = values[i];
+   }
+
+   // The next chunk of up to maxSets parameter sets, false at the end.
+   bool readParameterSets (std::istream& in, size_t nParams, size_t maxSets,
+                           std::vector<std::vector<Real> >& sets)
+   {
+      sets.clear();
+      std::string line;
+      while (sets.size() < maxSets && std::getline(in, line))
+      {
+         const size_t first = line.find_first_not_of(" \t\r");
+         if (first == std::string::npos || line[first] == '#')
+            continue;
+         std::istringstream values(line);
+         std::vector<Real> set;
+         Real value = 0.0;
+         while (values >> value)
+            set.push_back(value);
+         if (set.size() != nParams)
+            throw StokesTable::StokesTableError("Wrong number of parameters in: " + line);
+         sets.push_back(set);
+      }
+      return !sets.empty();
+   }
+
+   void appendInteger (std::ofstream& out, unsigned long long value)
+   {
+      out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+   }
+
+   template <typename T>
+   void writeValues (std::ofstream& out, const RealArray& values, std::vector<char>& bytes)
+   {
+      bytes.resize(values.size()*sizeof(T));
+      for (size_t i=0; i<values.size(); ++i)
+      {
+         const T value = static_cast<T>(values[i]);
+         std::memcpy(&bytes[i*sizeof(T)], &value, sizeof(T));
+      }
+      out.write(&bytes[0], bytes.size());
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   std::string scriptName, energiesName;
+   std::vector<std::string> variables;
+   RealArray energies;
+   bool isSingleStorage = false, isSingleOutput = false, isListing = false;
+   size_t nThreads = 0, chunkSize = 1024;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-' && argv[iArg][1] != 0 && !isdigit(argv[iArg][1]); ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (option == "-f")
+      {
+         isSingleStorage = true;
+         continue;
+      }
+      if (option == "-o")
+      {
+         isSingleOutput = true;
+         continue;
+      }
+      if (option == "-p")
+      {
+         isListing = true;
+         continue;
+      }
+      if (iArg+1 >= argc)
+         usage();
+      const char* value = argv[++iArg];
+      if (option == "-d")
+         scriptName = value;
+      else if (option == "-s")
+         variables.push_back(value);
+      else if (option == "-e")
+         energiesName = value;
+      else if (option == "-g")
+         parseGrid(value, false, energies);
+      else if (option == "-l")
+         parseGrid(value, true, energies);
+      else if (option == "-n")
+         nThreads = atoi(value);
+      else if (option == "-c")
+         chunkSize = atoi(value);
+      else
+         usage();
+   }
+   if (scriptName.empty() || chunkSize == 0 || argc - iArg != (isListing ? 1 : 3))
+      usage();
+   const std::string modelName(argv[iArg]);
+
+   try
+   {
+      MdefEngine engine;
+      engine.isSingleStorage(isSingleStorage);
+      for (size_t i=0; i<variables.size(); ++i)
+      {
+         const size_t equals = variables[i].find('=');
+         if (equals == std::string::npos)
+            usage();
+         engine.variable(variables[i].substr(0, equals), variables[i].substr(equals+1));
+      }
+      engine.readScript(scriptName);
+      const std::vector<std::string>& parNames = engine.parameterNames(modelName);
+      if (isListing)
+      {
+         for (size_t i=0; i<parNames.size(); ++i)
+            std::cout << parNames[i] << std::endl;
+         return 0;
+      }
+      if (!energiesName.empty())
+         readEnergies(energiesName, energies);
+      if (energies.size() == 0)
+         engine.tableEnergies(modelName, energies);
+
+      const char* paramsName = argv[iArg+1];
+      const char* outName = argv[iArg+2];
+      std::ifstream in(paramsName);
+      if (!in)
+         throw StokesTable::StokesTableError(std::string("Cannot read ") + paramsName);
+      std::ofstream out(outName, std::ios::binary | std::ios::trunc);
+      if (!out)
+         throw StokesTable::StokesTableError(std::string("Cannot write ") + outName);
+      // the number of records is written at the end
+      out.write(s_magic, 8);
+      appendInteger(out, s_version);
+      appendInteger(out, energies.size() - 1);
+      appendInteger(out, isSingleOutput ? sizeof(float) : sizeof(double));
+      appendInteger(out, parNames.size());
+      const std::streampos nRecordsPos = out.tellp();
+      appendInteger(out, 0);
+      out.write(reinterpret_cast<const char*>(&energies[0]), energies.size()*sizeof(Real));
+
+      std::vector<std::vector<Real> > sets;
+      std::vector<std::vector<RealArray> > spectra;
+      std::vector<char> bytes;
+      unsigned long long nRecords = 0;
+      while (readParameterSets(in, parNames.size(), chunkSize, sets))
+      {
+         engine.evaluateBatch(modelName, sets, energies, spectra, nThreads);
+         for (size_t iSet=0; iSet<sets.size(); ++iSet)
+         {
+            out.write(reinterpret_cast<const char*>(&sets[iSet][0]), sets[iSet].size()*sizeof(Real));
+            for (size_t iComp=0; iComp<3; ++iComp)
+            {
+               if (isSingleOutput)
+                  writeValues<float>(out, spectra[iSet][iComp], bytes);
+               else
+                  writeValues<double>(out, spectra[iSet][iComp], bytes);
+            }
+         }
+         nRecords += sets.size();
+      }
+      out.seekp(nRecordsPos);
+      appendInteger(out, nRecords);
+      out.close();
+      if (!out)
+         throw StokesTable::StokesTableError(std::string("Cannot write ") + outName);
+      std::cout << nRecords << " spectra of " << energies.size() - 1 << " bins written to "
+                << outName << std::endl;
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_eval: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,244 @@
+// stokes_f32check - validates single precision storage of a STOKES table.
+//
+// Reads the table in double and in single precision storage and reports
+// the largest deviation of the single precision spectra over the whole
+// grid:
+//    i       relative to i
+//    q, u    relative to i
+//    PD      relative to PD (where PD >= 1e-3)
+//    PA      in degrees     (where PD >= 1e-3)
+// Interpolation between grid nodes is a convex combination, so the node
+// deviations bound those of interpolated i, q and u.  With -s the
+// interpolated spectra at random points of the parameter space are
+// compared as well.  With -o the table is written with single precision
+// columns, which XSPEC reads as any other table.
+//
+// Usage:
+//    stokes_f32check [-s samples] [-n threads] [-t tol] [-o single.fits] table.fits
+//
+//    -t    exit with status 1 if the deviation of i, q or u exceeds tol
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "StokesTable.h"
+#include "TableInterpolator.h"
+
+namespace {
+
+   enum {I_DEV, Q_DEV, U_DEV, PD_DEV, PA_DEV, N_DEVS};
+
+   const Real s_minPolDegree = 1.0e-3;
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_f32check [-s samples] [-n threads] [-t tol] [-o single.fits] table.fits"
+                << std::endl;
+      exit(2);
+   }
+
+   Real polarisationDegree (Real i, Real q, Real u)
+   {
+      return std::sqrt(q*q + u*u)/i;
+   }
+
+   Real polarisationAngle (Real q, Real u)
+   {
+      return 0.5*std::atan2(u, q)*180.0/M_PI;
+   }
+
+   // Compare one spectrum (1 or 3 components) in double and single precision.
+   void compare (const Real* const* expected, const Real* const* single, size_t nComps,
+                 size_t nEngs, std::vector<Real>& maxDev)
+   {
+      for (size_t ie=0; ie<nEngs; ++ie)
+      {
+         const Real i = expected[StokesTable::I_COMP][ie];
+         if (i <= 0.0)
+            continue;
+         for (size_t iComp=0; iComp<nComps; ++iComp)
+            maxDev[iComp] = std::max(maxDev[iComp], std::fabs(single[iComp][ie] - expected[iComp][ie])/i);
+         if (nComps < 3)
+            continue;
+         const Real q = expected[StokesTable::Q_COMP][ie];
+         const Real u = expected[StokesTable::U_COMP][ie];
+         const Real pd = polarisationDegree(i, q, u);
+         if (pd < s_minPolDegree)
+            continue;
+         const Real iSingle = single[StokesTable::I_COMP][ie];
+         const Real qSingle = single[StokesTable::Q_COMP][ie];
+         const Real uSingle = single[StokesTable::U_COMP][ie];
+         const Real pdSingle = polarisationDegree(iSingle, qSingle, uSingle);
+         maxDev[PD_DEV] = std::max(maxDev[PD_DEV], std::fabs(pdSingle - pd)/pd);
+         Real paDiff = std::fabs(polarisationAngle(qSingle, uSingle) - polarisationAngle(q, u));
+         if (paDiff > 90.0)
+            paDiff = 180.0 - paDiff;
+         maxDev[PA_DEV] = std::max(maxDev[PA_DEV], paDiff);
+      }
+   }
+
+   void compareNodes (const StokesTable& table, const StokesTable& single, size_t first,
+                      size_t last, std::vector<Real>& maxDev)
+   {
+      const size_t nEngs = table.nEnergies();
+      const size_t nComps = table.nComponents();
+      std::vector<Real> converted(nComps*nEngs);
+      const Real* expected[3];
+      const Real* singleValues[3];
+      for (size_t iGrid=first; iGrid<last; ++iGrid)
+      {
+         for (size_t iComp=0; iComp<nComps; ++iComp)
+         {
+            const float* in = single.spectrumSingle(iComp, iGrid);
+            std::copy(in, in+nEngs, converted.begin() + iComp*nEngs);
+            expected[iComp] = table.spectrum(iComp, iGrid);
+            singleValues[iComp] = &converted[iComp*nEngs];
+         }
+         compare(expected, singleValues, nComps, nEngs, maxDev);
+      }
+   }
+
+   void compareSamples (const StokesTable& table, const StokesTable& single, size_t nSamples,
+                        unsigned seed, std::vector<Real>& maxDev)
+   {
+      const size_t nPars = table.nParameters();
+      const size_t nComps = table.nComponents();
+      std::mt19937 generator(seed);
+      std::vector<Real> parValues(nPars);
+      std::vector<RealArray> expected, singleSpectra;
+      const Real* expectedPtrs[3];
+      const Real* singlePtrs[3];
+      const TableInterpolator interpolator(table), singleInterpolator(single);
+      for (size_t iSample=0; iSample<nSamples; ++iSample)
+      {
+         for (size_t iPar=0; iPar<nPars; ++iPar)
+         {
+            const std::vector<Real>& values = table.parameter(iPar).values;
+            std::uniform_real_distribution<Real> uniform(values.front(), values.back());
+            parValues[iPar] = uniform(generator);
+         }
+         interpolator.interpolate(parValues, expected);
+         singleInterpolator.interpolate(parValues, singleSpectra);
+         for (size_t iComp=0; iComp<nComps; ++iComp)
+         {
+            expectedPtrs[iComp] = &expected[iComp][0];
+            singlePtrs[iComp] = &singleSpectra[iComp][0];
+         }
+         compare(expectedPtrs, singlePtrs, nComps, table.nEnergies(), maxDev);
+      }
+   }
+
+   void mergeMaxima (const std::vector<std::vector<Real> >& perThread, std::vector<Real>& maxDev)
+   {
+      for (size_t iThread=0; iThread<perThread.size(); ++iThread)
+      {
+         for (size_t i=0; i<maxDev.size(); ++i)
+            maxDev[i] = std::max(maxDev[i], perThread[iThread][i]);
+      }
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   size_t nSamples = 0;
+   size_t nThreads = std::thread::hardware_concurrency();
+   Real tolerance = -1.0;
+   std::string outName;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-'; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (iArg+1 >= argc)
+         usage();
+      const char* value = argv[++iArg];
+      if (option == "-s")
+         nSamples = atoi(value);
+      else if (option == "-n")
+         nThreads = atoi(value);
+      else if (option == "-t")
+         tolerance = atof(value);
+      else if (option == "-o")
+         outName = value;
+      else
+         usage();
+   }
+   if (argc - iArg != 1)
+      usage();
+   nThreads = std::max(static_cast<size_t>(1), nThreads);
+
+   try
+   {
+      StokesTable table;
+      table.read(argv[iArg]);
+      StokesTable single(table);
+      single.singleStorage(true);
+
+      // The grid points and the samples are split over threads, each keeping
+      // its own maxima.
+      const size_t nGrid = table.nGridPoints();
+      std::vector<std::vector<Real> > nodeDevs(nThreads, std::vector<Real>(N_DEVS, 0.0));
+      std::vector<std::vector<Real> > sampleDevs(nThreads, std::vector<Real>(N_DEVS, 0.0));
+      std::vector<std::thread> workers;
+      for (size_t iThread=0; iThread<nThreads; ++iThread)
+      {
+         const size_t first = nGrid*iThread/nThreads;
+         const size_t last = nGrid*(iThread+1)/nThreads;
+         workers.push_back(std::thread(compareNodes, std::cref(table), std::cref(single), first, last,
+                                       std::ref(nodeDevs[iThread])));
+         const size_t threadSamples = nSamples*(iThread+1)/nThreads - nSamples*iThread/nThreads;
+         workers.push_back(std::thread(compareSamples, std::cref(table), std::cref(single),
+                                       threadSamples, static_cast<unsigned>(iThread+1),
+                                       std::ref(sampleDevs[iThread])));
+      }
+      for (size_t i=0; i<workers.size(); ++i)
+         workers[i].join();
+      std::vector<Real> maxNodeDev(N_DEVS, 0.0), maxSampleDev(N_DEVS, 0.0);
+      mergeMaxima(nodeDevs, maxNodeDev);
+      mergeMaxima(sampleDevs, maxSampleDev);
+
+      const char* devNames[] = {"i ", "q ", "u ", "PD", "PA"};
+      const size_t nDevs = (table.nComponents() == 3) ? N_DEVS : 1;
+      std::cout << "Maximum deviation of single precision storage over " << nGrid
+                << " grid points";
+      if (nSamples)
+         std::cout << " (and " << nSamples << " random points)";
+      std::cout << ":" << std::endl;
+      for (size_t i=0; i<nDevs; ++i)
+      {
+         std::cout << "   " << devNames[i] << " : " << maxNodeDev[i];
+         if (nSamples)
+            std::cout << "  (" << maxSampleDev[i] << ")";
+         std::cout << (i == PA_DEV ? " deg" : "") << std::endl;
+      }
+
+      if (!outName.empty())
+      {
+         single.isDoublePrecision(false);
+         single.write(outName);
+         std::cout << "Wrote " << outName << std::endl;
+      }
+
+      for (size_t i=0; i<std::min(nDevs, static_cast<size_t>(PD_DEV)); ++i)
+      {
+         if (tolerance >= 0.0 && std::max(maxNodeDev[i], maxSampleDev[i]) > tolerance)
+         {
+            std::cerr << "Deviation exceeds tolerance " << tolerance << std::endl;
+            return 1;
+         }
+      }
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_f32check: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
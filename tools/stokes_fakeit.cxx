@@ -0,0 +1,272 @@
+// stokes_fakeit - i, q and u datasets simulated for many parameter sets.
+//
+// Simulates the three polarimetric datasets of load_null_data.xcm, as
+// fakeit does, for a model of an XSPEC script (see stokes_eval) at each of
+// the parameter sets listed in a text file, one set per line, the values in
+// the order of the model parameters followed by the normalisation.  The
+// simulations run on several threads and are written in order to a binary
+// file, and optionally also as OGIP spectra prefix_NNNNNN_{i,q,u}.pha.
+// The noise is drawn by SpectrumSimulator from a counter-based generator,
+// so the output depends on the seed only, not on the number of threads.
+//
+// Usage:
+//    stokes_fakeit -d STOKES_model_definitions.xcm [-s NAME=value] [-f]
+//                  -R response.rmf [-A response.arf] [-M response.mrf]
+//                  -t exposure [-S seed] [-r n] [-n threads] [-c chunk]
+//                  [-o prefix] model params.txt out.bin
+//
+// -r n simulates n realisations of each parameter set.  The simulations are
+// numbered from 0 in the order of the output, which is the counter of the
+// random numbers.
+//
+// File layout (native byte order, all integers 64-bit unsigned):
+//    "STKFAKES", version, nChannels, nParameters (with the normalisation),
+//    nRecords, seed, first channel, exposure (double),
+//    E_min[nChannels], E_max[nChannels] (doubles),
+// followed by nRecords records of
+//    the parameter values and normalisation (doubles),
+//    counts of i, q and u and errors of q and u [nChannels each] (floats).
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SpectrumSimulator.h"
+
+namespace {
+
+   const char s_magic[] = "STKFAKES";
+   const unsigned long long s_version = 1;
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_fakeit -d script.xcm [-s NAME=value] [-f] -R rmf [-A arf] [-M mrf]"
+                << " -t exposure [-S seed] [-r n] [-n threads] [-c chunk] [-o prefix]"
+                << " model params.txt out.bin" << std::endl;
+      exit(2);
+   }
+
+   // The next chunk of up to maxSets parameter sets, false at the end.
+   bool readParameterSets (std::istream& in, size_t nValues, size_t maxSets,
+                           std::vector<std::vector<Real> >& sets)
+   {
+      sets.clear();
+      std::string line;
+      while (sets.size() < maxSets && std::getline(in, line))
+      {
+         const size_t first = line.find_first_not_of(" \t\r");
+         if (first == std::string::npos || line[first] == '#')
+            continue;
+         std::istringstream values(line);
+         std::vector<Real> set;
+         Real value = 0.0;
+         while (values >> value)
+            set.push_back(value);
+         if (set.size() != nValues)
+            throw StokesTable::StokesTableError("Wrong number of parameters in: " + line);
+         sets.push_back(set);
+      }
+      return !sets.empty();
+   }
+
+   void appendInteger (std::ofstream& out, unsigned long long value)
+   {
+      out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+   }
+
+   void appendFloats (std::ofstream& out, const RealArray& values, std::vector<float>& buffer)
+   {
+      buffer.resize(values.size());
+      for (size_t i=0; i<values.size(); ++i)
+         buffer[i] = static_cast<float>(values[i]);
+      out.write(reinterpret_cast<const char*>(&buffer[0]), buffer.size()*sizeof(float));
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   std::string scriptName, rmfName, arfName, mrfName, prefix;
+   std::vector<std::string> variables;
+   bool isSingleStorage = false;
+   Real exposure = 0.0;
+   unsigned long long seed = 0;
+   size_t nRealisations = 1, nThreads = 0, chunkSize = 4096;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-' && argv[iArg][1] != 0 && !isdigit(argv[iArg][1]); ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (option == "-f")
+      {
+         isSingleStorage = true;
+         continue;
+      }
+      if (iArg+1 >= argc)
+         usage();
+      const char* value = argv[++iArg];
+      if (option == "-d")
+         scriptName = value;
+      else if (option == "-s")
+         variables.push_back(value);
+      else if (option == "-R")
+         rmfName = value;
+      else if (option == "-A")
+         arfName = value;
+      else if (option == "-M")
+         mrfName = value;
+      else if (option == "-t")
+         exposure = atof(value);
+      else if (option == "-S")
+         seed = strtoull(value, 0, 10);
+      else if (option == "-r")
+         nRealisations = atoi(value);
+      else if (option == "-n")
+         nThreads = atoi(value);
+      else if (option == "-c")
+         chunkSize = atoi(value);
+      else if (option == "-o")
+         prefix = value;
+      else
+         usage();
+   }
+   if (argc - iArg != 3 || scriptName.empty() || rmfName.empty() || !(exposure > 0.0)
+       || nRealisations == 0 || chunkSize == 0)
+      usage();
+   const std::string modelName(argv[iArg]);
+   const char* paramsName = argv[iArg+1];
+   const char* outName = argv[iArg+2];
+   if (nThreads == 0)
+      nThreads = std::max(1u, std::thread::hardware_concurrency());
+
+   try
+   {
+      MdefEngine engine;
+      engine.isSingleStorage(isSingleStorage);
+      for (size_t i=0; i<variables.size(); ++i)
+      {
+         const size_t equals = variables[i].find('=');
+         if (equals == std::string::npos)
+            usage();
+         engine.variable(variables[i].substr(0, equals), variables[i].substr(equals+1));
+      }
+      engine.readScript(scriptName);
+      ResponseFolder response;
+      response.read(rmfName, arfName, mrfName);
+      SpectrumSimulator simulator(engine, modelName, response);
+      simulator.exposure(exposure);
+      simulator.seed(seed);
+      const size_t nParams = engine.parameterNames(modelName).size();
+      const size_t nChans = response.nChannels();
+
+      std::ifstream in(paramsName);
+      if (!in)
+         throw StokesTable::StokesTableError(std::string("Cannot read ") + paramsName);
+      std::ofstream out(outName, std::ios::binary | std::ios::trunc);
+      if (!out)
+         throw StokesTable::StokesTableError(std::string("Cannot write ") + outName);
+      // the number of records is written at the end
+      out.write(s_magic, 8);
+      appendInteger(out, s_version);
+      appendInteger(out, nChans);
+      appendInteger(out, nParams + 1);
+      const std::streampos nRecordsPos = out.tellp();
+      appendInteger(out, 0);
+      appendInteger(out, seed);
+      appendInteger(out, response.firstChannel());
+      out.write(reinterpret_cast<const char*>(&exposure), sizeof(exposure));
+      out.write(reinterpret_cast<const char*>(&response.channelLow()[0]), nChans*sizeof(Real));
+      out.write(reinterpret_cast<const char*>(&response.channelHigh()[0]), nChans*sizeof(Real));
+
+      // Each chunk of parameter sets is simulated by all threads, which
+      // claim simulations in turn, and then written in order.
+      std::vector<std::vector<Real> > sets;
+      std::vector<SpectrumSimulator::Spectra> results;
+      std::vector<float> buffer;
+      unsigned long long nRecords = 0;
+      const size_t setsPerChunk = std::max(chunkSize/nRealisations, static_cast<size_t>(1));
+      while (readParameterSets(in, nParams + 1, setsPerChunk, sets))
+      {
+         const size_t nSims = sets.size()*nRealisations;
+         results.resize(nSims);
+         std::atomic<size_t> next(0);
+         std::mutex errorMutex;
+         std::exception_ptr error;
+         auto worker = [&]() {
+            std::vector<Real> parameters(nParams);
+            size_t iSim;
+            while ((iSim = next++) < nSims)
+            {
+               try
+               {
+                  const std::vector<Real>& set = sets[iSim/nRealisations];
+                  parameters.assign(set.begin(), set.begin() + nParams);
+                  simulator.simulate(nRecords + iSim, parameters, set[nParams], results[iSim]);
+               }
+               catch (...)
+               {
+                  std::lock_guard<std::mutex> lock(errorMutex);
+                  if (!error)
+                     error = std::current_exception();
+                  next = nSims;
+               }
+            }
+         };
+         std::vector<std::thread> workers;
+         for (size_t iThread=1; iThread<std::min(nThreads, nSims); ++iThread)
+            workers.push_back(std::thread(worker));
+         worker();
+         for (size_t i=0; i<workers.size(); ++i)
+            workers[i].join();
+         if (error)
+            std::rethrow_exception(error);
+
+         for (size_t iSim=0; iSim<nSims; ++iSim)
+         {
+            const std::vector<Real>& set = sets[iSim/nRealisations];
+            const SpectrumSimulator::Spectra& spectra = results[iSim];
+            out.write(reinterpret_cast<const char*>(&set[0]), set.size()*sizeof(Real));
+            for (size_t iComp=0; iComp<3; ++iComp)
+               appendFloats(out, spectra.counts[iComp], buffer);
+            for (size_t iComp=1; iComp<3; ++iComp)
+               appendFloats(out, spectra.errors[iComp], buffer);
+            if (!prefix.empty())
+            {
+               const char* const suffixes[] = {"i", "q", "u"};
+               const std::string ancrNames[] = {arfName, mrfName, mrfName};
+               for (size_t iComp=0; iComp<3; ++iComp)
+               {
+                  char fileName[32];
+                  snprintf(fileName, sizeof(fileName), "_%06llu_%s.pha", nRecords + iSim,
+                           suffixes[iComp]);
+                  simulator.writePha(prefix + fileName, spectra, iComp, rmfName, ancrNames[iComp]);
+               }
+            }
+         }
+         nRecords += nSims;
+      }
+      out.seekp(nRecordsPos);
+      appendInteger(out, nRecords);
+      out.close();
+      if (!out)
+         throw StokesTable::StokesTableError(std::string("Cannot write ") + outName);
+      std::cout << nRecords << " simulations of " << nChans << " channels written to " << outName
+                << std::endl;
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_fakeit: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
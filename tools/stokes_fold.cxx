@@ -0,0 +1,139 @@
+// stokes_fold - polrot*stokes folded through an OGIP response.
+//
+// Writes the counts per channel of the i, q and u datasets of
+// load_null_data.xcm for the stokes model, i through the RMF and ARF, q and
+// u through the RMF and MRF, as columns
+//    channel E_min E_max i q u
+// with channels numbered from 0.
+// The model is evaluated on the energy bins of the tables and folded from
+// there in a single pass over the matrix (see ResponseFolder).  With -t n
+// the fold is repeated n times and its mean time printed.
+//
+// Usage:
+//    stokes_fold -u stokes_unpol-v2.fits [-v stokes_vrpol-v2.fits]
+//                [-4 stokes_45deg-v2.fits] [-r psi] [-f]
+//                -R response.rmf [-A response.arf] [-M response.mrf] [-t n]
+//                Gamma Xi Thetai Phi Thetae PolFrac PolAng out.txt
+//
+// Angles are in degrees.  The counts are per unit norm and exposure.
+
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "ResponseFolder.h"
+#include "StokesModel.h"
+
+namespace {
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_fold -u unpol.fits [-v vrpol.fits] [-4 45deg.fits] [-r psi] [-f]"
+                << " -R rmf [-A arf] [-M mrf] [-t n] Gamma Xi Thetai Phi Thetae PolFrac PolAng out.txt"
+                << std::endl;
+      exit(2);
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   std::string unpolName, vrpolName, pol45Name, rmfName, arfName, mrfName;
+   bool isSingleStorage = false;
+   Real rotation = 0.0;
+   int nTimings = 0;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-' && argv[iArg][1] != 0 && !isdigit(argv[iArg][1]); ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (option == "-f")
+      {
+         isSingleStorage = true;
+         continue;
+      }
+      if (iArg+1 >= argc)
+         usage();
+      const char* value = argv[++iArg];
+      if (option == "-u")
+         unpolName = value;
+      else if (option == "-v")
+         vrpolName = value;
+      else if (option == "-4")
+         pol45Name = value;
+      else if (option == "-r")
+         rotation = atof(value);
+      else if (option == "-R")
+         rmfName = value;
+      else if (option == "-A")
+         arfName = value;
+      else if (option == "-M")
+         mrfName = value;
+      else if (option == "-t")
+         nTimings = atoi(value);
+      else
+         usage();
+   }
+   if (argc - iArg != 8 || unpolName.empty() || rmfName.empty())
+      usage();
+
+   StokesParameters params;
+   params.gamma = atof(argv[iArg]);
+   params.xi = atof(argv[iArg+1]);
+   params.thetai = atof(argv[iArg+2]);
+   params.phi = atof(argv[iArg+3]);
+   params.thetae = atof(argv[iArg+4]);
+   params.polFrac = atof(argv[iArg+5]);
+   params.polAng = atof(argv[iArg+6]);
+   params.rotation = rotation;
+   const char* outName = argv[iArg+7];
+
+   try
+   {
+      StokesTable unpol, vrpol, pol45;
+      unpol.read(unpolName, isSingleStorage);
+      if (!vrpolName.empty())
+         vrpol.read(vrpolName, isSingleStorage);
+      if (!pol45Name.empty())
+         pol45.read(pol45Name, isSingleStorage);
+      StokesModel model(unpol, vrpolName.empty() ? 0 : &vrpol, pol45Name.empty() ? 0 : &pol45);
+
+      ResponseFolder folder;
+      folder.read(rmfName, arfName, mrfName);
+      folder.modelBins(model.energyLow(), model.energyHigh());
+
+      RealArray iFlux, qFlux, uFlux;
+      model.evaluate(params, iFlux, qFlux, uFlux);
+      RealArray iCounts, qCounts, uCounts;
+      folder.fold(&iFlux[0], &qFlux[0], &uFlux[0], iCounts, qCounts, uCounts);
+      if (nTimings > 0)
+      {
+         const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+         for (int i=0; i<nTimings; ++i)
+            folder.fold(&iFlux[0], &qFlux[0], &uFlux[0], iCounts, qCounts, uCounts);
+         const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+         std::cout << "fold of " << folder.nEnergies() << " energies to " << folder.nChannels()
+                   << " channels: " << 1.0e6*elapsed.count()/nTimings << " us" << std::endl;
+      }
+
+      std::ofstream out(outName);
+      if (!out)
+         throw StokesTable::StokesTableError(std::string("Cannot write ") + outName);
+      out << std::setprecision(9);
+      out << "# channel E_min E_max i q u" << std::endl;
+      for (size_t ic=0; ic<folder.nChannels(); ++ic)
+      {
+         out << ic << " " << folder.channelLow()[ic] << " " << folder.channelHigh()[ic] << " "
+             << iCounts[ic] << " " << qCounts[ic] << " " << uCounts[ic] << std::endl;
+      }
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_fold: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
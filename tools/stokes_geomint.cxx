@@ -0,0 +1,153 @@
+// stokes_geomint - weighted sum of STOKES spectra over many local geometries.
+//
+// Reads a list of geometry samples, one per line,
+//    Thetai Phi Thetae weight [rotation]
+// (angles in degrees, rotation of the polarisation plane as in polrot,
+// '#' starts a comment) and writes the summed i, q and u spectra on the
+// energy bins of the tables as columns
+//    E_low E_high i q u
+//
+// Usage:
+//    stokes_geomint -u stokes_unpol-v2.fits [-v stokes_vrpol-v2.fits]
+//                   [-4 stokes_45deg-v2.fits] -g Gamma -x Xi
+//                   [-P PolFrac] [-A PolAng] [-n threads] [-f] samples.txt out.txt
+//
+// Half-Phi tables written by stokes_phisym can be used as well.  -f keeps
+// the tables in single precision (see stokes_f32check).
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "GeometryIntegrator.h"
+
+namespace {
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_geomint -u unpol.fits [-v vrpol.fits] [-4 45deg.fits]"
+                << " -g Gamma -x Xi [-P PolFrac] [-A PolAng] [-n threads] [-f] samples.txt out.txt"
+                << std::endl;
+      exit(2);
+   }
+
+   void readSamples (const std::string& fileName, std::vector<GeometrySample>& samples)
+   {
+      std::ifstream in(fileName.c_str());
+      if (!in)
+         throw StokesTable::StokesTableError("Cannot open sample list " + fileName);
+      std::string line;
+      size_t lineNumber = 0;
+      while (std::getline(in, line))
+      {
+         ++lineNumber;
+         const size_t commentPos = line.find('#');
+         if (commentPos != std::string::npos)
+            line.erase(commentPos);
+         std::istringstream iss(line);
+         GeometrySample sample;
+         if (!(iss >> sample.thetai))
+            continue;
+         if (!(iss >> sample.phi >> sample.thetae >> sample.weight))
+         {
+            std::ostringstream oss;
+            oss << fileName << ", line " << lineNumber << ": expected Thetai Phi Thetae weight [rotation]";
+            throw StokesTable::StokesTableError(oss.str());
+         }
+         if (!(iss >> sample.rotation))
+            sample.rotation = 0.0;
+         samples.push_back(sample);
+      }
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   std::string unpolName, vrpolName, pol45Name;
+   bool isSingleStorage = false;
+   Real gamma = 0.0, xi = 0.0, polFrac = 0.0, polAng = 0.0;
+   bool hasGamma = false, hasXi = false;
+   size_t nThreads = std::thread::hardware_concurrency();
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-'; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (option == "-f")
+      {
+         isSingleStorage = true;
+         continue;
+      }
+      if (iArg+1 >= argc)
+         usage();
+      const char* value = argv[++iArg];
+      if (option == "-u")
+         unpolName = value;
+      else if (option == "-v")
+         vrpolName = value;
+      else if (option == "-4")
+         pol45Name = value;
+      else if (option == "-g")
+      {
+         gamma = atof(value);
+         hasGamma = true;
+      }
+      else if (option == "-x")
+      {
+         xi = atof(value);
+         hasXi = true;
+      }
+      else if (option == "-P")
+         polFrac = atof(value);
+      else if (option == "-A")
+         polAng = atof(value);
+      else if (option == "-n")
+         nThreads = atoi(value);
+      else
+         usage();
+   }
+   if (argc - iArg != 2 || unpolName.empty() || !hasGamma || !hasXi)
+      usage();
+
+   try
+   {
+      std::vector<GeometrySample> samples;
+      readSamples(argv[iArg], samples);
+
+      StokesTable unpol, vrpol, pol45;
+      unpol.read(unpolName, isSingleStorage);
+      if (!vrpolName.empty())
+         vrpol.read(vrpolName, isSingleStorage);
+      if (!pol45Name.empty())
+         pol45.read(pol45Name, isSingleStorage);
+      GeometryIntegrator integrator(unpol, vrpolName.empty() ? 0 : &vrpol,
+                                    pol45Name.empty() ? 0 : &pol45);
+      integrator.setup(gamma, xi, polFrac, polAng);
+
+      RealArray iFlux, qFlux, uFlux;
+      integrator.integrate(samples, nThreads, iFlux, qFlux, uFlux);
+
+      std::ofstream out(argv[iArg+1]);
+      if (!out)
+         throw StokesTable::StokesTableError(std::string("Cannot write ") + argv[iArg+1]);
+      const RealArray& eLow = unpol.energyLow();
+      const RealArray& eHigh = unpol.energyHigh();
+      out << "# E_low E_high i q u  (" << samples.size() << " geometry samples)" << std::endl;
+      out << std::setprecision(9);
+      for (size_t ie=0; ie<iFlux.size(); ++ie)
+      {
+         out << eLow[ie] << " " << eHigh[ie] << " " << iFlux[ie] << " " << qFlux[ie]
+             << " " << uFlux[ie] << std::endl;
+      }
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_geomint: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,237 @@
+// stokes_levels - writes coarser versions of a STOKES table for the
+// coarse-to-fine evaluation of the updated MdefExpression.cxx.
+//
+// Level k is written next to the table as name_Lk.fits (name_Lk for a
+// file without the .fits extension), made from level k-1 (the table itself
+// for k = 1): the energy bins are grouped by n (the spectra of additive
+// tables are summed over the group, those of multiplicative tables averaged
+// with the bin widths as weights) and every other node of each parameter
+// grid with more than three nodes is kept, always with its first and last
+// node, so every level covers the parameter space of the full table.  The
+// spectra of the kept nodes are those of the full table; each written level
+// is read back and checked.
+//
+// Usage:
+//    stokes_levels [-l levels] [-g n] [-k name ...] full.fits
+//
+//    -l    number of levels, 2 by default
+//    -g    number of energy bins grouped into one at each level, 2 by default
+//    -k    parameter whose grid is kept at all levels, may be repeated
+//
+// A half-Phi 45 deg table refers to the same level of the unpolarised half
+// table (its PHIREFT is renamed), so all tables of a model must be given
+// the same number of levels.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "StokesTable.h"
+
+namespace {
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_levels [-l levels] [-g n] [-k name ...] full.fits" << std::endl;
+      exit(2);
+   }
+
+   // As looked up by MdefExpression.cxx.
+   std::string levelName (const std::string& fileName, int level)
+   {
+      std::ostringstream suffix;
+      suffix << "_L" << level;
+      const size_t nName = fileName.size();
+      std::string extension = nName > 5 ? fileName.substr(nName-5) : std::string();
+      std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+      if (extension == ".fits")
+         return fileName.substr(0, nName-5) + suffix.str() + fileName.substr(nName-5);
+      return fileName + suffix.str();
+   }
+
+   // Every other node, the first and last always.
+   void decimateNodes (const std::vector<Real>& values, std::vector<size_t>& kept)
+   {
+      kept.clear();
+      const size_t nValues = values.size();
+      if (nValues <= 3)
+      {
+         for (size_t i=0; i<nValues; ++i)
+            kept.push_back(i);
+         return;
+      }
+      for (size_t i=0; i<nValues; i+=2)
+         kept.push_back(i);
+      if (kept.back() != nValues-1)
+         kept.push_back(nValues-1);
+   }
+
+   StokesTable coarsen (const StokesTable& fine, size_t groupSize, const std::vector<bool>& isKept,
+                        const std::string& phiReference)
+   {
+      const size_t nPars = fine.nParameters();
+      const size_t nComps = fine.nComponents();
+
+      std::vector<StokesTable::Parameter> params(fine.parameters());
+      std::vector<std::vector<size_t> > nodes(nPars);
+      for (size_t iPar=0; iPar<nPars; ++iPar)
+      {
+         if (isKept[iPar])
+         {
+            for (size_t i=0; i<params[iPar].values.size(); ++i)
+               nodes[iPar].push_back(i);
+            continue;
+         }
+         decimateNodes(fine.parameter(iPar).values, nodes[iPar]);
+         params[iPar].values.clear();
+         for (size_t i=0; i<nodes[iPar].size(); ++i)
+            params[iPar].values.push_back(fine.parameter(iPar).values[nodes[iPar][i]]);
+      }
+
+      const RealArray& fineLow = fine.energyLow();
+      const RealArray& fineHigh = fine.energyHigh();
+      const size_t nFine = fine.nEnergies();
+      const size_t nGroups = (nFine + groupSize - 1)/groupSize;
+      RealArray eLow(nGroups), eHigh(nGroups);
+      for (size_t iGroup=0; iGroup<nGroups; ++iGroup)
+      {
+         eLow[iGroup] = fineLow[iGroup*groupSize];
+         eHigh[iGroup] = fineHigh[std::min((iGroup+1)*groupSize, nFine) - 1];
+      }
+
+      StokesTable coarse;
+      coarse.reset(params, eLow, eHigh, nComps);
+      coarse.modelName(fine.modelName());
+      coarse.modelUnits(fine.modelUnits());
+      coarse.isAdditive(fine.isAdditive());
+      coarse.isRedshift(fine.isRedshift());
+      coarse.isEscale(fine.isEscale());
+      coarse.isDoublePrecision(fine.isDoublePrecision());
+      if (fine.phiMirrorIndex() >= 0)
+         coarse.phiMirror(fine.phiMirrorIndex(), fine.phiSymmetry(), phiReference);
+
+      std::vector<size_t> coarseNodes, fineNodes(nPars);
+      for (size_t iGrid=0; iGrid<coarse.nGridPoints(); ++iGrid)
+      {
+         coarse.gridNodes(iGrid, coarseNodes);
+         for (size_t iPar=0; iPar<nPars; ++iPar)
+            fineNodes[iPar] = nodes[iPar][coarseNodes[iPar]];
+         const size_t iFine = fine.gridIndex(fineNodes);
+         for (size_t iComp=0; iComp<nComps; ++iComp)
+         {
+            const Real* in = fine.spectrum(iComp, iFine);
+            Real* out = coarse.spectrum(iComp, iGrid);
+            for (size_t iGroup=0; iGroup<nGroups; ++iGroup)
+            {
+               Real sum = 0.0, width = 0.0;
+               for (size_t ie=iGroup*groupSize; ie<std::min((iGroup+1)*groupSize, nFine); ++ie)
+               {
+                  const Real binWidth = fineHigh[ie] - fineLow[ie];
+                  sum += fine.isAdditive() ? in[ie] : in[ie]*binWidth;
+                  width += binWidth;
+               }
+               out[iGroup] = fine.isAdditive() ? sum : sum/width;
+            }
+         }
+      }
+      return coarse;
+   }
+
+   Real deviation (const StokesTable& expected, const StokesTable& written)
+   {
+      if (expected.nGridPoints() != written.nGridPoints() || expected.nEnergies() != written.nEnergies()
+          || expected.nComponents() != written.nComponents())
+         throw StokesTable::StokesTableError("The written table has a different grid");
+      const bool isSingle = !expected.isDoublePrecision();
+      Real maxDev = 0.0;
+      for (size_t iGrid=0; iGrid<expected.nGridPoints(); ++iGrid)
+      {
+         for (size_t iComp=0; iComp<expected.nComponents(); ++iComp)
+         {
+            const Real* in = expected.spectrum(iComp, iGrid);
+            const Real* out = written.spectrum(iComp, iGrid);
+            for (size_t ie=0; ie<expected.nEnergies(); ++ie)
+            {
+               const Real value = isSingle ? static_cast<float>(in[ie]) : in[ie];
+               if (value != out[ie])
+                  maxDev = std::max(maxDev, std::fabs(value - out[ie])/std::max(std::fabs(value), 1.0e-30));
+            }
+         }
+      }
+      return maxDev;
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   int nLevels = 2;
+   size_t groupSize = 2;
+   std::vector<std::string> keptNames;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-'; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (iArg+1 >= argc)
+         usage();
+      const std::string value(argv[++iArg]);
+      if (option == "-l")
+         nLevels = atoi(value.c_str());
+      else if (option == "-g")
+         groupSize = atoi(value.c_str());
+      else if (option == "-k")
+         keptNames.push_back(value);
+      else
+         usage();
+   }
+   if (argc - iArg != 1 || nLevels < 1 || groupSize < 1)
+      usage();
+   const std::string fullName(argv[iArg]);
+
+   try
+   {
+      StokesTable full;
+      full.read(fullName);
+      std::vector<bool> isKept(full.nParameters(), false);
+      for (size_t i=0; i<keptNames.size(); ++i)
+      {
+         const int iPar = full.parameterIndex(keptNames[i]);
+         if (iPar < 0)
+            throw StokesTable::StokesTableError("Table has no parameter " + keptNames[i]);
+         isKept[iPar] = true;
+      }
+
+      StokesTable fine(full);
+      for (int level=1; level<=nLevels; ++level)
+      {
+         const std::string levelFile = levelName(fullName, level);
+         const std::string reference = full.phiReference().empty() ? std::string()
+                                                                   : levelName(full.phiReference(), level);
+         const StokesTable coarse = coarsen(fine, groupSize, isKept, reference);
+         coarse.write(levelFile);
+         StokesTable written;
+         written.read(levelFile);
+         const Real maxDev = deviation(coarse, written);
+         std::cout << "Wrote " << levelFile << ": " << coarse.nGridPoints() << " grid points, "
+                   << coarse.nEnergies() << " energy bins" << std::endl;
+         for (size_t iPar=0; iPar<coarse.nParameters(); ++iPar)
+         {
+            std::cout << "   " << coarse.parameter(iPar).name << " : "
+                      << coarse.parameter(iPar).values.size() << " nodes" << std::endl;
+         }
+         if (maxDev > 0.0)
+            throw StokesTable::StokesTableError("The written spectra differ from the computed ones");
+         fine = coarse;
+      }
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_levels: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
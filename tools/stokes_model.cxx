@@ -0,0 +1,136 @@
+// stokes_model - polrot*stokes evaluated directly on the STOKES tables.
+//
+// Writes i, q and u of the stokes model rotated by the orientation angle
+// psi as in polrot, on the energy bins of the tables, as columns
+//    E_low E_high i q u
+// With -r first:last:n the model is evaluated for n angles psi between
+// first and last (one block per angle); the tables are interpolated only
+// once for the whole scan, each further angle only rotates q and u.
+//
+// Usage:
+//    stokes_model -u stokes_unpol-v2.fits [-v stokes_vrpol-v2.fits]
+//                 [-4 stokes_45deg-v2.fits] [-r psi | -r first:last:n] [-f]
+//                 Gamma Xi Thetai Phi Thetae PolFrac PolAng out.txt
+//
+// Angles are in degrees.  Half-Phi tables written by stokes_phisym can be
+// used as well.  -f keeps the tables in single precision (see
+// stokes_f32check).
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "StokesModel.h"
+
+namespace {
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_model -u unpol.fits [-v vrpol.fits] [-4 45deg.fits]"
+                << " [-r psi | -r first:last:n] [-f] Gamma Xi Thetai Phi Thetae PolFrac PolAng out.txt"
+                << std::endl;
+      exit(2);
+   }
+
+   void parseRotations (const std::string& value, std::vector<Real>& rotations)
+   {
+      const size_t firstColon = value.find(':');
+      if (firstColon == std::string::npos)
+      {
+         rotations.assign(1, atof(value.c_str()));
+         return;
+      }
+      const size_t secondColon = value.find(':', firstColon+1);
+      if (secondColon == std::string::npos)
+         usage();
+      const Real first = atof(value.substr(0, firstColon).c_str());
+      const Real last = atof(value.substr(firstColon+1, secondColon-firstColon-1).c_str());
+      const int nRotations = atoi(value.substr(secondColon+1).c_str());
+      if (nRotations < 1)
+         usage();
+      rotations.clear();
+      for (int i=0; i<nRotations; ++i)
+         rotations.push_back(nRotations == 1 ? first : first + (last - first)*i/(nRotations - 1));
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   std::string unpolName, vrpolName, pol45Name;
+   bool isSingleStorage = false;
+   std::vector<Real> rotations(1, 0.0);
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-' && argv[iArg][1] != 0 && !isdigit(argv[iArg][1]); ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (option == "-f")
+      {
+         isSingleStorage = true;
+         continue;
+      }
+      if (iArg+1 >= argc)
+         usage();
+      const char* value = argv[++iArg];
+      if (option == "-u")
+         unpolName = value;
+      else if (option == "-v")
+         vrpolName = value;
+      else if (option == "-4")
+         pol45Name = value;
+      else if (option == "-r")
+         parseRotations(value, rotations);
+      else
+         usage();
+   }
+   if (argc - iArg != 8 || unpolName.empty())
+      usage();
+
+   StokesParameters params;
+   params.gamma = atof(argv[iArg]);
+   params.xi = atof(argv[iArg+1]);
+   params.thetai = atof(argv[iArg+2]);
+   params.phi = atof(argv[iArg+3]);
+   params.thetae = atof(argv[iArg+4]);
+   params.polFrac = atof(argv[iArg+5]);
+   params.polAng = atof(argv[iArg+6]);
+   const char* outName = argv[iArg+7];
+
+   try
+   {
+      StokesTable unpol, vrpol, pol45;
+      unpol.read(unpolName, isSingleStorage);
+      if (!vrpolName.empty())
+         vrpol.read(vrpolName, isSingleStorage);
+      if (!pol45Name.empty())
+         pol45.read(pol45Name, isSingleStorage);
+      StokesModel model(unpol, vrpolName.empty() ? 0 : &vrpol, pol45Name.empty() ? 0 : &pol45);
+
+      std::ofstream out(outName);
+      if (!out)
+         throw StokesTable::StokesTableError(std::string("Cannot write ") + outName);
+      out << std::setprecision(9);
+      RealArray iFlux, qFlux, uFlux;
+      for (size_t iRot=0; iRot<rotations.size(); ++iRot)
+      {
+         params.rotation = rotations[iRot];
+         model.evaluate(params, iFlux, qFlux, uFlux);
+         out << "# E_low E_high i q u  (psi = " << params.rotation << ")" << std::endl;
+         for (size_t ie=0; ie<iFlux.size(); ++ie)
+         {
+            out << model.energyLow()[ie] << " " << model.energyHigh()[ie] << " " << iFlux[ie]
+                << " " << qFlux[ie] << " " << uFlux[ie] << std::endl;
+         }
+      }
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_model: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
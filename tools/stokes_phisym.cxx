@@ -0,0 +1,317 @@
+// stokes_phisym - writes a half-Phi version of a STOKES table.
+//
+// The stokes_unpol, stokes_vrpol and stokes_45deg tables tabulate the
+// azimuthal angle Phi over 7.5-352.5 deg.  Reflection about the scattering
+// plane (Phi -> 360-Phi) leaves i and q unchanged and flips the sign of u
+// for unpolarised and vertically polarised illumination ("EVEN" tables).
+// For illumination polarised at 45 deg the reflection turns it into -45 deg,
+// i.e. S45(360-Phi) = M [2 S0(Phi) - S45(Phi)], where M flips the sign of u
+// and S0 is the unpolarised table ("REF" tables).
+//
+// The half table keeps the Phi nodes up to 180 deg, each symmetrised with its
+// mirror node, and adds a node at 180 deg holding the value the full table
+// interpolates to there, so that the patched MdefExpression.cxx reproduces
+// the interpolation of the (symmetrised) full table exactly.  After writing,
+// the full grid is reconstructed from the half table and compared with the
+// input; the deviations are the Monte-Carlo asymmetry of the input table.
+//
+// Usage:
+//    stokes_phisym [-p phiPar] [-t tol] full.fits half.fits
+//    stokes_phisym [-p phiPar] [-t tol] -r unpol_full.fits -n unpol_half.fits
+//                  full.fits half.fits
+//
+//    -p    1-based index of the Phi parameter (default: parameter named Phi)
+//    -r    full unpolarised table; makes this a REF (45 deg) conversion
+//    -n    name of the unpolarised half table, recorded in the PHIREFT
+//          keyword and looked up in the directory of the half table
+//    -t    exit with status 1 if a reconstructed node deviates from the
+//          full table by more than tol (relative to i)
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "StokesTable.h"
+
+namespace {
+
+   struct PhiGrid
+   {
+      // full-table Phi node of each half-table node, not counting an
+      // appended 180 deg node
+      std::vector<size_t> halfToFull;
+      // half-table node of each full-table node at or below 180 deg, and of
+      // the mirror of each node above it
+      std::vector<size_t> fullToHalf;
+      // full-table node at 360-Phi for each full-table node
+      std::vector<size_t> mirrorOf;
+      bool hasAddedCentre;
+   };
+
+   const Real s_phiTolerance = 1.0e-4;
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_phisym [-p phiPar] [-t tol] [-r unpol_full.fits -n unpol_half.fits]"
+                << " full.fits half.fits" << std::endl;
+      exit(2);
+   }
+
+   PhiGrid buildPhiGrid (const std::vector<Real>& phiValues)
+   {
+      PhiGrid grid;
+      const size_t nPhi = phiValues.size();
+      grid.mirrorOf.resize(nPhi);
+      grid.fullToHalf.resize(nPhi);
+      for (size_t i=0; i<nPhi; ++i)
+      {
+         size_t j = 0;
+         while (j < nPhi && std::fabs(phiValues[j] - (360.0 - phiValues[i])) > s_phiTolerance)
+            ++j;
+         if (j == nPhi)
+         {
+            throw StokesTable::StokesTableError("Phi grid is not symmetric about 180 deg: no mirror node for Phi = "
+                                               + std::to_string(phiValues[i]));
+         }
+         grid.mirrorOf[i] = j;
+         if (phiValues[i] <= 180.0 + s_phiTolerance)
+         {
+            grid.fullToHalf[i] = grid.halfToFull.size();
+            grid.halfToFull.push_back(i);
+         }
+      }
+      for (size_t i=0; i<nPhi; ++i)
+      {
+         if (phiValues[i] > 180.0 + s_phiTolerance)
+            grid.fullToHalf[i] = grid.fullToHalf[grid.mirrorOf[i]];
+      }
+      grid.hasAddedCentre = (std::fabs(phiValues[grid.halfToFull.back()] - 180.0) > s_phiTolerance);
+      return grid;
+   }
+
+   // Fill half (whose grid is already set up) from full.  refHalf is the
+   // symmetrised unpolarised half table for REF conversions, 0 otherwise.
+   void symmetrise (const StokesTable& full, const StokesTable* refHalf, size_t phiIndex,
+                    const PhiGrid& grid, StokesTable& half)
+   {
+      const size_t nEngs = full.nEnergies();
+      const size_t nComps = full.nComponents();
+      const size_t nHalfPhi = grid.halfToFull.size();
+      std::vector<size_t> halfNodes, fullNodes;
+      for (size_t iGrid=0; iGrid<half.nGridPoints(); ++iGrid)
+      {
+         half.gridNodes(iGrid, halfNodes);
+         if (halfNodes[phiIndex] == nHalfPhi)
+            continue; // the added centre node, filled below
+         fullNodes = halfNodes;
+         fullNodes[phiIndex] = grid.halfToFull[halfNodes[phiIndex]];
+         const size_t iFull = full.gridIndex(fullNodes);
+         fullNodes[phiIndex] = grid.mirrorOf[fullNodes[phiIndex]];
+         const size_t iMirror = full.gridIndex(fullNodes);
+         for (size_t iComp=0; iComp<nComps; ++iComp)
+         {
+            const Real sign = (iComp == StokesTable::U_COMP) ? -1.0 : 1.0;
+            const Real* direct = full.spectrum(iComp, iFull);
+            const Real* mirror = full.spectrum(iComp, iMirror);
+            Real* out = half.spectrum(iComp, iGrid);
+            if (refHalf)
+            {
+               const Real* ref = refHalf->spectrum(iComp, iGrid);
+               for (size_t ie=0; ie<nEngs; ++ie)
+                  out[ie] = 0.5*(direct[ie] + 2.0*ref[ie] - sign*mirror[ie]);
+            }
+            else
+            {
+               for (size_t ie=0; ie<nEngs; ++ie)
+                  out[ie] = 0.5*(direct[ie] + sign*mirror[ie]);
+            }
+         }
+      }
+
+      if (!grid.hasAddedCentre)
+         return;
+      // The full table interpolates linearly between the last node below
+      // 180 deg and its mirror; store the midpoint of the two.
+      for (size_t iGrid=0; iGrid<half.nGridPoints(); ++iGrid)
+      {
+         half.gridNodes(iGrid, halfNodes);
+         if (halfNodes[phiIndex] != nHalfPhi)
+            continue;
+         halfNodes[phiIndex] = nHalfPhi - 1;
+         const size_t iBelow = half.gridIndex(halfNodes);
+         for (size_t iComp=0; iComp<nComps; ++iComp)
+         {
+            const Real sign = (iComp == StokesTable::U_COMP) ? -1.0 : 1.0;
+            const Real* below = half.spectrum(iComp, iBelow);
+            Real* out = half.spectrum(iComp, iGrid);
+            if (refHalf)
+            {
+               const Real* ref = refHalf->spectrum(iComp, iBelow);
+               for (size_t ie=0; ie<nEngs; ++ie)
+                  out[ie] = 0.5*(below[ie] + sign*(2.0*ref[ie] - below[ie]));
+            }
+            else
+            {
+               for (size_t ie=0; ie<nEngs; ++ie)
+                  out[ie] = 0.5*(below[ie] + sign*below[ie]);
+            }
+         }
+      }
+   }
+
+   void setupHalf (const StokesTable& full, size_t phiIndex, const PhiGrid& grid, StokesTable& half)
+   {
+      std::vector<StokesTable::Parameter> params(full.parameters());
+      StokesTable::Parameter& phiPar = params[phiIndex];
+      std::vector<Real> halfValues;
+      for (size_t i=0; i<grid.halfToFull.size(); ++i)
+         halfValues.push_back(phiPar.values[grid.halfToFull[i]]);
+      if (grid.hasAddedCentre)
+         halfValues.push_back(180.0);
+      phiPar.values = halfValues;
+      phiPar.top = std::min(phiPar.top, 180.0);
+      phiPar.maximum = 180.0;
+      phiPar.initial = std::min(phiPar.initial, 180.0);
+      half.reset(params, full.energyLow(), full.energyHigh(), full.nComponents());
+      half.modelName(full.modelName());
+      half.modelUnits(full.modelUnits());
+      half.isAdditive(full.isAdditive());
+      half.isRedshift(full.isRedshift());
+      half.isEscale(full.isEscale());
+      half.isDoublePrecision(full.isDoublePrecision());
+   }
+
+   // Largest deviation, relative to i, of the full grid reconstructed from
+   // the half table.  maxDev is indexed by Stokes component.
+   void validate (const StokesTable& full, const StokesTable& half, const StokesTable* refHalf,
+                  size_t phiIndex, const PhiGrid& grid, std::vector<Real>& maxDev)
+   {
+      const size_t nEngs = full.nEnergies();
+      const size_t nComps = full.nComponents();
+      maxDev.assign(nComps, 0.0);
+      std::vector<size_t> nodes;
+      const std::vector<Real>& phiValues = full.parameter(phiIndex).values;
+      for (size_t iFull=0; iFull<full.nGridPoints(); ++iFull)
+      {
+         full.gridNodes(iFull, nodes);
+         const bool isMirrored = phiValues[nodes[phiIndex]] > 180.0 + s_phiTolerance;
+         nodes[phiIndex] = grid.fullToHalf[nodes[phiIndex]];
+         const size_t iHalf = half.gridIndex(nodes);
+         const Real* fullI = full.spectrum(StokesTable::I_COMP, iFull);
+         for (size_t iComp=0; iComp<nComps; ++iComp)
+         {
+            const Real sign = (iComp == StokesTable::U_COMP) ? -1.0 : 1.0;
+            const Real* expected = full.spectrum(iComp, iFull);
+            const Real* stored = half.spectrum(iComp, iHalf);
+            const Real* ref = refHalf ? refHalf->spectrum(iComp, iHalf) : 0;
+            for (size_t ie=0; ie<nEngs; ++ie)
+            {
+               if (fullI[ie] <= 0.0)
+                  continue;
+               Real value = stored[ie];
+               if (isMirrored)
+                  value = ref ? sign*(2.0*ref[ie] - value) : sign*value;
+               const Real dev = std::fabs(value - expected[ie])/fullI[ie];
+               if (dev > maxDev[iComp])
+                  maxDev[iComp] = dev;
+            }
+         }
+      }
+   }
+
+   std::string directoryOf (const std::string& fileName)
+   {
+      const size_t slashPos = fileName.find_last_of('/');
+      return (slashPos == std::string::npos) ? std::string() : fileName.substr(0, slashPos+1);
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   int phiPar = 0;
+   Real tolerance = -1.0;
+   std::string refFullName, refHalfName;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-'; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (iArg+1 >= argc)
+         usage();
+      if (option == "-p")
+         phiPar = atoi(argv[++iArg]);
+      else if (option == "-t")
+         tolerance = atof(argv[++iArg]);
+      else if (option == "-r")
+         refFullName = argv[++iArg];
+      else if (option == "-n")
+         refHalfName = argv[++iArg];
+      else
+         usage();
+   }
+   if (argc - iArg != 2 || refFullName.empty() != refHalfName.empty())
+      usage();
+   const std::string fullName(argv[iArg]);
+   const std::string halfName(argv[iArg+1]);
+
+   try
+   {
+      StokesTable full;
+      full.read(fullName);
+      const int phiIndex = phiPar ? phiPar-1 : full.parameterIndex("Phi");
+      if (phiIndex < 0 || phiIndex >= static_cast<int>(full.nParameters()))
+         throw StokesTable::StokesTableError("Cannot identify the Phi parameter, use -p");
+      const PhiGrid grid = buildPhiGrid(full.parameter(phiIndex).values);
+
+      StokesTable refHalf;
+      if (!refFullName.empty())
+      {
+         StokesTable refFull;
+         refFull.read(refFullName);
+         if (refFull.nGridPoints() != full.nGridPoints() || refFull.nEnergies() != full.nEnergies()
+             || refFull.nComponents() != full.nComponents())
+            throw StokesTable::StokesTableError("Reference table " + refFullName + " has a different grid");
+         setupHalf(refFull, phiIndex, grid, refHalf);
+         symmetrise(refFull, 0, phiIndex, grid, refHalf);
+      }
+      const StokesTable* refPtr = refFullName.empty() ? 0 : &refHalf;
+
+      StokesTable half;
+      setupHalf(full, phiIndex, grid, half);
+      symmetrise(full, refPtr, phiIndex, grid, half);
+      half.phiMirror(phiIndex, refPtr ? "REF" : "EVEN", refHalfName);
+      half.write(halfName);
+      if (refPtr && directoryOf(refHalfName).empty())
+      {
+         std::cout << "Note: " << refHalfName << " must be in the same directory as "
+                   << halfName << std::endl;
+      }
+
+      std::vector<Real> maxDev;
+      validate(full, half, refPtr, phiIndex, grid, maxDev);
+      const char* compNames[] = {"i", "q", "u"};
+      bool isWithinTolerance = true;
+      std::cout << "Wrote " << halfName << ": " << half.nGridPoints() << " of "
+                << full.nGridPoints() << " grid points" << std::endl;
+      std::cout << "Maximum deviation of the reconstructed full table (relative to i):" << std::endl;
+      for (size_t iComp=0; iComp<maxDev.size(); ++iComp)
+      {
+         std::cout << "   " << compNames[iComp] << " : " << maxDev[iComp] << std::endl;
+         if (tolerance >= 0.0 && maxDev[iComp] > tolerance)
+            isWithinTolerance = false;
+      }
+      if (!isWithinTolerance)
+      {
+         std::cerr << "Deviation exceeds tolerance " << tolerance << std::endl;
+         return 1;
+      }
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_phisym: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
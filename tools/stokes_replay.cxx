@@ -0,0 +1,227 @@
+// stokes_replay - analyses and replays a trace of mdefine evaluations
+// recorded in XSPEC with 'xset MDEF_RECORD trace.bin'.
+//
+// Lists the recorded expressions with their calls per spectrum number, how
+// often each parameter changed between consecutive calls for the same
+// spectrum, and the recorded latencies.  With the tables the calls of the
+// STOKES models (stunp, stvrp, st45d, stpol and stokes, parameters as in
+// STOKES_model_definitions.xcm) are replayed in order through StokesModel,
+// one per model and spectrum number as XSPEC keeps them, and the latencies
+// of the replay are reported as well.  The replay evaluates on the energy
+// bins of the tables and ignores the redshift.
+//
+// Usage:
+//    stokes_replay [-u stokes_unpol-v2.fits [-v stokes_vrpol-v2.fits]
+//                  [-4 stokes_45deg-v2.fits] [-f]] trace.bin
+//
+// -f keeps the tables in single precision (see stokes_f32check).  The trace
+// can also be replayed inside XSPEC through the mdefine evaluator itself,
+// with real or stubbed tables, by MdefEvaluation::replay().
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "EvaluationTrace.h"
+#include "StokesModel.h"
+
+namespace {
+
+   enum {STUNP, STVRP, ST45D, STPOL, STOKES, N_MODELS};
+   const char* const s_modelNames[] = {"stunp", "stvrp", "st45d", "stpol", "stokes"};
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_replay [-u unpol.fits [-v vrpol.fits] [-4 45deg.fits] [-f]] trace.bin"
+                << std::endl;
+      exit(2);
+   }
+
+   int modelIndex (const std::string& name)
+   {
+      for (size_t i=0; i<N_MODELS; ++i)
+      {
+         if (name == s_modelNames[i])
+            return static_cast<int>(i);
+      }
+      return -1;
+   }
+
+   void printLatencies (const std::string& title, std::vector<double> seconds)
+   {
+      if (seconds.empty())
+         return;
+      std::sort(seconds.begin(), seconds.end());
+      const size_t n = seconds.size();
+      double total = 0.0;
+      for (size_t i=0; i<n; ++i)
+         total += seconds[i];
+      std::cout << title << " latency [ms] of " << n << " calls: median "
+                << 1.0e3*seconds[n/2] << ", 90% " << 1.0e3*seconds[std::min(n-1, n*90/100)]
+                << ", 99% " << 1.0e3*seconds[std::min(n-1, n*99/100)] << ", max "
+                << 1.0e3*seconds[n-1] << ", total " << 1.0e3*total << std::endl;
+   }
+
+   void printSummary (const EvaluationTrace& trace)
+   {
+      const std::vector<EvaluationTrace::Call>& calls = trace.calls();
+      std::cout << "Trace of " << calls.size() << " calls of " << trace.expressions().size()
+                << " expressions on " << trace.grids().size() << " energy grids" << std::endl;
+      for (size_t iExpr=0; iExpr<trace.expressions().size(); ++iExpr)
+      {
+         const EvaluationTrace::Expression& expression = trace.expressions()[iExpr];
+         // calls per spectrum, and changes of each parameter with respect to
+         // the previous call for the same spectrum
+         std::map<int, size_t> nCalls;
+         std::map<int, const std::vector<Real>*> previous;
+         std::vector<size_t> nChanged;
+         size_t nRepeated = 0, nAfterFirst = 0;
+         for (size_t iCall=0; iCall<calls.size(); ++iCall)
+         {
+            const EvaluationTrace::Call& call = calls[iCall];
+            if (call.expression != iExpr)
+               continue;
+            ++nCalls[call.spectrumNumber];
+            const std::vector<Real>*& last = previous[call.spectrumNumber];
+            if (last && last->size() == call.parameters.size())
+            {
+               ++nAfterFirst;
+               nChanged.resize(std::max(nChanged.size(), call.parameters.size()), 0);
+               bool isSame = true;
+               for (size_t iPar=0; iPar<call.parameters.size(); ++iPar)
+               {
+                  if (call.parameters[iPar] != (*last)[iPar])
+                  {
+                     ++nChanged[iPar];
+                     isSame = false;
+                  }
+               }
+               if (isSame)
+                  ++nRepeated;
+            }
+            last = &call.parameters;
+         }
+         std::cout << "   " << expression.name << " (" << expression.compType << "): ";
+         for (std::map<int, size_t>::const_iterator it=nCalls.begin(); it!=nCalls.end(); ++it)
+            std::cout << (it == nCalls.begin() ? "" : ", ") << it->second << " calls for spectrum " << it->first;
+         std::cout << std::endl;
+         if (nAfterFirst == 0)
+            continue;
+         std::cout << "      parameter changes between calls for a spectrum:";
+         for (size_t iPar=0; iPar<nChanged.size(); ++iPar)
+            std::cout << " " << iPar+1 << ":" << nChanged[iPar];
+         std::cout << ", unchanged " << nRepeated << " of " << nAfterFirst << std::endl;
+      }
+      std::vector<double> seconds;
+      for (size_t iCall=0; iCall<calls.size(); ++iCall)
+         seconds.push_back(calls[iCall].seconds);
+      printLatencies("Recorded", seconds);
+   }
+
+   void replay (const EvaluationTrace& trace, const StokesTable& unpol, const StokesTable* vrpol,
+                const StokesTable* pol45)
+   {
+      typedef std::pair<size_t, int> ModelKey;
+      std::map<ModelKey, std::unique_ptr<StokesModel> > models;
+      std::vector<double> recorded, replayed;
+      RealArray iFlux, qFlux, uFlux;
+      const std::vector<EvaluationTrace::Call>& calls = trace.calls();
+      for (size_t iCall=0; iCall<calls.size(); ++iCall)
+      {
+         const EvaluationTrace::Call& call = calls[iCall];
+         const int iModel = modelIndex(trace.expressions()[call.expression].name);
+         const std::vector<Real>& pars = call.parameters;
+         const size_t nPars = (iModel == STOKES) ? 8 : ((iModel == STPOL) ? 7 : 6);
+         if (iModel < 0 || pars.size() < nPars || (iModel != STUNP && !vrpol)
+             || ((iModel == ST45D || iModel == STOKES) && !pol45))
+            continue;
+         StokesParameters params;
+         params.gamma = pars[0];
+         params.xi = pars[1];
+         params.thetai = pars[2];
+         params.phi = pars[3];
+         params.thetae = pars[4];
+         // the single tables are the combinations for P = 1 at 0 and 45 deg
+         if (iModel == STVRP || iModel == ST45D)
+         {
+            params.polFrac = 1.0;
+            params.polAng = (iModel == ST45D) ? 45.0 : 0.0;
+         }
+         else if (iModel == STPOL || iModel == STOKES)
+         {
+            params.polFrac = pars[6];
+            params.polAng = (iModel == STOKES) ? pars[7] : 0.0;
+         }
+         std::unique_ptr<StokesModel>& model = models[ModelKey(call.expression, call.spectrumNumber)];
+         if (!model)
+            model.reset(new StokesModel(unpol, vrpol, pol45));
+         const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+         model->evaluate(params, iFlux, qFlux, uFlux);
+         replayed.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+         recorded.push_back(call.seconds);
+      }
+      std::cout << "Replayed " << replayed.size() << " calls of the STOKES models" << std::endl;
+      printLatencies("Recorded", recorded);
+      printLatencies("Replayed", replayed);
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   std::string unpolName, vrpolName, pol45Name;
+   bool isSingleStorage = false;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-'; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (option == "-f")
+      {
+         isSingleStorage = true;
+         continue;
+      }
+      if (iArg+1 >= argc)
+         usage();
+      const char* value = argv[++iArg];
+      if (option == "-u")
+         unpolName = value;
+      else if (option == "-v")
+         vrpolName = value;
+      else if (option == "-4")
+         pol45Name = value;
+      else
+         usage();
+   }
+   if (argc - iArg != 1 || (unpolName.empty() && (!vrpolName.empty() || !pol45Name.empty())))
+      usage();
+
+   try
+   {
+      EvaluationTrace trace;
+      trace.read(argv[iArg]);
+      std::cout << std::setprecision(4);
+      printSummary(trace);
+      if (!unpolName.empty())
+      {
+         StokesTable unpol, vrpol, pol45;
+         unpol.read(unpolName, isSingleStorage);
+         if (!vrpolName.empty())
+            vrpol.read(vrpolName, isSingleStorage);
+         if (!pol45Name.empty())
+            pol45.read(pol45Name, isSingleStorage);
+         replay(trace, unpol, vrpolName.empty() ? 0 : &vrpol, pol45Name.empty() ? 0 : &pol45);
+      }
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_replay: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
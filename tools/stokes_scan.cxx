@@ -0,0 +1,376 @@
+// stokes_scan - chi^2 of the stokes model against an observed spectrum over
+// a grid of its parameters, as steppar does, on all cores of a node.
+//
+// The observed spectrum is given on the energy bins of the tables, one bin
+// per line as
+//    E_low E_high i q u sigma_i sigma_q sigma_u
+// (bins with zero sigma are ignored, '#' starts a comment).  For each grid
+// point the normalisation is fitted analytically and
+//    Gamma Xi Thetai Phi Thetae PolFrac PolAng norm chi2
+// is written.  Axes are given as in stokes_atlas, name=first:last:n or
+// name=value, and the grid points are numbered in the same order.
+//
+// The tables are loaded once, then -n worker processes are forked which
+// share them copy-on-write.  The workers claim chunks of grid points from a
+// counter in shared memory and store their results in a shared array,
+// written out by the parent once all workers are done.  With -s k:n only
+// the k-th of n equal contiguous parts of the grid is scanned (k = 0 ... n-1),
+// so n nodes can share a scan; their outputs concatenated in order of k are
+// the output of the whole scan.
+//
+// Usage:
+//    stokes_scan -u stokes_unpol-v2.fits [-v stokes_vrpol-v2.fits]
+//                [-4 stokes_45deg-v2.fits] [-a name=first:last:n ...]
+//                [-n workers] [-c chunk] [-s shard:nshards] [-f]
+//                observed.txt scan.txt
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "AtlasGenerator.h"
+
+namespace {
+
+   struct Observed
+   {
+      RealArray value[3];
+      RealArray weight[3];   // 1/sigma^2, 0 for ignored bins
+   };
+
+   // Shared between the parent and the workers.
+   struct ScanState
+   {
+      std::atomic<unsigned long long> nextChunk;
+   };
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_scan -u unpol.fits [-v vrpol.fits] [-4 45deg.fits]"
+                << " [-a name=first:last:n ...] [-n workers] [-c chunk] [-s shard:nshards] [-f]"
+                << " observed.txt scan.txt" << std::endl;
+      exit(2);
+   }
+
+   void parseAxis (const std::string& value, std::vector<AtlasAxis>& axes)
+   {
+      const size_t equalPos = value.find('=');
+      if (equalPos == std::string::npos)
+         usage();
+      const int iAxis = AtlasGenerator::axisIndex(value.substr(0, equalPos));
+      if (iAxis < 0)
+         throw StokesTable::StokesTableError("Unknown scan axis " + value.substr(0, equalPos));
+      const std::string range(value.substr(equalPos+1));
+      AtlasAxis& axis = axes[iAxis];
+      const size_t firstColon = range.find(':');
+      if (firstColon == std::string::npos)
+      {
+         axis.first = axis.last = atof(range.c_str());
+         axis.n = 1;
+         return;
+      }
+      const size_t secondColon = range.find(':', firstColon+1);
+      if (secondColon == std::string::npos)
+         usage();
+      axis.first = atof(range.substr(0, firstColon).c_str());
+      axis.last = atof(range.substr(firstColon+1, secondColon-firstColon-1).c_str());
+      const int n = atoi(range.substr(secondColon+1).c_str());
+      if (n < 1)
+         usage();
+      axis.n = n;
+   }
+
+   void readObserved (const std::string& fileName, const StokesTable& table, Observed& observed)
+   {
+      std::ifstream in(fileName.c_str());
+      if (!in)
+         throw StokesTable::StokesTableError("Cannot open " + fileName);
+      const size_t nEngs = table.nEnergies();
+      for (size_t iComp=0; iComp<3; ++iComp)
+      {
+         observed.value[iComp].resize(nEngs, 0.0);
+         observed.weight[iComp].resize(nEngs, 0.0);
+      }
+      std::string line;
+      size_t iBin = 0;
+      while (std::getline(in, line))
+      {
+         const size_t commentPos = line.find('#');
+         if (commentPos != std::string::npos)
+            line.erase(commentPos);
+         std::istringstream iss(line);
+         Real eLow, eHigh, values[3], sigmas[3];
+         if (!(iss >> eLow))
+            continue;
+         if (!(iss >> eHigh >> values[0] >> values[1] >> values[2] >> sigmas[0] >> sigmas[1] >> sigmas[2]))
+            throw StokesTable::StokesTableError(fileName + ": expected E_low E_high i q u sigma_i sigma_q sigma_u");
+         if (iBin >= nEngs || std::fabs(eLow - table.energyLow()[iBin]) > 1.0e-6*std::fabs(eLow))
+            throw StokesTable::StokesTableError(fileName + " is not on the energy bins of the tables");
+         for (size_t iComp=0; iComp<3; ++iComp)
+         {
+            observed.value[iComp][iBin] = values[iComp];
+            observed.weight[iComp][iBin] = (sigmas[iComp] > 0.0) ? 1.0/(sigmas[iComp]*sigmas[iComp]) : 0.0;
+         }
+         ++iBin;
+      }
+      if (iBin != nEngs)
+         throw StokesTable::StokesTableError(fileName + " is not on the energy bins of the tables");
+   }
+
+   // Best normalisation and its chi^2.
+   void fitNorm (const Observed& observed, const RealArray* model, Real& norm, Real& chi2)
+   {
+      Real md = 0.0, mm = 0.0, dd = 0.0;
+      for (size_t iComp=0; iComp<3; ++iComp)
+      {
+         const RealArray& m = model[iComp];
+         const RealArray& d = observed.value[iComp];
+         const RealArray& w = observed.weight[iComp];
+         for (size_t ie=0; ie<m.size(); ++ie)
+         {
+            md += w[ie]*m[ie]*d[ie];
+            mm += w[ie]*m[ie]*m[ie];
+            dd += w[ie]*d[ie]*d[ie];
+         }
+      }
+      norm = (mm > 0.0) ? md/mm : 0.0;
+      chi2 = dd - norm*md;
+   }
+
+   // Worker: claims chunks of the shard [first, last) until none are left.
+   void scanChunks (const StokesTable& unpol, const StokesTable* vrpol, const StokesTable* pol45,
+                    const std::vector<AtlasAxis>& axes, const Observed& observed, size_t first,
+                    size_t last, size_t chunkSize, ScanState& state, Real* results)
+   {
+      StokesModel model(unpol, vrpol, pol45);
+      StokesParameters params;
+      RealArray flux[3];
+      std::vector<Real> values(axes.size());
+      const size_t nChunks = (last - first + chunkSize - 1)/chunkSize;
+      size_t iChunk;
+      while ((iChunk = state.nextChunk++) < nChunks)
+      {
+         const size_t chunkFirst = first + iChunk*chunkSize;
+         const size_t chunkLast = std::min(chunkFirst + chunkSize, last);
+         for (size_t iRecord=chunkFirst; iRecord<chunkLast; ++iRecord)
+         {
+            size_t rest = iRecord;
+            for (size_t iAxis=axes.size(); iAxis-- > 0; )
+            {
+               values[iAxis] = axes[iAxis].value(rest % axes[iAxis].n);
+               rest /= axes[iAxis].n;
+            }
+            params.gamma = values[AtlasGenerator::GAMMA_AXIS];
+            params.xi = values[AtlasGenerator::XI_AXIS];
+            params.thetai = values[AtlasGenerator::THETAI_AXIS];
+            params.phi = values[AtlasGenerator::PHI_AXIS];
+            params.thetae = values[AtlasGenerator::THETAE_AXIS];
+            params.polFrac = values[AtlasGenerator::POLFRAC_AXIS];
+            params.polAng = values[AtlasGenerator::POLANG_AXIS];
+            model.evaluate(params, flux[0], flux[1], flux[2]);
+            Real* result = results + 2*(iRecord - first);
+            fitNorm(observed, flux, result[0], result[1]);
+         }
+      }
+   }
+
+   // A positive count, as atoi() would turn "-1" into a huge size_t.
+   size_t parseCount (const std::string& value)
+   {
+      const int count = atoi(value.c_str());
+      if (count < 1)
+         usage();
+      return count;
+   }
+
+   // Stops the workers already started when the scan cannot go on.
+   void stopWorkers (const std::vector<pid_t>& workers)
+   {
+      for (size_t i=0; i<workers.size(); ++i)
+         kill(workers[i], SIGKILL);
+      for (size_t i=0; i<workers.size(); ++i)
+      {
+         int status = 0;
+         waitpid(workers[i], &status, 0);
+      }
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   std::string unpolName, vrpolName, pol45Name;
+   std::vector<std::string> axisValues;
+   size_t nWorkers = std::thread::hardware_concurrency();
+   size_t chunkSize = 64;
+   size_t shard = 0, nShards = 1;
+   bool isSingleStorage = false;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-'; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (option == "-f")
+      {
+         isSingleStorage = true;
+         continue;
+      }
+      if (iArg+1 >= argc)
+         usage();
+      const std::string value(argv[++iArg]);
+      if (option == "-u")
+         unpolName = value;
+      else if (option == "-v")
+         vrpolName = value;
+      else if (option == "-4")
+         pol45Name = value;
+      else if (option == "-a")
+         axisValues.push_back(value);
+      else if (option == "-n")
+         nWorkers = parseCount(value);
+      else if (option == "-c")
+         chunkSize = parseCount(value);
+      else if (option == "-s")
+      {
+         const size_t colonPos = value.find(':');
+         if (colonPos == std::string::npos)
+            usage();
+         const int shardValue = atoi(value.substr(0, colonPos).c_str());
+         if (shardValue < 0)
+            usage();
+         shard = shardValue;
+         nShards = parseCount(value.substr(colonPos+1));
+      }
+      else
+         usage();
+   }
+   if (argc - iArg != 2 || unpolName.empty() || chunkSize < 1 || nShards < 1 || shard >= nShards)
+      usage();
+   nWorkers = std::max(static_cast<size_t>(1), nWorkers);
+   const std::string observedName(argv[iArg]);
+   const std::string scanName(argv[iArg+1]);
+
+   try
+   {
+      StokesTable unpol, vrpol, pol45;
+      unpol.read(unpolName, isSingleStorage);
+      if (!vrpolName.empty())
+         vrpol.read(vrpolName, isSingleStorage);
+      if (!pol45Name.empty())
+         pol45.read(pol45Name, isSingleStorage);
+      const StokesTable* vrpolPtr = vrpolName.empty() ? 0 : &vrpol;
+      const StokesTable* pol45Ptr = pol45Name.empty() ? 0 : &pol45;
+      // the axes default to the initial table parameters as in stokes_atlas
+      const AtlasGenerator defaults(unpol, vrpolPtr, pol45Ptr);
+      std::vector<AtlasAxis> axes(AtlasGenerator::N_AXES);
+      for (size_t iAxis=0; iAxis<AtlasGenerator::N_AXES; ++iAxis)
+         axes[iAxis] = defaults.axis(iAxis);
+      for (size_t i=0; i<axisValues.size(); ++i)
+         parseAxis(axisValues[i], axes);
+      Observed observed;
+      readObserved(observedName, unpol, observed);
+
+      size_t nRecords = 1;
+      for (size_t iAxis=0; iAxis<axes.size(); ++iAxis)
+         nRecords *= axes[iAxis].n;
+      const size_t first = nRecords*shard/nShards;
+      const size_t last = nRecords*(shard+1)/nShards;
+
+      // Shared memory for the chunk counter and the results, mapped before
+      // the fork so that all processes see the same pages.
+      const size_t sharedBytes = sizeof(ScanState) + 2*(last - first)*sizeof(Real);
+      void* shared = mmap(0, sharedBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+      if (shared == MAP_FAILED)
+         throw StokesTable::StokesTableError("Cannot map shared memory for the results");
+      ScanState* state = new (shared) ScanState;
+      state->nextChunk = 0;
+      if (!state->nextChunk.is_lock_free())
+         throw StokesTable::StokesTableError("No lock-free atomics for sharing between processes");
+      Real* results = reinterpret_cast<Real*>(static_cast<char*>(shared) + sizeof(ScanState));
+
+      std::cout.flush();
+      std::vector<pid_t> workers;
+      for (size_t iWorker=0; iWorker<nWorkers; ++iWorker)
+      {
+         const pid_t pid = fork();
+         if (pid < 0)
+         {
+            stopWorkers(workers);
+            throw StokesTable::StokesTableError("Cannot fork a worker process");
+         }
+         if (pid == 0)
+         {
+            int status = 0;
+            try
+            {
+               scanChunks(unpol, vrpolPtr, pol45Ptr, axes, observed, first, last, chunkSize, *state,
+                          results);
+            }
+            catch (StokesTable::StokesTableError& err)
+            {
+               std::cerr << "stokes_scan: " << err.what() << std::endl;
+               status = 1;
+            }
+            _exit(status);
+         }
+         workers.push_back(pid);
+      }
+      bool isFailed = false;
+      for (size_t i=0; i<workers.size(); ++i)
+      {
+         int status = 0;
+         if (waitpid(workers[i], &status, 0) != workers[i] || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            isFailed = true;
+      }
+      if (isFailed)
+         throw StokesTable::StokesTableError("A worker process failed");
+
+      std::ofstream out(scanName.c_str());
+      if (!out)
+         throw StokesTable::StokesTableError("Cannot write " + scanName);
+      out << std::setprecision(9);
+      out << "# Gamma Xi Thetai Phi Thetae PolFrac PolAng norm chi2" << std::endl;
+      size_t iBest = first;
+      std::vector<Real> values(axes.size());
+      for (size_t iRecord=first; iRecord<last; ++iRecord)
+      {
+         size_t rest = iRecord;
+         for (size_t iAxis=axes.size(); iAxis-- > 0; )
+         {
+            values[iAxis] = axes[iAxis].value(rest % axes[iAxis].n);
+            rest /= axes[iAxis].n;
+         }
+         for (size_t iAxis=0; iAxis<axes.size(); ++iAxis)
+            out << values[iAxis] << " ";
+         const Real* result = results + 2*(iRecord - first);
+         out << result[0] << " " << result[1] << std::endl;
+         if (result[1] < results[2*(iBest - first) + 1])
+            iBest = iRecord;
+      }
+      if (last > first)
+      {
+         std::cout << "Scanned " << last - first << " of " << nRecords << " grid points with "
+                   << nWorkers << " workers, lowest chi2 " << results[2*(iBest - first) + 1]
+                   << " at grid point " << iBest << std::endl;
+      }
+      munmap(shared, sharedBytes);
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_scan: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
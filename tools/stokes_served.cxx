@@ -0,0 +1,100 @@
+// stokes_served - table interpolations served to the XSPEC sessions of a
+// machine.
+//
+// Listens on a Unix-domain socket for the atable{} calls that the updated
+// MdefExpression.cxx sends while 'xset MDEF_SERVER socket' is set, reads
+// each table the first time it is asked for and keeps it for all sessions.
+// The results are written to buffers shared with the sessions and kept in a
+// cache common to all of them (see TableServer.h for the protocol).
+//
+// Usage:
+//    stokes_served [-f] [-n threads] [-m cacheMB] [-w window_us] socket
+//
+// -f keeps the tables in single precision.  Requests arriving within the
+// batch window (-w, 500 us by default) of the first are served together,
+// the distinct ones on up to -n threads.  The server stops on SIGINT or
+// SIGTERM and prints its statistics.
+
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "TableServer.h"
+
+namespace {
+
+   void usage ()
+   {
+      std::cerr << "Usage: stokes_served [-f] [-n threads] [-m cacheMB] [-w window_us] socket"
+                << std::endl;
+      exit(2);
+   }
+
+   void onSignal (int)
+   {
+      TableServer::stop();
+   }
+
+} // namespace
+
+int main (int argc, char* argv[])
+{
+   bool isSingleStorage = false;
+   size_t nThreads = 0, cacheMB = 256;
+   double window = 500.0;
+   int iArg = 1;
+   for (; iArg<argc && argv[iArg][0] == '-' && argv[iArg][1] != 0; ++iArg)
+   {
+      const std::string option(argv[iArg]);
+      if (option == "-f")
+      {
+         isSingleStorage = true;
+         continue;
+      }
+      if (iArg+1 >= argc)
+         usage();
+      const char* value = argv[++iArg];
+      if (option == "-n")
+         nThreads = atoi(value);
+      else if (option == "-m")
+         cacheMB = atoi(value);
+      else if (option == "-w")
+         window = atof(value);
+      else
+         usage();
+   }
+   if (argc - iArg != 1 || window < 0.0)
+      usage();
+   const std::string socketPath(argv[iArg]);
+
+   try
+   {
+      MdefEngine engine;
+      engine.isSingleStorage(isSingleStorage);
+      TableServer server(engine);
+      server.nThreads(nThreads);
+      server.cacheSize(cacheMB << 20);
+      server.batchWindow(window*1.0e-6);
+
+      struct sigaction action;
+      action.sa_handler = onSignal;
+      sigemptyset(&action.sa_mask);
+      action.sa_flags = 0;
+      sigaction(SIGINT, &action, 0);
+      sigaction(SIGTERM, &action, 0);
+      std::cout << "stokes_served: listening on " << socketPath << std::endl;
+      server.run(socketPath);
+
+      const TableServer::Statistics& stats = server.statistics();
+      std::cout << stats.nRequests << " requests in " << stats.nBatches << " batches, "
+                << stats.nCacheHits << " from the cache, " << stats.nEvaluations
+                << " interpolations, " << stats.nErrors << " errors" << std::endl;
+   }
+   catch (StokesTable::StokesTableError& err)
+   {
+      std::cerr << "stokes_served: " << err.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}